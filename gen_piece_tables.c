@@ -0,0 +1,111 @@
+// A program run at build time, which prints the C source for the piece tables
+// that can be derived from tetris_pieces: piece_row_masks and piece_info. It
+// also prints the random keys used for Zobrist hashing, zobrist_cells.
+// Keeping these generated means tetris_pieces.c remains the only piece data
+// that needs to be edited by hand.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_engine.h"
+
+// The order in which x offsets are tried when rotating. Left comes first,
+// since the pieces are aligned on the left side of their 4x4 boxes, so a
+// rotated piece more often overlaps something on its right.
+static const int8_t kick_order[TETRIS_KICK_COUNT] = {0, -1, -2, -3, 1, 2, 3};
+
+// Fills in the derived information for a single piece. Exits if the piece
+// doesn't have exactly 4 cells, or isn't aligned to the bottom left corner of
+// its box.
+static void DerivePiece(int piece, uint16_t *masks, TetrisPieceInfo *info) {
+  const char *p = tetris_pieces[piece];
+  int x, y, count = 0, columns_seen = 0;
+  char c;
+  memset(info, 0, sizeof(*info));
+  for (y = 0; y < 4; y++) {
+    masks[y] = 0;
+    for (x = 0; x < 4; x++) {
+      c = p[y * 4 + x];
+      if (c == ' ') continue;
+      if (count == 4) {
+        fprintf(stderr, "Piece %d has more than 4 cells.\n", piece);
+        exit(1);
+      }
+      masks[y] |= 1 << x;
+      info->cell_x[count] = x;
+      info->cell_y[count] = y;
+      info->glyph = c;
+      // Rows are scanned starting at the bottom, so the first cell seen in a
+      // column is its lowest.
+      if (!(columns_seen & (1 << x))) info->bottom[x] = y;
+      columns_seen |= 1 << x;
+      if (x >= info->width) info->width = x + 1;
+      if (y >= info->height) info->height = y + 1;
+      count++;
+    }
+  }
+  if ((count != 4) || !masks[0] || !(columns_seen & 1) ||
+    (columns_seen != ((1 << info->width) - 1))) {
+    fprintf(stderr, "Piece %d is invalid.\n", piece);
+    exit(1);
+  }
+  memcpy(info->kicks, kick_order, sizeof(kick_order));
+}
+
+// The seed for the Zobrist keys. Any value works, but it must not change
+// between builds if hashes are ever stored.
+#define ZOBRIST_SEED (0x5445545249535a42ULL)
+
+// Returns the next output of the splitmix64 generator with the given state.
+static uint64_t SplitMix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+int main(void) {
+  uint64_t zobrist_state = ZOBRIST_SEED;
+  uint16_t masks[TETRIS_PIECE_COUNT][4];
+  TetrisPieceInfo info[TETRIS_PIECE_COUNT];
+  int i, j;
+  for (i = 0; i < TETRIS_PIECE_COUNT; i++) {
+    DerivePiece(i, masks[i], info + i);
+  }
+  printf("// Generated by gen_piece_tables.c from tetris_pieces.c. Don't edit "
+    "this file.\n");
+  printf("#include \"tetris_engine.h\"\n\n");
+  printf("const uint16_t piece_row_masks[TETRIS_PIECE_COUNT][4] = {\n");
+  for (i = 0; i < TETRIS_PIECE_COUNT; i++) {
+    printf("  {0x%x, 0x%x, 0x%x, 0x%x},  // %d\n", masks[i][0], masks[i][1],
+      masks[i][2], masks[i][3], i);
+  }
+  printf("};\n\n");
+  printf("const TetrisPieceInfo piece_info[TETRIS_PIECE_COUNT] = {\n");
+  for (i = 0; i < TETRIS_PIECE_COUNT; i++) {
+    printf("  // %d\n  {\n    {", i);
+    for (j = 0; j < 4; j++) printf("%s%d", j ? ", " : "", info[i].cell_x[j]);
+    printf("},\n    {");
+    for (j = 0; j < 4; j++) printf("%s%d", j ? ", " : "", info[i].cell_y[j]);
+    printf("},\n    '%c', %d, %d,\n    {", info[i].glyph, info[i].width,
+      info[i].height);
+    for (j = 0; j < 4; j++) printf("%s%d", j ? ", " : "", info[i].bottom[j]);
+    printf("},\n    {");
+    for (j = 0; j < TETRIS_KICK_COUNT; j++) {
+      printf("%s%d", j ? ", " : "", info[i].kicks[j]);
+    }
+    printf("},\n  },\n");
+  }
+  printf("};\n\n");
+  printf("const uint64_t zobrist_cells[TETRIS_MAX_BLOCKS_TALL]"
+    "[TETRIS_MAX_BLOCKS_WIDE] = {\n");
+  for (i = 0; i < TETRIS_MAX_BLOCKS_TALL; i++) {
+    printf("  {\n");
+    for (j = 0; j < TETRIS_MAX_BLOCKS_WIDE; j++) {
+      printf("    0x%016llxULL,\n",
+        (unsigned long long) SplitMix64(&zobrist_state));
+    }
+    printf("  },\n");
+  }
+  printf("};\n");
+  return 0;
+}
@@ -2,17 +2,58 @@
 #include <curses.h>
 #include <errno.h>
 #include <locale.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "tetris.h"
+#include "tetris_ai.h"
+#include "tetris_broadcast.h"
+#include "tetris_draw.h"
+#include "tetris_input.h"
+#include "tetris_replay.h"
+#include "tetris_save.h"
+#include "tetris_sched.h"
+#include "tetris_undo.h"
+#include "tetris_versus.h"
 
-// This will be the maximum amount of time to wait for a keypress before
-// updating the screen anyway. Basically, we can achieve a higher "frames per
-// second" if there's faster input, but we'll always have about 30 FPS.
-#define MAX_MS_PER_FRAME (33)
+// The file used for quicksaves, in the current directory.
+#define QUICKSAVE_PATH "tetris_quicksave.bin"
+
+// The character used to draw the ghost piece, which shows where the falling
+// piece will land.
+#define GHOST_CHARACTER '.'
+
+// The default number of pieces the 'r' key takes back.
+#define DEFAULT_REWIND_PIECES (10)
+
+// The default number of upcoming pieces shown: the next piece, and those
+// after it in the queue window.
+#define DEFAULT_PREVIEW_PIECES (3)
+
+// The width of the hold and queue windows, which hold a piece 4 blocks wide
+// with a space of padding and the border on each side.
+#define QUEUE_WINDOW_WIDTH (12)
+
+// The most lines PrintControls prints, including the "Controls:" heading.
+#define CONTROL_LINES (10)
+
+// With --autoplay, the number of seconds the AI waits after a piece appears
+// before moving it.
+#define AUTOPLAY_MOVE_SECONDS (0.2)
+
+// The number of seconds a status message stays up before being cleared.
+#define STATUS_MESSAGE_SECONDS (5.0)
+
+// The number of seconds between updates of the stats shown in the status line.
+#define STATS_UPDATE_SECONDS (0.5)
+
+// Resizes arriving within this many seconds of each other, one frame at the
+// default tick rate, are handled as one.
+#define RESIZE_SETTLE_SECONDS (1.0 / DEFAULT_TICK_RATE)
 
 // Calls our internal function to print the location of an error and exit if
 // a curses function returns ERR.
@@ -22,6 +63,24 @@
 #define CheckNULL(val) InternalCheckNULL((val), #val, __FILE__, __LINE__)
 
 
+// The frontend's instrumentation. There's only ever one main loop to time.
+static TetrisInstruments instruments;
+
+// The undo history of the game being played, with no storage if it's turned
+// off.
+static TetrisUndoRing undo;
+
+// The broadcast showing the game to spectators, or NULL if there isn't one.
+static TetrisBroadcast broadcast_state;
+static TetrisBroadcast *broadcast;
+
+// The number of upcoming pieces shown, from 1 to TETRIS_MAX_PREVIEW.
+static int preview_pieces = DEFAULT_PREVIEW_PIECES;
+
+// The versus match being played, or NULL when playing alone.
+static VersusMatch versus_match;
+static VersusMatch *versus;
+
 // Returns the current time, in seconds.
 static double CurrentSeconds(void) {
   struct timespec ts;
@@ -50,8 +109,9 @@ static void InternalCheckNULL(void *value, const char *fn,
 }
 
 // Initially called to set up the curses settings for character-at-a-time
-// control. Exits on error.
-static void SetupCurses(void) {
+// control. Exits on error. If batched_output is nonzero, output is tuned for
+// slow links, where every write() can cost a round trip; see below.
+static void SetupCurses(int batched_output) {
   CheckNULL(initscr());
   // This causes a "break" after every character input, rather than every line
   CheckCursesError(cbreak());
@@ -66,6 +126,21 @@ static void SetupCurses(void) {
   CheckCursesError(keypad(stdscr, TRUE));
   // Hide the location of the cursor
   CheckCursesError(curs_set(0));
+  if (!batched_output) return;
+  // By default curses checks for typeahead while updating, and stops partway
+  // (sending what it has) if a key is waiting, leaving the rest for another
+  // update. Keys are read right after every refresh anyway, so never stop
+  // early.
+  CheckCursesError(typeahead(-1));
+  // Until the screen has been through endwin() once, ncurses (as of 6.4)
+  // flushes its output after every cursor movement, so an update takes a
+  // write() per changed line. Going through it now, before anything is
+  // drawn, makes curses keep each update in its output buffer, which is
+  // sized for the whole screen, and send it with one write() at the end of
+  // doupdate(). The summary printed at exit shows the writes per refresh.
+  CheckCursesError(refresh());
+  CheckCursesError(endwin());
+  CheckCursesError(refresh());
 }
 
 // We replace ncurses' box(..) function with this, because it works properly in
@@ -87,17 +162,42 @@ static void PrintWindowTitle(WINDOW *window, const char *s) {
 static void PrintControls(WINDOW *w, int row, int col) {
   CheckCursesError(mvwprintw(w, row, col, "Controls:"));
   CheckCursesError(mvwprintw(w, row + 1, col, "q: quit"));
+  // A versus match can't be paused, saved or loaded.
+  if (versus) {
+    CheckCursesError(mvwprintw(w, row + 2, col, "i: stats"));
+    CheckCursesError(mvwprintw(w, row + 3, col, "arrow keys:"));
+    CheckCursesError(mvwprintw(w, row + 4, col, "  move/rotate"));
+    return;
+  }
   CheckCursesError(mvwprintw(w, row + 2, col, "l: quick load"));
   CheckCursesError(mvwprintw(w, row + 3, col, "s: quick save"));
   CheckCursesError(mvwprintw(w, row + 4, col, "space: pause"));
-  CheckCursesError(mvwprintw(w, row + 5, col, "arrow keys:"));
-  CheckCursesError(mvwprintw(w, row + 6, col, "  move/rotate"));
+  CheckCursesError(mvwprintw(w, row + 5, col, "u: undo"));
+  CheckCursesError(mvwprintw(w, row + 6, col, "r: rewind"));
+  CheckCursesError(mvwprintw(w, row + 7, col, "i: stats"));
+  CheckCursesError(mvwprintw(w, row + 8, col, "arrow keys:"));
+  CheckCursesError(mvwprintw(w, row + 9, col, "  move/rotate"));
 }
 
-// Initializes the layout and empty display. Exits on error.
-static void CreateWindows(TetrisDisplay *windows) {
-  int chars_wide, chars_tall, status_window_width, main_window_width;
-  memset(windows, 0, sizeof(*windows));
+// Where one of the display's windows goes, relative to the screen, as
+// newwin() and subwin() take it. window is the TetrisDisplay field holding it.
+typedef struct {
+  WINDOW **window;
+  int lines;
+  int columns;
+  int y;
+  int x;
+} WindowPlacement;
+
+// The most windows in the display: the top window and every subwindow.
+#define MAX_DISPLAY_WINDOWS (8)
+
+// Fills in where each window shown in this mode goes, starting with the top
+// window, which contains the rest. Returns the number of windows. The layout
+// doesn't depend on the terminal's size.
+static int PlanWindows(TetrisDisplay *windows, WindowPlacement *places) {
+  int chars_wide, chars_tall, status_window_width, main_window_width, queue_x;
+  int count = 0;
   // The width of the play area = 2 chars per block, plus a character on each
   // side for the border.
   chars_wide = (BLOCKS_WIDE * 2) + 2;
@@ -111,29 +211,95 @@ static void CreateWindows(TetrisDisplay *windows) {
   // windows, along with a space between the two windows, and 2 characters of
   // border + padding on each side.
   main_window_width = chars_wide + status_window_width + 8;
+  // The hold and queue windows go to the right of the status windows, and
+  // the opponent's board to the right of them.
+  main_window_width += QUEUE_WINDOW_WIDTH + 2;
+  queue_x = chars_wide + status_window_width + 7;
+  if (versus) main_window_width += chars_wide + 2;
+
+  // The controls start 4 rows above the bottom of the game window, and the
+  // main window's border goes below them.
+  places[count++] = (WindowPlacement) {&windows->top_window,
+    chars_tall - 3 + CONTROL_LINES, main_window_width, 0, 0};
+  places[count++] = (WindowPlacement) {&windows->game, chars_tall, chars_wide,
+    2, 2};
+  places[count++] = (WindowPlacement) {&windows->score, 3,
+    status_window_width, 11, chars_wide + 5};
+  places[count++] = (WindowPlacement) {&windows->line_count, 3, 15, 15,
+    chars_wide + 5};
+  places[count++] = (WindowPlacement) {&windows->next_piece, 8, 15, 2,
+    chars_wide + 5};
+  // The hold window is tall enough for any piece. The queue window runs down
+  // to the bottom of the game window, with 3 rows for each piece.
+  places[count++] = (WindowPlacement) {&windows->hold, 6, QUEUE_WINDOW_WIDTH,
+    2, queue_x};
+  if (preview_pieces > 1) {
+    places[count++] = (WindowPlacement) {&windows->queue, chars_tall - 6,
+      QUEUE_WINDOW_WIDTH, 8, queue_x};
+  }
+  if (versus) {
+    places[count++] = (WindowPlacement) {&windows->opponent, chars_tall,
+      chars_wide, 2, queue_x + QUEUE_WINDOW_WIDTH + 2};
+  }
+  return count;
+}
 
-  windows->top_window = newwin(chars_tall + 4, main_window_width, 0, 0);
-  CheckNULL(windows->top_window);
+// Draws the parts of the display that never change: the borders, titles and
+// controls. Everything else is marked as needing to be drawn again, since
+// this is only called when the windows are new or their contents were lost.
+// Exits on error.
+static void DrawChrome(TetrisDisplay *windows) {
+  int chars_tall = getmaxy(windows->game), i;
   WinBox(windows->top_window);
   PrintWindowTitle(windows->top_window, " Tetris ");
-  PrintControls(windows->top_window, chars_tall - 4, chars_wide + 5);
-
-  windows->game = subwin(windows->top_window, chars_tall, chars_wide, 2, 2);
-  CheckNULL(windows->game);
+  PrintControls(windows->top_window, chars_tall - 4,
+    getbegx(windows->score));
   WinBox(windows->game);
-  windows->score = subwin(windows->top_window, 3, status_window_width, 11,
-    chars_wide + 5);
-  CheckNULL(windows->score);
   WinBox(windows->score);
   PrintWindowTitle(windows->score, " Score ");
-  windows->line_count = subwin(windows->top_window, 3, 15, 15, chars_wide + 5);
-  CheckNULL(windows->line_count);
   WinBox(windows->line_count);
   PrintWindowTitle(windows->line_count, " Lines ");
-  windows->next_piece = subwin(windows->top_window, 8, 15, 2, chars_wide + 5);
-  CheckNULL(windows->next_piece);
   WinBox(windows->next_piece);
   PrintWindowTitle(windows->next_piece, " Next ");
+  WinBox(windows->hold);
+  PrintWindowTitle(windows->hold, " Hold ");
+  CheckCursesError(mvwprintw(windows->top_window, chars_tall + 2,
+    getbegx(windows->hold) + 1, "h: hold"));
+  if (windows->queue) {
+    WinBox(windows->queue);
+    PrintWindowTitle(windows->queue, " Queue ");
+  }
+  if (windows->opponent) {
+    WinBox(windows->opponent);
+    PrintWindowTitle(windows->opponent, " Opponent ");
+    windows->redraw_opponent = 1;
+  }
+  windows->drawn_next_piece = -1;
+  windows->drawn_hold_piece = -1;
+  for (i = 0; i < TETRIS_MAX_PREVIEW; i++) windows->drawn_queue[i] = -1;
+  windows->drawn_ghost_piece = -1;
+  windows->redraw_all = 1;
+}
+
+// Initializes the layout and empty display. Exits on error.
+static void CreateWindows(TetrisDisplay *windows) {
+  WindowPlacement places[MAX_DISPLAY_WINDOWS];
+  WINDOW *w;
+  int count, i;
+  memset(windows, 0, sizeof(*windows));
+  count = PlanWindows(windows, places);
+  for (i = 0; i < count; i++) {
+    if (i == 0) {
+      w = newwin(places[i].lines, places[i].columns, places[i].y,
+        places[i].x);
+    } else {
+      w = subwin(windows->top_window, places[i].lines, places[i].columns,
+        places[i].y, places[i].x);
+    }
+    CheckNULL(w);
+    *places[i].window = w;
+  }
+  DrawChrome(windows);
 }
 
 // Clears the status line if something is there. Doesn't refresh the screen.
@@ -149,20 +315,69 @@ static void ClearStatusLine(TetrisDisplay *windows) {
   windows->status_message[0] = 0;
 }
 
+// Returns nonzero if the main loop is being timed: if its stats are shown, or
+// it's being traced.
+static int Instrumented(void) {
+  return instruments.show_stats || instruments.trace.file;
+}
+
+// Returns the current time if the main loop is being timed, or 0 if not.
+static double TraceTime(void) {
+  return Instrumented() ? CurrentSeconds() : 0;
+}
+
+// Records a stage of the main loop that started at the given time, unless it
+// was 0 (i.e., from TraceTime when nothing is being timed). Returns the time
+// the stage ended, or 0 if it wasn't recorded.
+static double TraceStage(int stage, double start) {
+  double end;
+  if (!start) return 0;
+  end = CurrentSeconds();
+  TraceRecord(&instruments.trace.stages, stage, start, end);
+  return end;
+}
+
+// Shows the median and 99th percentile frame time and key-to-screen latency
+// in the status line, if enabled. The stats are only recomputed every
+// STATS_UPDATE_SECONDS.
+static void WriteStatsOverlay(TetrisDisplay *windows) {
+  WINDOW *w = windows->top_window;
+  double now, frame_p50 = 0, frame_p99 = 0, key_p50 = 0, key_p99 = 0;
+  if (!instruments.show_stats) return;
+  now = CurrentSeconds();
+  if (now >= instruments.stats_update_time) {
+    instruments.stats_update_time = now + STATS_UPDATE_SECONDS;
+    TracePercentiles(&instruments.trace.stages, TRACE_STAGE_FRAME, &frame_p50,
+      &frame_p99);
+    TracePercentiles(&instruments.trace.latencies, TRACE_STAGE_KEY_LATENCY,
+      &key_p50, &key_p99);
+    snprintf(instruments.stats_text, sizeof(instruments.stats_text),
+      "Frame %.2f/%.2f Key %.2f/%.2f ms", frame_p50 * 1e3, frame_p99 * 1e3,
+      key_p50 * 1e3, key_p99 * 1e3);
+  }
+  CheckCursesError(mvwprintw(w, 1, 2, "%-*s",
+    (int) sizeof(windows->status_message) - 2, instruments.stats_text));
+  CheckCursesError(mvwaddch(w, 1, getmaxx(w) - 1, '|'));
+}
+
 // Writes the status message to the game display, or clears it if the timeout
-// has elapsed. To set a new status message, write the message to
-// windows->status_message and set windows->status_start_time to
-// CurrentSeconds().
+// has elapsed. The stats overlay is shown instead when there's no message. To
+// set a new status message, write the message to windows->status_message and
+// set windows->status_start_time to CurrentSeconds().
 static void WriteStatusMessage(TetrisDisplay *windows) {
   WINDOW *w = windows->top_window;
   double displayed_duration;
   // We have no current status message.
-  if (windows->status_message[0] == 0) return;
+  if (windows->status_message[0] == 0) {
+    WriteStatsOverlay(windows);
+    return;
+  }
 
   // Clear the status message if it's been displayed for over 5 seconds.
   displayed_duration = CurrentSeconds() - windows->status_start_time;
-  if (displayed_duration >= 5.0) {
+  if (displayed_duration >= STATUS_MESSAGE_SECONDS) {
     ClearStatusLine(windows);
+    WriteStatsOverlay(windows);
     return;
   }
 
@@ -176,21 +391,71 @@ static void WriteStatusMessage(TetrisDisplay *windows) {
   CheckCursesError(mvwaddch(w, 1, getmaxx(w) - 1, '|'));
 }
 
-// Handles the ncurses calls to flush the content to the terminal.
+// Returns the CLOCK_MONOTONIC time, in nanoseconds, at which the status line
+// next needs to change: when the current status message needs to be cleared,
+// or the stats overlay updated. Returns 0 if it never needs to change.
+static uint64_t StatusDeadline(TetrisDisplay *windows) {
+  uint64_t deadline = 0, stats_deadline;
+  if (windows->status_message[0] != 0) {
+    deadline = (windows->status_start_time + STATUS_MESSAGE_SECONDS) * 1e9;
+  }
+  if (!instruments.show_stats) return deadline;
+  stats_deadline = instruments.stats_update_time * 1e9;
+  if (!deadline || (stats_deadline < deadline)) deadline = stats_deadline;
+  return deadline;
+}
+
+// Handles the ncurses calls to flush the content to the terminal. Each window
+// is only copied to the virtual screen, so the terminal is written to once, by
+// the doupdate() at the end. If the main loop is being timed, whatever keys
+// were read before this are counted as shown once it's done.
 static void RefreshAllWindows(TetrisDisplay *windows) {
+  uint64_t bytes_before, writes_before, bytes, writes;
+  int counted = 0;
+  double start, end;
+  // Count everything the process writes during the refresh, which is all
+  // curses' output.
+  if (Instrumented()) {
+    counted = ReadWriteCounters(&instruments.trace, &bytes_before,
+      &writes_before);
+  }
+  start = TraceTime();
   WriteStatusMessage(windows);
-  CheckCursesError(refresh());
-  CheckCursesError(wrefresh(windows->top_window));
-  CheckCursesError(wrefresh(windows->game));
-  CheckCursesError(wrefresh(windows->score));
-  CheckCursesError(wrefresh(windows->line_count));
-  CheckCursesError(wrefresh(windows->next_piece));
+  CheckCursesError(wnoutrefresh(stdscr));
+  CheckCursesError(wnoutrefresh(windows->top_window));
+  CheckCursesError(wnoutrefresh(windows->game));
+  CheckCursesError(wnoutrefresh(windows->score));
+  CheckCursesError(wnoutrefresh(windows->line_count));
+  CheckCursesError(wnoutrefresh(windows->next_piece));
+  CheckCursesError(wnoutrefresh(windows->hold));
+  if (windows->queue) CheckCursesError(wnoutrefresh(windows->queue));
+  if (windows->opponent) CheckCursesError(wnoutrefresh(windows->opponent));
+  CheckCursesError(doupdate());
+  if (!start) return;
+  end = CurrentSeconds();
+  if (counted && ReadWriteCounters(&instruments.trace, &bytes, &writes)) {
+    bytes -= bytes_before;
+    writes -= writes_before;
+    TraceRecordRefresh(&instruments.trace.stages, start, end, bytes, writes);
+    instruments.refreshes_counted++;
+    instruments.bytes_written += bytes;
+    instruments.writes_made += writes;
+  } else {
+    TraceRecord(&instruments.trace.stages, TRACE_STAGE_REFRESH, start, end);
+  }
+  if (!instruments.pending_key_time) return;
+  TraceRecord(&instruments.trace.latencies, TRACE_STAGE_KEY_LATENCY,
+    instruments.pending_key_time, end);
+  instruments.pending_key_time = 0;
 }
 
 static void DestroyWindows(TetrisDisplay *windows) {
   // We're not going to bother checking errors on these cleanup functions.
   // Technically, they return an error if any of the windows are NULL, but at
   // least they shouldn't segfault in that case, so we won't bother checking.
+  if (windows->opponent) delwin(windows->opponent);
+  if (windows->queue) delwin(windows->queue);
+  delwin(windows->hold);
   delwin(windows->next_piece);
   delwin(windows->line_count);
   delwin(windows->score);
@@ -200,6 +465,54 @@ static void DestroyWindows(TetrisDisplay *windows) {
   memset(windows, 0, sizeof(*windows));
 }
 
+// Restores the windows after the terminal was resized, once CoalesceResizes
+// has let the resizing settle. The layout doesn't depend on the terminal's
+// size, so the windows only need changing if curses shrank or moved them to
+// fit a smaller terminal along the way. If so, they're put back in place with
+// wresize() and mvderwin(), keeping the windows and the memory they share,
+// the chrome is drawn again, and nonzero is returned: the caller must then
+// draw whatever else it shows, and refresh. Otherwise, just repaints the
+// terminal, which curses clears after a resize, from the windows as they are,
+// and returns 0. Exits if the terminal is now too small for the layout.
+static int ResizeWindows(TetrisDisplay *windows) {
+  WindowPlacement places[MAX_DISPLAY_WINDOWS];
+  WindowPlacement *p;
+  WINDOW *w;
+  int count, i, changed = 0;
+  count = PlanWindows(windows, places);
+  if ((LINES < places[0].lines) || (COLS < places[0].columns)) {
+    endwin();
+    printf("The terminal must be at least %d columns by %d lines.\n",
+      places[0].columns, places[0].lines);
+    exit(1);
+  }
+  // The top window comes first, so each subwindow fits once it's restored.
+  for (i = 0; i < count; i++) {
+    p = places + i;
+    w = *p->window;
+    if ((getmaxy(w) == p->lines) && (getmaxx(w) == p->columns) &&
+      (getbegy(w) == p->y) && (getbegx(w) == p->x)) {
+      continue;
+    }
+    changed = 1;
+    CheckCursesError(wresize(w, p->lines, p->columns));
+    if (i == 0) {
+      CheckCursesError(mvwin(w, p->y, p->x));
+    } else {
+      CheckCursesError(mvderwin(w, p->y - places[0].y, p->x - places[0].x));
+    }
+  }
+  if (!changed) {
+    // The subwindows share the top window's memory, so touching it is enough
+    // to copy everything to the cleared screen.
+    CheckCursesError(touchwin(windows->top_window));
+    RefreshAllWindows(windows);
+    return 0;
+  }
+  DrawChrome(windows);
+  return 1;
+}
+
 // Prints a status message to the top of the game display's main window.
 static void StatusPrintf(TetrisDisplay *windows, const char *format, ...) {
   va_list args;
@@ -213,174 +526,273 @@ static void StatusPrintf(TetrisDisplay *windows, const char *format, ...) {
   RefreshAllWindows(windows);
 }
 
-// Takes a pointer to the game window, and the board array in the game state,
-// and draws the contents of the board.
-static void DrawBoard(WINDOW *w, char *board) {
-  // We'll use these as the coordinates in the ncurses window.
-  // The coordinates into the ncurses window.
-  int y, x;
-  // The index into the board array.
-  int i = 0;
-  char c;
-  // Note that we start at y = 1 and x = 1 to skip the window border.
-  for (y = 1; y <= BLOCKS_TALL; y++) {
-    for (x = 1; x <= (BLOCKS_WIDE * 2); x += 2) {
-      c = board[i];
-      // Omit error checking here; if the window gets too small, just let these
-      // fail silently as the pieces fall off the bottom of the screen.
-      // Move the cursor and print the char
-      mvwaddch(w, y, x, c);
-      // Print the second copy of the char
-      waddch(w, c);
-      i++;
-    }
-  }
+// Takes a window, and indices into the tetris_pieces array of the piece to
+// draw and the piece currently shown there (or -1 if none is shown), with
+// the piece's location at the given screen coordinates. Only the cells of the
+// two pieces are drawn.
+static void DrawPreviewPiece(WINDOW *w, short piece, short drawn_piece, int x,
+  int y) {
+  if (drawn_piece >= 0) DrawPieceCells(w, drawn_piece, x, y, 1);
+  if (piece >= 0) DrawPieceCells(w, piece, x, y, 0);
 }
 
-// Takes a pointer to the next piece window, and the index of the piece in the
-// tetris_pieces array. Draws the piece in the window.
-static void DrawNextPiece(WINDOW *w, short piece) {
-  const char *p = tetris_pieces[piece];
-  int piece_x, piece_y, screen_x, screen_y, i = 0;
-  char c;
-  for (piece_y = 0; piece_y < 4; piece_y++) {
-    screen_y = 5 - piece_y;
-    for (piece_x = 0; piece_x < 4; piece_x++) {
-      c = p[i];
-      screen_x = (piece_x << 1) + 3;
-      mvwaddch(w, screen_y, screen_x, c);
-      waddch(w, c);
-      i++;
+// Returns the flattest rotation of the given piece's kind, which is how the
+// queue window shows it, so every piece fits in 2 rows.
+static short FlatRotation(short piece) {
+  int kind, i;
+  short first, flattest;
+  for (kind = TETRIS_PIECE_KINDS - 1; kind > 0; kind--) {
+    if (piece >= piece_kind_first[kind]) break;
+  }
+  first = piece_kind_first[kind];
+  flattest = first;
+  for (i = 1; i < piece_kind_rotations[kind]; i++) {
+    if (piece_info[first + i].height < piece_info[flattest].height) {
+      flattest = first + i;
     }
   }
+  return flattest;
 }
 
-// Returns 1 if a space is available for a falling block, and 0 if not. Returns
-// 0 if the given position is either out of bounds, or overlapping with an
-// existing block. The x, y coordinate is in game cells, NOT ncurses rows/cols.
-static int SpaceAvailable(char *board, int x, int y) {
-  char c;
-  if ((x < 0) || (x >= BLOCKS_WIDE)) return 0;
-  // We always count space above the board as OK.
-  if (y < 0) return 1;
-  if (y >= BLOCKS_TALL) return 0;
-  c = board[y * BLOCKS_WIDE + x];
-  return c == ' ';
+// Draws the upcoming pieces that changed since the last call: the next one in
+// the next piece window as it will appear, and the rest of the previewed
+// ones in the queue window. Returns nonzero if anything was drawn.
+static int DrawNextPieces(TetrisDisplay *windows, TetrisGameState *s) {
+  short piece;
+  int i, changed = 0;
+  piece = QueuedPiece(s, 0);
+  if (piece != windows->drawn_next_piece) {
+    DrawPreviewPiece(windows->next_piece, piece, windows->drawn_next_piece, 3,
+      5);
+    windows->drawn_next_piece = piece;
+    changed = 1;
+  }
+  for (i = 1; i < preview_pieces; i++) {
+    piece = FlatRotation(QueuedPiece(s, i));
+    if (piece == windows->drawn_queue[i]) continue;
+    DrawPreviewPiece(windows->queue, piece, windows->drawn_queue[i], 2,
+      (i * 3) - 1);
+    windows->drawn_queue[i] = piece;
+    changed = 1;
+  }
+  if (s->hold_piece != windows->drawn_hold_piece) {
+    DrawPreviewPiece(windows->hold, s->hold_piece, windows->drawn_hold_piece,
+      2, 4);
+    windows->drawn_hold_piece = s->hold_piece;
+    changed = 1;
+  }
+  return changed;
 }
 
-static void DrawFallingPiece(WINDOW *w, TetrisGameState *s) {
-  const char *p = tetris_pieces[s->current_piece];
-  int piece_x, piece_y, board_x, board_y, screen_x, screen_y;
-  char c;
+// Draws the opponent's board and falling piece in a versus match, below it
+// their line count and the garbage waiting for them, and the garbage waiting
+// for the local player below the game window. Only redraws what changed since
+// the last call. Returns nonzero if anything was drawn.
+static int DrawOpponent(TetrisDisplay *windows) {
+  TetrisGameState *s = OpponentVersusGame(versus);
+  TetrisRowSet rows = s->dirty_rows;
+  uint32_t incoming = versus->current.pending_garbage[versus->local_player];
+  uint32_t opponent_incoming =
+    versus->current.pending_garbage[1 - versus->local_player];
+  int changed = 0, info_y = BLOCKS_TALL + 4;
+  if (windows->redraw_opponent) rows = ALL_ROWS_DIRTY;
+  if (rows) {
+    DrawBoard(windows->opponent, s->board, rows);
+    DrawBoardPiece(windows->opponent, s->current_piece, s->location_x,
+      s->location_y, piece_info[s->current_piece].glyph, rows);
+    s->dirty_rows = 0;
+    changed = 1;
+  }
+  if (windows->redraw_opponent || (incoming != windows->drawn_incoming)) {
+    mvwprintw(windows->top_window, info_y, 2, "Incoming garbage: %-3u",
+      (unsigned) incoming);
+    windows->drawn_incoming = incoming;
+    changed = 1;
+  }
+  if (windows->redraw_opponent || (s->lines != windows->drawn_opponent_lines) ||
+    (opponent_incoming != windows->drawn_opponent_incoming)) {
+    mvwprintw(windows->top_window, info_y, getbegx(windows->opponent),
+      "Lines: %-5u In: %-3u", s->lines, (unsigned) opponent_incoming);
+    windows->drawn_opponent_lines = s->lines;
+    windows->drawn_opponent_incoming = opponent_incoming;
+    changed = 1;
+  }
+  windows->redraw_opponent = 0;
+  return changed;
+}
 
-  for (piece_y = 0; piece_y < 4; piece_y++) {
-    board_y = s->location_y - piece_y;
-    if (board_y < 0) continue;
-    screen_y = board_y + 1;
-    for (piece_x = 0; piece_x < 4; piece_x++) {
-      c = p[piece_y * 4 + piece_x];
-      if (c == ' ') continue;
-      board_x = s->location_x + piece_x;
-      screen_x = board_x * 2 + 1;
-      // Do the same thing we do in DrawBoard.
-      mvwaddch(w, screen_y, screen_x, c);
-      waddch(w, c);
+// Writes the score, piece, and so on, in the game window. Only redraws the
+// parts of the display that changed since the last call, and doesn't touch the
+// terminal at all if nothing changed.
+static void DisplayGameState(TetrisDisplay *windows, TetrisGameState *s) {
+  TetrisRowSet rows = s->dirty_rows;
+  int changed = 0, ghost_y = LandingY(s);
+  // Spectators are sent the same changes, before they're cleared below.
+  if (broadcast) BroadcastGameState(broadcast, s);
+  if (windows->redraw_all) {
+    rows = ALL_ROWS_DIRTY;
+    windows->drawn_score = ~s->score;
+    windows->drawn_lines = ~s->lines;
+    windows->redraw_all = 0;
+  }
+  // The ghost piece shows where the falling piece would land. If it moved,
+  // the rows it left and the rows it now covers need to be redrawn.
+  if ((s->current_piece != windows->drawn_ghost_piece) ||
+    (s->location_x != windows->drawn_ghost_x) ||
+    (ghost_y != windows->drawn_ghost_y)) {
+    if (windows->drawn_ghost_piece >= 0) {
+      rows |= PieceRows(windows->drawn_ghost_piece, windows->drawn_ghost_y);
     }
+    rows |= PieceRows(s->current_piece, ghost_y);
+    windows->drawn_ghost_piece = s->current_piece;
+    windows->drawn_ghost_x = s->location_x;
+    windows->drawn_ghost_y = ghost_y;
+  }
+  if (rows) {
+    DrawBoard(windows->game, s->board, rows);
+    DrawBoardPiece(windows->game, s->current_piece, s->location_x, ghost_y,
+      GHOST_CHARACTER, rows);
+    DrawBoardPiece(windows->game, s->current_piece, s->location_x,
+      s->location_y, piece_info[s->current_piece].glyph, rows);
+    s->dirty_rows = 0;
+    changed = 1;
+  }
+  if (DrawNextPieces(windows, s)) changed = 1;
+  if (s->score != windows->drawn_score) {
+    mvwprintw(windows->score, 1, 2, "%11u", s->score);
+    windows->drawn_score = s->score;
+    changed = 1;
   }
+  if (s->lines != windows->drawn_lines) {
+    mvwprintw(windows->line_count, 1, 2, "%11u", s->lines);
+    windows->drawn_lines = s->lines;
+    changed = 1;
+  }
+  if (versus && DrawOpponent(windows)) changed = 1;
+  // Keep refreshing while a status message is up, so it's cleared on time,
+  // and whenever the stats overlay is due to be updated.
+  if (windows->status_message[0] != 0) changed = 1;
+  if (instruments.show_stats &&
+    (CurrentSeconds() >= instruments.stats_update_time)) {
+    changed = 1;
+  }
+  if (changed) RefreshAllWindows(windows);
 }
 
-// Writes the score, piece, and so on, in the game window.
-static void DisplayGameState(TetrisDisplay *windows, TetrisGameState *s) {
-  DrawBoard(windows->game, s->board);
-  DrawNextPiece(windows->next_piece, s->next_piece);
-  DrawFallingPiece(windows->game, s);
-  mvwprintw(windows->score, 1, 2, "% 11u", s->score);
-  mvwprintw(windows->line_count, 1, 2, "% 11u", s->lines);
-  RefreshAllWindows(windows);
+// Finishes the replay log being recorded by w, if any. The given tick is the
+// one at which the recorded game ended.
+static void StopRecording(TetrisDisplay *windows, ReplayWriter *w,
+  uint64_t final_tick) {
+  if (!w->file) return;
+  if (!CloseReplayWriter(w, final_tick)) {
+    StatusPrintf(windows, "Recording error: %s", strerror(errno));
+  }
 }
 
-// Returns a random piece to drop down (i.e., an index into tetris_pieces).
-static short RandomNewPiece(void) {
-  // Since some pieces have up to four rotations, this allows us to select a
-  // random piece rotation without weighting pieces with more rotations over
-  // pieces with fewer, as every piece has four entries.
-  static const short piece_ids[] = {0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4,
-    5, 5, 6, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
-  const short max_choice = sizeof(piece_ids) / sizeof(short);
-  return piece_ids[rand() % max_choice];
+// Adds an input to the replay log being recorded by w, if any. Recording
+// stops if the log can't be written.
+static void RecordGameInput(TetrisDisplay *windows, ReplayWriter *w,
+  uint64_t tick, int input) {
+  if (!w->file) return;
+  if (!RecordInput(w, tick, input)) {
+    StatusPrintf(windows, "Recording error: %s", strerror(errno));
+    fclose(w->file);
+    w->file = NULL;
+  }
 }
 
-// Returns 1 if everything in the given game state looks OK, and 0 if not.
-static int SanityCheckState(TetrisGameState *s) {
-  int row, col, tmp;
-  char c;
-  tmp = s->location_x;
-  if ((tmp < 0) || (tmp >= BLOCKS_WIDE)) return 0;
-  tmp = s->location_y;
-  if ((tmp < PIECE_START_Y) || (tmp >= BLOCKS_TALL)) return 0;
+// Where RecordAIInput sends the AI's inputs.
+typedef struct {
+  TetrisDisplay *windows;
+  ReplayWriter *replay;
+} AIRecordTarget;
 
-  // Important check: make sure the current piece is a valid piece ID.
-  tmp = sizeof(tetris_pieces) / sizeof(const char*);
-  if ((s->current_piece < 0) || (s->current_piece >= tmp)) return 0;
-  if ((s->next_piece < 0) || (s->next_piece >= tmp)) return 0;
+// Passed to PlayMove, so the AI's inputs are recorded like the player's.
+static void RecordAIInput(uint64_t tick, int input, void *arg) {
+  AIRecordTarget *target = (AIRecordTarget *) arg;
+  RecordGameInput(target->windows, target->replay, tick, input);
+}
 
-  // Make sure the board contains no invalid characters.
-  for (row = 0; row < BLOCKS_TALL; row++) {
-    for (col = 0; col < BLOCKS_WIDE; col++) {
-      c = s->board[row * BLOCKS_WIDE + col];
-      if ((c < ' ') || (c > '~')) return 0;
-    }
+// Writes out the trace events recorded so far, if enough have built up. If
+// they can't be written, tracing stops and an error is shown.
+static void FlushTraceEvents(TetrisDisplay *windows) {
+  if (!FlushTrace(&instruments.trace, 0)) {
+    StatusPrintf(windows, "Trace error: %s", strerror(errno));
   }
+}
 
-  // There are clearly more sanity checks we can do, but these are all that
-  // we'll test for now. Ideas for later:
-  // - No completed lines
-  // - Score is at least lines * 100.
-
-  return 1;
+// Shows or hides the stats overlay in the status line.
+static void ToggleStatsOverlay(TetrisDisplay *windows) {
+  instruments.show_stats = !instruments.show_stats;
+  // Start off with stats for the recent frames, if any.
+  instruments.stats_update_time = 0;
+  instruments.pending_key_time = 0;
+  if (!instruments.show_stats && (windows->status_message[0] == 0)) {
+    ClearStatusLine(windows);
+  }
+  RefreshAllWindows(windows);
 }
 
 // Attempts to quickload a game state from the quicksave file. If any error
 // occurs in loading or validating the file, this will *not* exit or crash;
 // instead it will just print an error message to the game display and return
-// 0. If any error occurs, this will *not* modify s.
-static int TryQuickload(TetrisDisplay *windows, TetrisGameState *s) {
+// 0. If any error occurs, this will *not* modify s. A successful load stops
+// the recording in w, since the loaded game can't be replayed from its start.
+static int TryQuickload(TetrisDisplay *windows, TetrisGameState *s,
+  ReplayWriter *w) {
   // Load state to a temporary location so we won't ruin the game if the load
   // fails for any reason.
   TetrisGameState tmp;
-  FILE *f = fopen("tetris_quicksave.bin", "rb");
-  if (!f) {
-    StatusPrintf(windows, "Quickload open error: %s", strerror(errno));
+  int result = ReadSaveFile(QUICKSAVE_PATH, &tmp);
+  if (result != SAVE_OK) {
+    StatusPrintf(windows, "Quickload error: %s", SaveErrorString(result));
     return 0;
   }
-  if (fread(&tmp, sizeof(tmp), 1, f) < 1) {
-    StatusPrintf(windows, "Quickload read error: %s", strerror(errno));
+  StatusPrintf(windows, "Quickload complete! Unpause to play.");
+  if (w->file) {
+    StopRecording(windows, w, s->ticks);
+    StatusPrintf(windows, "Quickload complete! Recording stopped.");
+  }
+  // Keep running at the current tick rate, whatever the saved game used.
+  tmp.tick_rate = s->tick_rate;
+  *s = tmp;
+  // Pieces from before the load can't be taken back.
+  if (undo.capacity) {
+    ResetUndoRing(&undo);
+    TakeSnapshot(&undo, s);
+  }
+  return 1;
+}
+
+// Takes back up to count pieces using the undo history. The recording in w is
+// stopped, as after a quickload. Returns 0 if nothing was taken back.
+static int TakeBackPieces(TetrisDisplay *windows, TetrisGameState *s,
+  ReplayWriter *w, uint32_t count) {
+  uint32_t taken;
+  if (!undo.capacity) {
+    StatusPrintf(windows, "Undo is turned off.");
     return 0;
   }
-  if (!SanityCheckState(&tmp)) {
-    StatusPrintf(windows, "Invalid tetris_quicksave.bin contents");
+  if (!UndoablePieces(&undo, s)) {
+    StatusPrintf(windows, "No pieces to take back.");
     return 0;
   }
-  StatusPrintf(windows, "Quickload complete! Unpause to play.");
-  *s = tmp;
+  StopRecording(windows, w, s->ticks);
+  taken = RestoreSnapshot(&undo, s, count);
+  StatusPrintf(windows, "Took back %u piece%s.", (unsigned) taken,
+    (taken == 1) ? "" : "s");
   return 1;
 }
 
 // Attempts to save the game state to the quicksave file. If any error occurs,
 // this will *not* exit or crash, but instead will print an error message to
-// the game display and return 0.
+// the game display. A failed save leaves any previous quicksave intact.
 static void DoQuicksave(TetrisDisplay *windows, TetrisGameState *s) {
-  FILE *f = fopen("tetris_quicksave.bin", "wb");
-  if (!f) {
-    StatusPrintf(windows, "Quicksave open error: code %d", errno);
-    return;
-  }
-  if (fwrite(s, sizeof(*s), 1, f) < 1) {
-    StatusPrintf(windows, "Quicksave write error: code %d", errno);
-    fclose(f);
+  int result = WriteSaveFile(QUICKSAVE_PATH, s);
+  if (result != SAVE_OK) {
+    StatusPrintf(windows, "Quicksave error: %s", SaveErrorString(result));
     return;
   }
-  fclose(f);
   StatusPrintf(windows, "Quicksave written OK!");
 }
 
@@ -390,280 +802,66 @@ static void ClearGameBoard(TetrisDisplay *windows) {
   // after exiting games but before starting a new one.
   CheckCursesError(werase(windows->game));
   WinBox(windows->game);
+  windows->redraw_all = 1;
 }
 
-// Sets up a new game, clearing the board, setting score and lines to 0, and
-// setting up the current and next piece.
-static void InitializeNewGame(TetrisGameState *s) {
-  memset(s, 0, sizeof(*s));
-  memset(s->board, ' ', sizeof(s->board));
-  s->next_piece = RandomNewPiece();
-  s->current_piece = RandomNewPiece();
-  // The piece starts at the top, in the middle.
-  s->location_y = PIECE_START_Y;
-  s->location_x = BLOCKS_WIDE / 2;
-}
-
-// Returns 1 if the given piece can fit at coordinate new_x, new_y on the
-// current board. Otherwise returns 0.
-static int PieceFits(TetrisGameState *s, short piece, int new_x, int new_y) {
-  const char *p = tetris_pieces[piece];
-  int piece_x, piece_y, board_x, board_y, i = 0;
-
-  for (piece_y = 0; piece_y < 4; piece_y++) {
-    board_y = new_y - piece_y;
-    for (piece_x = 0; piece_x < 4; piece_x++) {
-      board_x = new_x + piece_x;
-      if (p[i] == ' ') {
-        i++;
-        continue;
-      }
-      if (!SpaceAvailable(s->board, board_x, board_y)) return 0;
-      i++;
-    }
-  }
-  return 1;
-}
-
-// Attempts to move a falling piece down by one spot. Returns 0 if the piece is
-// blocked, otherwise moves the piece down by 1 row.
-static int TryMovingDown(TetrisGameState *s) {
-  if (!PieceFits(s, s->current_piece, s->location_x, s->location_y + 1)) {
-    return 0;
-  }
-  s->location_y++;
-  return 1;
-}
-
-// Attempts to move a falling piece left by one column. Doesn't move the piece
-// if the movement is blocked.
-static void TryMovingLeft(TetrisGameState *s) {
-  if (!PieceFits(s, s->current_piece, s->location_x - 1, s->location_y)) {
-    return;
-  }
-  s->location_x--;
-}
-
-// Similar to TryMovingLeft, but attempts to move the falling piece right.
-static void TryMovingRight(TetrisGameState *s) {
-  if (!PieceFits(s, s->current_piece, s->location_x + 1, s->location_y)) {
-    return;
-  }
-  s->location_x++;
-}
-
-// Attempts to rotate the current piece to its next position. Does nothing if
-// the rotation is blocked.
-static void TryRotating(TetrisGameState *s) {
-  short new_piece = piece_rotations[s->current_piece];
-  int x_offset = 0;
-  // First, see if the piece can simply be rotated.
-  if (PieceFits(s, new_piece, s->location_x, s->location_y)) {
-    s->current_piece = new_piece;
-    return;
-  }
-
-  // Perhaps it can be rotated if it gets "pushed" to the side. Try pushing it
-  // to the left first, since getting pushed right seems less likely with the
-  // pieces already being aligned on the left side of their 4x4 boxes.
-  for (x_offset = -1; x_offset > -4; x_offset--) {
-    if (PieceFits(s, new_piece, s->location_x + x_offset, s->location_y)) {
-      s->current_piece = new_piece;
-      s->location_x += x_offset;
-      return;
-    }
-  }
-
-  // Now, see if it can rotate if it's pushed to the right.
-  for (x_offset = 1; x_offset < 4; x_offset++) {
-    if (PieceFits(s, new_piece, s->location_x + x_offset, s->location_y)) {
-      s->current_piece = new_piece;
-      s->location_x += x_offset;
-      return;
-    }
-  }
-
-  // The piece couldn't rotate.
-}
-
-// Moves the piece down until it can't move down any more. Returns the number
-// of rows that it moved down.
-static int MoveDownToContactPosition(TetrisGameState *s) {
-  int to_return = 0;
-  while (TryMovingDown(s)) to_return++;
-  return to_return;
-}
-
-// Must be called after the falling piece can't fall any more, but *before*
-// FinishFallingPiece. Returns 1 if any of the falling piece is above the top
-// of the board.
-static int IsGameOver(TetrisGameState *s) {
-  const char *p = tetris_pieces[s->current_piece];
-  int piece_x, piece_y, board_y;
-  for (piece_y = 0; piece_y < 4; piece_y++) {
-    board_y = s->location_y - piece_y;
-    for (piece_x = 0; piece_x < 4; piece_x++) {
-      if (p[piece_y * 4 + piece_x] == ' ') continue;
-      // We found a non-space part of the current piece that ended up above the
-      // board.
-      if (board_y < 0) return 1;
-    }
-  }
-  return 0;
-}
-
-// Removes the given row from the board, shifting down everything above it.
-static void RemoveRowAndShift(char *board, int row) {
-  int x, y, row_start, i;
-  for (y = row; y > 0; y--) {
-    row_start = y * BLOCKS_WIDE;
-    for (x = 0; x < BLOCKS_WIDE; x++) {
-      i = row_start + x;
-      board[i] = board[i - BLOCKS_WIDE];
-    }
-  }
-  // Clear the top row.
-  for (x = 0; x < BLOCKS_WIDE; x++) {
-    board[x] = ' ';
-  }
-}
-
-// This function checks for completed lines, removes any complete lines, and
-// scores points for lines completed. This must be called after a falling piece
-// has landed and after FinishFallingPiece has finished. However,
-// FinishFallingPiece will modify s->location_y, so the caller is responsible
-// for keeping track of the y position that just landed, and provide it.
-static void CheckForCompleteLines(TetrisDisplay *w, TetrisGameState *s,
-  int fallen_piece_y) {
-  int completed_row_count = 0;
-  int completed_rows[4];
-  int board_x, board_y, row_ok, i;
-
-  for (board_y = fallen_piece_y - 3; board_y <= fallen_piece_y; board_y++) {
-    row_ok = 1;
-    for (board_x = 0; board_x < BLOCKS_WIDE; board_x++) {
-      if (!SpaceAvailable(s->board, board_x, board_y)) continue;
-      row_ok = 0;
-      break;
-    }
-    if (!row_ok) continue;
-    completed_rows[completed_row_count] = board_y;
-    completed_row_count++;
-  }
-  if (completed_row_count == 0) return;
-
-  // Now that we've identified the completed rows, clear the pieces and shift
-  // everything above it down.
-  for (i = 0; i < completed_row_count; i++) {
-    RemoveRowAndShift(s->board, completed_rows[i]);
-  }
-  ClearGameBoard(w);
-  s->lines += completed_row_count;
-  switch (completed_row_count) {
-  case 1:
-    s->score += 100;
-    break;
-  case 2:
-    s->score += 400;
-    break;
-  case 3:
-    s->score += 1600;
-    break;
-  case 4:
-    s->score += 6400;
-    break;
-  default:
-    break;
-  }
-}
-
-// Makes the falling piece "land"; adding its cells to the game board, and
-// generating a new falling piece.
-static void FinishFallingPiece(TetrisGameState *s) {
-  const char *p = tetris_pieces[s->current_piece];
-  int piece_x, piece_y, board_x, board_y;
-  char c;
-  for (piece_y = 0; piece_y < 4; piece_y++) {
-    board_y = s->location_y - piece_y;
-    for (piece_x = 0; piece_x < 4; piece_x++) {
-      c = p[piece_y * 4 + piece_x];
-      board_x = s->location_x + piece_x;
-      if (c == ' ') continue;
-      s->board[board_y * BLOCKS_WIDE + board_x] = c;
-    }
-  }
-
-  // Next, get the new falling piece.
-  s->current_piece = s->next_piece;
-  s->next_piece = RandomNewPiece();
-  s->location_x = BLOCKS_WIDE / 2;
-  s->location_y = PIECE_START_Y;
-}
-
-// This function happens every time either a keypress occurs or
-// MAX_MS_PER_FRAME has elapsed. Takes the time elapsed since the last call to
-// UpdateGameState, the input key that has been pressed (which may be ERR if no
-// key was pressed), and the timer (accumulator) to keep track of when the
-// falling piece needs to be moved down next. Returns 0 on game over.
-static int UpdateGameState(TetrisDisplay *w, TetrisGameState *s, double delta,
-  int input_key, double *down_movement_timer) {
-  int done_falling = 0;
-  int fallen_piece_y = 0;
-  // This is the number of seconds after which the piece moves down regardless
-  // of what has been pressed.
-  double down_movement_threshold = 0.7;
-  // Every 10 lines, the piece speeds up by 1 ms, until it gets to the point of
-  // moving down every frame at ~360 lines. When the threshold hits 0, it's
-  // going to move down every single input event or frame, whichever comes
-  // first!
-  down_movement_threshold -= ((double) (s->lines / 10)) * 0.001;
-
-  // Handle movement or rotation.
+// Translates a curses key code into one of the TETRIS_INPUT_* values expected
+// by UpdateGameState. Keys that don't control the falling piece, including
+// ERR, become TETRIS_INPUT_NONE.
+static int KeyToInput(int input_key) {
   switch (input_key) {
   case (KEY_LEFT):
-    TryMovingLeft(s);
-    break;
+    return TETRIS_INPUT_LEFT;
   case (KEY_RIGHT):
-    TryMovingRight(s);
-    break;
+    return TETRIS_INPUT_RIGHT;
   case (KEY_UP):
-    TryRotating(s);
-    break;
+    return TETRIS_INPUT_ROTATE;
+  case (KEY_DOWN):
+    return TETRIS_INPUT_DOWN;
+  case (KEY_NPAGE):
+    return TETRIS_INPUT_DROP;
+  case ('h'):
+    return TETRIS_INPUT_HOLD;
   default:
-    // This occurs if no key was pressed (input_key == ERR).
     break;
   }
+  return TETRIS_INPUT_NONE;
+}
 
-  // If the input key is page down, move down to the contact position, and then
-  // try moving down again.
-  if (input_key == KEY_NPAGE) {
-    // Increase the score here, just as we would if it moved down one line at
-    // a time.
-    s->score += MoveDownToContactPosition(s);
-
-    // We'll set the input key to KEY_DOWN just to get to the next logical
-    // block and allow the piece to land.
-    input_key = KEY_DOWN;
+// Called after WaitForKey returns KEY_RESIZE. Dragging a terminal's edge
+// sends a stream of them, so this keeps reading them until none has arrived
+// for RESIZE_SETTLE_SECONDS (or deadline_ns, if nonzero, passes), leaving the
+// caller one resize to handle for the whole stream. Any other key is pushed
+// back to be read next. Spectators are still served meanwhile.
+static void CoalesceResizes(TetrisInput *input, uint64_t deadline_ns) {
+  uint64_t settle_ns = 0;
+  int key = KEY_RESIZE;
+  while (1) {
+    if (key == KEY_RESIZE) {
+      settle_ns = MonotonicNanoseconds() + RESIZE_SETTLE_SECONDS * 1e9;
+      if (deadline_ns && (deadline_ns < settle_ns)) settle_ns = deadline_ns;
+    } else if ((key == TETRIS_KEY_EXTRA_FD) && broadcast) {
+      ServiceBroadcast(broadcast);
+    } else {
+      break;
+    }
+    key = WaitForKey(input, settle_ns);
   }
+  // The caller will see the extra fd is ready again on its next wait.
+  if ((key != ERR) && (key != TETRIS_KEY_EXTRA_FD)) ungetch(key);
+}
 
-  // Process downward movement after side-to-side movements or rotations.
-  if (down_movement_threshold < 0.0) down_movement_threshold = 0.0;
-  *down_movement_timer += delta;
-  if ((input_key == KEY_DOWN) ||
-    (*down_movement_timer > down_movement_threshold)) {
-    // We'll get a point every time the piece moves down.
-    s->score++;
-    done_falling = !TryMovingDown(s);
-    *down_movement_timer = 0.0;
-  }
-  if (done_falling) {
-    // It's a game over if the falling piece is at all above the board.
-    if (IsGameOver(s)) return 0;
-    fallen_piece_y = s->location_y;
-    FinishFallingPiece(s);
-    CheckForCompleteLines(w, s, fallen_piece_y);
+// Waits for a key like WaitForKey, looking after the broadcast's spectators
+// whenever they need it in the meantime. A stream of resizes is returned as
+// one KEY_RESIZE.
+static int WaitForPlayerKey(TetrisInput *input, uint64_t deadline_ns) {
+  int key;
+  while (1) {
+    key = WaitForKey(input, deadline_ns);
+    if (key == KEY_RESIZE) CoalesceResizes(input, deadline_ns);
+    if ((key != TETRIS_KEY_EXTRA_FD) || !broadcast) return key;
+    ServiceBroadcast(broadcast);
   }
-  return 1;
 }
 
 // Writes the information about the game being paused to the tetris board.
@@ -679,38 +877,36 @@ static void PrintPauseMessages(TetrisDisplay *windows) {
 // Pauses the game; essentially turns off the movement timer, clears the board
 // display, and waits for the player to press space or q. Returns 0 if the
 // player "unpaused" by pressing 'q' to quit. Quicksaving and quickloading
-// are allowed while paused.
-static int PauseGame(TetrisDisplay *windows, TetrisGameState *s,
-  int immediate_quickload) {
+// are allowed while paused; w is the game's replay recording.
+static int PauseGame(TetrisDisplay *windows, TetrisInput *input,
+  TetrisGameState *s, ReplayWriter *w, int immediate_quickload) {
   int input_key;
   if (immediate_quickload) {
-    TryQuickload(windows, s);
+    TryQuickload(windows, s, w);
   }
 
-  // When paused, switch back to waiting indefinitely for inputs.
-  timeout(-1);
   PrintPauseMessages(windows);
 
-  // Wait for keypresses.
+  // Wait for keypresses. Nothing else happens while paused, so we'll only wake
+  // up early to clear a status message.
   while (1) {
-    input_key = getch();
+    input_key = WaitForPlayerKey(input, StatusDeadline(windows));
     switch (input_key) {
+    case ERR:
+      RefreshAllWindows(windows);
+      break;
     case 's':
       DoQuicksave(windows, s);
       break;
     case 'l':
-      TryQuickload(windows, s);
+      TryQuickload(windows, s, w);
       break;
     case ' ':
-      timeout(MAX_MS_PER_FRAME);
       return 1;
     case KEY_RESIZE:
-      DestroyWindows(windows);
-      CreateWindows(windows);
-      PrintPauseMessages(windows);
+      if (ResizeWindows(windows)) PrintPauseMessages(windows);
       break;
     case 'q':
-      timeout(MAX_MS_PER_FRAME);
       return 0;
     default:
       break;
@@ -720,95 +916,775 @@ static int PauseGame(TetrisDisplay *windows, TetrisGameState *s,
   return 0;
 }
 
+// Returns a seed for a game started without --seed. This only needs to differ
+// between games, not be unpredictable.
+static uint64_t NewRandomSeed(void) {
+  uint64_t seed = MonotonicNanoseconds();
+  seed ^= ((uint64_t) time(NULL)) << 32;
+  seed ^= ((uint64_t) getpid()) << 16;
+  return seed;
+}
+
 // Runs a game until a quit or a game over occurs. Returns 0 on a game over,
 // and nonzero on a quit. The initial_quickload argument should be zero to
 // start a new game, and nonzero if we should attempt to load a quicksave
-// immediately.
-static int RunGame(TetrisDisplay *windows, int initial_quickload) {
+// immediately. The game is advanced by the given scheduler, which keeps
+// counting ticks and missed deadlines across games. New games are recorded if
+// options->record_path is set. If ai isn't NULL, it plays the game, though the
+// player can still move pieces too.
+static int RunGame(TetrisDisplay *windows, TetrisInput *input,
+  TetrisOptions *options, TetrisScheduler *sched, TetrisAI *ai,
+  int initial_quickload) {
   TetrisGameState s;
+  TetrisGameConfig config;
+  ReplayWriter replay;
+  TetrisAIMove move;
+  AIRecordTarget record_target;
   int input_key, quickload_and_pause, should_exit = 0, game_done = 0;
-  double time_delta, last_update_time, pre_pause_delta, down_movement_timer;
-  down_movement_timer = 0.0;
-  last_update_time = CurrentSeconds();
-  if (initial_quickload) {
-    if (TryQuickload(windows, &s)) {
-      PauseGame(windows, &s, 0);
-    } else {
-      InitializeNewGame(&s);
-    }
+  int game_input;
+  double wait_start, wake_time = 0, display_start, display_end;
+  uint64_t deadline, status_deadline, next_move_tick;
+  uint32_t ticks_due, ticks_ahead, move_delay;
+  move_delay = options->tick_rate * AUTOPLAY_MOVE_SECONDS;
+  if (move_delay < 1) move_delay = 1;
+  record_target.windows = windows;
+  record_target.replay = &replay;
+  config.tick_rate = options->tick_rate;
+  config.seed = options->have_seed ? options->seed : NewRandomSeed();
+  config.randomizer = options->randomizer;
+  InitializeNewGame(&s, &config);
+  if (undo.capacity) {
+    ResetUndoRing(&undo);
+    TakeSnapshot(&undo, &s);
+  }
+  replay.file = NULL;
+  if (initial_quickload && TryQuickload(windows, &s, &replay)) {
+    PauseGame(windows, input, &s, &replay, 0);
   } else {
-    InitializeNewGame(&s);
+    // Show the seed, so an interesting game can be played again.
+    StatusPrintf(windows, "Seed: %llu", (unsigned long long) config.seed);
+    if (options->record_path &&
+      !OpenReplayWriter(&replay, options->record_path, &config)) {
+      StatusPrintf(windows, "Recording error: %s", strerror(errno));
+    }
   }
-  // We'll enter non-blocking behavior here, so we can move blocks down without
-  // waiting for keypresses.
-  timeout(MAX_MS_PER_FRAME);
+  ResetScheduler(sched);
+  next_move_tick = s.ticks + move_delay;
   while (!game_done) {
+    // If the main loop is being timed, a frame runs from waking up until the
+    // results have been drawn. Trace events are written between frames.
+    display_start = TraceTime();
     DisplayGameState(windows, &s);
+    display_end = TraceStage(TRACE_STAGE_DISPLAY, display_start);
+    if (display_end && wake_time) {
+      TraceRecord(&instruments.trace.stages, TRACE_STAGE_FRAME, wake_time,
+        display_end);
+    }
+    FlushTraceEvents(windows);
     quickload_and_pause = 0;
-    input_key = getch();
-    time_delta = CurrentSeconds() - last_update_time;
+    // Wait for a keypress, but only until the tick at which gravity moves the
+    // piece, or until the status message needs to be cleared. The ticks in
+    // between don't change anything visible, so there's no reason to wake up
+    // for them. Keypresses are handled as soon as they arrive.
+    ticks_ahead = TicksUntilGravity(&s);
+    if (ai && ((next_move_tick - s.ticks) < ticks_ahead)) {
+      ticks_ahead = next_move_tick - s.ticks;
+    }
+    deadline = PlanWakeup(sched, ticks_ahead);
+    status_deadline = StatusDeadline(windows);
+    if (status_deadline && (status_deadline < deadline)) {
+      deadline = status_deadline;
+    }
+    wait_start = TraceTime();
+    input_key = WaitForPlayerKey(input, deadline);
+    wake_time = TraceStage(TRACE_STAGE_WAIT, wait_start);
+    if (wake_time && (input_key != ERR) && !instruments.pending_key_time) {
+      instruments.pending_key_time = wake_time;
+    }
     switch (input_key) {
+    case ERR:
+      break;
     case 's':
       DoQuicksave(windows, &s);
       break;
+    case 'i':
+      ToggleStatsOverlay(windows);
+      break;
+    case 'u':
+    case 'r':
+      // The restored piece starts over where it appeared, so give the AI its
+      // usual delay before moving it.
+      if (TakeBackPieces(windows, &s, &replay,
+        (input_key == 'u') ? 1 : options->rewind_pieces)) {
+        next_move_tick = s.ticks + move_delay;
+      }
+      break;
     case 'l':
       quickload_and_pause = 1;
       // We'll fall through here; quickloading while the game is running will
       // always result in pausing.
     case ' ':
-      // Keep track of the time prior to the pause keypress to avoid letting
-      // people cheat and slow down blocks by pausing to reduce the
-      // time_delta going into UpdateGameState.
-      pre_pause_delta = CurrentSeconds() - last_update_time;
-      game_done = !PauseGame(windows, &s, quickload_and_pause);
-      last_update_time = CurrentSeconds() - pre_pause_delta;
+      // The gravity timer is part of the game state, so pausing can't be used
+      // to slow down blocks. Only the partial tick in progress is lost.
+      game_done = !PauseGame(windows, input, &s, &replay,
+        quickload_and_pause);
       should_exit = game_done;
-      timeout(MAX_MS_PER_FRAME);
+      ResetScheduler(sched);
+      next_move_tick = s.ticks + move_delay;
+      // Time spent paused isn't part of any frame.
+      wake_time = 0;
       break;
     case KEY_RESIZE:
-      DestroyWindows(windows);
-      CreateWindows(windows);
-      DisplayGameState(windows, &s);
+      ResizeWindows(windows);
       break;
     case 'q':
       game_done = 1;
       should_exit = 1;
       break;
     default:
-      // Any directional movement, no keypress, or some random keypress will
-      // be handled here.
-      game_done = !UpdateGameState(windows, &s, time_delta, input_key,
-        &down_movement_timer);
-      last_update_time = CurrentSeconds();
+      // Any directional movement or some random keypress will be handled
+      // here.
+      game_input = KeyToInput(input_key);
+      RecordGameInput(windows, &replay, s.ticks, game_input);
+      game_done = !UpdateGameState(&s, game_input);
       break;
     }
+    // Run however many ticks came due while waiting. Rendering only happens
+    // once per loop, no matter how many ticks ran.
+    ticks_due = TicksDue(sched);
+    while (!game_done && (ticks_due > 0)) {
+      game_done = !TickGameState(&s);
+      ticks_due--;
+    }
+    if (ai && !game_done && (s.ticks >= next_move_tick)) {
+      // If the piece can't be placed anywhere, gravity will end the game.
+      if (ChooseMove(ai, &s, &move)) {
+        game_done = !PlayMove(&s, &move, RecordAIInput, &record_target);
+      }
+      next_move_tick = s.ticks + move_delay;
+    }
+    // Give the AI time to show each new piece before moving it.
+    if (s.events & TETRIS_EVENT_PIECE_LOCKED) {
+      next_move_tick = s.ticks + move_delay;
+      if (undo.capacity) TakeSnapshot(&undo, &s);
+    }
+    // Removed lines are already covered by s.dirty_rows.
+    s.events = 0;
+    TraceStage(TRACE_STAGE_UPDATE, wake_time);
   }
+  StopRecording(windows, &replay, s.ticks);
   return should_exit;
 }
 
+// Passed to PlayMove, so the AI's inputs are sent to the opponent like the
+// player's.
+static void SendAIInput(uint64_t tick, int input, void *arg) {
+  VersusLocalInput((VersusMatch *) arg, input);
+}
+
+// Returns the message shown when a versus match ends with the given result.
+static const char* VersusResultMessage(int result) {
+  switch (result) {
+  case VERSUS_PLAYING:
+    return "You left the match.";
+  case VERSUS_WON:
+    return "You win!";
+  case VERSUS_LOST:
+    return "You lose!";
+  case VERSUS_DRAW:
+    return "It's a draw!";
+  case VERSUS_OPPONENT_LEFT:
+    return "Your opponent left.";
+  case VERSUS_DESYNCED:
+    return "Error: the games got out of sync.";
+  default:
+    break;
+  }
+  return "Error: the connection failed.";
+}
+
+// Plays the versus match in versus until it's decided, or the player quits
+// with 'q', and then waits for a key. Unlike RunGame, the loop wakes up at
+// every tick, to tell the opponent how far the game has got. If ai isn't NULL,
+// it plays the local player's game.
+static void RunVersusMatch(TetrisDisplay *windows, TetrisInput *input,
+  TetrisScheduler *sched, TetrisAI *ai) {
+  TetrisGameState *s, scratch;
+  TetrisAIMove move;
+  int input_key, quit = 0;
+  uint64_t deadline, status_deadline, next_move_tick;
+  uint32_t ticks_due, move_delay, last_pieces;
+  move_delay = versus->config.tick_rate * AUTOPLAY_MOVE_SECONDS;
+  if (move_delay < 1) move_delay = 1;
+  s = LocalVersusGame(versus);
+  StatusPrintf(windows, "Playing as %s. Seed: %llu",
+    versus->local_player ? "guest" : "host",
+    (unsigned long long) versus->config.seed);
+  ResetScheduler(sched);
+  next_move_tick = s->ticks + move_delay;
+  last_pieces = s->pieces;
+  input->extra_fd = versus->fd;
+  while (!quit && (VersusResult(versus) == VERSUS_PLAYING)) {
+    // A rollback replaces the game, though not where it's stored.
+    s = LocalVersusGame(versus);
+    DisplayGameState(windows, s);
+    FlushTraceEvents(windows);
+    deadline = PlanWakeup(sched, 1);
+    status_deadline = StatusDeadline(windows);
+    if (status_deadline && (status_deadline < deadline)) {
+      deadline = status_deadline;
+    }
+    input->extra_events = POLLIN | (VersusWantsToSend(versus) ? POLLOUT : 0);
+    input_key = WaitForKey(input, deadline);
+    if (input_key == KEY_RESIZE) CoalesceResizes(input, deadline);
+    switch (input_key) {
+    case ERR:
+    case TETRIS_KEY_EXTRA_FD:
+      break;
+    case 'i':
+      ToggleStatsOverlay(windows);
+      break;
+    case KEY_RESIZE:
+      ResizeWindows(windows);
+      break;
+    case 'q':
+      VersusQuit(versus);
+      quit = 1;
+      break;
+    default:
+      VersusLocalInput(versus, KeyToInput(input_key));
+      break;
+    }
+    if (quit) break;
+    // Ticks skipped while waiting for the opponent aren't made up.
+    ticks_due = TicksDue(sched);
+    while (ticks_due > 0) {
+      VersusTick(versus);
+      ticks_due--;
+    }
+    if (ai && (s->ticks >= next_move_tick)) {
+      // The move is played on a copy, since the inputs are applied to the
+      // real game as they're sent.
+      scratch = *s;
+      if (ChooseMove(ai, s, &move)) {
+        PlayMove(&scratch, &move, SendAIInput, versus);
+      }
+      next_move_tick = s->ticks + move_delay;
+    }
+    // Give the AI time to show each new piece before moving it. Counting
+    // pieces, rather than checking s->events, also covers pieces that landed
+    // during a rollback.
+    if (s->pieces != last_pieces) {
+      next_move_tick = s->ticks + move_delay;
+      last_pieces = s->pieces;
+    }
+    s->events = 0;
+    VersusExchange(versus);
+  }
+  input->extra_fd = -1;
+  DisplayGameState(windows, LocalVersusGame(versus));
+  if (quit) return;
+  StatusPrintf(windows, "%s Press any key.",
+    VersusResultMessage(VersusResult(versus)));
+  while (1) {
+    // Keep sending whatever's left, so the opponent sees the same result.
+    input->extra_fd = VersusWantsToSend(versus) ? versus->fd : -1;
+    input->extra_events = POLLOUT;
+    input_key = WaitForKey(input, 0);
+    if (input_key == KEY_RESIZE) CoalesceResizes(input, 0);
+    if (input_key == TETRIS_KEY_EXTRA_FD) {
+      VersusExchange(versus);
+      continue;
+    }
+    if (input_key == KEY_RESIZE) {
+      if (ResizeWindows(windows)) {
+        DisplayGameState(windows, LocalVersusGame(versus));
+      }
+      continue;
+    }
+    if (input_key != ERR) break;
+  }
+  input->extra_fd = -1;
+}
+
+// Loads the replay log at path into r. Prints an error and returns NULL on
+// failure; otherwise returns the log's data, which the caller must free.
+static uint8_t* OpenReplay(const char *path, ReplayReader *r) {
+  size_t size;
+  uint8_t *data = LoadReplayFile(path, &size);
+  if (!data) {
+    printf("Failed reading %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (!InitializeReplayReader(r, data, size)) {
+    printf("%s is not a valid replay log.\n", path);
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+// Prints how a replayed game ended, after curses has been shut down.
+static void PrintReplaySummary(ReplayReader *r, TetrisGameState *s) {
+  printf("Replayed %llu ticks: score %u, %u lines.\n",
+    (unsigned long long) s->ticks, s->score, s->lines);
+  if (r->truncated) printf("Warning: the replay log ended early.\n");
+}
+
+// Plays a replay log as fast as possible, without a display, and prints the
+// final result. Returns the process exit status.
+static int RunHeadlessReplay(const char *path) {
+  TetrisGameState s;
+  ReplayReader r;
+  uint64_t start_time, elapsed;
+  uint8_t *data = OpenReplay(path, &r);
+  if (!data) return 1;
+  start_time = MonotonicNanoseconds();
+  StartReplay(&r, &s);
+  while (StepReplay(&r, &s)) continue;
+  elapsed = MonotonicNanoseconds() - start_time;
+  PrintReplaySummary(&r, &s);
+  printf("Took %.3f ms.\n", ((double) elapsed) / 1e6);
+  free(data);
+  return r.truncated ? 1 : 0;
+}
+
+// Shows a replay at the speed it was recorded, stepping it with the scheduler.
+// Returns once the replay ends and the player presses a key, or the player
+// quits early with 'q'.
+static void RunRealtimeReplay(TetrisDisplay *windows, TetrisInput *input,
+  TetrisScheduler *sched, ReplayReader *r, TetrisGameState *s) {
+  int input_key, replay_done = 0;
+  uint32_t ticks_due, ticks_ahead;
+  uint64_t deadline, status_deadline;
+  StartReplay(r, s);
+  StatusPrintf(windows, "Replaying. Press q to stop.");
+  ResetScheduler(sched);
+  while (!replay_done) {
+    DisplayGameState(windows, s);
+    // As when playing, only wake up when something visible can change: at the
+    // next gravity step or the next recorded input.
+    ticks_ahead = TicksUntilGravity(s);
+    if (r->has_pending && (r->pending_tick - s->ticks < ticks_ahead)) {
+      ticks_ahead = r->pending_tick - s->ticks;
+    }
+    deadline = PlanWakeup(sched, ticks_ahead);
+    status_deadline = StatusDeadline(windows);
+    if (status_deadline && (status_deadline < deadline)) {
+      deadline = status_deadline;
+    }
+    input_key = WaitForPlayerKey(input, deadline);
+    switch (input_key) {
+    case 'q':
+      return;
+    case KEY_RESIZE:
+      ResizeWindows(windows);
+      break;
+    default:
+      break;
+    }
+    ticks_due = TicksDue(sched);
+    while (!replay_done && (ticks_due > 0)) {
+      replay_done = !StepReplay(r, s);
+      ticks_due--;
+    }
+    s->events = 0;
+  }
+  DisplayGameState(windows, s);
+  StatusPrintf(windows, "Replay finished. Press any key.");
+  RefreshAllWindows(windows);
+  while (1) {
+    input_key = WaitForPlayerKey(input, 0);
+    if (input_key == KEY_RESIZE) {
+      if (ResizeWindows(windows)) DisplayGameState(windows, s);
+      continue;
+    }
+    if (input_key != ERR) break;
+  }
+}
+
+// Finishes the trace file, if there is one, after curses has been shut down.
+static void FinishTrace(void) {
+  if (!CloseTraceFile(&instruments.trace)) {
+    printf("Failed writing the trace: %s\n", strerror(errno));
+  }
+}
+
+// Disconnects the spectators, if there's a broadcast, and prints how it went,
+// after curses has been shut down.
+static void FinishBroadcast(void) {
+  if (!broadcast) return;
+  StopBroadcast(broadcast);
+  printf("Broadcast %llu frames, %.1f bytes each on average, to %llu "
+    "spectators (at most %d at once). Sent %llu keyframes, encoding %llu.\n",
+    (unsigned long long) broadcast->frames, broadcast->frames ?
+    (((double) broadcast->frame_bytes) / broadcast->frames) : 0.0,
+    (unsigned long long) broadcast->spectators, broadcast->most_clients,
+    (unsigned long long) broadcast->keyframes_sent,
+    (unsigned long long) broadcast->keyframes);
+}
+
+// Takes over the terminal, and draws the empty board. This is only done once
+// the arguments show the game will be displayed, so headless runs never load
+// the locale or the terminal's description. Exits on error.
+static void StartDisplay(TetrisDisplay *windows, TetrisInput *input,
+  TetrisOptions *options) {
+  if (!setlocale(LC_ALL, "")) {
+    printf("Failed setting locale: %s\n", strerror(errno));
+    exit(1);
+  }
+  SetupCurses(options->batched_output);
+  InitializeInput(input);
+  if (broadcast) {
+    input->extra_fd = broadcast->epoll_fd;
+    input->extra_events = POLLIN;
+  }
+  CreateWindows(windows);
+}
+
+static void PrintVersion(void) {
+  printf("ncurses_tetris %s (%dx%d board, replay format %d, save format "
+    "%d)\n", TETRIS_VERSION, BLOCKS_WIDE, BLOCKS_TALL, REPLAY_VERSION,
+    SAVE_VERSION);
+}
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s [options]\n"
+    "Options:\n"
+    "  --tick-rate <rate>: Run the game at <rate> ticks per second. Must be\n"
+    "    between 1 and 1000. Defaults to %d.\n"
+    "  --seed <seed>: Start every game with the given random seed, rather\n"
+    "    than a new one each game.\n"
+    "  --randomizer <weighted|bag>: Choose each piece independently\n"
+    "    (weighted, the default), or deal pieces from shuffled bags of all 7\n"
+    "    (bag).\n"
+    "  --record <file>: Record each new game to the replay log <file>,\n"
+    "    replacing the previous game's log.\n"
+    "  --replay <file>: Replay the log in <file> as fast as possible, and\n"
+    "    print the result.\n"
+    "  --realtime: With --replay, show the replay at its recorded speed.\n"
+    "  --autoplay: Let the AI play every game.\n"
+    "  --trace <file>: Write the time taken by each stage of the main loop\n"
+    "    to <file>, as Chrome trace-event JSON.\n"
+    "  --batched-output: Tune screen updates for slow links: send each one\n"
+    "    with a single write(), and never stop one partway.\n"
+    "  --undo-depth <pieces>: The number of pieces that can be taken back.\n"
+    "    Defaults to %d; 0 turns undo off.\n"
+    "  --rewind <pieces>: The number of pieces the 'r' key takes back.\n"
+    "    Defaults to %d.\n"
+    "  --preview <pieces>: The number of upcoming pieces shown, from 1 to\n"
+    "    %d. Defaults to %d.\n"
+    "  --versus-host <port>: Wait for an opponent to connect on <port>, and\n"
+    "    play a versus match against them, with this game's settings.\n"
+    "  --versus-connect <host[:port]>: Play a versus match against the\n"
+    "    opponent hosting one at <host>. The port defaults to %d.\n"
+    "  --broadcast <port>: Let spectators watch with telnet on <port>.\n"
+    "  --max-spectators <count>: The most spectators watching at once.\n"
+    "    Defaults to %d.\n"
+    "  --version: Print the version and exit.\n",
+    program_name, DEFAULT_TICK_RATE, DEFAULT_UNDO_DEPTH,
+    DEFAULT_REWIND_PIECES, TETRIS_MAX_PREVIEW, DEFAULT_PREVIEW_PIECES,
+    DEFAULT_VERSUS_PORT, DEFAULT_MAX_SPECTATORS);
+}
+
+// Parses the command-line arguments into options. Returns 0 and prints a
+// usage message if the arguments are invalid.
+static int ParseArguments(int argc, char **argv, TetrisOptions *options) {
+  int i;
+  char *end = NULL;
+  long value;
+  memset(options, 0, sizeof(*options));
+  options->tick_rate = DEFAULT_TICK_RATE;
+  options->randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+  options->undo_depth = DEFAULT_UNDO_DEPTH;
+  options->rewind_pieces = DEFAULT_REWIND_PIECES;
+  options->max_spectators = DEFAULT_MAX_SPECTATORS;
+  options->preview_pieces = DEFAULT_PREVIEW_PIECES;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--tick-rate") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (value < 1) || (value > 1000)) {
+        printf("Invalid tick rate: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->tick_rate = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--seed") == 0) && ((i + 1) < argc)) {
+      i++;
+      errno = 0;
+      options->seed = strtoull(argv[i], &end, 0);
+      if ((*end != 0) || (end == argv[i]) || (errno != 0)) {
+        printf("Invalid seed: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->have_seed = 1;
+      continue;
+    }
+    if ((strcmp(argv[i], "--randomizer") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (strcmp(argv[i], "weighted") == 0) {
+        options->randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+      } else if (strcmp(argv[i], "bag") == 0) {
+        options->randomizer = TETRIS_RANDOMIZER_BAG;
+      } else {
+        printf("Invalid randomizer: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      continue;
+    }
+    if ((strcmp(argv[i], "--record") == 0) && ((i + 1) < argc)) {
+      i++;
+      options->record_path = argv[i];
+      continue;
+    }
+    if ((strcmp(argv[i], "--replay") == 0) && ((i + 1) < argc)) {
+      i++;
+      options->replay_path = argv[i];
+      continue;
+    }
+    if (strcmp(argv[i], "--realtime") == 0) {
+      options->realtime = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--autoplay") == 0) {
+      options->autoplay = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--batched-output") == 0) {
+      options->batched_output = 1;
+      continue;
+    }
+    if ((strcmp(argv[i], "--undo-depth") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 0) ||
+        (value > 1000000)) {
+        printf("Invalid undo depth: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->undo_depth = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--rewind") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 1) ||
+        (value > 1000000)) {
+        printf("Invalid rewind length: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->rewind_pieces = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--versus-host") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 1) || (value > 65535)) {
+        printf("Invalid port: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->versus_port = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--versus-connect") == 0) && ((i + 1) < argc)) {
+      i++;
+      options->versus_address = argv[i];
+      continue;
+    }
+    if ((strcmp(argv[i], "--broadcast") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 1) || (value > 65535)) {
+        printf("Invalid port: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->broadcast_port = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--max-spectators") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 1) ||
+        (value > 1000000)) {
+        printf("Invalid spectator count: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->max_spectators = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--preview") == 0) && ((i + 1) < argc)) {
+      i++;
+      value = strtol(argv[i], &end, 10);
+      if ((*end != 0) || (end == argv[i]) || (value < 1) ||
+        (value > TETRIS_MAX_PREVIEW)) {
+        printf("Invalid preview length: %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      options->preview_pieces = value;
+      continue;
+    }
+    if (strcmp(argv[i], "--version") == 0) {
+      options->print_version = 1;
+      continue;
+    }
+    if ((strcmp(argv[i], "--trace") == 0) && ((i + 1) < argc)) {
+      i++;
+      options->trace_path = argv[i];
+      continue;
+    }
+    printf("Invalid argument: %s\n", argv[i]);
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  if (options->realtime && !options->replay_path) {
+    printf("--realtime requires --replay.\n");
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  if (options->record_path && options->replay_path) {
+    printf("--record can't be used with --replay.\n");
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  if (options->versus_port && options->versus_address) {
+    printf("--versus-host can't be used with --versus-connect.\n");
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  if ((options->versus_port || options->versus_address) &&
+    (options->record_path || options->replay_path)) {
+    printf("Versus matches can't be recorded or replayed.\n");
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  // The frontend only waits on one connection besides the terminal.
+  if (options->broadcast_port &&
+    (options->versus_port || options->versus_address)) {
+    printf("Versus matches can't be broadcast.\n");
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  return 1;
+}
+
 int main(int argc, char **argv) {
   TetrisDisplay windows;
+  TetrisOptions options;
+  TetrisScheduler sched;
+  TetrisInput input;
+  TetrisGameState replay_state;
+  TetrisGameConfig config;
+  ReplayReader replay;
+  TetrisAI ai_player, *ai = NULL;
+  uint8_t *replay_data = NULL;
   int input_key, should_exit;
-  srand(time(NULL));
-  if (!setlocale(LC_ALL, "")) {
-    printf("Failed setting locale: %s\n", strerror(errno));
+  if (!ParseArguments(argc, argv, &options)) return 1;
+  // Modes that never display anything return before StartDisplay, and do as
+  // little else as they can, since they may be run many times by scripts.
+  if (options.print_version) {
+    PrintVersion();
+    return 0;
+  }
+  if (options.replay_path) {
+    if (!options.realtime) return RunHeadlessReplay(options.replay_path);
+    replay_data = OpenReplay(options.replay_path, &replay);
+    if (!replay_data) return 1;
+    // Replays run at the rate they were recorded at.
+    options.tick_rate = replay.config.tick_rate;
+  }
+  // Connect to the opponent before starting curses, so the progress and any
+  // errors are printed normally.
+  if (options.versus_port || options.versus_address) {
+    config.tick_rate = options.tick_rate;
+    config.seed = options.have_seed ? options.seed : NewRandomSeed();
+    config.randomizer = options.randomizer;
+    if (options.versus_port) {
+      if (!HostVersusMatch(&versus_match, options.versus_port, &config)) {
+        return 1;
+      }
+    } else if (!JoinVersusMatch(&versus_match, options.versus_address)) {
+      return 1;
+    }
+    versus = &versus_match;
+    // The guest plays at the host's rate.
+    options.tick_rate = versus->config.tick_rate;
+    // Pieces can't be taken back in a versus match.
+    options.undo_depth = 0;
+  }
+  InitializeScheduler(&sched, options.tick_rate);
+  preview_pieces = options.preview_pieces;
+  if (options.autoplay) {
+    InitializeAI(&ai_player, NULL);
+    ai = &ai_player;
+  }
+  InitializeTrace(&instruments.trace);
+  // Without this, the output per refresh just isn't counted.
+  OpenWriteCounters(&instruments.trace);
+  if (options.trace_path &&
+    !OpenTraceFile(&instruments.trace, options.trace_path, CurrentSeconds())) {
+    printf("Failed creating %s: %s\n", options.trace_path, strerror(errno));
     return 1;
   }
-  SetupCurses();
-  CreateWindows(&windows);
+  // The history is allocated once, so playing never allocates memory for it.
+  if (options.undo_depth && !CreateUndoRing(&undo, options.undo_depth)) {
+    printf("Failed allocating the undo history: %s\n", strerror(errno));
+    return 1;
+  }
+  if (options.broadcast_port) {
+    if (!StartBroadcast(&broadcast_state, options.broadcast_port,
+      options.max_spectators)) {
+      return 1;
+    }
+    broadcast = &broadcast_state;
+  }
+  StartDisplay(&windows, &input, &options);
+  if (replay_data) {
+    RunRealtimeReplay(&windows, &input, &sched, &replay, &replay_state);
+    DestroyWindows(&windows);
+    DestroyInput(&input);
+    endwin();
+    FinishTrace();
+    FinishBroadcast();
+    PrintReplaySummary(&replay, &replay_state);
+    free(replay_data);
+    return 0;
+  }
+  if (versus) {
+    RunVersusMatch(&windows, &input, &sched, ai);
+    DestroyWindows(&windows);
+    DestroyInput(&input);
+    endwin();
+    FinishTrace();
+    printf("%s\n", VersusResultMessage(VersusResult(versus)));
+    printf("Rolled back %llu times, replaying %llu ticks; waited %llu ticks "
+      "for the opponent.\n", (unsigned long long) versus->rollbacks,
+      (unsigned long long) versus->rollback_ticks,
+      (unsigned long long) versus->stalls);
+    CloseVersusMatch(versus);
+    return 0;
+  }
   // This loop controls the game over / new game screen, where we initially
   // start.
   should_exit = 0;
   while (!should_exit) {
-    // Re-enable blocking behavior for getch if we just exited a game.
-    timeout(-1);
     CheckCursesError(mvwprintw(windows.game, 9, 6, "Press space"));
     CheckCursesError(mvwprintw(windows.game, 10, 7, "to start!"));
     RefreshAllWindows(&windows);
-    input_key = getch();
+    input_key = WaitForPlayerKey(&input, 0);
     switch (input_key) {
     case (' '):
-      should_exit = RunGame(&windows, 0);
+      should_exit = RunGame(&windows, &input, &options, &sched, ai, 0);
       if (!should_exit) {
         StatusPrintf(&windows, "Game over!");
         RefreshAllWindows(&windows);
@@ -818,7 +1694,7 @@ int main(int argc, char **argv) {
     case ('l'):
       // Here, we just call RunGame like normal, except instruct it to
       // immediately try loading the quicksave if it exists.
-      should_exit = RunGame(&windows, 1);
+      should_exit = RunGame(&windows, &input, &options, &sched, ai, 1);
       if (!should_exit) {
         StatusPrintf(&windows, "Game over!");
         RefreshAllWindows(&windows);
@@ -829,15 +1705,32 @@ int main(int argc, char **argv) {
       should_exit = 1;
       break;
     case (KEY_RESIZE):
-      DestroyWindows(&windows);
-      CreateWindows(&windows);
+      ResizeWindows(&windows);
       break;
     default:
       break;
     }
   }
   DestroyWindows(&windows);
+  DestroyInput(&input);
   endwin();
+  FinishTrace();
+  if (undo.capacity) DestroyUndoRing(&undo);
   printf("Tetris exited normally!\n");
+  FinishBroadcast();
+  printf("Missed %llu of %llu tick deadlines.\n",
+    (unsigned long long) sched.missed, (unsigned long long) sched.ticks);
+  if (instruments.refreshes_counted) {
+    printf("Refreshes wrote %.1f bytes in %.2f writes on average, over %llu "
+      "refreshes.\n", ((double) instruments.bytes_written) /
+      instruments.refreshes_counted, ((double) instruments.writes_made) /
+      instruments.refreshes_counted,
+      (unsigned long long) instruments.refreshes_counted);
+  }
+  if (ai && ai->search_ns) {
+    printf("AI evaluated %llu placements, %.0f per second.\n",
+      (unsigned long long) ai->placements_evaluated,
+      ((double) ai->placements_evaluated) / (((double) ai->search_ns) / 1e9));
+  }
   return 0;
 }
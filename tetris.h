@@ -1,16 +1,10 @@
 #ifndef TETRIS_H
 #define TETRIS_H
 // We'll use this file to contain commonly-accessed struct definitions from
-// tetris.c.
+// tetris.c. The game rules themselves are in tetris_engine.h.
 #include <curses.h>
-
-// The width and height of the area where the blocks go, in blocks rather than
-// characters.
-#define BLOCKS_WIDE (10)
-#define BLOCKS_TALL (20)
-
-// This is the y position a piece spawns at when entering the board.
-#define PIECE_START_Y (-1)
+#include "tetris_engine.h"
+#include "tetris_trace.h"
 
 // This struct keeps track of the tetris display windows from ncurses.
 typedef struct {
@@ -27,6 +21,14 @@ typedef struct {
   WINDOW *line_count;
   // The window showing a preview of the next piece.
   WINDOW *next_piece;
+  // The window showing the held piece.
+  WINDOW *hold;
+  // The window showing the previewed pieces after the next one, or NULL if
+  // only the next piece is previewed.
+  WINDOW *queue;
+  // In a versus match, the window showing the opponent's board, laid out like
+  // the game window; otherwise NULL.
+  WINDOW *opponent;
   // The status message to be displayed. strlen(status_message) must be 0 if no
   // message should be displayed.
   char status_message[40];
@@ -34,143 +36,91 @@ typedef struct {
   // we can automatically clear the status message after a certain amount of
   // time has elapsed.
   double status_start_time;
+  // If nonzero, the next DisplayGameState will redraw everything rather than
+  // only what changed. Set whenever the windows' contents are lost.
+  int redraw_all;
+  // The next piece, score, and line count last drawn by DisplayGameState, so
+  // they're only redrawn when they change. Likewise for the held piece and
+  // the queue window's pieces (from drawn_queue[1]), which are -1 if none is
+  // drawn.
+  short drawn_next_piece;
+  short drawn_hold_piece;
+  short drawn_queue[TETRIS_MAX_PREVIEW];
+  unsigned drawn_score;
+  unsigned drawn_lines;
+  // The piece and location of the ghost piece last drawn, or -1 in
+  // drawn_ghost_piece if it hasn't been drawn in the current windows.
+  short drawn_ghost_piece;
+  int drawn_ghost_x;
+  int drawn_ghost_y;
+  // If nonzero, the next DisplayGameState redraws the whole opponent window.
+  // The opponent's lines and the garbage waiting for each player, as last
+  // drawn.
+  int redraw_opponent;
+  unsigned drawn_opponent_lines;
+  uint32_t drawn_incoming;
+  uint32_t drawn_opponent_incoming;
 } TetrisDisplay;
 
-// This holds everything we need to know about the current state of an ongoing
-// game.
+// The state of the optional instrumentation of the main loop. It's kept apart
+// from TetrisDisplay, which is cleared whenever the windows are recreated.
 typedef struct {
-  // Holds the state of the entire board. If a cell is empty, it must contain a
-  // space character. It is invalid for a cell to contain a nonprintable
-  // character or whitespace other than ' '. In any case except for ' ', the
-  // cell is occupied, and this must contain the character to draw to the
-  // screen when drawing the cell. Note that cells are drawn as two characters
-  // wide, so each character in this array will be printed twice when drawing
-  // the board. This starts from the TOP row in the window that's displayed.
-  char board[BLOCKS_WIDE * BLOCKS_TALL];
-  // The ID of the next piece that will be generated; the index into the
-  // tetris_pieces array.
-  short next_piece;
-  // The x and y location of the current piece being dropped into the board, in
-  // a cell coordinate rather than a window character.  Note that these
-  // coordinates refer to the *bottom left* of the falling piece on the board!
-  int location_x;
-  int location_y;
-  // The piece that is currently "falling". Once again, it's an index into the
-  // tetris_pieces array.
-  short current_piece;
-  // The player's current score.
-  unsigned score;
-  // The number of lines the player has completed.
-  unsigned lines;
-} TetrisGameState;
-
-// We statically define each piece as a 16-byte strings here. Note that when
-// the game is being rendered, the widths of these will be doubled. This
-// contains all pieces along with their rotations. There are 19 of them. Note
-// that the pieces in this array are "upside down", with the bottom row first.
-static const char *tetris_pieces[] = {
-  // 0:
-  "===="
-  "    "
-  "    "
-  "    ",
-  // 1:
-  "=   "
-  "=   "
-  "=   "
-  "=   ",
-  // 2:
-  "HH  "
-  "HH  "
-  "    "
-  "    ",
-  // 3:
-  "N   "
-  "NN  "
-  " N  "
-  "    ",
-  // 4:
-  " NN "
-  "NN  "
-  "    "
-  "    ",
-  // 5:
-  " Z  "
-  "ZZ  "
-  "Z   "
-  "    ",
-  // 6:
-  "ZZ  "
-  " ZZ "
-  "    "
-  "    ",
-  // 7:
-  " #  "
-  "### "
-  "    "
-  "    ",
-  // 8:
-  "#   "
-  "##  "
-  "#   "
-  "    ",
-  // 9:
-  "### "
-  " #  "
-  "    "
-  "    ",
-  // 10:
-  " #  "
-  "##  "
-  " #  "
-  "    ",
-  // 11:
-  "@   "
-  "@   "
-  "@@  "
-  "    ",
-  // 12:
-  "@@@ "
-  "@   "
-  "    "
-  "    ",
-  // 13:
-  "@@  "
-  " @  "
-  " @  "
-  "    ",
-  // 14:
-  "  @ "
-  "@@@ "
-  "    "
-  "    ",
-  // 15:
-  " O  "
-  " O  "
-  "OO  "
-  "    ",
-  // 16:
-  "O   "
-  "OOO "
-  "    "
-  "    ",
-  // 17:
-  "OO  "
-  "O   "
-  "O   "
-  "    ",
-  // 18:
-  "OOO "
-  "  O "
-  "    "
-  "    ",
-};
+  TetrisTrace trace;
+  // If nonzero, the status line shows the frame time and key-to-screen
+  // latency stats when there's no status message.
+  int show_stats;
+  // The stats shown in the status line, and the time at which they're next
+  // recomputed.
+  char stats_text[40];
+  double stats_update_time;
+  // The time at which the oldest key not yet shown on the screen was read, or
+  // 0 if every key has been shown.
+  double pending_key_time;
+  // The number of refreshes whose output was counted, and the bytes and
+  // write() calls they took in total.
+  uint64_t refreshes_counted;
+  uint64_t bytes_written;
+  uint64_t writes_made;
+} TetrisInstruments;
 
-// This is how we look up rotations. If the current piece is at index i in the
-// tetris_pieces array, then piece_rotations[i] gives the index of its next
-// rotation in the tetris_pieces array.
-static char piece_rotations[] = {1, 0, 2, 4, 3, 6, 5, 8, 9, 10, 7, 12, 13, 14,
-  11, 16, 17, 18, 15};
+// Holds the settings chosen on the command line.
+typedef struct {
+  // The number of game ticks to run per second.
+  uint32_t tick_rate;
+  // If have_seed is nonzero, every game starts with this seed.
+  int have_seed;
+  uint64_t seed;
+  // The TETRIS_RANDOMIZER_* value to use for new games.
+  int randomizer;
+  // If non-NULL, each new game is recorded to this replay log.
+  const char *record_path;
+  // If non-NULL, the replay log to play back instead of running the game.
+  // The replay is only shown, at its recorded speed, if realtime is nonzero.
+  const char *replay_path;
+  int realtime;
+  // If nonzero, the AI plays every game.
+  int autoplay;
+  // If non-NULL, the file to write a trace of the main loop's timing to.
+  const char *trace_path;
+  // If nonzero, curses is set up to send each refresh in as few writes as it
+  // can; see SetupCurses.
+  int batched_output;
+  // The number of pieces the undo history keeps, or 0 to turn it off, and
+  // the number of pieces the 'r' key takes back.
+  int undo_depth;
+  int rewind_pieces;
+  // If versus_port is nonzero, a versus match is hosted on that port. If
+  // versus_address isn't NULL, the versus match hosted there is joined.
+  int versus_port;
+  const char *versus_address;
+  // If broadcast_port is nonzero, spectators can watch on that port, up to
+  // max_spectators at once.
+  int broadcast_port;
+  int max_spectators;
+  // The number of upcoming pieces shown, from 1 to TETRIS_MAX_PREVIEW.
+  int preview_pieces;
+  // If nonzero, the version is printed, and nothing else is done.
+  int print_version;
+} TetrisOptions;
 
 #endif  // TETRIS_H
-
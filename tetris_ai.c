@@ -0,0 +1,286 @@
+// Implements the AI player described in tetris_ai.h. The search only ever
+// looks at the row bitmasks and column heights of the board, and uses the
+// engine's own PieceFits, RotatedX and PieceLandingY, so it finds exactly the
+// placements a player could reach.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_ai.h"
+#include "tetris_sched.h"
+
+// The most placements a single piece can have: 4 rotations in each column.
+#define MAX_PLACEMENTS (4 * BLOCKS_WIDE)
+
+// The score given to a placement that ends the game. It's low enough that
+// any other placement is preferred.
+#define GAME_OVER_SCORE (-1e30)
+
+void DefaultAIWeights(TetrisAIWeights *weights) {
+  weights->aggregate_height = -0.510066;
+  weights->holes = -0.35663;
+  weights->bumpiness = -0.184483;
+  weights->lines = 0.760666;
+}
+
+int ParseAIWeights(const char *text, TetrisAIWeights *weights) {
+  TetrisAIWeights parsed;
+  int length = 0;
+  if (sscanf(text, "%lf,%lf,%lf,%lf%n", &parsed.aggregate_height,
+    &parsed.holes, &parsed.bumpiness, &parsed.lines, &length) != 4) {
+    return 0;
+  }
+  if (text[length] != 0) return 0;
+  *weights = parsed;
+  return 1;
+}
+
+void InitializeAI(TetrisAI *ai, const TetrisAIWeights *weights) {
+  memset(ai, 0, sizeof(*ai));
+  ai->evaluator = GetAIEvaluator(NULL);
+  if (weights) {
+    ai->weights = *weights;
+  } else {
+    DefaultAIWeights(&ai->weights);
+  }
+}
+
+// Cache keys are a board's hash mixed with a multiple of this, chosen by the
+// next piece. It's odd, so every piece gets a different multiple, and none of
+// them are 0, so the empty board (whose hash is 0) never matches an unused
+// entry.
+#define CACHE_KEY_SALT (0x9e3779b97f4a7c15ULL)
+
+int CreateAICache(TetrisAICache *cache, int bits) {
+  uint64_t count = ((uint64_t) 1) << bits;
+  cache->entries = (TetrisAICacheEntry *) calloc(count,
+    sizeof(TetrisAICacheEntry));
+  if (!cache->entries) return 0;
+  cache->mask = count - 1;
+  return 1;
+}
+
+void DestroyAICache(TetrisAICache *cache) {
+  free(cache->entries);
+  cache->entries = NULL;
+}
+
+// Looks up the score stored with the given key. Returns 0 if it isn't in the
+// cache.
+static int CacheLookup(TetrisAICache *cache, uint64_t key, double *score) {
+  TetrisAICacheEntry *entry;
+  uint64_t value;
+  entry = cache->entries + (key & cache->mask);
+  value = atomic_load_explicit(&entry->value, memory_order_relaxed);
+  if ((atomic_load_explicit(&entry->check, memory_order_relaxed) ^ value) !=
+    key) {
+    return 0;
+  }
+  memcpy(score, &value, sizeof(value));
+  return 1;
+}
+
+// Stores a score with the given key, replacing whatever was in its entry.
+static void CacheStore(TetrisAICache *cache, uint64_t key, double score) {
+  TetrisAICacheEntry *entry;
+  uint64_t value;
+  memcpy(&value, &score, sizeof(value));
+  entry = cache->entries + (key & cache->mask);
+  atomic_store_explicit(&entry->value, value, memory_order_relaxed);
+  atomic_store_explicit(&entry->check, key ^ value, memory_order_relaxed);
+}
+
+// Copies the parts of the board used by the search from one state to another.
+static void CopyBoard(TetrisGameState *to, TetrisGameState *from) {
+  memcpy(to->rows, from->rows, sizeof(to->rows));
+  memcpy(to->column_tops, from->column_tops, sizeof(to->column_tops));
+  to->board_hash = from->board_hash;
+}
+
+// Adds the piece at the given location to the board in b, and removes any
+// completed rows. Returns the number of rows removed, or -1 if part of the
+// piece is above the board, which would end the game.
+static int LockPiece(TetrisGameState *b, short piece, int x, int y) {
+  const uint16_t *masks = piece_row_masks[piece];
+  const TetrisPieceInfo *info = piece_info + piece;
+  int i, src, dst, column, lines = 0;
+  if ((y - info->height + 1) < 0) return -1;
+  for (i = 0; i < info->height; i++) {
+    b->rows[y - i] |= masks[i] << x;
+    if (b->rows[y - i] == FULL_ROW_MASK) lines++;
+  }
+  for (i = 0; i < 4; i++) {
+    b->board_hash ^= zobrist_cells[y - info->cell_y[i]][x + info->cell_x[i]];
+  }
+  if (!lines) {
+    for (i = 0; i < 4; i++) {
+      column = x + info->cell_x[i];
+      if ((y - info->cell_y[i]) < b->column_tops[column]) {
+        b->column_tops[column] = y - info->cell_y[i];
+      }
+    }
+    return 0;
+  }
+  // Nothing below the piece can be complete, so compact the rows from the
+  // bottom of the piece upwards.
+  dst = y;
+  for (src = y; src >= 0; src--) {
+    if (b->rows[src] == FULL_ROW_MASK) continue;
+    b->rows[dst] = b->rows[src];
+    dst--;
+  }
+  for (; dst >= 0; dst--) b->rows[dst] = 0;
+  RecomputeColumnTops(b);
+  b->board_hash = BoardHash(b->rows);
+  return lines;
+}
+
+// Adds a copy of the board in b to the batch, with the piece at the given
+// location added and any completed rows removed. Returns the number of rows
+// removed, or -1 (without adding the board) if part of the piece is above the
+// board.
+static int AddToBatch(TetrisAIBatch *batch, TetrisGameState *b, short piece,
+  int x, int y) {
+  const uint16_t *masks = piece_row_masks[piece];
+  const TetrisPieceInfo *info = piece_info + piece;
+  int i, src, dst, lines = 0, lane = batch->count;
+  uint16_t row;
+  if ((y - info->height + 1) < 0) return -1;
+  for (i = 0; i < BLOCKS_TALL; i++) batch->rows[i][lane] = b->rows[i];
+  for (i = 0; i < info->height; i++) {
+    row = b->rows[y - i] | (masks[i] << x);
+    batch->rows[y - i][lane] = row;
+    if (row == FULL_ROW_MASK) lines++;
+  }
+  if (lines) {
+    dst = y;
+    for (src = y; src >= 0; src--) {
+      row = batch->rows[src][lane];
+      if (row == FULL_ROW_MASK) continue;
+      batch->rows[dst][lane] = row;
+      dst--;
+    }
+    for (; dst >= 0; dst--) batch->rows[dst][lane] = 0;
+  }
+  batch->count++;
+  return lines;
+}
+
+// Fills moves with every placement of the given piece that can be reached from
+// (x, y) on the board in b, by rotating and then moving sideways. Returns the
+// number of placements. Only the rotations, x, piece, and y of the moves are
+// filled in.
+static int ListPlacements(TetrisGameState *b, short piece, int x, int y,
+  TetrisAIMove *moves) {
+  int count = 0, rotations = 0, column;
+  short first_piece = piece;
+  if (!PieceFits(b, piece, x, y)) return 0;
+  while (1) {
+    // Every column reachable by moving left from here, then right.
+    for (column = x; PieceFits(b, piece, column, y); column--) {
+      moves[count].rotations = rotations;
+      moves[count].x = column;
+      moves[count].piece = piece;
+      moves[count].y = PieceLandingY(b, piece, column, y);
+      count++;
+    }
+    for (column = x + 1; PieceFits(b, piece, column, y); column++) {
+      moves[count].rotations = rotations;
+      moves[count].x = column;
+      moves[count].piece = piece;
+      moves[count].y = PieceLandingY(b, piece, column, y);
+      count++;
+    }
+    // Rotate, just as TryRotating would.
+    if (piece_rotations[piece] == first_piece) break;
+    x = RotatedX(b, piece_rotations[piece], x, y);
+    if (x < 0) break;
+    piece = piece_rotations[piece];
+    rotations++;
+  }
+  return count;
+}
+
+int ChooseMove(TetrisAI *ai, TetrisGameState *s, TetrisAIMove *move) {
+  TetrisAIMove moves[MAX_PLACEMENTS], next_moves[MAX_PLACEMENTS];
+  TetrisGameState *after_current = &ai->scratch;
+  TetrisAIBatch *batch = &ai->batch;
+  TetrisAIWeights *w = &ai->weights;
+  int batch_lines[AI_BATCH_SIZE];
+  int count, next_count, i, j, lines, next_lines, best = -1;
+  short next_piece = QueuedPiece(s, 0);
+  double score, lookahead;
+  uint64_t key;
+  uint64_t start_time = MonotonicNanoseconds();
+  count = ListPlacements(s, s->current_piece, s->location_x, s->location_y,
+    moves);
+  for (i = 0; i < count; i++) {
+    CopyBoard(after_current, s);
+    lines = LockPiece(after_current, moves[i].piece, moves[i].x, moves[i].y);
+    ai->placements_evaluated++;
+    moves[i].score = GAME_OVER_SCORE;
+    if (lines < 0) goto next_move;
+    // Look ahead one piece: this placement is as good as the best board the
+    // next piece can reach from it. That only depends on the board and the
+    // next piece, so different placements (or games) leading to the same
+    // board can share it. Lines cleared by this placement are added after,
+    // since they depend on how the board was reached.
+    key = after_current->board_hash ^ (CACHE_KEY_SALT * (next_piece + 1));
+    if (ai->cache && CacheLookup(ai->cache, key, &lookahead)) {
+      ai->cache_hits++;
+      goto add_lines;
+    }
+    if (ai->cache) ai->cache_misses++;
+    next_count = ListPlacements(after_current, next_piece, BLOCKS_WIDE / 2,
+      PIECE_START_Y, next_moves);
+    // The boards it leads to are all scored at once.
+    batch->count = 0;
+    for (j = 0; j < next_count; j++) {
+      next_lines = AddToBatch(batch, after_current, next_moves[j].piece,
+        next_moves[j].x, next_moves[j].y);
+      if (next_lines >= 0) batch_lines[batch->count - 1] = next_lines;
+    }
+    ai->placements_evaluated += next_count;
+    lookahead = GAME_OVER_SCORE;
+    if (batch->count) ai->evaluator(batch);
+    for (j = 0; j < batch->count; j++) {
+      score = w->aggregate_height * batch->aggregate_height[j] +
+        w->holes * batch->holes[j] + w->bumpiness * batch->bumpiness[j] +
+        w->lines * batch_lines[j];
+      if (score > lookahead) lookahead = score;
+    }
+    if (ai->cache) CacheStore(ai->cache, key, lookahead);
+add_lines:
+    if (lookahead > GAME_OVER_SCORE) {
+      moves[i].score = lookahead + w->lines * lines;
+    }
+next_move:
+    if ((best < 0) || (moves[i].score > moves[best].score)) best = i;
+  }
+  ai->search_ns += MonotonicNanoseconds() - start_time;
+  if (best < 0) return 0;
+  *move = moves[best];
+  return 1;
+}
+
+// Passes an input to UpdateGameState, recording it first if needed.
+static int ApplyInput(TetrisGameState *s, int input,
+  void (*record)(uint64_t tick, int input, void *arg), void *arg) {
+  if (record) record(s->ticks, input, arg);
+  return UpdateGameState(s, input);
+}
+
+int PlayMove(TetrisGameState *s, TetrisAIMove *move,
+  void (*record)(uint64_t tick, int input, void *arg), void *arg) {
+  int i, old_x, input;
+  for (i = 0; i < move->rotations; i++) {
+    if (!ApplyInput(s, TETRIS_INPUT_ROTATE, record, arg)) return 0;
+  }
+  input = (move->x < s->location_x) ? TETRIS_INPUT_LEFT : TETRIS_INPUT_RIGHT;
+  while (s->location_x != move->x) {
+    old_x = s->location_x;
+    if (!ApplyInput(s, input, record, arg)) return 0;
+    // This only happens if the board changed since the move was chosen.
+    if (s->location_x == old_x) break;
+  }
+  return ApplyInput(s, TETRIS_INPUT_DROP, record, arg);
+}
@@ -0,0 +1,115 @@
+#ifndef TETRIS_AI_H
+#define TETRIS_AI_H
+// This file defines a simple AI player. For each falling piece, it tries every
+// rotation and column the piece can reach from where it spawned, followed by
+// every placement of the next piece, and scores the resulting boards with a
+// weighted sum of features. Like the rest of the engine, this doesn't depend
+// on curses.
+#include <stdatomic.h>
+#include <stdint.h>
+#include "tetris_ai_eval.h"
+#include "tetris_engine.h"
+
+#ifdef TETRIS_BOARD_SUFFIX
+#define DefaultAIWeights TETRIS_SIZED(DefaultAIWeights)
+#define ParseAIWeights TETRIS_SIZED(ParseAIWeights)
+#define CreateAICache TETRIS_SIZED(CreateAICache)
+#define DestroyAICache TETRIS_SIZED(DestroyAICache)
+#define InitializeAI TETRIS_SIZED(InitializeAI)
+#define ChooseMove TETRIS_SIZED(ChooseMove)
+#define PlayMove TETRIS_SIZED(PlayMove)
+#endif
+
+// The weights applied to each feature of a board. Placements with the highest
+// weighted sum are chosen, so the weights for bad features are negative.
+typedef struct {
+  // The sum of the heights of every column.
+  double aggregate_height;
+  // The number of empty cells with an occupied cell somewhere above them.
+  double holes;
+  // The sum of the height differences between neighboring columns.
+  double bumpiness;
+  // The number of lines cleared by the placements.
+  double lines;
+} TetrisAIWeights;
+
+// A move chosen by the AI: the falling piece is rotated the given number of
+// times, moved to column x, and dropped.
+typedef struct {
+  int rotations;
+  int x;
+  // The rotated piece, and the y location it lands at.
+  short piece;
+  int y;
+  // The weighted score of the best board reachable with this move.
+  double score;
+} TetrisAIMove;
+
+// A fixed-size table of board scores, keyed on board_hash, so boards reached
+// more than once aren't scored again. A cache may be shared by AIs in
+// different threads without locking: each entry holds its value and the XOR
+// of its key with its value, so an entry torn by two threads writing at once
+// won't match either key. Only AIs with the same weights may share a cache.
+typedef struct {
+  _Atomic uint64_t check;
+  _Atomic uint64_t value;
+} TetrisAICacheEntry;
+
+typedef struct {
+  TetrisAICacheEntry *entries;
+  // The number of entries minus one; the number of entries is a power of 2.
+  uint64_t mask;
+} TetrisAICache;
+
+typedef struct {
+  TetrisAIWeights weights;
+  // The number of placements scored so far, including those of the next
+  // piece.
+  uint64_t placements_evaluated;
+  // The total time spent in ChooseMove, in nanoseconds.
+  uint64_t search_ns;
+  // If non-NULL, the cache used to skip scoring boards seen before, and the
+  // number of boards that were found in it or not.
+  TetrisAICache *cache;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  // Computes the features of candidate boards. InitializeAI picks the
+  // fastest one the CPU supports, but any from GetAIEvaluator may be used.
+  TetrisAIEvaluator evaluator;
+  // The board after placing the current piece, and the boards after placing
+  // the next piece on it.
+  TetrisGameState scratch;
+  TetrisAIBatch batch;
+} TetrisAI;
+
+// Fills in weights that play reasonably well.
+void DefaultAIWeights(TetrisAIWeights *weights);
+
+// Parses weights written as four comma-separated numbers, in the same order
+// as the TetrisAIWeights fields. Returns 0 if the string is invalid.
+int ParseAIWeights(const char *text, TetrisAIWeights *weights);
+
+// Allocates an empty cache with 2^bits entries. Returns 0 and sets errno on
+// error.
+int CreateAICache(TetrisAICache *cache, int bits);
+
+// Frees a cache's entries.
+void DestroyAICache(TetrisAICache *cache);
+
+// Sets up an AI using the given weights, or the defaults if weights is NULL.
+// The AI starts without a cache.
+void InitializeAI(TetrisAI *ai, const TetrisAIWeights *weights);
+
+// Finds the best move for the falling piece in s, which must be at the
+// location it spawned at. Doesn't modify s. Returns 0 if the piece can't be
+// placed anywhere.
+int ChooseMove(TetrisAI *ai, TetrisGameState *s, TetrisAIMove *move);
+
+// Carries out a move returned by ChooseMove, using the same inputs a player
+// would, so the move is scored and recorded like any other. Calls
+// record(tick, input, arg) before each input if record isn't NULL. Returns 0
+// on game over.
+int PlayMove(TetrisGameState *s, TetrisAIMove *move,
+  void (*record)(uint64_t tick, int input, void *arg), void *arg);
+
+#endif  // TETRIS_AI_H
@@ -0,0 +1,171 @@
+// Implements the batched board evaluators described in tetris_ai_eval.h. The
+// SIMD versions are compiled with function-level target attributes, so the
+// rest of the program doesn't need to be built for a newer CPU; they're only
+// called if the CPU reports supporting them.
+#include <stddef.h>
+#include <string.h>
+#include "tetris_ai_eval.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_EVALUATORS
+#endif
+
+static void EvaluateScalar(TetrisAIBatch *batch) {
+  uint32_t row, covered;
+  int i, y, height, holes, bumpiness;
+  for (i = 0; i < batch->count; i++) {
+    covered = 0;
+    height = 0;
+    holes = 0;
+    bumpiness = 0;
+    // Empty rows above the highest cell add nothing to any feature.
+    for (y = 0; (y < BLOCKS_TALL) && !batch->rows[y][i]; y++) continue;
+    for (; y < BLOCKS_TALL; y++) {
+      row = batch->rows[y][i];
+      holes += __builtin_popcount(covered & ~row);
+      covered |= row;
+      height += __builtin_popcount(covered);
+      bumpiness += __builtin_popcount((covered ^ (covered >> 1)) &
+        (FULL_ROW_MASK >> 1));
+    }
+    batch->aggregate_height[i] = height;
+    batch->holes[i] = holes;
+    batch->bumpiness[i] = bumpiness;
+  }
+}
+
+#ifdef HAVE_X86_EVALUATORS
+
+// Counts the set bits in each 16-bit lane, by looking up each nibble's count
+// with a byte shuffle and adding the bytes of each lane together.
+__attribute__((target("ssse3")))
+static inline __m128i Popcount16SSSE3(__m128i v) {
+  const __m128i table = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+    3, 3, 4);
+  const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+  __m128i counts = _mm_add_epi8(
+    _mm_shuffle_epi8(table, _mm_and_si128(v, low_nibbles)),
+    _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4),
+      low_nibbles)));
+  return _mm_add_epi16(_mm_and_si128(counts, _mm_set1_epi16(0xff)),
+    _mm_srli_epi16(counts, 8));
+}
+
+__attribute__((target("ssse3")))
+static void EvaluateSSSE3(TetrisAIBatch *batch) {
+  const __m128i bump_mask = _mm_set1_epi16(FULL_ROW_MASK >> 1);
+  __m128i row, covered, height, holes, bumpiness;
+  int i, y;
+  for (i = 0; i < batch->count; i += 8) {
+    covered = _mm_setzero_si128();
+    height = _mm_setzero_si128();
+    holes = _mm_setzero_si128();
+    bumpiness = _mm_setzero_si128();
+    for (y = 0; y < BLOCKS_TALL; y++) {
+      row = _mm_load_si128((const __m128i *) (batch->rows[y] + i));
+      holes = _mm_add_epi16(holes, Popcount16SSSE3(_mm_andnot_si128(row,
+        covered)));
+      covered = _mm_or_si128(covered, row);
+      height = _mm_add_epi16(height, Popcount16SSSE3(covered));
+      bumpiness = _mm_add_epi16(bumpiness, Popcount16SSSE3(_mm_and_si128(
+        _mm_xor_si128(covered, _mm_srli_epi16(covered, 1)), bump_mask)));
+    }
+    _mm_store_si128((__m128i *) (batch->aggregate_height + i), height);
+    _mm_store_si128((__m128i *) (batch->holes + i), holes);
+    _mm_store_si128((__m128i *) (batch->bumpiness + i), bumpiness);
+  }
+}
+
+// The same as Popcount16SSSE3, on 16 lanes at once.
+__attribute__((target("avx2")))
+static inline __m256i Popcount16AVX2(__m256i v) {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+    2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i counts = _mm256_add_epi8(
+    _mm256_shuffle_epi8(table, _mm256_and_si256(v, low_nibbles)),
+    _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+      low_nibbles)));
+  return _mm256_add_epi16(_mm256_and_si256(counts, _mm256_set1_epi16(0xff)),
+    _mm256_srli_epi16(counts, 8));
+}
+
+__attribute__((target("avx2")))
+static void EvaluateAVX2(TetrisAIBatch *batch) {
+  const __m256i bump_mask = _mm256_set1_epi16(FULL_ROW_MASK >> 1);
+  __m256i row, covered, height, holes, bumpiness;
+  int i, y;
+  for (i = 0; i < batch->count; i += 16) {
+    covered = _mm256_setzero_si256();
+    height = _mm256_setzero_si256();
+    holes = _mm256_setzero_si256();
+    bumpiness = _mm256_setzero_si256();
+    for (y = 0; y < BLOCKS_TALL; y++) {
+      row = _mm256_load_si256((const __m256i *) (batch->rows[y] + i));
+      holes = _mm256_add_epi16(holes, Popcount16AVX2(_mm256_andnot_si256(row,
+        covered)));
+      covered = _mm256_or_si256(covered, row);
+      height = _mm256_add_epi16(height, Popcount16AVX2(covered));
+      bumpiness = _mm256_add_epi16(bumpiness, Popcount16AVX2(
+        _mm256_and_si256(_mm256_xor_si256(covered,
+        _mm256_srli_epi16(covered, 1)), bump_mask)));
+    }
+    _mm256_store_si256((__m256i *) (batch->aggregate_height + i), height);
+    _mm256_store_si256((__m256i *) (batch->holes + i), holes);
+    _mm256_store_si256((__m256i *) (batch->bumpiness + i), bumpiness);
+  }
+}
+
+#endif  // HAVE_X86_EVALUATORS
+
+typedef struct {
+  const char *name;
+  TetrisAIEvaluator evaluator;
+  // Returns nonzero if the CPU can run the evaluator.
+  int (*supported)(void);
+} EvaluatorEntry;
+
+static int AlwaysSupported(void) {
+  return 1;
+}
+
+#ifdef HAVE_X86_EVALUATORS
+static int SupportsSSSE3(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+static int SupportsAVX2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Every evaluator, from the fastest to the slowest.
+static const EvaluatorEntry evaluators[] = {
+#ifdef HAVE_X86_EVALUATORS
+  {"avx2", EvaluateAVX2, SupportsAVX2},
+  {"ssse3", EvaluateSSSE3, SupportsSSSE3},
+#endif
+  {"scalar", EvaluateScalar, AlwaysSupported},
+};
+
+#define EVALUATOR_COUNT (sizeof(evaluators) / sizeof(evaluators[0]))
+
+TetrisAIEvaluator GetAIEvaluator(const char *name) {
+  size_t i;
+  int automatic = !name || (strcmp(name, "auto") == 0);
+  for (i = 0; i < EVALUATOR_COUNT; i++) {
+    if (!automatic && (strcmp(name, evaluators[i].name) != 0)) continue;
+    if (evaluators[i].supported()) return evaluators[i].evaluator;
+    if (!automatic) return NULL;
+  }
+  return NULL;
+}
+
+const char* AIEvaluatorName(TetrisAIEvaluator evaluator) {
+  size_t i;
+  for (i = 0; i < EVALUATOR_COUNT; i++) {
+    if (evaluators[i].evaluator == evaluator) return evaluators[i].name;
+  }
+  return "unknown";
+}
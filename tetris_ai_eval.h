@@ -0,0 +1,53 @@
+#ifndef TETRIS_AI_EVAL_H
+#define TETRIS_AI_EVAL_H
+// This file defines the batched board evaluator used by the AI. Candidate
+// boards are stored as a structure of arrays, with row y of every candidate
+// next to each other, so the features of many boards can be computed at once
+// using SIMD instructions where the CPU supports them.
+//
+// Every feature is computed from the row bitmasks alone. Going down the board
+// while keeping "covered", the columns with a cell at or above the current
+// row:
+//  - A column's height is the number of rows at which it's covered, so the
+//    aggregate height is the sum of popcount(covered) over every row.
+//  - A hole is an empty cell in a covered column: popcount(covered & ~row).
+//  - Neighboring columns differ in height by the number of rows at which
+//    exactly one of them is covered, so the bumpiness is the sum of
+//    popcount((covered ^ (covered >> 1)) & (FULL_ROW_MASK >> 1)).
+#include <stdint.h>
+#include "tetris_engine.h"
+
+#ifdef TETRIS_BOARD_SUFFIX
+#define GetAIEvaluator TETRIS_SIZED(GetAIEvaluator)
+#define AIEvaluatorName TETRIS_SIZED(AIEvaluatorName)
+#endif
+
+// The number of boards in a batch. This is enough for every placement of a
+// piece (4 rotations in each column), rounded up to a multiple of the widest
+// SIMD width used (16 lanes of 16 bits).
+#define AI_BATCH_SIZE ((((4 * BLOCKS_WIDE) + 15) / 16) * 16)
+
+typedef struct {
+  // rows[y][i] is row y of board i.
+  _Alignas(32) uint16_t rows[BLOCKS_TALL][AI_BATCH_SIZE];
+  // The features of each board, filled in by an evaluator.
+  _Alignas(32) uint16_t aggregate_height[AI_BATCH_SIZE];
+  _Alignas(32) uint16_t holes[AI_BATCH_SIZE];
+  _Alignas(32) uint16_t bumpiness[AI_BATCH_SIZE];
+  // The number of boards in the batch. Evaluators may also compute features
+  // for the unused entries after these.
+  int count;
+} TetrisAIBatch;
+
+// Computes the features of every board in a batch.
+typedef void (*TetrisAIEvaluator)(TetrisAIBatch *batch);
+
+// Returns the evaluator with the given name ("scalar", "ssse3" or "avx2"), or
+// the fastest one the CPU supports if name is "auto" or NULL. Returns NULL if
+// the named evaluator doesn't exist or isn't supported by this CPU.
+TetrisAIEvaluator GetAIEvaluator(const char *name);
+
+// Returns the name of an evaluator returned by GetAIEvaluator.
+const char* AIEvaluatorName(TetrisAIEvaluator evaluator);
+
+#endif  // TETRIS_AI_EVAL_H
@@ -0,0 +1,701 @@
+// A microbenchmark harness for the engine's hot paths. Each benchmark is run
+// against corpora of seeded random boards, from nearly empty to nearly topped
+// out, and the results are printed as a single JSON object, so runs can be
+// saved and compared by scripts.
+//
+// Each benchmark is repeated with twice as many iterations until one run takes
+// at least the minimum time; only that last run is reported, so the shorter
+// runs before it double as warmup.
+//
+// The startup benchmarks time launching the other programs in quick headless
+// modes, the way a script or job scheduler runs them, from exec() to exit.
+//
+// Given an earlier run's output with --baseline, each result also reports the
+// earlier run's time and the speedup since, as make pgo uses to compare
+// builds.
+#include <curses.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tetris_ai_eval.h"
+#include "tetris_draw.h"
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_sched.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER
+#endif
+
+// The number of boards in each corpus, and of the piece locations and inputs
+// the benchmarks cycle through. Both are powers of 2, so picking the next one
+// is cheap next to what's being measured.
+#define CORPUS_BOARDS (64)
+#define QUERY_COUNT (1024)
+
+// The percent chance of each cell below a column's top being filled when
+// generating a board.
+#define FILL_PERCENT (85)
+
+// A piece at a location on one of a corpus's boards.
+typedef struct {
+  int board;
+  short piece;
+  int x;
+  int y;
+} BenchQuery;
+
+typedef struct {
+  const char *name;
+  // Generated columns are filled up to between 2/3 of this many rows and this
+  // many rows from the bottom.
+  int fill_height;
+  TetrisGameState boards[CORPUS_BOARDS];
+  // The same boards with 1 to 4 complete rows added, and the lowest of those
+  // rows on each board.
+  TetrisGameState clear_boards[CORPUS_BOARDS];
+  int clear_y[CORPUS_BOARDS];
+  // Locations on the boards, which may or may not fit the piece.
+  BenchQuery fits[QUERY_COUNT];
+  // Locations on the boards where the piece fits.
+  BenchQuery placed[QUERY_COUNT];
+  // Copies of the boards, for benchmarks that change them.
+  TetrisGameState work[CORPUS_BOARDS];
+} BenchCorpus;
+
+typedef struct {
+  const char *name;
+  // Runs the benchmark for the given number of iterations, and returns the
+  // number of operations that took.
+  uint64_t (*run)(BenchCorpus *c, uint64_t iterations, void *arg);
+  void *arg;
+  // Nonzero if the benchmark draws into board_window.
+  int draws;
+  // Nonzero if the benchmark doesn't use the corpora, so it's only run once.
+  int no_corpus;
+} Benchmark;
+
+// A program run by a startup benchmark, found in the same directory as
+// tetris-bench. path is empty if it wasn't found.
+typedef struct {
+  const char *name;
+  const char *program;
+  char *const args[8];
+  char path[PATH_MAX];
+} StartupCommand;
+
+static StartupCommand startup_commands[] = {
+  {"startup_tetris_version", "tetris", {"tetris", "--version", NULL}},
+  {"startup_sim_version", "tetris-sim", {"tetris-sim", "--version", NULL}},
+  {"startup_sim_short_run", "tetris-sim", {"tetris-sim", "--games", "1",
+    "--threads", "1", "--max-pieces", "10", NULL}},
+};
+
+#define STARTUP_COMMAND_COUNT (sizeof(startup_commands) / \
+  sizeof(startup_commands[0]))
+
+// The most results read from a --baseline file.
+#define MAX_BASELINE_RESULTS (128)
+
+// A result from a --baseline file. corpus is as it was printed: a quoted name,
+// or null.
+typedef struct {
+  char benchmark[32];
+  char corpus[32];
+  double ns_per_op;
+} BaselineResult;
+
+static BaselineResult baseline[MAX_BASELINE_RESULTS];
+static int baseline_count;
+
+extern char **environ;
+
+static BenchCorpus corpora[] = {
+  {"sparse", 5},
+  {"dense", 12},
+  {"near_topout", 17},
+};
+
+#define CORPUS_COUNT (sizeof(corpora) / sizeof(corpora[0]))
+
+// The inputs played by the update_game_state benchmark. Most ticks have no
+// input, like a real game.
+static int inputs[QUERY_COUNT];
+
+// The window the drawing benchmarks draw into, or NULL if curses couldn't be
+// set up. Its screen writes to /dev/null.
+static WINDOW *board_window;
+
+// Every benchmark adds something it computed to this, so the compiler can't
+// skip the work.
+static volatile uint64_t sink;
+
+static uint64_t ReadCycles(void) {
+#ifdef HAVE_CYCLE_COUNTER
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void SetCell(TetrisGameState *s, int x, int y, char glyph) {
+  s->board[y * BLOCKS_WIDE + x] = glyph;
+  s->rows[y] |= 1 << x;
+}
+
+// Fills in a game state with a random board. No row of the board is complete.
+static void GenerateBoard(TetrisGameState *s, TetrisRNG *rng,
+  int fill_height, uint64_t seed) {
+  TetrisGameConfig config;
+  int x, y, top;
+  config.tick_rate = DEFAULT_TICK_RATE;
+  config.seed = seed;
+  config.randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+  InitializeNewGame(s, &config);
+  for (x = 0; x < BLOCKS_WIDE; x++) {
+    top = BLOCKS_TALL - fill_height + RandomBelow(rng, fill_height / 3 + 1);
+    for (y = top; y < BLOCKS_TALL; y++) {
+      if (RandomBelow(rng, 100) >= FILL_PERCENT) continue;
+      SetCell(s, x, y, piece_info[RandomBelow(rng,
+        TETRIS_PIECE_COUNT)].glyph);
+    }
+  }
+  for (y = 0; y < BLOCKS_TALL; y++) {
+    if (s->rows[y] != FULL_ROW_MASK) continue;
+    x = RandomBelow(rng, BLOCKS_WIDE);
+    s->board[y * BLOCKS_WIDE + x] = ' ';
+    s->rows[y] &= ~(1 << x);
+  }
+  RecomputeColumnTops(s);
+  s->board_hash = BoardHash(s->rows);
+}
+
+// Returns a random location of a random piece on one of the corpus's boards.
+// The location may be partly outside of the board.
+static void RandomQuery(TetrisRNG *rng, BenchQuery *q) {
+  q->board = RandomBelow(rng, CORPUS_BOARDS);
+  q->piece = RandomBelow(rng, TETRIS_PIECE_COUNT);
+  q->x = ((int) RandomBelow(rng, BLOCKS_WIDE + 2)) - 1;
+  q->y = PIECE_START_Y + RandomBelow(rng, BLOCKS_TALL - PIECE_START_Y);
+}
+
+static void GenerateCorpus(BenchCorpus *c, uint64_t seed) {
+  TetrisGameState *s;
+  TetrisRNG rng;
+  int i, x, y, count;
+  SeedRandom(&rng, seed);
+  for (i = 0; i < CORPUS_BOARDS; i++) {
+    GenerateBoard(c->boards + i, &rng, c->fill_height, seed + i);
+    // Complete between 1 and 4 rows, ending somewhere in the filled part of
+    // the board.
+    s = c->clear_boards + i;
+    *s = c->boards[i];
+    count = 1 + (i % 4);
+    c->clear_y[i] = BLOCKS_TALL - 1 - RandomBelow(&rng, c->fill_height -
+      count + 1);
+    for (y = c->clear_y[i] - count + 1; y <= c->clear_y[i]; y++) {
+      for (x = 0; x < BLOCKS_WIDE; x++) {
+        if (!(s->rows[y] & (1 << x))) SetCell(s, x, y, piece_info[0].glyph);
+      }
+    }
+    RecomputeColumnTops(s);
+    s->board_hash = BoardHash(s->rows);
+  }
+  for (i = 0; i < QUERY_COUNT; i++) {
+    RandomQuery(&rng, c->fits + i);
+    do {
+      RandomQuery(&rng, c->placed + i);
+    } while (!PieceFits(c->boards + c->placed[i].board, c->placed[i].piece,
+      c->placed[i].x, c->placed[i].y));
+  }
+}
+
+static uint64_t BenchPieceFits(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  BenchQuery *q;
+  for (i = 0; i < iterations; i++) {
+    q = c->fits + (i % QUERY_COUNT);
+    total += PieceFits(c->boards + q->board, q->piece, q->x, q->y);
+  }
+  sink += total;
+  return iterations;
+}
+
+static uint64_t BenchTryRotating(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  TetrisGameState *s;
+  BenchQuery *q;
+  memcpy(c->work, c->boards, sizeof(c->work));
+  for (i = 0; i < iterations; i++) {
+    q = c->placed + (i % QUERY_COUNT);
+    s = c->work + q->board;
+    s->current_piece = q->piece;
+    s->location_x = q->x;
+    s->location_y = q->y;
+    TryRotating(s);
+    total += s->location_x;
+  }
+  sink += total;
+  return iterations;
+}
+
+static uint64_t BenchLandingY(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  BenchQuery *q;
+  for (i = 0; i < iterations; i++) {
+    q = c->placed + (i % QUERY_COUNT);
+    total += PieceLandingY(c->boards + q->board, q->piece, q->x, q->y);
+  }
+  sink += total;
+  return iterations;
+}
+
+// Checks for complete lines on boards without any, so nothing is removed.
+static uint64_t BenchCheckLines(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i;
+  BenchQuery *q;
+  for (i = 0; i < iterations; i++) {
+    q = c->placed + (i % QUERY_COUNT);
+    CheckForCompleteLines(c->boards + q->board, q->y);
+  }
+  sink += c->boards[0].lines;
+  return iterations;
+}
+
+// Copies a board, as clear_lines does before each operation, to show how much
+// of its time that takes.
+static uint64_t BenchCopyState(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  for (i = 0; i < iterations; i++) {
+    c->work[0] = c->clear_boards[i % CORPUS_BOARDS];
+    total += c->work[0].rows[BLOCKS_TALL - 1];
+  }
+  sink += total;
+  return iterations;
+}
+
+// Removes between 1 and 4 complete rows from a fresh copy of a board.
+static uint64_t BenchClearLines(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  int board;
+  for (i = 0; i < iterations; i++) {
+    board = i % CORPUS_BOARDS;
+    c->work[0] = c->clear_boards[board];
+    CheckForCompleteLines(c->work, c->clear_y[board]);
+    total += c->work[0].lines;
+  }
+  sink += total;
+  return iterations;
+}
+
+// Plays one input and one tick per operation, the way the frontend does, and
+// moves on to the next board whenever the game ends.
+static uint64_t BenchUpdateGameState(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i, total = 0;
+  TetrisGameState *s = c->work;
+  int board = 0;
+  *s = c->boards[board];
+  for (i = 0; i < iterations; i++) {
+    if (!UpdateGameState(s, inputs[i % QUERY_COUNT]) || !TickGameState(s)) {
+      total += s->score;
+      board = (board + 1) % CORPUS_BOARDS;
+      *s = c->boards[board];
+    }
+    s->events = 0;
+    s->dirty_rows = 0;
+  }
+  sink += total;
+  return iterations;
+}
+
+// Draws every row of a board into the window's buffer, without refreshing the
+// terminal.
+static uint64_t BenchDrawBoard(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i;
+  for (i = 0; i < iterations; i++) {
+    DrawBoard(board_window, c->boards[i % CORPUS_BOARDS].board,
+      ALL_ROWS_DIRTY);
+  }
+  return iterations;
+}
+
+// Draws every row of a different board each time, and writes the changes to
+// the terminal (which is /dev/null).
+static uint64_t BenchDrawBoardRefresh(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  uint64_t i;
+  for (i = 0; i < iterations; i++) {
+    DrawBoard(board_window, c->boards[i % CORPUS_BOARDS].board,
+      ALL_ROWS_DIRTY);
+    wnoutrefresh(board_window);
+    doupdate();
+  }
+  return iterations;
+}
+
+// Runs the StartupCommand arg points to, waiting for it to exit each
+// iteration, with its output sent to /dev/null. Exits if it fails.
+static uint64_t BenchStartup(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  StartupCommand *command = (StartupCommand *) arg;
+  posix_spawn_file_actions_t actions;
+  uint64_t i;
+  pid_t pid;
+  int result, status;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+    O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  for (i = 0; i < iterations; i++) {
+    result = posix_spawn(&pid, command->path, &actions, NULL, command->args,
+      environ);
+    if (result != 0) {
+      fprintf(stderr, "Failed running %s: %s\n", command->path,
+        strerror(result));
+      exit(1);
+    }
+    if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) ||
+      (WEXITSTATUS(status) != 0)) {
+      fprintf(stderr, "%s failed\n", command->path);
+      exit(1);
+    }
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  return iterations;
+}
+
+// Computes the AI's features for a full batch of boards each iteration, using
+// the evaluator arg points to. Each board is one operation.
+static uint64_t BenchEvaluator(BenchCorpus *c, uint64_t iterations,
+  void *arg) {
+  static TetrisAIBatch batch;
+  TetrisAIEvaluator evaluator = *((TetrisAIEvaluator *) arg);
+  uint64_t i, total = 0;
+  int lane, y;
+  for (lane = 0; lane < AI_BATCH_SIZE; lane++) {
+    for (y = 0; y < BLOCKS_TALL; y++) {
+      batch.rows[y][lane] = c->boards[lane % CORPUS_BOARDS].rows[y];
+    }
+  }
+  batch.count = AI_BATCH_SIZE;
+  for (i = 0; i < iterations; i++) {
+    evaluator(&batch);
+    total += batch.holes[i % AI_BATCH_SIZE];
+  }
+  sink += total;
+  return iterations * AI_BATCH_SIZE;
+}
+
+// The evaluators that can be benchmarked, and the ones this CPU supports.
+static const char *evaluator_names[] = {"scalar", "ssse3", "avx2"};
+#define EVALUATOR_NAME_COUNT (sizeof(evaluator_names) / \
+  sizeof(evaluator_names[0]))
+static TetrisAIEvaluator evaluators[EVALUATOR_NAME_COUNT];
+static char evaluator_benchmark_names[EVALUATOR_NAME_COUNT][32];
+
+// Every benchmark that can run, filled in by FindBenchmarks.
+static Benchmark benchmarks[32];
+static int benchmark_count;
+
+// Adds a benchmark, and returns it so its flags can be set.
+static Benchmark* AddBenchmark(const char *name, uint64_t (*run)(
+  BenchCorpus *c, uint64_t iterations, void *arg), void *arg) {
+  Benchmark *b = benchmarks + benchmark_count;
+  memset(b, 0, sizeof(*b));
+  b->name = name;
+  b->run = run;
+  b->arg = arg;
+  benchmark_count++;
+  return b;
+}
+
+// Fills in the paths of the startup benchmarks' programs, looking in the
+// directory holding this program.
+static void FindStartupCommands(const char *program_name) {
+  const char *slash = strrchr(program_name, '/');
+  int dir_length = slash ? (slash - program_name) + 1 : 0;
+  StartupCommand *command;
+  size_t i;
+  for (i = 0; i < STARTUP_COMMAND_COUNT; i++) {
+    command = startup_commands + i;
+    snprintf(command->path, sizeof(command->path), "%.*s%s", dir_length,
+      program_name, command->program);
+    if (access(command->path, X_OK) == 0) continue;
+    fprintf(stderr, "Couldn't find %s; skipping %s\n", command->path,
+      command->name);
+    command->path[0] = 0;
+  }
+}
+
+static void FindBenchmarks(void) {
+  size_t i;
+  AddBenchmark("piece_fits", BenchPieceFits, NULL);
+  AddBenchmark("try_rotating", BenchTryRotating, NULL);
+  AddBenchmark("landing_y", BenchLandingY, NULL);
+  AddBenchmark("check_for_complete_lines", BenchCheckLines, NULL);
+  AddBenchmark("copy_state", BenchCopyState, NULL);
+  AddBenchmark("clear_lines", BenchClearLines, NULL);
+  AddBenchmark("update_game_state", BenchUpdateGameState, NULL);
+  AddBenchmark("draw_board", BenchDrawBoard, NULL)->draws = 1;
+  AddBenchmark("draw_board_refresh", BenchDrawBoardRefresh, NULL)->draws = 1;
+  for (i = 0; i < EVALUATOR_NAME_COUNT; i++) {
+    evaluators[i] = GetAIEvaluator(evaluator_names[i]);
+    if (!evaluators[i]) continue;
+    snprintf(evaluator_benchmark_names[i], sizeof(evaluator_benchmark_names[i]),
+      "ai_evaluate_%s", evaluator_names[i]);
+    AddBenchmark(evaluator_benchmark_names[i], BenchEvaluator, evaluators + i);
+  }
+  for (i = 0; i < STARTUP_COMMAND_COUNT; i++) {
+    AddBenchmark(startup_commands[i].name, BenchStartup,
+      startup_commands + i)->no_corpus = 1;
+  }
+}
+
+// Returns the number of benchmarks matching the filter (which may be NULL)
+// that need drawing, if drawing is nonzero, or that run a startup command,
+// if it's 0.
+static int CountSelected(const char *filter, int drawing) {
+  int i, count = 0;
+  for (i = 0; i < benchmark_count; i++) {
+    if (filter && !strstr(benchmarks[i].name, filter)) continue;
+    if (drawing ? benchmarks[i].draws : (benchmarks[i].run == BenchStartup)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Sets up a curses screen that writes to /dev/null, and a window the size of
+// the game board for the drawing benchmarks. Leaves board_window NULL if this
+// fails.
+static SCREEN* SetupDrawing(FILE *null_file) {
+  SCREEN *screen;
+  // The terminal type only changes the escape codes written by refreshes, so
+  // use a common one if there isn't any.
+  screen = newterm(getenv("TERM") ? NULL : "xterm", null_file, null_file);
+  if (!screen) return NULL;
+  board_window = newwin(BLOCKS_TALL + 2, BLOCKS_WIDE * 2 + 2, 0, 0);
+  if (!board_window) {
+    endwin();
+    delscreen(screen);
+    return NULL;
+  }
+  return screen;
+}
+
+// Reads the results from an earlier run's output, which RunBenchmark prints
+// one per line. Returns 0 and prints an error if the file can't be read or
+// has no results.
+static int LoadBaseline(const char *path) {
+  BaselineResult *r;
+  char line[512];
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Failed opening %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  while ((baseline_count < MAX_BASELINE_RESULTS) &&
+    fgets(line, sizeof(line), f)) {
+    r = baseline + baseline_count;
+    if (sscanf(line, " {\"benchmark\": \"%31[^\"]\", \"corpus\": %31[^,], "
+      "\"ops\": %*[0-9], \"ns_per_op\": %lf", r->benchmark, r->corpus,
+      &r->ns_per_op) != 3) {
+      continue;
+    }
+    baseline_count++;
+  }
+  fclose(f);
+  if (baseline_count == 0) {
+    fprintf(stderr, "No benchmark results in %s\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+// Returns the baseline's nanoseconds per operation for a benchmark on the
+// given corpus (as printed), or 0 if the baseline doesn't have it.
+static double BaselineNsPerOp(const char *benchmark, const char *corpus) {
+  int i;
+  for (i = 0; i < baseline_count; i++) {
+    if ((strcmp(baseline[i].benchmark, benchmark) == 0) &&
+      (strcmp(baseline[i].corpus, corpus) == 0)) {
+      return baseline[i].ns_per_op;
+    }
+  }
+  return 0;
+}
+
+static void RunBenchmark(Benchmark *b, BenchCorpus *c, uint64_t min_ns,
+  int first) {
+  uint64_t iterations = 64, ops, start_ns, elapsed_ns, start_cycles, cycles;
+  double ns_per_op, baseline_ns;
+  char corpus[sizeof(baseline[0].corpus)];
+  while (1) {
+    start_cycles = ReadCycles();
+    start_ns = MonotonicNanoseconds();
+    ops = b->run(c, iterations, b->arg);
+    elapsed_ns = MonotonicNanoseconds() - start_ns;
+    cycles = ReadCycles() - start_cycles;
+    if (elapsed_ns >= min_ns) break;
+    iterations *= 2;
+  }
+  snprintf(corpus, sizeof(corpus), "%s%s%s", c ? "\"" : "",
+    c ? c->name : "null", c ? "\"" : "");
+  ns_per_op = ((double) elapsed_ns) / ((double) ops);
+  printf("%s    {\"benchmark\": \"%s\", \"corpus\": %s, \"ops\": %llu, "
+    "\"ns_per_op\": %.3f, ", first ? "" : ",\n", b->name, corpus,
+    (unsigned long long) ops, ns_per_op);
+#ifdef HAVE_CYCLE_COUNTER
+  printf("\"cycles_per_op\": %.3f", ((double) cycles) / ((double) ops));
+#else
+  printf("\"cycles_per_op\": null");
+#endif
+  if (baseline_count) {
+    baseline_ns = BaselineNsPerOp(b->name, corpus);
+    if (baseline_ns) {
+      printf(", \"baseline_ns_per_op\": %.3f, \"speedup\": %.3f",
+        baseline_ns, baseline_ns / ns_per_op);
+    } else {
+      printf(", \"baseline_ns_per_op\": null, \"speedup\": null");
+    }
+  }
+  printf("}");
+}
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s [options]\n"
+    "Options:\n"
+    "  --seed <seed>: The seed for the generated boards. Defaults to 0.\n"
+    "  --min-ms <ms>: Run each benchmark for at least this many\n"
+    "    milliseconds. Defaults to 100.\n"
+    "  --filter <text>: Only run the benchmarks whose names contain\n"
+    "    <text>. The startup benchmarks run the other programs, which must\n"
+    "    be in the same directory as this one.\n"
+    "  --baseline <file>: Compare each result against the same one in\n"
+    "    <file>, the output of an earlier run, and report the speedup.\n",
+    program_name);
+}
+
+int main(int argc, char **argv) {
+  uint64_t seed = 0, min_ms = 100;
+  const char *filter = NULL;
+  FILE *null_file = NULL;
+  SCREEN *screen = NULL;
+  TetrisRNG rng;
+  char *end = NULL;
+  size_t j;
+  int i, first = 1;
+  for (i = 1; i < argc; i++) {
+    if (((strcmp(argv[i], "--seed") == 0) ||
+      (strcmp(argv[i], "--min-ms") == 0)) && ((i + 1) < argc)) {
+      errno = 0;
+      end = NULL;
+      if (strcmp(argv[i], "--seed") == 0) {
+        seed = strtoull(argv[i + 1], &end, 0);
+      } else {
+        min_ms = strtoull(argv[i + 1], &end, 0);
+      }
+      if ((*end != 0) || (end == argv[i + 1]) || (errno != 0)) {
+        printf("Invalid %s: %s\n", argv[i], argv[i + 1]);
+        break;
+      }
+      i++;
+      continue;
+    }
+    if ((strcmp(argv[i], "--filter") == 0) && ((i + 1) < argc)) {
+      i++;
+      filter = argv[i];
+      continue;
+    }
+    if ((strcmp(argv[i], "--baseline") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!LoadBaseline(argv[i])) return 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--help") != 0) {
+      printf("Invalid argument: %s\n", argv[i]);
+    }
+    break;
+  }
+  if (i < argc) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  for (j = 0; j < CORPUS_COUNT; j++) {
+    GenerateCorpus(corpora + j, seed + j * CORPUS_BOARDS);
+  }
+  SeedRandom(&rng, seed);
+  for (i = 0; i < QUERY_COUNT; i++) {
+    inputs[i] = RandomBelow(&rng, 20);
+    // About one input in four does something, and drops are rare.
+    if (inputs[i] >= TETRIS_INPUT_DROP) {
+      inputs[i] = (inputs[i] == 19) ? TETRIS_INPUT_DROP : TETRIS_INPUT_NONE;
+    }
+  }
+  FindBenchmarks();
+  // Loading the terminal's description takes longer than some of the
+  // benchmarks, so only do it if they'll draw.
+  if (CountSelected(filter, 1)) {
+    null_file = fopen("/dev/null", "r+");
+    if (!null_file) {
+      fprintf(stderr, "Failed opening /dev/null: %s\n", strerror(errno));
+      return 1;
+    }
+    screen = SetupDrawing(null_file);
+    if (!screen) {
+      fprintf(stderr, "Couldn't set up curses; skipping drawing benchmarks\n");
+    }
+  }
+  if (CountSelected(filter, 0)) FindStartupCommands(argv[0]);
+  printf("{\n  \"seed\": %llu,\n  \"min_ms\": %llu,\n"
+    "  \"cycle_counter\": %s,\n  \"results\": [\n",
+    (unsigned long long) seed, (unsigned long long) min_ms,
+#ifdef HAVE_CYCLE_COUNTER
+    "\"rdtsc\""
+#else
+    "null"
+#endif
+    );
+  for (i = 0; i < benchmark_count; i++) {
+    if (filter && !strstr(benchmarks[i].name, filter)) continue;
+    if (benchmarks[i].draws && !board_window) continue;
+    if ((benchmarks[i].run == BenchStartup) &&
+      !((StartupCommand *) benchmarks[i].arg)->path[0]) {
+      continue;
+    }
+    if (benchmarks[i].no_corpus) {
+      RunBenchmark(benchmarks + i, NULL, min_ms * 1000000, first);
+      first = 0;
+      fflush(stdout);
+      continue;
+    }
+    for (j = 0; j < CORPUS_COUNT; j++) {
+      RunBenchmark(benchmarks + i, corpora + j, min_ms * 1000000, first);
+      first = 0;
+      fflush(stdout);
+    }
+  }
+  printf("\n  ]\n}\n");
+  if (screen) {
+    endwin();
+    delscreen(screen);
+  }
+  if (null_file) fclose(null_file);
+  return 0;
+}
@@ -0,0 +1,585 @@
+// Implements the spectator broadcasts described in tetris_broadcast.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "tetris_broadcast.h"
+#include "tetris_engine.h"
+
+// The character drawn for the cells of the ghost piece, as in the game.
+#define GHOST_CHARACTER ('.')
+
+// The column at which the score, lines and next piece are shown, and the
+// screen lines they start at. The held piece is shown on the next piece's
+// lines, at HOLD_X.
+#define INFO_X ((BLOCKS_WIDE * 2) + 4)
+#define HOLD_X (INFO_X + 10)
+#define SCORE_Y (1)
+#define LINES_Y (4)
+#define NEXT_Y (7)
+
+// The epoll_event data for the listening socket, rather than a client index.
+#define LISTEN_EVENT (0xffffffffu)
+
+// The most epoll events handled per ServiceBroadcast loop.
+#define MAX_EVENTS (64)
+
+// The most frames passed to one sendmsg().
+#define MAX_IOVECS (BROADCAST_MAX_QUEUED_FRAMES)
+
+// Two cells in the same line closer than this are sent as one run, including
+// the unchanged ones between them, since moving the cursor costs about as
+// much.
+#define MIN_CURSOR_MOVE (6)
+
+// Telnet command bytes (RFC 854) and options, asking the client not to echo
+// what the spectator types.
+#define TELNET_IAC (255)
+#define TELNET_WILL (251)
+#define TELNET_ECHO (1)
+#define TELNET_SUPPRESS_GO_AHEAD (3)
+
+// Sets O_NONBLOCK on a file descriptor. Returns 0 on error.
+static int SetNonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) return 0;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Drops a reference to a frame, freeing it if it was the last.
+static void ReleaseFrame(BroadcastFrame *f) {
+  f->references--;
+  if (f->references <= 0) free(f);
+}
+
+// Appends bytes to the scratch buffer at *size, growing it as needed. Returns
+// 0 if it couldn't be grown.
+static int Emit(TetrisBroadcast *b, size_t *size, const void *data,
+  size_t length) {
+  size_t needed = *size + length, capacity;
+  uint8_t *grown;
+  if (needed > b->scratch_capacity) {
+    capacity = b->scratch_capacity ? (b->scratch_capacity * 2) : 4096;
+    while (capacity < needed) capacity *= 2;
+    grown = (uint8_t *) realloc(b->scratch, capacity);
+    if (!grown) return 0;
+    b->scratch = grown;
+    b->scratch_capacity = capacity;
+  }
+  memcpy(b->scratch + *size, data, length);
+  *size = needed;
+  return 1;
+}
+
+// Appends the escape sequence moving the cursor to the given screen location.
+static int EmitMove(TetrisBroadcast *b, size_t *size, int y, int x) {
+  char move[24];
+  int length = snprintf(move, sizeof(move), "\x1b[%d;%dH", y + 1, x + 1);
+  return Emit(b, size, move, length);
+}
+
+// Copies the scratch buffer's first size bytes into a new frame, with no
+// references yet. Returns NULL on error.
+static BroadcastFrame* NewFrame(TetrisBroadcast *b, size_t size) {
+  BroadcastFrame *f = (BroadcastFrame *) malloc(sizeof(*f) + size);
+  if (!f) return NULL;
+  f->references = 0;
+  f->size = size;
+  memcpy(f->data, b->scratch, size);
+  return f;
+}
+
+// Returns the keyframe for the current screen, encoding it if needed: the
+// whole screen, drawn over whatever the spectator's terminal showed. Returns
+// NULL on error.
+static BroadcastFrame* CurrentKeyframe(TetrisBroadcast *b) {
+  static const char reset[] = "\x1b[?25l\x1b[H\x1b[2J";
+  size_t size = 0;
+  int y, length;
+  if (b->keyframe) return b->keyframe;
+  if (!Emit(b, &size, reset, sizeof(reset) - 1)) return NULL;
+  for (y = 0; y < BROADCAST_LINES; y++) {
+    length = BROADCAST_COLUMNS;
+    while ((length > 0) && (b->screen[y][length - 1] == ' ')) length--;
+    if (length == 0) continue;
+    if (!EmitMove(b, &size, y, 0) ||
+      !Emit(b, &size, b->screen[y], length)) {
+      return NULL;
+    }
+  }
+  b->keyframe = NewFrame(b, size);
+  if (!b->keyframe) return NULL;
+  // The broadcast holds a reference until the screen changes.
+  b->keyframe->references = 1;
+  b->keyframes++;
+  return b->keyframe;
+}
+
+// Writes text into a line of the next screen, starting at column x.
+static void ComposeText(TetrisBroadcast *b, int y, int x, const char *text) {
+  size_t length = strlen(text);
+  if (length > (BROADCAST_COLUMNS - x)) length = BROADCAST_COLUMNS - x;
+  memcpy(b->next[y] + x, text, length);
+}
+
+// Draws the layout that never changes into an empty screen.
+static void DrawLayout(char screen[BROADCAST_LINES][BROADCAST_COLUMNS]) {
+  int y;
+  memset(screen, ' ', BROADCAST_LINES * BROADCAST_COLUMNS);
+  for (y = 0; y < BROADCAST_LINES; y++) {
+    screen[y][0] = '|';
+    screen[y][BLOCKS_WIDE * 2 + 1] = '|';
+  }
+  memset(screen[0], '-', BLOCKS_WIDE * 2 + 2);
+  memset(screen[BROADCAST_LINES - 1], '-', BLOCKS_WIDE * 2 + 2);
+  screen[0][0] = screen[0][BLOCKS_WIDE * 2 + 1] = '+';
+  screen[BROADCAST_LINES - 1][0] = '+';
+  screen[BROADCAST_LINES - 1][BLOCKS_WIDE * 2 + 1] = '+';
+  memcpy(screen[SCORE_Y] + INFO_X, "Score:", 6);
+  memcpy(screen[LINES_Y] + INFO_X, "Lines:", 6);
+  memcpy(screen[NEXT_Y] + INFO_X, "Next:", 5);
+  memcpy(screen[NEXT_Y] + HOLD_X, "Hold:", 5);
+}
+
+// Draws a piece's cells in the given board rows of the next screen, like
+// DrawBoardPiece.
+static void ComposeBoardPiece(TetrisBroadcast *b, short piece, int x, int y,
+  char c, TetrisRowSet rows) {
+  const TetrisPieceInfo *info = piece_info + piece;
+  int i, board_x, board_y;
+  for (i = 0; i < 4; i++) {
+    board_y = y - info->cell_y[i];
+    if ((board_y < 0) || !(rows & (((TetrisRowSet) 1) << board_y))) continue;
+    board_x = x + info->cell_x[i];
+    b->next[board_y + 1][board_x * 2 + 1] = c;
+    b->next[board_y + 1][board_x * 2 + 2] = c;
+  }
+}
+
+// Returns the board rows covered by a piece at the given y location, like
+// PieceRows in tetris_draw.h, which needs curses.
+static TetrisRowSet CoveredRows(short piece, int y) {
+  TetrisRowSet rows = 0;
+  int i;
+  for (i = 0; i < piece_info[piece].height; i++) {
+    if ((y - i) >= 0) rows |= ((TetrisRowSet) 1) << (y - i);
+  }
+  return rows;
+}
+
+// Fills in the given board rows of the next screen from the game, and
+// returns the screen lines they're on.
+static uint64_t ComposeBoard(TetrisBroadcast *b, TetrisGameState *s,
+  TetrisRowSet rows, int ghost_y) {
+  uint64_t lines = 0;
+  char *line;
+  int x, y;
+  for (y = 0; y < BLOCKS_TALL; y++) {
+    if (!(rows & (((TetrisRowSet) 1) << y))) continue;
+    line = b->next[y + 1];
+    for (x = 0; x < BLOCKS_WIDE; x++) {
+      line[x * 2 + 1] = s->board[y * BLOCKS_WIDE + x];
+      line[x * 2 + 2] = s->board[y * BLOCKS_WIDE + x];
+    }
+    lines |= ((uint64_t) 1) << (y + 1);
+  }
+  ComposeBoardPiece(b, s->current_piece, s->location_x, ghost_y,
+    GHOST_CHARACTER, rows);
+  ComposeBoardPiece(b, s->current_piece, s->location_x, s->location_y,
+    piece_info[s->current_piece].glyph, rows);
+  return lines;
+}
+
+// Draws a piece below the "Next:" or "Hold:" label at column x of the next
+// screen, replacing whatever piece was there, and returns the screen lines
+// that changed. Draws nothing but spaces if piece is -1.
+static uint64_t ComposePreview(TetrisBroadcast *b, short piece, int x) {
+  const TetrisPieceInfo *info;
+  uint64_t lines = 0;
+  int i, y;
+  // Pieces are at most 4 cells tall, drawn upwards from the bottom line.
+  for (y = NEXT_Y + 1; y <= NEXT_Y + 4; y++) {
+    memset(b->next[y] + x, ' ', 8);
+    lines |= ((uint64_t) 1) << y;
+  }
+  if (piece < 0) return lines;
+  info = piece_info + piece;
+  for (i = 0; i < 4; i++) {
+    y = NEXT_Y + 4 - info->cell_y[i];
+    b->next[y][x + info->cell_x[i] * 2] = info->glyph;
+    b->next[y][x + info->cell_x[i] * 2 + 1] = info->glyph;
+  }
+  return lines;
+}
+
+// Fills in the next and held pieces, score and lines in the next screen where
+// they changed, and returns the screen lines that changed.
+static uint64_t ComposeInfo(TetrisBroadcast *b, TetrisGameState *s) {
+  uint64_t lines = 0;
+  char text[24];
+  if (s->score != b->drawn_score) {
+    snprintf(text, sizeof(text), "%-11u", s->score);
+    ComposeText(b, SCORE_Y + 1, INFO_X, text);
+    lines |= ((uint64_t) 1) << (SCORE_Y + 1);
+  }
+  if (s->lines != b->drawn_lines) {
+    snprintf(text, sizeof(text), "%-11u", s->lines);
+    ComposeText(b, LINES_Y + 1, INFO_X, text);
+    lines |= ((uint64_t) 1) << (LINES_Y + 1);
+  }
+  if (QueuedPiece(s, 0) != b->drawn_next_piece) {
+    lines |= ComposePreview(b, QueuedPiece(s, 0), INFO_X);
+  }
+  if (s->hold_piece != b->drawn_hold_piece) {
+    lines |= ComposePreview(b, s->hold_piece, HOLD_X);
+  }
+  return lines;
+}
+
+// Encodes the differences between the screen and the next screen in the
+// given lines into the scratch buffer, and makes the screen match. Returns
+// the number of bytes encoded, or 0 if nothing changed or on error.
+static size_t EncodeDiff(TetrisBroadcast *b, uint64_t lines) {
+  size_t size = 0;
+  int y, x, run_start, run_end;
+  for (y = 0; y < BROADCAST_LINES; y++) {
+    if (!(lines & (((uint64_t) 1) << y))) continue;
+    x = 0;
+    while (x < BROADCAST_COLUMNS) {
+      if (b->screen[y][x] == b->next[y][x]) {
+        x++;
+        continue;
+      }
+      // Extend the run over every change that's close to the previous one.
+      run_start = x;
+      run_end = x + 1;
+      for (x = run_end; x < BROADCAST_COLUMNS; x++) {
+        if (b->screen[y][x] == b->next[y][x]) {
+          if ((x - run_end) >= MIN_CURSOR_MOVE) break;
+          continue;
+        }
+        run_end = x + 1;
+      }
+      if (!EmitMove(b, &size, y, run_start) ||
+        !Emit(b, &size, b->next[y] + run_start, run_end - run_start)) {
+        return 0;
+      }
+      x = run_end;
+    }
+    memcpy(b->screen[y], b->next[y], BROADCAST_COLUMNS);
+  }
+  return size;
+}
+
+// Disconnects a spectator, releasing their queued frames.
+static void CloseClient(TetrisBroadcast *b, BroadcastClient *c) {
+  int i;
+  if (c->fd < 0) return;
+  epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  for (i = 0; i < c->queue_count; i++) {
+    ReleaseFrame(c->queue[(c->queue_start + i) % BROADCAST_MAX_QUEUED_FRAMES]);
+  }
+  c->queue_count = 0;
+  b->client_count--;
+}
+
+// Adds a frame to the end of a spectator's queue.
+static void QueueFrame(BroadcastClient *c, BroadcastFrame *f) {
+  int i = (c->queue_start + c->queue_count) % BROADCAST_MAX_QUEUED_FRAMES;
+  c->queue[i] = f;
+  c->queue_count++;
+  f->references++;
+}
+
+// Empties a spectator's queue so they get a keyframe next, except for a frame
+// that's partly sent, which must be finished so its escape sequences aren't
+// cut off.
+static void DropToKeyframe(BroadcastClient *c) {
+  int keep = (c->sent > 0) ? 1 : 0, i;
+  for (i = keep; i < c->queue_count; i++) {
+    ReleaseFrame(c->queue[(c->queue_start + i) % BROADCAST_MAX_QUEUED_FRAMES]);
+  }
+  c->queue_count = keep;
+  c->needs_keyframe = 1;
+}
+
+// Sends as much of a spectator's queue as the socket will take, in one
+// sendmsg() per batch of frames, and polls for writability if any is left.
+// Disconnects them on error.
+static void SendFrames(TetrisBroadcast *b, BroadcastClient *c) {
+  struct iovec iov[MAX_IOVECS];
+  struct epoll_event event;
+  struct msghdr message;
+  BroadcastFrame *f;
+  ssize_t sent;
+  int count, i, want_output;
+  while (1) {
+    if (c->needs_keyframe && (c->queue_count == 0)) {
+      f = CurrentKeyframe(b);
+      if (!f) {
+        CloseClient(b, c);
+        return;
+      }
+      QueueFrame(c, f);
+      c->needs_keyframe = 0;
+      b->keyframes_sent++;
+    }
+    if (c->queue_count == 0) break;
+    count = (c->queue_count < MAX_IOVECS) ? c->queue_count : MAX_IOVECS;
+    for (i = 0; i < count; i++) {
+      f = c->queue[(c->queue_start + i) % BROADCAST_MAX_QUEUED_FRAMES];
+      iov[i].iov_base = f->data;
+      iov[i].iov_len = f->size;
+    }
+    iov[0].iov_base = c->queue[c->queue_start]->data + c->sent;
+    iov[0].iov_len -= c->sent;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    // Unlike writev(), this can be told not to raise SIGPIPE.
+    sent = sendmsg(c->fd, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      CloseClient(b, c);
+      return;
+    }
+    sent += c->sent;
+    while ((c->queue_count > 0) &&
+      (((size_t) sent) >= c->queue[c->queue_start]->size)) {
+      sent -= c->queue[c->queue_start]->size;
+      ReleaseFrame(c->queue[c->queue_start]);
+      c->queue_start = (c->queue_start + 1) % BROADCAST_MAX_QUEUED_FRAMES;
+      c->queue_count--;
+    }
+    c->sent = sent;
+    if (c->sent > 0) break;
+  }
+  want_output = c->queue_count > 0;
+  if (want_output == c->polling_output) return;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | (want_output ? EPOLLOUT : 0);
+  event.data.u32 = c - b->clients;
+  if (epoll_ctl(b->epoll_fd, EPOLL_CTL_MOD, c->fd, &event) != 0) {
+    CloseClient(b, c);
+    return;
+  }
+  c->polling_output = want_output;
+}
+
+int StartBroadcast(TetrisBroadcast *b, uint16_t port, int max_clients) {
+  struct sockaddr_in address;
+  struct epoll_event event;
+  int one = 1, i;
+  memset(b, 0, sizeof(*b));
+  b->listen_fd = -1;
+  b->epoll_fd = -1;
+  b->max_clients = max_clients;
+  b->drawn_piece = -1;
+  DrawLayout(b->screen);
+  b->clients = (BroadcastClient *) calloc(max_clients,
+    sizeof(BroadcastClient));
+  b->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (!b->clients || (b->epoll_fd < 0)) {
+    printf("Failed setting up the broadcast: %s\n", strerror(errno));
+    StopBroadcast(b);
+    return 0;
+  }
+  for (i = 0; i < max_clients; i++) b->clients[i].fd = -1;
+  b->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (b->listen_fd < 0) {
+    printf("Failed creating a socket: %s\n", strerror(errno));
+    StopBroadcast(b);
+    return 0;
+  }
+  setsockopt(b->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = LISTEN_EVENT;
+  if ((bind(b->listen_fd, (struct sockaddr *) &address,
+    sizeof(address)) != 0) || (listen(b->listen_fd, SOMAXCONN) != 0) ||
+    !SetNonblocking(b->listen_fd) ||
+    (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, b->listen_fd, &event) != 0)) {
+    printf("Failed listening on port %d: %s\n", port, strerror(errno));
+    StopBroadcast(b);
+    return 0;
+  }
+  return 1;
+}
+
+void StopBroadcast(TetrisBroadcast *b) {
+  int i;
+  if (b->clients) {
+    for (i = 0; i < b->max_clients; i++) CloseClient(b, b->clients + i);
+  }
+  if (b->listen_fd >= 0) close(b->listen_fd);
+  if (b->epoll_fd >= 0) close(b->epoll_fd);
+  if (b->keyframe) ReleaseFrame(b->keyframe);
+  free(b->clients);
+  free(b->scratch);
+  b->clients = NULL;
+  b->scratch = NULL;
+  b->keyframe = NULL;
+  b->listen_fd = -1;
+  b->epoll_fd = -1;
+}
+
+void BroadcastGameState(TetrisBroadcast *b, TetrisGameState *s) {
+  TetrisRowSet rows = s->dirty_rows;
+  BroadcastFrame *f;
+  BroadcastClient *c;
+  uint64_t lines;
+  size_t size;
+  int i, ghost_y = LandingY(s);
+  // Dirty rows are compared against what spectators were last sent, so only
+  // the cells that actually changed are sent.
+  if (b->drawn_piece < 0) rows = ALL_ROWS_DIRTY;
+  if (b->drawn_piece >= 0) {
+    rows |= CoveredRows(b->drawn_piece, b->drawn_y) |
+      CoveredRows(b->drawn_piece, b->drawn_ghost_y);
+  }
+  if ((s->current_piece != b->drawn_piece) || (s->location_x != b->drawn_x) ||
+    (s->location_y != b->drawn_y) || (ghost_y != b->drawn_ghost_y)) {
+    rows |= CoveredRows(s->current_piece, s->location_y) |
+      CoveredRows(s->current_piece, ghost_y);
+  }
+  if (b->drawn_piece < 0) {
+    b->drawn_score = ~s->score;
+    b->drawn_lines = ~s->lines;
+    b->drawn_next_piece = -1;
+    // The hold starts out empty, which is already what's on the screen.
+    b->drawn_hold_piece = -1;
+  }
+  // Whatever isn't composed again stays as it is.
+  memcpy(b->next, b->screen, sizeof(b->next));
+  lines = ComposeBoard(b, s, rows, ghost_y) | ComposeInfo(b, s);
+  b->drawn_piece = s->current_piece;
+  b->drawn_x = s->location_x;
+  b->drawn_y = s->location_y;
+  b->drawn_ghost_y = ghost_y;
+  b->drawn_next_piece = QueuedPiece(s, 0);
+  b->drawn_hold_piece = s->hold_piece;
+  b->drawn_score = s->score;
+  b->drawn_lines = s->lines;
+  if (!lines) return;
+  size = EncodeDiff(b, lines);
+  if (size == 0) return;
+  if (b->keyframe) {
+    ReleaseFrame(b->keyframe);
+    b->keyframe = NULL;
+  }
+  b->frames++;
+  b->frame_bytes += size;
+  if (b->client_count == 0) return;
+  // Hold a reference while fanning the frame out, since sending it may
+  // release everyone else's.
+  f = NewFrame(b, size);
+  if (f) f->references = 1;
+  // Without the frame, everyone's screen is out of date.
+  for (i = 0; i < b->max_clients; i++) {
+    c = b->clients + i;
+    if (c->fd < 0) continue;
+    if (!f || (c->queue_count >= BROADCAST_MAX_QUEUED_FRAMES)) {
+      DropToKeyframe(c);
+    }
+    if (f && !c->needs_keyframe) QueueFrame(c, f);
+    SendFrames(b, c);
+  }
+  if (f) ReleaseFrame(f);
+}
+
+// Accepts every waiting spectator. Those past the limit are disconnected.
+static void AcceptSpectators(TetrisBroadcast *b) {
+  static const uint8_t negotiation[] = {TELNET_IAC, TELNET_WILL, TELNET_ECHO,
+    TELNET_IAC, TELNET_WILL, TELNET_SUPPRESS_GO_AHEAD};
+  static const char full_message[] = "Sorry, too many spectators.\r\n";
+  struct epoll_event event;
+  BroadcastClient *c = NULL;
+  int fd, one = 1, i;
+  while (1) {
+    fd = accept(b->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+      return;
+    }
+    for (i = 0; i < b->max_clients; i++) {
+      c = b->clients + i;
+      if (c->fd < 0) break;
+    }
+    if (i == b->max_clients) {
+      send(fd, full_message, strlen(full_message), MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    b->client_count++;
+    if (!SetNonblocking(fd) ||
+      (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)) {
+      CloseClient(b, c);
+      continue;
+    }
+    b->spectators++;
+    if (b->client_count > b->most_clients) b->most_clients = b->client_count;
+    // The negotiation is tiny, and the socket is empty, so it always fits.
+    send(fd, negotiation, sizeof(negotiation), MSG_NOSIGNAL);
+    c->needs_keyframe = 1;
+    SendFrames(b, c);
+  }
+}
+
+// Discards whatever a spectator sent, and disconnects them if they left.
+static void ReadSpectator(TetrisBroadcast *b, BroadcastClient *c) {
+  uint8_t buffer[512];
+  ssize_t length;
+  while (1) {
+    length = read(c->fd, buffer, sizeof(buffer));
+    if (length > 0) continue;
+    if ((length < 0) && (errno == EINTR)) continue;
+    if ((length < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return;
+    CloseClient(b, c);
+    return;
+  }
+}
+
+void ServiceBroadcast(TetrisBroadcast *b) {
+  struct epoll_event events[MAX_EVENTS];
+  BroadcastClient *c;
+  int count, i;
+  while (1) {
+    count = epoll_wait(b->epoll_fd, events, MAX_EVENTS, 0);
+    if ((count < 0) && (errno == EINTR)) continue;
+    if (count <= 0) return;
+    for (i = 0; i < count; i++) {
+      if (events[i].data.u32 == LISTEN_EVENT) {
+        AcceptSpectators(b);
+        continue;
+      }
+      c = b->clients + events[i].data.u32;
+      if (c->fd < 0) continue;
+      if (events[i].events & EPOLLOUT) SendFrames(b, c);
+      if ((c->fd >= 0) && (events[i].events & (EPOLLIN | EPOLLHUP |
+        EPOLLERR))) {
+        ReadSpectator(b, c);
+      }
+    }
+    if (count < MAX_EVENTS) return;
+  }
+}
@@ -0,0 +1,120 @@
+#ifndef TETRIS_BROADCAST_H
+#define TETRIS_BROADCAST_H
+// This file defines broadcasts: a game shown live to any number of spectators
+// connected with telnet. The broadcast keeps its own copy of the spectators'
+// screen, and each frame, only the board rows the engine marked dirty (plus
+// the rows the falling piece and its ghost left or entered) are composed
+// again and compared against it. The cells that changed are encoded once, as
+// terminal escape sequences, into a reference-counted frame buffer that every
+// spectator's queue shares, and each spectator's queue is sent with a single
+// scatter-gather sendmsg(). So the cost of a frame per spectator is queueing
+// a pointer and the kernel copying its bytes, however many are watching.
+//
+// A spectator whose queue fills up, because they aren't reading fast enough,
+// has it emptied and gets a keyframe instead: the whole screen, encoded once
+// per frame for everyone who needs one (including newly connected
+// spectators), followed by the frames after it. A slow spectator skips
+// frames rather than slowing down the game or anyone else.
+//
+// Like the engine, this doesn't depend on curses; it writes the escape
+// sequences itself. The frontend polls the broadcast's epoll instance along
+// with the terminal.
+#include <stddef.h>
+#include <stdint.h>
+#include "tetris_engine.h"
+
+// The most frames queued for a spectator before they're switched to a
+// keyframe.
+#define BROADCAST_MAX_QUEUED_FRAMES (64)
+
+// The most spectators watching at once, unless another limit is given.
+#define DEFAULT_MAX_SPECTATORS (1024)
+
+// The spectators' screen: the board in a box, with the score, line count and
+// next piece to its right, and the held piece beside the next one.
+#define BROADCAST_LINES (BLOCKS_TALL + 2)
+#define BROADCAST_COLUMNS ((BLOCKS_WIDE * 2) + 2 + 26)
+
+#if BROADCAST_LINES > 64
+#error "Broadcasts only support boards up to 62 rows tall."
+#endif
+
+// An encoded frame, shared by every spectator it's queued for. It's freed
+// when the last of them has sent it.
+typedef struct {
+  int references;
+  size_t size;
+  uint8_t data[];
+} BroadcastFrame;
+
+typedef struct {
+  // The connected socket, or -1 if this slot is free.
+  int fd;
+  // The frames waiting to be sent, oldest first, as a ring starting at
+  // queue_start, and the number of bytes of the oldest already sent.
+  BroadcastFrame *queue[BROADCAST_MAX_QUEUED_FRAMES];
+  int queue_start;
+  int queue_count;
+  size_t sent;
+  // Nonzero if the spectator needs a keyframe before the next frame.
+  int needs_keyframe;
+  // Nonzero if the socket is being polled for writability, which is only
+  // needed while frames are waiting.
+  int polling_output;
+} BroadcastClient;
+
+typedef struct {
+  int listen_fd;
+  // Polls the listening socket and every spectator's socket. It's readable
+  // whenever one of them needs ServiceBroadcast.
+  int epoll_fd;
+  BroadcastClient *clients;
+  int max_clients;
+  int client_count;
+  // What every spectator whose queue is empty is looking at, and the screen
+  // being composed for the next frame.
+  char screen[BROADCAST_LINES][BROADCAST_COLUMNS];
+  char next[BROADCAST_LINES][BROADCAST_COLUMNS];
+  // The part of the game shown on the screen, so only changes are composed.
+  // drawn_piece is -1 if the screen shows no game yet.
+  short drawn_piece;
+  int drawn_x;
+  int drawn_y;
+  int drawn_ghost_y;
+  short drawn_next_piece;
+  short drawn_hold_piece;
+  unsigned drawn_score;
+  unsigned drawn_lines;
+  // The keyframe for the current screen, or NULL if it hasn't been encoded
+  // since the screen last changed.
+  BroadcastFrame *keyframe;
+  // Where frames are encoded before being copied into a BroadcastFrame.
+  uint8_t *scratch;
+  size_t scratch_capacity;
+  // Counters, printed when the game exits.
+  uint64_t frames;
+  uint64_t frame_bytes;
+  uint64_t keyframes;
+  uint64_t keyframes_sent;
+  uint64_t spectators;
+  int most_clients;
+} TetrisBroadcast;
+
+// Starts listening for spectators on the given port, allowing at most
+// max_clients at once. Returns 0 and prints an error on failure.
+int StartBroadcast(TetrisBroadcast *b, uint16_t port, int max_clients);
+
+// Disconnects every spectator and stops listening.
+void StopBroadcast(TetrisBroadcast *b);
+
+// Sends every spectator whatever changed in the game since the last call.
+// Must be called before the game's dirty_rows are cleared by drawing it, since
+// they're used to find what changed.
+void BroadcastGameState(TetrisBroadcast *b, TetrisGameState *s);
+
+// Accepts new spectators, discards whatever spectators send, drops those who
+// disconnected, and sends queued frames to those who can take them. Never
+// blocks. Should be called whenever epoll_fd is readable.
+void ServiceBroadcast(TetrisBroadcast *b);
+
+#endif  // TETRIS_BROADCAST_H
@@ -0,0 +1,421 @@
+// Implements the game databases described in tetris_db.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tetris_db.h"
+#include "tetris_replay.h"
+#include "tetris_save.h"
+
+// The offsets of the fields in a game's record.
+#define RECORD_SEED (0)
+#define RECORD_TICK_RATE (8)
+#define RECORD_RANDOMIZER (12)
+#define RECORD_BOARD_WIDTH (13)
+#define RECORD_BOARD_HEIGHT (14)
+#define RECORD_SCORE (16)
+#define RECORD_LINES (20)
+#define RECORD_PIECES (24)
+#define RECORD_LOG_SIZE (36)
+#define RECORD_LOG_CRC (40)
+
+static void PutU32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void PutU64(uint8_t *p, uint64_t v) {
+  PutU32(p, v);
+  PutU32(p + 4, v >> 32);
+}
+
+static uint32_t GetU32(const uint8_t *p) {
+  return ((uint32_t) p[0]) | (((uint32_t) p[1]) << 8) |
+    (((uint32_t) p[2]) << 16) | (((uint32_t) p[3]) << 24);
+}
+
+static uint64_t GetU64(const uint8_t *p) {
+  return ((uint64_t) GetU32(p)) | (((uint64_t) GetU32(p + 4)) << 32);
+}
+
+// Fills in the header of a data or index file.
+static void EncodeFileHeader(const char *magic, uint8_t *header) {
+  memset(header, 0, GAME_DB_HEADER_SIZE);
+  memcpy(header, magic, 4);
+  header[4] = GAME_DB_VERSION & 0xff;
+  header[5] = GAME_DB_VERSION >> 8;
+}
+
+// Returns nonzero if header is a valid header for a data or index file.
+static int CheckFileHeader(const char *magic, const uint8_t *header) {
+  if (memcmp(header, magic, 4) != 0) return 0;
+  return (header[4] | (header[5] << 8)) == GAME_DB_VERSION;
+}
+
+// Returns the path of a database's index file, which the caller must free.
+// Returns NULL and sets errno on error.
+static char* IndexPath(const char *path) {
+  size_t length = strlen(path);
+  char *index_path = (char *) malloc(length + sizeof(GAME_DB_INDEX_SUFFIX));
+  if (!index_path) return NULL;
+  memcpy(index_path, path, length);
+  memcpy(index_path + length, GAME_DB_INDEX_SUFFIX,
+    sizeof(GAME_DB_INDEX_SUFFIX));
+  return index_path;
+}
+
+// Opens one of a database's files for reading and writing, creating it with
+// the given header if it doesn't exist or is empty. Returns the file, and sets
+// *size to its size, or returns NULL and sets errno on error.
+static FILE* OpenDBFile(const char *path, const char *magic, uint64_t *size) {
+  uint8_t header[GAME_DB_HEADER_SIZE];
+  struct stat st;
+  FILE *f = fopen(path, "r+b");
+  if (!f && (errno == ENOENT)) f = fopen(path, "w+b");
+  if (!f) return NULL;
+  if (fstat(fileno(f), &st) != 0) goto error;
+  if (st.st_size == 0) {
+    EncodeFileHeader(magic, header);
+    if ((fwrite(header, sizeof(header), 1, f) < 1) || (fflush(f) != 0)) {
+      goto error;
+    }
+    *size = sizeof(header);
+    return f;
+  }
+  if ((fread(header, sizeof(header), 1, f) < 1) ||
+    !CheckFileHeader(magic, header)) {
+    errno = EINVAL;
+    goto error;
+  }
+  *size = st.st_size;
+  return f;
+error:
+  fclose(f);
+  return NULL;
+}
+
+// Drops the games at the end of the index whose records don't fit in the
+// data file, which happens if adding them was interrupted, and cuts off
+// anything in either file after the last complete game. Returns 0 and sets
+// errno on error.
+static int DiscardIncompleteGames(GameDBWriter *w, uint64_t index_size) {
+  uint8_t entry[8], record[GAME_DB_RECORD_SIZE];
+  uint64_t offset, end = GAME_DB_HEADER_SIZE;
+  w->count = (index_size - GAME_DB_HEADER_SIZE) / 8;
+  while (w->count > 0) {
+    if ((fseek(w->index, GAME_DB_HEADER_SIZE + (w->count - 1) * 8,
+      SEEK_SET) != 0) || (fread(entry, sizeof(entry), 1, w->index) < 1)) {
+      return 0;
+    }
+    offset = GetU64(entry);
+    if ((offset >= GAME_DB_HEADER_SIZE) &&
+      ((offset + GAME_DB_RECORD_SIZE) <= w->data_size)) {
+      if ((fseek(w->data, offset, SEEK_SET) != 0) ||
+        (fread(record, sizeof(record), 1, w->data) < 1)) {
+        return 0;
+      }
+      end = offset + GAME_DB_RECORD_SIZE + GetU32(record + RECORD_LOG_SIZE);
+      if (end <= w->data_size) break;
+    }
+    w->count--;
+    end = GAME_DB_HEADER_SIZE;
+  }
+  if ((end < w->data_size) && (ftruncate(fileno(w->data), end) != 0)) {
+    return 0;
+  }
+  w->data_size = end;
+  index_size = GAME_DB_HEADER_SIZE + w->count * 8;
+  if (ftruncate(fileno(w->index), index_size) != 0) return 0;
+  // Whatever follows is appended.
+  if (fseek(w->data, 0, SEEK_END) != 0) return 0;
+  return fseek(w->index, 0, SEEK_END) == 0;
+}
+
+int OpenGameDBWriter(GameDBWriter *w, const char *path) {
+  uint64_t index_size = 0;
+  char *index_path;
+  int saved_errno;
+  memset(w, 0, sizeof(*w));
+  index_path = IndexPath(path);
+  if (!index_path) return 0;
+  w->data = OpenDBFile(path, GAME_DB_MAGIC, &w->data_size);
+  if (w->data) {
+    w->index = OpenDBFile(index_path, GAME_DB_INDEX_MAGIC, &index_size);
+  }
+  saved_errno = errno;
+  free(index_path);
+  errno = saved_errno;
+  if (w->index && DiscardIncompleteGames(w, index_size)) return 1;
+  saved_errno = errno;
+  if (w->data) fclose(w->data);
+  if (w->index) fclose(w->index);
+  memset(w, 0, sizeof(*w));
+  errno = saved_errno;
+  return 0;
+}
+
+int AppendGame(GameDBWriter *w, GameSummary *summary, const uint8_t *log,
+  size_t log_size) {
+  uint8_t record[GAME_DB_RECORD_SIZE], entry[8];
+  memset(record, 0, sizeof(record));
+  PutU64(record + RECORD_SEED, summary->config.seed);
+  PutU32(record + RECORD_TICK_RATE, summary->config.tick_rate);
+  record[RECORD_RANDOMIZER] = summary->config.randomizer;
+  record[RECORD_BOARD_WIDTH] = summary->board_width;
+  record[RECORD_BOARD_HEIGHT] = summary->board_height;
+  PutU32(record + RECORD_SCORE, summary->score);
+  PutU32(record + RECORD_LINES, summary->lines);
+  PutU32(record + RECORD_PIECES, summary->pieces);
+  PutU32(record + RECORD_LOG_SIZE, log_size);
+  PutU32(record + RECORD_LOG_CRC, SaveCRC32(log, log_size));
+  PutU64(entry, w->data_size);
+  if ((fwrite(record, sizeof(record), 1, w->data) < 1) ||
+    ((log_size > 0) && (fwrite(log, log_size, 1, w->data) < 1)) ||
+    (fwrite(entry, sizeof(entry), 1, w->index) < 1)) {
+    return 0;
+  }
+  w->data_size += sizeof(record) + log_size;
+  w->count++;
+  return 1;
+}
+
+int CloseGameDBWriter(GameDBWriter *w) {
+  int ok = 1, saved_errno = 0;
+  // The data goes first, so the index never refers to records that aren't
+  // there.
+  if (fclose(w->data) != 0) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if ((fclose(w->index) != 0) && ok) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  memset(w, 0, sizeof(*w));
+  if (!ok) errno = saved_errno;
+  return ok;
+}
+
+// Maps the whole file at path for reading. Returns NULL and sets errno on
+// error.
+static const uint8_t* MapFile(const char *path, size_t *size) {
+  struct stat st;
+  void *data;
+  int saved_errno, fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0) goto error;
+  if (st.st_size < GAME_DB_HEADER_SIZE) {
+    errno = EINVAL;
+    goto error;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) goto error;
+  // The mapping stays valid without the descriptor.
+  close(fd);
+  *size = st.st_size;
+  return (const uint8_t *) data;
+error:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return NULL;
+}
+
+// Returns nonzero if a whole record fits in the data file at offset, after the
+// header. Nothing is subtracted from data_size, so a data file shorter than a
+// record can't wrap around.
+static int RecordFits(GameDB *db, uint64_t offset) {
+  if ((offset < GAME_DB_HEADER_SIZE) || (offset > db->data_size)) return 0;
+  return (db->data_size - offset) >= GAME_DB_RECORD_SIZE;
+}
+
+int OpenGameDB(GameDB *db, const char *path) {
+  char *index_path;
+  uint64_t k;
+  int saved_errno;
+  memset(db, 0, sizeof(*db));
+  index_path = IndexPath(path);
+  if (!index_path) return 0;
+  db->data = MapFile(path, &db->data_size);
+  if (db->data) db->index = MapFile(index_path, &db->index_size);
+  saved_errno = errno;
+  free(index_path);
+  errno = saved_errno;
+  if (!db->index) goto error;
+  if (!CheckFileHeader(GAME_DB_MAGIC, db->data) ||
+    !CheckFileHeader(GAME_DB_INDEX_MAGIC, db->index)) {
+    errno = EINVAL;
+    goto error;
+  }
+  db->count = (db->index_size - GAME_DB_HEADER_SIZE) / 8;
+  // MapFile already rejected files shorter than their headers. An index
+  // pointing past the end of the data file (e.g. if the data file was
+  // truncated) would make reading the missing records fault, so it's
+  // rejected here, before any record is read.
+  for (k = 0; k < db->count; k++) {
+    if (!RecordFits(db, GetU64(db->index + GAME_DB_HEADER_SIZE + k * 8))) {
+      errno = EINVAL;
+      goto error;
+    }
+  }
+  return 1;
+error:
+  saved_errno = errno;
+  CloseGameDB(db);
+  errno = saved_errno;
+  return 0;
+}
+
+void CloseGameDB(GameDB *db) {
+  if (db->data) munmap((void *) db->data, db->data_size);
+  if (db->index) munmap((void *) db->index, db->index_size);
+  memset(db, 0, sizeof(*db));
+}
+
+// Returns game k's record, or NULL if there is no such game or its record
+// doesn't fit in the data file. Its log isn't checked.
+static const uint8_t* GameRecord(GameDB *db, uint64_t k) {
+  uint64_t offset;
+  if (k >= db->count) return NULL;
+  offset = GetU64(db->index + GAME_DB_HEADER_SIZE + k * 8);
+  if (!RecordFits(db, offset)) return NULL;
+  return db->data + offset;
+}
+
+int ReadGame(GameDB *db, uint64_t k, GameSummary *summary,
+  const uint8_t **log, size_t *log_size) {
+  const uint8_t *record = GameRecord(db, k);
+  uint32_t size;
+  if (!record) return 0;
+  size = GetU32(record + RECORD_LOG_SIZE);
+  if (size > (db->data + db->data_size - record - GAME_DB_RECORD_SIZE)) {
+    return 0;
+  }
+  if (SaveCRC32(record + GAME_DB_RECORD_SIZE, size) !=
+    GetU32(record + RECORD_LOG_CRC)) {
+    return 0;
+  }
+  memset(summary, 0, sizeof(*summary));
+  summary->config.seed = GetU64(record + RECORD_SEED);
+  summary->config.tick_rate = GetU32(record + RECORD_TICK_RATE);
+  summary->config.randomizer = record[RECORD_RANDOMIZER];
+  summary->board_width = record[RECORD_BOARD_WIDTH];
+  summary->board_height = record[RECORD_BOARD_HEIGHT];
+  summary->score = GetU32(record + RECORD_SCORE);
+  summary->lines = GetU32(record + RECORD_LINES);
+  summary->pieces = GetU32(record + RECORD_PIECES);
+  *log = record + GAME_DB_RECORD_SIZE;
+  *log_size = size;
+  return 1;
+}
+
+// Returns nonzero if game a ranks above game b in TopScores.
+static int RanksAbove(uint32_t score_a, uint64_t a, uint32_t score_b,
+  uint64_t b) {
+  if (score_a != score_b) return score_a > score_b;
+  return a < b;
+}
+
+// Returns the score of a game whose record is known to exist.
+static uint32_t GameScore(GameDB *db, uint64_t k) {
+  return GetU32(GameRecord(db, k) + RECORD_SCORE);
+}
+
+// Moves the game at position i of a heap down until neither of its children
+// ranks below it, so the lowest-ranked game is at the top.
+static void SiftDown(GameDB *db, uint64_t *heap, size_t count, size_t i) {
+  size_t child;
+  uint64_t tmp;
+  while (1) {
+    child = i * 2 + 1;
+    if (child >= count) return;
+    if (((child + 1) < count) && RanksAbove(GameScore(db, heap[child]),
+      heap[child], GameScore(db, heap[child + 1]), heap[child + 1])) {
+      child++;
+    }
+    if (!RanksAbove(GameScore(db, heap[i]), heap[i],
+      GameScore(db, heap[child]), heap[child])) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+size_t TopScores(GameDB *db, size_t n, uint64_t *games) {
+  size_t count = 0, i;
+  uint64_t k, tmp;
+  uint32_t score;
+  if (n == 0) return 0;
+  // Keep the best n games seen so far in a heap with the worst of them on
+  // top, so each game is compared against it and usually discarded at once.
+  for (k = 0; k < db->count; k++) {
+    if (!GameRecord(db, k)) continue;
+    if (count < n) {
+      games[count] = k;
+      count++;
+      if (count < n) continue;
+      for (i = count / 2; i > 0; i--) SiftDown(db, games, count, i - 1);
+      continue;
+    }
+    score = GameScore(db, k);
+    if (!RanksAbove(score, k, GameScore(db, games[0]), games[0])) continue;
+    games[0] = k;
+    SiftDown(db, games, count, 0);
+  }
+  if (count < n) {
+    for (i = count / 2; i > 0; i--) SiftDown(db, games, count, i - 1);
+  }
+  // Taking the worst game off the top each time leaves the rest best first.
+  for (i = count; i > 1; i--) {
+    tmp = games[0];
+    games[0] = games[i - 1];
+    games[i - 1] = tmp;
+    SiftDown(db, games, i - 1, 0);
+  }
+  return count;
+}
+
+void ResetReplayBuffer(ReplayBuffer *b) {
+  b->size = 0;
+  b->last_tick = 0;
+}
+
+// Adds a single record to a buffer.
+static int BufferRecord(ReplayBuffer *b, uint64_t tick, int input) {
+  size_t new_capacity;
+  uint8_t *new_data;
+  if ((b->size + REPLAY_MAX_RECORD_SIZE) > b->capacity) {
+    new_capacity = b->capacity ? (b->capacity * 2) : 4096;
+    new_data = (uint8_t *) realloc(b->data, new_capacity);
+    if (!new_data) return 0;
+    b->data = new_data;
+    b->capacity = new_capacity;
+  }
+  b->size += EncodeReplayRecord(tick - b->last_tick, input,
+    b->data + b->size);
+  b->last_tick = tick;
+  return 1;
+}
+
+int BufferInput(ReplayBuffer *b, uint64_t tick, int input) {
+  if (input == TETRIS_INPUT_NONE) return 1;
+  return BufferRecord(b, tick, input);
+}
+
+int BufferGameEnd(ReplayBuffer *b, uint64_t final_tick) {
+  return BufferRecord(b, final_tick, TETRIS_INPUT_NONE);
+}
+
+void DestroyReplayBuffer(ReplayBuffer *b) {
+  free(b->data);
+  memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,143 @@
+#ifndef TETRIS_DB_H
+#define TETRIS_DB_H
+// This file defines game databases: append-only files holding any number of
+// finished games, each as a summary and its replay log, so large collections
+// of games (e.g. from tetris-sim) don't need a file each. A database is read
+// through mmap(), so looking up a game, or scanning every game's summary,
+// never reads the replay logs of the games that aren't needed. Like the rest
+// of the engine, this doesn't depend on curses.
+//
+// A database is two files, written in little-endian order like saves:
+//
+//   The data file (at the database's path):
+//     16 bytes: GAME_DB_MAGIC, format version (2 bytes), 10 reserved bytes
+//     Then, for each game, a GAME_DB_RECORD_SIZE-byte record:
+//       8 bytes: seed
+//       4 bytes: tick_rate
+//       1 byte each: randomizer, board width, board height, reserved (0)
+//       4 bytes each: score, lines, pieces (the length of the game)
+//       8 bytes: reserved, must be 0
+//       4 bytes: the length of the replay log, in bytes
+//       4 bytes: CRC-32 of the replay log
+//       4 bytes: reserved, must be 0
+//     followed by the game's replay log, without its header (see
+//     tetris_replay.h).
+//
+//   The index file (at the path with GAME_DB_INDEX_SUFFIX appended):
+//     16 bytes: GAME_DB_INDEX_MAGIC, format version (2 bytes), 10 reserved
+//       bytes
+//     8 bytes per game: the offset of its record in the data file.
+//
+// Games are numbered from 0 in the order they were added. A game is added by
+// appending its record to the data file, and then its offset to the index,
+// so a game interrupted partway through being added is never in the index.
+// Opening a database for writing discards anything such a game left behind.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "tetris_engine.h"
+
+#define GAME_DB_MAGIC "TTDB"
+#define GAME_DB_INDEX_MAGIC "TTDI"
+#define GAME_DB_VERSION (1)
+#define GAME_DB_HEADER_SIZE (16)
+#define GAME_DB_RECORD_SIZE (48)
+#define GAME_DB_INDEX_SUFFIX ".index"
+
+// The summary of a game stored in a database.
+typedef struct {
+  // The config the game was started with, which is all that's needed to
+  // replay it along with its log.
+  TetrisGameConfig config;
+  // The size of the board the game was played on.
+  int board_width;
+  int board_height;
+  // The game's result.
+  unsigned score;
+  unsigned lines;
+  // The number of pieces placed, which is how long the game lasted. Games
+  // are recorded by tetris-sim, which places pieces without running the
+  // game's clock, so a duration in ticks would always be 0.
+  uint32_t pieces;
+} GameSummary;
+
+// Adds games to a database.
+typedef struct {
+  FILE *data;
+  FILE *index;
+  // The size of the data file, including anything not yet flushed.
+  uint64_t data_size;
+  // The number of games in the database.
+  uint64_t count;
+} GameDBWriter;
+
+// A database opened for reading. The files are only mapped, not read, so
+// opening a database only reads its index, to check that every game's record
+// is within the data file.
+typedef struct {
+  const uint8_t *data;
+  size_t data_size;
+  const uint8_t *index;
+  size_t index_size;
+  // The number of games in the index.
+  uint64_t count;
+} GameDB;
+
+// Builds a replay log's records in memory, in the same format
+// ReplayWriter writes to a file.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  // The tick of the last record written.
+  uint64_t last_tick;
+} ReplayBuffer;
+
+// Opens the database at path for adding games, creating it if it doesn't
+// exist. Returns 0 and sets errno on error; EINVAL means the files exist but
+// aren't a database.
+int OpenGameDBWriter(GameDBWriter *w, const char *path);
+
+// Adds a game, with the replay log records in log, to the database. Returns 0
+// and sets errno on error.
+int AppendGame(GameDBWriter *w, GameSummary *summary, const uint8_t *log,
+  size_t log_size);
+
+// Flushes the database and closes it. Returns 0 and sets errno on error; the
+// files are closed either way.
+int CloseGameDBWriter(GameDBWriter *w);
+
+// Maps the database at path for reading. Returns 0 and sets errno on error;
+// EINVAL means the files aren't a database, or the index refers to records
+// past the end of the data file.
+int OpenGameDB(GameDB *db, const char *path);
+
+// Unmaps a database.
+void CloseGameDB(GameDB *db);
+
+// Looks up game number k, filling in its summary and pointing log at its
+// replay log records, which stay valid until the database is closed. Returns
+// 0 if there is no such game, or its record is damaged.
+int ReadGame(GameDB *db, uint64_t k, GameSummary *summary,
+  const uint8_t **log, size_t *log_size);
+
+// Finds the (up to) n games with the highest scores, reading only their
+// summaries. Fills in games with their numbers, best first, with ties going to
+// the earlier game. Returns the number found.
+size_t TopScores(GameDB *db, size_t n, uint64_t *games);
+
+// Removes every record from a buffer, to start logging a new game.
+void ResetReplayBuffer(ReplayBuffer *b);
+
+// Adds a record to a buffer, as RecordInput does. Returns 0 if the buffer
+// couldn't be grown.
+int BufferInput(ReplayBuffer *b, uint64_t tick, int input);
+
+// Adds the end-of-game record to a buffer. Returns 0 if the buffer couldn't
+// be grown.
+int BufferGameEnd(ReplayBuffer *b, uint64_t final_tick);
+
+// Frees a buffer's memory.
+void DestroyReplayBuffer(ReplayBuffer *b);
+
+#endif  // TETRIS_DB_H
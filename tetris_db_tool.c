@@ -0,0 +1,188 @@
+// A program for querying the game databases that tetris-sim --record-db
+// writes (see tetris_db.h): counting their games, listing the best scores,
+// replaying a game to check its result, and exporting a game as a replay log
+// that `tetris --replay` can play. The database is only mapped, so each
+// command reads the summaries and logs it needs and nothing else.
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_db.h"
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_replay.h"
+#include "tetris_sched.h"
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s <database> <command>\n"
+    "Commands:\n"
+    "  count: Print the number of games in the database.\n"
+    "  top <n>: List the <n> games with the highest scores, best first.\n"
+    "  replay <game>: Replay game number <game>, and check that it ends with\n"
+    "    the score and lines recorded for it.\n"
+    "  export <game> <file>: Write game number <game> to <file> as a replay\n"
+    "    log, for tetris --replay.\n", program_name);
+}
+
+// Parses a game number or count argument. Returns 0 and prints an error if
+// it's invalid.
+static int ParseNumber(const char *arg, const char *name, uint64_t *value) {
+  char *end = NULL;
+  errno = 0;
+  *value = strtoull(arg, &end, 0);
+  if ((*end != 0) || (end == arg) || (errno != 0)) {
+    printf("Invalid %s: %s\n", name, arg);
+    return 0;
+  }
+  return 1;
+}
+
+// Looks up game k, printing an error and returning 0 if it can't be read.
+static int LoadGame(GameDB *db, uint64_t k, GameSummary *summary,
+  const uint8_t **log, size_t *log_size) {
+  if (k >= db->count) {
+    printf("There is no game %llu; the database holds %llu games.\n",
+      (unsigned long long) k, (unsigned long long) db->count);
+    return 0;
+  }
+  if (!ReadGame(db, k, summary, log, log_size)) {
+    printf("Game %llu's record is damaged.\n", (unsigned long long) k);
+    return 0;
+  }
+  return 1;
+}
+
+// Prints a line describing a game.
+static void PrintGame(uint64_t k, GameSummary *summary, size_t log_size) {
+  printf("Game %llu: score %u, %u lines, %u pieces "
+    "(seed %llu, %s, %dx%d board, %llu-byte log)\n", (unsigned long long) k,
+    summary->score, summary->lines, summary->pieces,
+    (unsigned long long) summary->config.seed,
+    (summary->config.randomizer == TETRIS_RANDOMIZER_BAG) ? "bag" :
+    "weighted", summary->board_width, summary->board_height,
+    (unsigned long long) log_size);
+}
+
+static int PrintTopScores(GameDB *db, uint64_t n) {
+  GameSummary summary;
+  const uint8_t *log;
+  size_t log_size, found, i;
+  uint64_t *games;
+  if (n > db->count) n = db->count;
+  if (n == 0) {
+    printf("The database holds no games.\n");
+    return 0;
+  }
+  games = (uint64_t *) malloc(n * sizeof(uint64_t));
+  if (!games) {
+    printf("Failed allocating memory: %s\n", strerror(errno));
+    return 1;
+  }
+  found = TopScores(db, n, games);
+  for (i = 0; i < found; i++) {
+    // TopScores skips games whose records don't fit in the data file, but
+    // doesn't check their logs.
+    if (ReadGame(db, games[i], &summary, &log, &log_size)) {
+      PrintGame(games[i], &summary, log_size);
+    } else {
+      printf("Game %llu: damaged\n", (unsigned long long) games[i]);
+    }
+  }
+  free(games);
+  return 0;
+}
+
+static int ReplayGame(GameDB *db, uint64_t k) {
+  TetrisGameState s;
+  GameSummary summary;
+  ReplayReader r;
+  const uint8_t *log;
+  size_t log_size;
+  uint64_t start_time, elapsed;
+  if (!LoadGame(db, k, &summary, &log, &log_size)) return 1;
+  PrintGame(k, &summary, log_size);
+  // Other board sizes would need the engine built for them, as tetris-sim
+  // does.
+  if ((summary.board_width != BLOCKS_WIDE) ||
+    (summary.board_height != BLOCKS_TALL)) {
+    printf("Only games on a %dx%d board can be replayed.\n", BLOCKS_WIDE,
+      BLOCKS_TALL);
+    return 1;
+  }
+  InitializeReplayRecords(&r, &summary.config, log, log_size);
+  start_time = MonotonicNanoseconds();
+  StartReplay(&r, &s);
+  while (StepReplay(&r, &s)) continue;
+  elapsed = MonotonicNanoseconds() - start_time;
+  printf("Replayed %u pieces: score %u, %u lines, in %.3f ms.\n", s.pieces,
+    s.score, s.lines, ((double) elapsed) / 1e6);
+  if (r.truncated) {
+    printf("Warning: the replay log ended early.\n");
+    return 1;
+  }
+  if ((s.score != summary.score) || (s.lines != summary.lines) ||
+    (s.pieces != summary.pieces)) {
+    printf("The replay doesn't match the recorded result.\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int ExportGame(GameDB *db, uint64_t k, const char *path) {
+  uint8_t header[REPLAY_HEADER_SIZE];
+  GameSummary summary;
+  const uint8_t *log;
+  size_t log_size;
+  FILE *f;
+  if (!LoadGame(db, k, &summary, &log, &log_size)) return 1;
+  EncodeReplayHeader(&summary.config, header);
+  f = fopen(path, "wb");
+  if (!f || (fwrite(header, sizeof(header), 1, f) < 1) ||
+    ((log_size > 0) && (fwrite(log, log_size, 1, f) < 1)) ||
+    (fclose(f) != 0)) {
+    printf("Failed writing %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  PrintGame(k, &summary, log_size);
+  printf("Wrote %s.\n", path);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  GameDB db;
+  uint64_t value;
+  int result = 1;
+  if (argc < 3) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (!OpenGameDB(&db, argv[1])) {
+    if (errno == EINVAL) {
+      printf("%s is not a game database.\n", argv[1]);
+    } else {
+      printf("Failed opening %s: %s\n", argv[1], strerror(errno));
+    }
+    return 1;
+  }
+  if ((strcmp(argv[2], "count") == 0) && (argc == 3)) {
+    printf("%llu\n", (unsigned long long) db.count);
+    result = 0;
+  } else if ((strcmp(argv[2], "top") == 0) && (argc == 4)) {
+    if (ParseNumber(argv[3], "count", &value)) {
+      result = PrintTopScores(&db, value);
+    }
+  } else if ((strcmp(argv[2], "replay") == 0) && (argc == 4)) {
+    if (ParseNumber(argv[3], "game number", &value)) {
+      result = ReplayGame(&db, value);
+    }
+  } else if ((strcmp(argv[2], "export") == 0) && (argc == 5)) {
+    if (ParseNumber(argv[3], "game number", &value)) {
+      result = ExportGame(&db, value, argv[4]);
+    }
+  } else {
+    PrintUsage(argv[0]);
+  }
+  CloseGameDB(&db);
+  return result;
+}
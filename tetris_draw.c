@@ -0,0 +1,60 @@
+// Implements the drawing functions described in tetris_draw.h.
+#include <curses.h>
+#include <stdint.h>
+#include "tetris_draw.h"
+#include "tetris_engine.h"
+
+void DrawBoard(WINDOW *w, char *board, TetrisRowSet rows) {
+  // One row of the board, with each cell doubled, as it's drawn.
+  char line[BLOCKS_WIDE * 2];
+  // The index into the board array.
+  int i;
+  int y, x;
+  // Note that we start at y = 1 to skip the window border.
+  for (y = 1; y <= BLOCKS_TALL; y++) {
+    if (!(rows & (((TetrisRowSet) 1) << (y - 1)))) continue;
+    i = (y - 1) * BLOCKS_WIDE;
+    for (x = 0; x < BLOCKS_WIDE; x++) {
+      line[x * 2] = board[i + x];
+      line[x * 2 + 1] = board[i + x];
+    }
+    // Omit error checking here; if the window gets too small, just let this
+    // fail silently as the pieces fall off the bottom of the screen. Drawing
+    // the whole row in one call is much cheaper than a call per character.
+    mvwaddnstr(w, y, 1, line, sizeof(line));
+  }
+}
+
+void DrawPieceCells(WINDOW *w, short piece, int screen_x, int screen_y,
+  int erase) {
+  const TetrisPieceInfo *info = piece_info + piece;
+  char c = erase ? ' ' : info->glyph;
+  int i;
+  for (i = 0; i < 4; i++) {
+    mvwaddch(w, screen_y - info->cell_y[i], screen_x + info->cell_x[i] * 2, c);
+    waddch(w, c);
+  }
+}
+
+void DrawBoardPiece(WINDOW *w, short piece, int x, int y, char c,
+  TetrisRowSet rows) {
+  const TetrisPieceInfo *info = piece_info + piece;
+  int i, board_x, board_y;
+  for (i = 0; i < 4; i++) {
+    board_y = y - info->cell_y[i];
+    if ((board_y < 0) || !(rows & (((TetrisRowSet) 1) << board_y))) continue;
+    board_x = x + info->cell_x[i];
+    // Do the same thing we do in DrawBoard.
+    mvwaddch(w, board_y + 1, board_x * 2 + 1, c);
+    waddch(w, c);
+  }
+}
+
+TetrisRowSet PieceRows(short piece, int y) {
+  TetrisRowSet rows = 0;
+  int i;
+  for (i = 0; i < piece_info[piece].height; i++) {
+    if ((y - i) >= 0) rows |= ((TetrisRowSet) 1) << (y - i);
+  }
+  return rows;
+}
@@ -0,0 +1,29 @@
+#ifndef TETRIS_DRAW_H
+#define TETRIS_DRAW_H
+// This file defines the functions that draw the board and pieces into curses
+// windows. They only write to the windows; refreshing the terminal is left to
+// the caller.
+#include <curses.h>
+#include <stdint.h>
+#include "tetris_engine.h"
+
+// Takes a pointer to the game window, the board array in the game state, and
+// a bitmask of rows (in the same format as TetrisGameState.dirty_rows). Draws
+// the contents of the board in the given rows.
+void DrawBoard(WINDOW *w, char *board, TetrisRowSet rows);
+
+// Draws a piece's cells in a window, with the piece's location at the given
+// screen coordinates. Draws spaces instead if erase is nonzero.
+void DrawPieceCells(WINDOW *w, short piece, int screen_x, int screen_y,
+  int erase);
+
+// Draws the cells of a piece at the given board location that lie in the given
+// board rows (a bitmask, with bit y set for row y), using the character c.
+void DrawBoardPiece(WINDOW *w, short piece, int x, int y, char c,
+  TetrisRowSet rows);
+
+// Returns a bitmask of the board rows covered by a piece at the given y
+// location.
+TetrisRowSet PieceRows(short piece, int y);
+
+#endif  // TETRIS_DRAW_H
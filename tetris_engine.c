@@ -0,0 +1,545 @@
+// The game rules for ncurses_tetris. This file must not depend on curses; see
+// tetris.c for the terminal frontend.
+#include <stdint.h>
+#include <string.h>
+#include "tetris_engine.h"
+
+// Adds a piece to the back of the queue, which must have room for it.
+static void PushPiece(TetrisGameState *s, short piece) {
+  s->queue[(s->queue_start + s->queue_count) & (TETRIS_QUEUE_CAPACITY - 1)] =
+    piece;
+  s->queue_count++;
+}
+
+// Adds a batch of TETRIS_PIECE_KINDS random pieces to the back of the queue
+// (i.e., indices into tetris_pieces). The random numbers are drawn in the
+// same order as when pieces were chosen one at a time, so every seed still
+// produces the same pieces.
+static void RefillQueue(TetrisGameState *s) {
+  // Since some pieces have up to four rotations, this allows us to select a
+  // random piece rotation without weighting pieces with more rotations over
+  // pieces with fewer, as every piece has four entries.
+  static const short piece_ids[] = {0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4,
+    5, 5, 6, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
+  const short max_choice = sizeof(piece_ids) / sizeof(short);
+  uint8_t bag[TETRIS_PIECE_KINDS], tmp;
+  int i, j;
+  if (s->randomizer != TETRIS_RANDOMIZER_BAG) {
+    for (i = 0; i < TETRIS_PIECE_KINDS; i++) {
+      PushPiece(s, piece_ids[RandomBelow(&s->rng, max_choice)]);
+    }
+    return;
+  }
+
+  // Shuffle a new bag, and deal it out from the end.
+  for (i = 0; i < TETRIS_PIECE_KINDS; i++) bag[i] = i;
+  for (i = TETRIS_PIECE_KINDS - 1; i > 0; i--) {
+    j = RandomBelow(&s->rng, i + 1);
+    tmp = bag[i];
+    bag[i] = bag[j];
+    bag[j] = tmp;
+  }
+  for (i = TETRIS_PIECE_KINDS - 1; i >= 0; i--) {
+    // Every rotation of the chosen piece is equally likely.
+    PushPiece(s, piece_kind_first[bag[i]] + RandomBelow(&s->rng,
+      piece_kind_rotations[bag[i]]));
+  }
+}
+
+// Removes the piece at the front of the queue and returns it, refilling the
+// queue if too few pieces are left to preview.
+static short TakeQueuedPiece(TetrisGameState *s) {
+  short piece = s->queue[s->queue_start];
+  s->queue_start = (s->queue_start + 1) & (TETRIS_QUEUE_CAPACITY - 1);
+  s->queue_count--;
+  if (s->queue_count < TETRIS_MAX_PREVIEW) RefillQueue(s);
+  return piece;
+}
+
+short QueuedPiece(const TetrisGameState *s, int i) {
+  return s->queue[(s->queue_start + i) & (TETRIS_QUEUE_CAPACITY - 1)];
+}
+
+// Returns 1 if everything in the given game state looks OK, and 0 if not.
+int SanityCheckState(TetrisGameState *s) {
+  int row, tmp, i;
+  tmp = s->location_x;
+  if ((tmp < 0) || (tmp >= BLOCKS_WIDE)) return 0;
+  tmp = s->location_y;
+  if ((tmp < PIECE_START_Y) || (tmp >= BLOCKS_TALL)) return 0;
+
+  // Important check: make sure the current piece is a valid piece ID.
+  tmp = TETRIS_PIECE_COUNT;
+  if ((s->current_piece < 0) || (s->current_piece >= tmp)) return 0;
+  if ((s->queue_count < TETRIS_MAX_PREVIEW) ||
+    (s->queue_count > TETRIS_QUEUE_CAPACITY) ||
+    (s->queue_start >= TETRIS_QUEUE_CAPACITY)) {
+    return 0;
+  }
+  for (i = 0; i < s->queue_count; i++) {
+    if (QueuedPiece(s, i) >= tmp) return 0;
+  }
+  if ((s->hold_piece < -1) || (s->hold_piece >= tmp)) return 0;
+  // The falling piece must be entirely between the walls.
+  tmp = s->location_x + piece_info[s->current_piece].width;
+  if (tmp > BLOCKS_WIDE) return 0;
+
+  // The randomizer must be one we know about.
+  if ((s->randomizer != TETRIS_RANDOMIZER_WEIGHTED) &&
+    (s->randomizer != TETRIS_RANDOMIZER_BAG)) {
+    return 0;
+  }
+
+  // Make sure the board contains no cells outside of its columns. The board's
+  // characters aren't checked here; they're only used for drawing.
+  for (row = 0; row < BLOCKS_TALL; row++) {
+    if (s->rows[row] & ~FULL_ROW_MASK) return 0;
+  }
+
+  // There are clearly more sanity checks we can do, but these are all that
+  // we'll test for now. Ideas for later:
+  // - No completed lines
+  // - Score is at least lines * 100.
+
+  return 1;
+}
+
+// Sets up a new game, clearing the board, setting score and lines to 0, and
+// setting up the current piece and the queue.
+void InitializeNewGame(TetrisGameState *s, TetrisGameConfig *config) {
+  short first;
+  memset(s, 0, sizeof(*s));
+  s->tick_rate = config->tick_rate;
+  s->seed = config->seed;
+  SeedRandom(&s->rng, config->seed);
+  s->randomizer = config->randomizer;
+  memset(s->board, ' ', sizeof(s->board));
+  memset(s->column_tops, BLOCKS_TALL, sizeof(s->column_tops));
+  s->hold_piece = -1;
+  // The first piece chosen has always been the first one previewed, with the
+  // second falling first, so the queue starts with the first piece again.
+  RefillQueue(s);
+  first = TakeQueuedPiece(s);
+  s->current_piece = TakeQueuedPiece(s);
+  s->queue_start = (s->queue_start - 1) & (TETRIS_QUEUE_CAPACITY - 1);
+  s->queue[s->queue_start] = first;
+  s->queue_count++;
+  // The piece starts at the top, in the middle.
+  s->location_y = PIECE_START_Y;
+  s->location_x = BLOCKS_WIDE / 2;
+  s->dirty_rows = ALL_ROWS_DIRTY;
+}
+
+// Returns 1 if the given piece can fit at coordinate new_x, new_y on the
+// current board. Otherwise returns 0.
+int PieceFits(TetrisGameState *s, short piece, int new_x, int new_y) {
+  const uint16_t *masks = piece_row_masks[piece];
+  const TetrisPieceInfo *info = piece_info + piece;
+  int piece_y, board_y;
+  // Every piece's bounding box starts at its location, and its bottom row is
+  // never empty, so the box alone tells us if it's within the walls and floor.
+  if ((new_x < 0) || ((new_x + info->width) > BLOCKS_WIDE)) return 0;
+  if (new_y >= BLOCKS_TALL) return 0;
+  for (piece_y = 0; piece_y < info->height; piece_y++) {
+    board_y = new_y - piece_y;
+    // We always count space above the board as OK.
+    if (board_y < 0) break;
+    if (s->rows[board_y] & (masks[piece_y] << new_x)) return 0;
+  }
+  return 1;
+}
+
+// Adds the rows covered by the falling piece, at its current location, to
+// s->dirty_rows.
+static void MarkPieceDirty(TetrisGameState *s) {
+  const uint16_t *masks = piece_row_masks[s->current_piece];
+  int piece_y, board_y;
+  for (piece_y = 0; piece_y < 4; piece_y++) {
+    if (!masks[piece_y]) continue;
+    board_y = s->location_y - piece_y;
+    if ((board_y < 0) || (board_y >= BLOCKS_TALL)) continue;
+    s->dirty_rows |= ((TetrisRowSet) 1) << board_y;
+  }
+}
+
+// Replaces the falling piece and its location, marking the rows it used to
+// cover and the rows it now covers as dirty. Doesn't check whether the piece
+// fits.
+static void MovePiece(TetrisGameState *s, short piece, int x, int y) {
+  MarkPieceDirty(s);
+  s->current_piece = piece;
+  s->location_x = x;
+  s->location_y = y;
+  MarkPieceDirty(s);
+}
+
+// Attempts to move a falling piece down by one spot. Returns 0 if the piece is
+// blocked, otherwise moves the piece down by 1 row.
+int TryMovingDown(TetrisGameState *s) {
+  if (!PieceFits(s, s->current_piece, s->location_x, s->location_y + 1)) {
+    return 0;
+  }
+  MovePiece(s, s->current_piece, s->location_x, s->location_y + 1);
+  return 1;
+}
+
+// Attempts to move a falling piece left by one column. Doesn't move the piece
+// if the movement is blocked.
+void TryMovingLeft(TetrisGameState *s) {
+  if (!PieceFits(s, s->current_piece, s->location_x - 1, s->location_y)) {
+    return;
+  }
+  MovePiece(s, s->current_piece, s->location_x - 1, s->location_y);
+}
+
+// Similar to TryMovingLeft, but attempts to move the falling piece right.
+void TryMovingRight(TetrisGameState *s) {
+  if (!PieceFits(s, s->current_piece, s->location_x + 1, s->location_y)) {
+    return;
+  }
+  MovePiece(s, s->current_piece, s->location_x + 1, s->location_y);
+}
+
+// Returns the x a rotation into new_piece kicks the piece to, or -1 if blocked.
+int RotatedX(TetrisGameState *s, short new_piece, int x, int y) {
+  const TetrisPieceInfo *info = piece_info + new_piece;
+  // Offsets that would push the piece through a wall can't succeed, so they
+  // aren't checked at all.
+  int min_offset = -x;
+  int max_offset = BLOCKS_WIDE - info->width - x;
+  int i, x_offset;
+  for (i = 0; i < TETRIS_KICK_COUNT; i++) {
+    x_offset = info->kicks[i];
+    if ((x_offset < min_offset) || (x_offset > max_offset)) continue;
+    if (PieceFits(s, new_piece, x + x_offset, y)) return x + x_offset;
+  }
+  return -1;
+}
+
+// Attempts to rotate the current piece to its next position. Does nothing if
+// the rotation is blocked.
+void TryRotating(TetrisGameState *s) {
+  short new_piece = piece_rotations[s->current_piece];
+  int new_x = RotatedX(s, new_piece, s->location_x, s->location_y);
+  if (new_x < 0) return;
+  MovePiece(s, new_piece, new_x, s->location_y);
+}
+
+// Returns the y at which the piece would land, found from the tops of the
+// columns it covers. Falls back to testing each row below the piece if it has
+// been slid under an overhang.
+int PieceLandingY(TetrisGameState *s, short piece, int piece_x,
+  int piece_y) {
+  const TetrisPieceInfo *info = piece_info + piece;
+  int x, y, column_bottom, landing_y = BLOCKS_TALL;
+  for (x = 0; x < info->width; x++) {
+    column_bottom = piece_y - info->bottom[x];
+    y = s->column_tops[piece_x + x];
+    // If the piece is below the top of any column it covers, it has been slid
+    // under an overhang, and it may land on a cell that isn't the column's
+    // top. These cases are rare, so just test each row the piece falls to.
+    if (column_bottom >= y) goto slow_path;
+    // Otherwise, only empty space lies between the piece and each column's
+    // top, and the piece lands when its lowest cell in any column reaches the
+    // row just above that column's top.
+    y = y - 1 + info->bottom[x];
+    if (y < landing_y) landing_y = y;
+  }
+  return landing_y;
+slow_path:
+  y = piece_y;
+  while (PieceFits(s, piece, piece_x, y + 1)) y++;
+  return y;
+}
+
+int LandingY(TetrisGameState *s) {
+  return PieceLandingY(s, s->current_piece, s->location_x, s->location_y);
+}
+
+// Moves the piece down until it can't move down any more. Returns the number
+// of rows that it moved down.
+int MoveDownToContactPosition(TetrisGameState *s) {
+  int landing_y = LandingY(s);
+  int to_return = landing_y - s->location_y;
+  if (to_return > 0) {
+    MovePiece(s, s->current_piece, s->location_x, landing_y);
+  }
+  return to_return;
+}
+
+uint64_t RowHash(int y, uint16_t row) {
+  uint64_t hash = 0;
+  int x;
+  for (x = 0; row; x++, row >>= 1) {
+    if (row & 1) hash ^= zobrist_cells[y][x];
+  }
+  return hash;
+}
+
+uint64_t BoardHash(const uint16_t *rows) {
+  uint64_t hash = 0;
+  int y;
+  for (y = 0; y < BLOCKS_TALL; y++) hash ^= RowHash(y, rows[y]);
+  return hash;
+}
+
+void RecomputeColumnTops(TetrisGameState *s) {
+  uint32_t found, unseen = FULL_ROW_MASK;
+  int x, y;
+  memset(s->column_tops, BLOCKS_TALL, sizeof(s->column_tops));
+  for (y = 0; (y < BLOCKS_TALL) && unseen; y++) {
+    found = s->rows[y] & unseen;
+    if (!found) continue;
+    unseen &= ~found;
+    for (x = 0; x < BLOCKS_WIDE; x++) {
+      if (found & (1 << x)) s->column_tops[x] = y;
+    }
+  }
+}
+
+// Must be called after the falling piece can't fall any more, but *before*
+// FinishFallingPiece. Returns 1 if any of the falling piece is above the top
+// of the board.
+int IsGameOver(TetrisGameState *s) {
+  const uint16_t *masks = piece_row_masks[s->current_piece];
+  int piece_y;
+  for (piece_y = 0; piece_y < 4; piece_y++) {
+    if (!masks[piece_y]) continue;
+    // We found a non-space part of the current piece that ended up above the
+    // board.
+    if ((s->location_y - piece_y) < 0) return 1;
+  }
+  return 0;
+}
+
+// Removes the given rows from the board in a single pass, shifting down
+// everything above them. The rows must be sorted from top to bottom. Each run
+// of kept rows between two removed ones is moved with one memmove, starting at
+// the bottom, so every kept row is copied at most once.
+static void RemoveRows(TetrisGameState *s, const int *rows, int count) {
+  int i, span_start, span_rows, shift, y;
+  int bottom = rows[count - 1];
+  // Every row above the lowest removed one moves, so take those rows out of
+  // the hash now, and put them back once they've moved.
+  for (y = 0; y <= bottom; y++) s->board_hash ^= RowHash(y, s->rows[y]);
+  for (i = count - 1; i >= 0; i--) {
+    span_start = (i > 0) ? (rows[i - 1] + 1) : 0;
+    span_rows = rows[i] - span_start;
+    if (span_rows <= 0) continue;
+    shift = count - i;
+    memmove(s->board + (span_start + shift) * BLOCKS_WIDE,
+      s->board + span_start * BLOCKS_WIDE, span_rows * BLOCKS_WIDE);
+    memmove(s->rows + span_start + shift, s->rows + span_start,
+      span_rows * sizeof(s->rows[0]));
+  }
+  // Clear the rows that were uncovered at the top.
+  memset(s->board, ' ', count * BLOCKS_WIDE);
+  memset(s->rows, 0, count * sizeof(s->rows[0]));
+  for (y = count; y <= bottom; y++) s->board_hash ^= RowHash(y, s->rows[y]);
+}
+
+// This function checks for completed lines, removes any complete lines, and
+// scores points for lines completed. This must be called after a falling piece
+// has landed and after FinishFallingPiece has finished. However,
+// FinishFallingPiece will modify s->location_y, so the caller is responsible
+// for keeping track of the y position that just landed, and provide it.
+void CheckForCompleteLines(TetrisGameState *s, int fallen_piece_y) {
+  int completed_row_count = 0;
+  int completed_rows[4];
+  int board_y;
+
+  for (board_y = fallen_piece_y - 3; board_y <= fallen_piece_y; board_y++) {
+    if (board_y < 0) continue;
+    if (s->rows[board_y] != FULL_ROW_MASK) continue;
+    completed_rows[completed_row_count] = board_y;
+    completed_row_count++;
+  }
+  if (completed_row_count == 0) return;
+
+  // Now that we've identified the completed rows, clear the pieces and shift
+  // everything above it down.
+  RemoveRows(s, completed_rows, completed_row_count);
+  RecomputeColumnTops(s);
+  s->events |= TETRIS_EVENT_LINES_CLEARED;
+  // Every row at or above the lowest removed one has changed.
+  board_y = completed_rows[completed_row_count - 1];
+  s->dirty_rows |= (((TetrisRowSet) 2) << board_y) - 1;
+  s->lines += completed_row_count;
+  s->garbage_sent += GarbageForLines(completed_row_count);
+  switch (completed_row_count) {
+  case 1:
+    s->score += 100;
+    break;
+  case 2:
+    s->score += 400;
+    break;
+  case 3:
+    s->score += 1600;
+    break;
+  case 4:
+    s->score += 6400;
+    break;
+  default:
+    break;
+  }
+}
+
+int GarbageForLines(int lines) {
+  // A single line sends nothing, and a tetris sends a whole tetris back.
+  switch (lines) {
+  case 2:
+    return 1;
+  case 3:
+    return 2;
+  case 4:
+    return 4;
+  default:
+    break;
+  }
+  return 0;
+}
+
+int AddGarbageRows(TetrisGameState *s, int count, int hole_x) {
+  uint16_t garbage_row = FULL_ROW_MASK & ~(1 << hole_x);
+  int y, overflowed = 0;
+  if (count <= 0) return 1;
+  if (count > BLOCKS_TALL) count = BLOCKS_TALL;
+  for (y = 0; y < count; y++) {
+    if (s->rows[y]) overflowed = 1;
+  }
+  // Every row moves, so the hash is simplest to redo from scratch.
+  memmove(s->board, s->board + count * BLOCKS_WIDE,
+    (BLOCKS_TALL - count) * BLOCKS_WIDE);
+  memmove(s->rows, s->rows + count,
+    (BLOCKS_TALL - count) * sizeof(s->rows[0]));
+  for (y = BLOCKS_TALL - count; y < BLOCKS_TALL; y++) {
+    memset(s->board + y * BLOCKS_WIDE, TETRIS_GARBAGE_GLYPH, BLOCKS_WIDE);
+    s->board[y * BLOCKS_WIDE + hole_x] = ' ';
+    s->rows[y] = garbage_row;
+  }
+  s->board_hash = BoardHash(s->rows);
+  RecomputeColumnTops(s);
+  // The whole board moved.
+  s->dirty_rows = ALL_ROWS_DIRTY;
+  if (overflowed) return 0;
+  return PieceFits(s, s->current_piece, s->location_x, s->location_y);
+}
+
+// Makes the falling piece "land"; adding its cells to the game board, and
+// generating a new falling piece.
+void FinishFallingPiece(TetrisGameState *s) {
+  const TetrisPieceInfo *info = piece_info + s->current_piece;
+  int i, board_x, board_y;
+  for (i = 0; i < 4; i++) {
+    board_x = s->location_x + info->cell_x[i];
+    board_y = s->location_y - info->cell_y[i];
+    s->board[board_y * BLOCKS_WIDE + board_x] = info->glyph;
+    s->rows[board_y] |= 1 << board_x;
+    s->board_hash ^= zobrist_cells[board_y][board_x];
+    if (board_y < s->column_tops[board_x]) {
+      s->column_tops[board_x] = board_y;
+    }
+  }
+  s->pieces++;
+
+  // Next, get the new falling piece. The rows the old piece covered are dirty,
+  // since the cells drawn there are now part of the board.
+  MovePiece(s, TakeQueuedPiece(s), BLOCKS_WIDE / 2, PIECE_START_Y);
+  s->hold_used = 0;
+}
+
+// Swaps the falling piece with the held piece, or with the next piece if none
+// is held, starting it again from the top. Does nothing if the falling piece
+// was already swapped in.
+static void HoldPiece(TetrisGameState *s) {
+  short piece = s->hold_piece;
+  if (s->hold_used) return;
+  s->hold_piece = s->current_piece;
+  if (piece < 0) piece = TakeQueuedPiece(s);
+  MovePiece(s, piece, BLOCKS_WIDE / 2, PIECE_START_Y);
+  s->hold_used = 1;
+  s->gravity_ticks = 0;
+}
+
+// Moves the falling piece down by one row, counting a point for it. If the
+// piece can't move down, it lands instead. Returns 0 on game over.
+static int StepDown(TetrisGameState *s) {
+  int fallen_piece_y;
+  // We'll get a point every time the piece moves down. The gravity timer
+  // restarts whenever the piece moves down, whatever the reason.
+  s->score++;
+  s->gravity_ticks = 0;
+  if (TryMovingDown(s)) return 1;
+  // It's a game over if the falling piece is at all above the board.
+  if (IsGameOver(s)) return 0;
+  fallen_piece_y = s->location_y;
+  FinishFallingPiece(s);
+  s->events |= TETRIS_EVENT_PIECE_LOCKED;
+  CheckForCompleteLines(s, fallen_piece_y);
+  return 1;
+}
+
+// Returns the number of ticks after which the falling piece moves down on its
+// own.
+uint32_t GravityTicks(TetrisGameState *s) {
+  // This is the number of milliseconds after which the piece moves down
+  // regardless of what has been pressed.
+  uint32_t threshold_ms = 700;
+  uint32_t ticks;
+  // Every 10 lines, the piece speeds up by 1 ms, until it gets to the point of
+  // moving down every tick.
+  if ((s->lines / 10) >= threshold_ms) {
+    threshold_ms = 0;
+  } else {
+    threshold_ms -= s->lines / 10;
+  }
+  ticks = (threshold_ms * s->tick_rate) / 1000;
+  if (ticks < 1) ticks = 1;
+  return ticks;
+}
+
+// Returns the number of ticks until gravity next moves the falling piece.
+uint32_t TicksUntilGravity(TetrisGameState *s) {
+  uint32_t threshold = GravityTicks(s);
+  if (s->gravity_ticks >= threshold) return 1;
+  return threshold - s->gravity_ticks;
+}
+
+// Processes a single input immediately. Returns 0 on game over.
+int UpdateGameState(TetrisGameState *s, int input) {
+  // Handle movement or rotation.
+  switch (input) {
+  case (TETRIS_INPUT_LEFT):
+    TryMovingLeft(s);
+    break;
+  case (TETRIS_INPUT_RIGHT):
+    TryMovingRight(s);
+    break;
+  case (TETRIS_INPUT_ROTATE):
+    TryRotating(s);
+    break;
+  case (TETRIS_INPUT_DOWN):
+    return StepDown(s);
+  case (TETRIS_INPUT_DROP):
+    // Move down to the contact position, and then try moving down again to
+    // allow the piece to land. Increase the score here, just as we would if it
+    // moved down one line at a time.
+    s->score += MoveDownToContactPosition(s);
+    return StepDown(s);
+  case (TETRIS_INPUT_HOLD):
+    HoldPiece(s);
+    break;
+  default:
+    // This occurs if nothing was pressed (input == TETRIS_INPUT_NONE).
+    break;
+  }
+  return 1;
+}
+
+// Advances the game by one tick of gravity. Returns 0 on game over.
+int TickGameState(TetrisGameState *s) {
+  s->ticks++;
+  s->gravity_ticks++;
+  if (s->gravity_ticks < GravityTicks(s)) return 1;
+  return StepDown(s);
+}
@@ -0,0 +1,385 @@
+#ifndef TETRIS_ENGINE_H
+#define TETRIS_ENGINE_H
+// This file defines the game rules for ncurses_tetris. Nothing here depends on
+// curses, so the engine can be linked into programs that never touch a
+// terminal.
+#include <stdint.h>
+#include "tetris_random.h"
+
+// The version of ncurses_tetris, printed by each program's --version.
+#define TETRIS_VERSION "1.0"
+
+// The width and height of the area where the blocks go, in blocks rather than
+// characters. The engine can be built for other sizes by defining these when
+// compiling, so every loop over the board still has constant bounds. A build
+// for another size must also define TETRIS_BOARD_SUFFIX (e.g. as _10x40),
+// which is appended to the name of everything the engine exports, so engines
+// for several sizes can be linked into one program. The curses frontends and
+// the save and replay formats only use the default size.
+#ifndef BLOCKS_WIDE
+#define BLOCKS_WIDE (10)
+#endif
+#ifndef BLOCKS_TALL
+#define BLOCKS_TALL (20)
+#endif
+
+// The largest board sizes the engine supports: every row must fit in a
+// uint16_t, and every row's bit must fit in a TetrisRowSet.
+#define TETRIS_MAX_BLOCKS_WIDE (16)
+#define TETRIS_MAX_BLOCKS_TALL (64)
+#if (BLOCKS_WIDE < 4) || (BLOCKS_WIDE > TETRIS_MAX_BLOCKS_WIDE)
+#error "BLOCKS_WIDE must be between 4 and 16."
+#endif
+#if (BLOCKS_TALL < 4) || (BLOCKS_TALL > TETRIS_MAX_BLOCKS_TALL)
+#error "BLOCKS_TALL must be between 4 and 64."
+#endif
+
+#ifdef TETRIS_BOARD_SUFFIX
+// Appends TETRIS_BOARD_SUFFIX to a name.
+#define TETRIS_PASTE_NAME(name, suffix) name##suffix
+#define TETRIS_EXPAND_NAME(name, suffix) TETRIS_PASTE_NAME(name, suffix)
+#define TETRIS_SIZED(name) TETRIS_EXPAND_NAME(name, TETRIS_BOARD_SUFFIX)
+#define InitializeNewGame TETRIS_SIZED(InitializeNewGame)
+#define SanityCheckState TETRIS_SIZED(SanityCheckState)
+#define PieceFits TETRIS_SIZED(PieceFits)
+#define TryMovingDown TETRIS_SIZED(TryMovingDown)
+#define TryMovingLeft TETRIS_SIZED(TryMovingLeft)
+#define TryMovingRight TETRIS_SIZED(TryMovingRight)
+#define TryRotating TETRIS_SIZED(TryRotating)
+#define RotatedX TETRIS_SIZED(RotatedX)
+#define LandingY TETRIS_SIZED(LandingY)
+#define PieceLandingY TETRIS_SIZED(PieceLandingY)
+#define MoveDownToContactPosition TETRIS_SIZED(MoveDownToContactPosition)
+#define RecomputeColumnTops TETRIS_SIZED(RecomputeColumnTops)
+#define RowHash TETRIS_SIZED(RowHash)
+#define BoardHash TETRIS_SIZED(BoardHash)
+#define IsGameOver TETRIS_SIZED(IsGameOver)
+#define FinishFallingPiece TETRIS_SIZED(FinishFallingPiece)
+#define CheckForCompleteLines TETRIS_SIZED(CheckForCompleteLines)
+#define GravityTicks TETRIS_SIZED(GravityTicks)
+#define TicksUntilGravity TETRIS_SIZED(TicksUntilGravity)
+#define UpdateGameState TETRIS_SIZED(UpdateGameState)
+#define TickGameState TETRIS_SIZED(TickGameState)
+#define GarbageForLines TETRIS_SIZED(GarbageForLines)
+#define AddGarbageRows TETRIS_SIZED(AddGarbageRows)
+#define QueuedPiece TETRIS_SIZED(QueuedPiece)
+#endif
+
+// This is the y position a piece spawns at when entering the board.
+#define PIECE_START_Y (-1)
+
+// The number of entries in the tetris_pieces array: every piece along with all
+// of its rotations.
+#define TETRIS_PIECE_COUNT (19)
+
+// The bitmask for a row in which every cell is occupied. Bit x of a row mask
+// corresponds to column x of the board.
+#define FULL_ROW_MASK ((uint16_t) ((1 << BLOCKS_WIDE) - 1))
+
+// A set of the board's rows, as a bitmask with bit y set for row y.
+#if BLOCKS_TALL > 32
+typedef uint64_t TetrisRowSet;
+#else
+typedef uint32_t TetrisRowSet;
+#endif
+
+// The value of TetrisGameState.dirty_rows when every row needs to be redrawn.
+#define ALL_ROWS_DIRTY (((TetrisRowSet) -1) >> \
+  ((sizeof(TetrisRowSet) * 8) - BLOCKS_TALL))
+
+// The character drawn for the cells of garbage rows, which an opponent's line
+// clears add to the bottom of the board in versus games.
+#define TETRIS_GARBAGE_GLYPH '#'
+
+// The default number of times per second TickGameState should be called.
+#define DEFAULT_TICK_RATE (60)
+
+// The number of distinct pieces, not counting rotations.
+#define TETRIS_PIECE_KINDS (7)
+
+// Ways of choosing the next piece, for TetrisGameConfig.randomizer.
+// Picks each piece independently, giving every rotation of every piece the
+// same odds. This is how the game has always worked.
+#define TETRIS_RANDOMIZER_WEIGHTED (0)
+// Shuffles one of each of the 7 pieces into a "bag", and deals out the whole
+// bag before shuffling the next one.
+#define TETRIS_RANDOMIZER_BAG (1)
+
+// The most upcoming pieces that can be previewed; TetrisGameState.queue always
+// holds at least this many.
+#define TETRIS_MAX_PREVIEW (6)
+
+// The size of TetrisGameState.queue, which is refilled with a batch of
+// TETRIS_PIECE_KINDS pieces whenever fewer than TETRIS_MAX_PREVIEW are left.
+// It must be a power of 2, with room for a refill and one piece put back at
+// the start of a game.
+#define TETRIS_QUEUE_CAPACITY (16)
+#if TETRIS_QUEUE_CAPACITY < (TETRIS_MAX_PREVIEW + TETRIS_PIECE_KINDS)
+#error "The piece queue is too small to refill."
+#endif
+
+// Inputs to UpdateGameState. These are deliberately separate from curses key
+// codes; the frontend is responsible for translating keypresses.
+#define TETRIS_INPUT_NONE (0)
+#define TETRIS_INPUT_LEFT (1)
+#define TETRIS_INPUT_RIGHT (2)
+#define TETRIS_INPUT_ROTATE (3)
+#define TETRIS_INPUT_DOWN (4)
+// Moves the falling piece all the way down and lands it immediately.
+#define TETRIS_INPUT_DROP (5)
+// Swaps the falling piece with the held piece, or puts it aside for the next
+// piece if none is held yet. Only works once per piece.
+#define TETRIS_INPUT_HOLD (6)
+
+// Flags for TetrisGameState.events.
+// Set when the falling piece has been added to the board.
+#define TETRIS_EVENT_PIECE_LOCKED (1)
+// Set when one or more completed rows have been removed from the board.
+#define TETRIS_EVENT_LINES_CLEARED (2)
+
+// The settings used to start a new game.
+typedef struct {
+  // The number of times per second the game will be advanced by
+  // TickGameState.
+  uint32_t tick_rate;
+  // The seed for the game's random number generator. The same seed and
+  // randomizer always produce the same sequence of pieces.
+  uint64_t seed;
+  // One of the TETRIS_RANDOMIZER_* values.
+  int randomizer;
+} TetrisGameConfig;
+
+// This holds everything we need to know about the current state of an ongoing
+// game.
+typedef struct {
+  // Holds the state of the entire board. If a cell is empty, it must contain a
+  // space character. It is invalid for a cell to contain a nonprintable
+  // character or whitespace other than ' '. In any case except for ' ', the
+  // cell is occupied, and this must contain the character to draw to the
+  // screen when drawing the cell. Note that cells are drawn as two characters
+  // wide, so each character in this array will be printed twice when drawing
+  // the board. This starts from the TOP row in the window that's displayed.
+  char board[BLOCKS_WIDE * BLOCKS_TALL];
+  // Holds the occupancy of the board as one bitmask per row, starting from the
+  // top row, like the board array. Bit x of rows[y] is set if and only if
+  // board[y * BLOCKS_WIDE + x] is not ' '. The game rules only consult this;
+  // the characters in board are only needed for drawing.
+  uint16_t rows[BLOCKS_TALL];
+  // For each column, the row of its highest occupied cell, or BLOCKS_TALL if
+  // the column is empty. Kept up to date from rows, and used to find where
+  // a piece lands without testing every position it falls through.
+  uint8_t column_tops[BLOCKS_WIDE];
+  // The Zobrist hash of the board's occupied cells: the XOR of
+  // zobrist_cells[y][x] for every occupied cell. Kept up to date as pieces
+  // land and rows are removed, so identical boards can be found cheaply.
+  uint64_t board_hash;
+  // A set of TETRIS_EVENT_* flags, set by the game rules to tell a caller what
+  // happened during an update. The engine never clears these; it's up to
+  // whoever consumes the events (i.e. the renderer) to reset this to 0.
+  uint32_t events;
+  // Bit y of this is set if row y of the board, or the part of the falling
+  // piece in row y, has changed since the renderer last cleared this. Like
+  // events, the engine only ever sets bits here.
+  TetrisRowSet dirty_rows;
+  // The upcoming pieces, in the order they'll fall, as indices into the
+  // tetris_pieces array: a ring of queue_count pieces starting at
+  // queue[queue_start]. See QueuedPiece.
+  uint8_t queue[TETRIS_QUEUE_CAPACITY];
+  uint8_t queue_start;
+  uint8_t queue_count;
+  // The piece put aside with TETRIS_INPUT_HOLD, or -1 if there isn't one.
+  // hold_used is nonzero if the falling piece came out of the hold (or the
+  // queue, for a hold), so it can't be held again.
+  short hold_piece;
+  uint8_t hold_used;
+  // The x and y location of the current piece being dropped into the board, in
+  // a cell coordinate rather than a window character.  Note that these
+  // coordinates refer to the *bottom left* of the falling piece on the board!
+  int location_x;
+  int location_y;
+  // The piece that is currently "falling". Once again, it's an index into the
+  // tetris_pieces array.
+  short current_piece;
+  // The player's current score.
+  unsigned score;
+  // The number of lines the player has completed.
+  unsigned lines;
+  // The number of pieces that have landed. Quicksaves don't keep this, so it
+  // counts from when the game was loaded.
+  uint32_t pieces;
+  // The total number of garbage rows this game's line clears have earned, to
+  // be sent to an opponent (see GarbageForLines). Only versus games use this,
+  // and quicksaves don't keep it.
+  uint32_t garbage_sent;
+  // The number of times per second the game is meant to be advanced by
+  // TickGameState. Gravity is measured in ticks, so this converts it to time.
+  uint32_t tick_rate;
+  // The number of ticks the game has run for.
+  uint64_t ticks;
+  // The number of ticks since the falling piece last moved down.
+  uint32_t gravity_ticks;
+  // The seed the game started with, and the generator that chooses pieces.
+  uint64_t seed;
+  TetrisRNG rng;
+  // The TETRIS_RANDOMIZER_* value used to choose pieces. Bags are dealt into
+  // the queue whole, so no partial bag needs to be kept.
+  int randomizer;
+} TetrisGameState;
+
+// We statically define each piece as a 16-byte strings here. Note that when
+// the game is being rendered, the widths of these will be doubled. This
+// contains all pieces along with their rotations. There are 19 of them. Note
+// that the pieces in this array are "upside down", with the bottom row first.
+extern const char *tetris_pieces[TETRIS_PIECE_COUNT];
+
+// Holds the same 19 pieces as tetris_pieces, but with each row of the piece
+// converted to a bitmask, starting with the bottom row. Bit x of a row's mask
+// is set if the character at column x in the piece's row isn't a space.
+// Generated at build time, along with piece_info.
+extern const uint16_t piece_row_masks[TETRIS_PIECE_COUNT][4];
+
+// The number of candidate x offsets tried when rotating: the unmoved position,
+// then up to 3 columns left, then up to 3 columns right.
+#define TETRIS_KICK_COUNT (7)
+
+// Information derived from a piece's entry in tetris_pieces, so it doesn't
+// need to be decoded during the game.
+typedef struct {
+  // The x offset of each of the piece's 4 cells from the piece's location, and
+  // the number of rows it is above the location. (Rows of the board count
+  // down, so the cell is drawn at location_y - cell_y.)
+  int8_t cell_x[4];
+  int8_t cell_y[4];
+  // The piece's character, as it appears on the board.
+  char glyph;
+  // The size of the piece's bounding box. Pieces are aligned to the bottom
+  // left of their 4x4 box, so the box always starts at offset (0, 0).
+  uint8_t width;
+  uint8_t height;
+  // For each column of the bounding box, the lowest cell's row above the
+  // piece's location.
+  uint8_t bottom[4];
+  // The x offsets to try, in order, when rotating into this piece.
+  int8_t kicks[TETRIS_KICK_COUNT];
+} TetrisPieceInfo;
+extern const TetrisPieceInfo piece_info[TETRIS_PIECE_COUNT];
+
+// A random 64-bit key for every cell of the largest supported board, used for
+// board_hash. Generated at build time. Boards of every size share these keys.
+extern const uint64_t zobrist_cells[TETRIS_MAX_BLOCKS_TALL][
+  TETRIS_MAX_BLOCKS_WIDE];
+
+// For each kind of piece, the index of its first rotation in tetris_pieces and
+// the number of rotations it has. A piece's rotations are contiguous.
+extern const char piece_kind_first[TETRIS_PIECE_KINDS];
+extern const char piece_kind_rotations[TETRIS_PIECE_KINDS];
+
+// This is how we look up rotations. If the current piece is at index i in the
+// tetris_pieces array, then piece_rotations[i] gives the index of its next
+// rotation in the tetris_pieces array.
+extern const char piece_rotations[TETRIS_PIECE_COUNT];
+
+// Sets up a new game using the given config, clearing the board, setting
+// score and lines to 0, and setting up the current and next piece.
+void InitializeNewGame(TetrisGameState *s, TetrisGameConfig *config);
+
+// Returns the upcoming piece i places from the front of the queue, so 0 is
+// the next piece. i must be less than TETRIS_MAX_PREVIEW.
+short QueuedPiece(const TetrisGameState *s, int i);
+
+// Returns 1 if everything in the given game state looks OK, and 0 if not. Only
+// checks the fields the game rules depend on, so it never scans the board's
+// characters.
+int SanityCheckState(TetrisGameState *s);
+
+// Returns 1 if the given piece can fit at coordinate new_x, new_y on the
+// current board. Otherwise returns 0.
+int PieceFits(TetrisGameState *s, short piece, int new_x, int new_y);
+
+// Attempts to move a falling piece down by one spot. Returns 0 if the piece is
+// blocked, otherwise moves the piece down by 1 row.
+int TryMovingDown(TetrisGameState *s);
+
+// Attempts to move a falling piece left by one column. Doesn't move the piece
+// if the movement is blocked.
+void TryMovingLeft(TetrisGameState *s);
+
+// Similar to TryMovingLeft, but attempts to move the falling piece right.
+void TryMovingRight(TetrisGameState *s);
+
+// Attempts to rotate the current piece to its next position. Does nothing if
+// the rotation is blocked.
+void TryRotating(TetrisGameState *s);
+
+// Returns the x location new_piece would end up at if a piece at (x, y) were
+// rotated into it, after being pushed sideways if needed. Returns -1 if the
+// rotation is blocked. Doesn't modify s.
+int RotatedX(TetrisGameState *s, short new_piece, int x, int y);
+
+// Returns the location_y at which the falling piece would land if it were
+// dropped straight down from its current location. Doesn't modify s.
+int LandingY(TetrisGameState *s);
+
+// Like LandingY, but for the given piece at the given location, which must
+// fit on the board. Only s->rows and s->column_tops are used.
+int PieceLandingY(TetrisGameState *s, short piece, int x, int y);
+
+// Moves the piece down until it can't move down any more. Returns the number
+// of rows that it moved down.
+int MoveDownToContactPosition(TetrisGameState *s);
+
+// Recomputes s->column_tops from s->rows. Must be called after rows are
+// changed by anything other than the game rules, e.g. loading a saved game.
+void RecomputeColumnTops(TetrisGameState *s);
+
+// Returns the Zobrist hash of the cells set in a single row of the board.
+uint64_t RowHash(int y, uint16_t row);
+
+// Returns the Zobrist hash of a whole board, given its row bitmasks, for
+// computing board_hash from scratch.
+uint64_t BoardHash(const uint16_t *rows);
+
+// Must be called after the falling piece can't fall any more, but *before*
+// FinishFallingPiece. Returns 1 if any of the falling piece is above the top
+// of the board.
+int IsGameOver(TetrisGameState *s);
+
+// Makes the falling piece "land"; adding its cells to the game board, and
+// taking the new falling piece from the front of the queue.
+void FinishFallingPiece(TetrisGameState *s);
+
+// Checks for completed lines, removes any complete lines, and scores points
+// for lines completed. This must be called after FinishFallingPiece, with the
+// y position the fallen piece landed at (FinishFallingPiece resets
+// s->location_y). Sets TETRIS_EVENT_LINES_CLEARED if any rows were removed.
+void CheckForCompleteLines(TetrisGameState *s, int fallen_piece_y);
+
+// Returns the number of garbage rows earned by clearing the given number of
+// lines at once.
+int GarbageForLines(int lines);
+
+// Pushes the board up by count rows, and fills the uncovered rows at the
+// bottom with garbage: every cell but the one in column hole_x. Must be called
+// between pieces, i.e. after FinishFallingPiece. Returns 0 on game over, if
+// occupied cells are pushed off the top of the board or the falling piece no
+// longer fits.
+int AddGarbageRows(TetrisGameState *s, int count, int hole_x);
+
+// Returns the number of ticks after which the falling piece moves down on its
+// own, which gets smaller as more lines are completed.
+uint32_t GravityTicks(TetrisGameState *s);
+
+// Returns the number of calls to TickGameState until the one that moves the
+// falling piece down. All ticks before that one only advance counters.
+uint32_t TicksUntilGravity(TetrisGameState *s);
+
+// Processes a single TETRIS_INPUT_* value immediately, without waiting for the
+// next tick. Returns 0 on game over.
+int UpdateGameState(TetrisGameState *s, int input);
+
+// Advances the game by one tick, moving the falling piece down if enough ticks
+// have passed since it last moved down. Must be called s->tick_rate times per
+// second. Returns 0 on game over.
+int TickGameState(TetrisGameState *s);
+
+#endif  // TETRIS_ENGINE_H
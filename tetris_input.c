@@ -0,0 +1,100 @@
+// Implements the poll()-based input layer from tetris_input.h.
+#include <curses.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "tetris_input.h"
+#include "tetris_sched.h"
+
+// Prints an error message about the failed system call and exits.
+static void InputError(const char *what) {
+  int error = errno;
+  endwin();
+  printf("Input error: %s failed: %s\n", what, strerror(error));
+  exit(1);
+}
+
+void InitializeInput(TetrisInput *input) {
+  input->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+    TFD_CLOEXEC);
+  if (input->timer_fd < 0) InputError("timerfd_create");
+  input->extra_fd = -1;
+  input->extra_events = 0;
+  // We'll only call getch() once poll() says there's something to read, or to
+  // drain input curses has already buffered, so it must never block.
+  if (nodelay(stdscr, TRUE) == ERR) InputError("nodelay");
+}
+
+void DestroyInput(TetrisInput *input) {
+  close(input->timer_fd);
+  input->timer_fd = -1;
+}
+
+// Sets the timerfd to expire at the given absolute time, or disarms it if
+// deadline_ns is 0.
+static void ArmTimer(TetrisInput *input, uint64_t deadline_ns) {
+  struct itimerspec its;
+  uint64_t expirations;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline_ns / 1000000000ull;
+  its.it_value.tv_nsec = deadline_ns % 1000000000ull;
+  if (timerfd_settime(input->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    InputError("timerfd_settime");
+  }
+  // Discard an expiration left over from an earlier deadline, if any. This
+  // fails with EAGAIN if there wasn't one, which is fine.
+  if (read(input->timer_fd, &expirations, sizeof(expirations)) < 0) {
+    if (errno != EAGAIN) InputError("read(timerfd)");
+  }
+}
+
+int WaitForKey(TetrisInput *input, uint64_t deadline_ns) {
+  struct pollfd fds[3];
+  int key, result, count;
+  // A deadline that has already passed would be 0 once converted, which means
+  // "disarm" to timerfd, so handle it here.
+  if (deadline_ns && (MonotonicNanoseconds() >= deadline_ns)) {
+    return getch();
+  }
+  ArmTimer(input, deadline_ns);
+  while (1) {
+    // Curses may have already read more than one key from the terminal, so
+    // always check for buffered input before sleeping.
+    key = getch();
+    if (key != ERR) return key;
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    count = 1;
+    if (input->extra_fd >= 0) {
+      fds[count].fd = input->extra_fd;
+      fds[count].events = input->extra_events;
+      count++;
+    }
+    if (deadline_ns) {
+      fds[count].fd = input->timer_fd;
+      fds[count].events = POLLIN;
+      count++;
+    }
+    result = poll(fds, count, -1);
+    if (result < 0) {
+      // We'll get EINTR for SIGWINCH, after which getch() returns KEY_RESIZE.
+      if (errno == EINTR) continue;
+      InputError("poll");
+    }
+    if (fds[0].revents & POLLIN) continue;
+    if (fds[0].revents & (POLLHUP | POLLERR)) {
+      // The terminal went away, so there's nobody left to play.
+      endwin();
+      exit(1);
+    }
+    if ((input->extra_fd >= 0) && fds[1].revents) return TETRIS_KEY_EXTRA_FD;
+    if (deadline_ns && (fds[count - 1].revents & POLLIN)) return ERR;
+  }
+  // Should be unreachable.
+  return ERR;
+}
@@ -0,0 +1,36 @@
+#ifndef TETRIS_INPUT_H
+#define TETRIS_INPUT_H
+// This file defines the input layer for the curses frontend. Rather than
+// polling getch() on a timeout, it sleeps in a single poll() on the terminal
+// and a timerfd, so the process only wakes up for a keypress or a deadline.
+#include <curses.h>
+#include <stdint.h>
+
+// Returned by WaitForKey when extra_fd is ready.
+#define TETRIS_KEY_EXTRA_FD (KEY_MAX + 1)
+
+typedef struct {
+  // A CLOCK_MONOTONIC timerfd, armed with the deadline passed to WaitForKey.
+  int timer_fd;
+  // Another file descriptor for WaitForKey to wait on, for the given poll()
+  // events, or -1 if there isn't one. Used for a versus match's connection.
+  int extra_fd;
+  short extra_events;
+} TetrisInput;
+
+// Creates the timerfd and puts stdscr into non-blocking mode, with no
+// extra_fd. Must be called after curses has been initialized. Exits on
+// error.
+void InitializeInput(TetrisInput *input);
+
+// Closes the timerfd.
+void DestroyInput(TetrisInput *input);
+
+// Returns the next key from getch(). If no key is available, this sleeps
+// until one arrives or until the CLOCK_MONOTONIC time reaches deadline_ns, in
+// which case this returns ERR. If deadline_ns is 0, this waits for a key
+// indefinitely. Terminal resizes are returned as KEY_RESIZE, like getch().
+// Returns TETRIS_KEY_EXTRA_FD if extra_fd becomes ready first.
+int WaitForKey(TetrisInput *input, uint64_t deadline_ns);
+
+#endif  // TETRIS_INPUT_H
@@ -0,0 +1,108 @@
+// Defines the shape of every piece. This is the only hand-written piece data:
+// gen_piece_tables.c derives the rest of the piece tables from it when the
+// game is built. This file must not depend on curses.
+#include "tetris_engine.h"
+
+const char *tetris_pieces[TETRIS_PIECE_COUNT] = {
+  // 0:
+  "===="
+  "    "
+  "    "
+  "    ",
+  // 1:
+  "=   "
+  "=   "
+  "=   "
+  "=   ",
+  // 2:
+  "HH  "
+  "HH  "
+  "    "
+  "    ",
+  // 3:
+  "N   "
+  "NN  "
+  " N  "
+  "    ",
+  // 4:
+  " NN "
+  "NN  "
+  "    "
+  "    ",
+  // 5:
+  " Z  "
+  "ZZ  "
+  "Z   "
+  "    ",
+  // 6:
+  "ZZ  "
+  " ZZ "
+  "    "
+  "    ",
+  // 7:
+  " #  "
+  "### "
+  "    "
+  "    ",
+  // 8:
+  "#   "
+  "##  "
+  "#   "
+  "    ",
+  // 9:
+  "### "
+  " #  "
+  "    "
+  "    ",
+  // 10:
+  " #  "
+  "##  "
+  " #  "
+  "    ",
+  // 11:
+  "@   "
+  "@   "
+  "@@  "
+  "    ",
+  // 12:
+  "@@@ "
+  "@   "
+  "    "
+  "    ",
+  // 13:
+  "@@  "
+  " @  "
+  " @  "
+  "    ",
+  // 14:
+  "  @ "
+  "@@@ "
+  "    "
+  "    ",
+  // 15:
+  " O  "
+  " O  "
+  "OO  "
+  "    ",
+  // 16:
+  "O   "
+  "OOO "
+  "    "
+  "    ",
+  // 17:
+  "OO  "
+  "O   "
+  "O   "
+  "    ",
+  // 18:
+  "OOO "
+  "  O "
+  "    "
+  "    ",
+};
+
+const char piece_kind_first[TETRIS_PIECE_KINDS] = {0, 2, 3, 5, 7, 11, 15};
+const char piece_kind_rotations[TETRIS_PIECE_KINDS] = {2, 1, 2, 2, 4, 4, 4};
+
+const char piece_rotations[TETRIS_PIECE_COUNT] = {1, 0, 2, 4, 3, 6, 5, 8, 9,
+  10, 7, 12, 13, 14, 11, 16, 17, 18, 15};
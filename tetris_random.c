@@ -0,0 +1,35 @@
+// Implements the PCG32 generator from tetris_random.h. See
+// https://www.pcg-random.org for a description of the algorithm.
+#include "tetris_random.h"
+
+// The LCG multiplier, and the stream selector we use for every game.
+#define PCG_MULTIPLIER (6364136223846793005ull)
+#define PCG_STREAM (1442695040888963407ull)
+
+void SeedRandom(TetrisRNG *rng, uint64_t seed) {
+  rng->state = 0;
+  rng->increment = PCG_STREAM | 1;
+  RandomU32(rng);
+  rng->state += seed;
+  RandomU32(rng);
+}
+
+uint32_t RandomU32(TetrisRNG *rng) {
+  uint64_t old = rng->state;
+  uint32_t xorshifted, rotation;
+  rng->state = old * PCG_MULTIPLIER + rng->increment;
+  xorshifted = ((old >> 18) ^ old) >> 27;
+  rotation = old >> 59;
+  return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+}
+
+uint32_t RandomBelow(TetrisRNG *rng, uint32_t limit) {
+  // Reject the few values at the bottom of the range that would make some
+  // results more likely than others.
+  uint32_t threshold = -limit % limit;
+  uint32_t value;
+  do {
+    value = RandomU32(rng);
+  } while (value < threshold);
+  return value % limit;
+}
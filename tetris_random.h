@@ -0,0 +1,24 @@
+#ifndef TETRIS_RANDOM_H
+#define TETRIS_RANDOM_H
+// This file defines a small, seedable pseudorandom number generator (PCG32).
+// Every game keeps its own generator, so games are reproducible from their
+// seed and independent games can run in parallel.
+#include <stdint.h>
+
+typedef struct {
+  uint64_t state;
+  uint64_t increment;
+} TetrisRNG;
+
+// Initializes the generator so that it produces the sequence for the given
+// seed.
+void SeedRandom(TetrisRNG *rng, uint64_t seed);
+
+// Returns the next 32 random bits from the generator.
+uint32_t RandomU32(TetrisRNG *rng);
+
+// Returns a uniformly distributed random number in [0, limit). limit must not
+// be 0.
+uint32_t RandomBelow(TetrisRNG *rng, uint32_t limit);
+
+#endif  // TETRIS_RANDOM_H
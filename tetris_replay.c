@@ -0,0 +1,187 @@
+// Implements the replay logs described in tetris_replay.h.
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_replay.h"
+
+// The number of bits of each record used for the input.
+#define INPUT_BITS (3)
+
+void EncodeReplayHeader(TetrisGameConfig *config, uint8_t *header) {
+  int i;
+  memset(header, 0, REPLAY_HEADER_SIZE);
+  memcpy(header, REPLAY_MAGIC, 4);
+  header[4] = REPLAY_VERSION & 0xff;
+  header[5] = REPLAY_VERSION >> 8;
+  header[6] = config->randomizer;
+  for (i = 0; i < 4; i++) header[8 + i] = config->tick_rate >> (i * 8);
+  for (i = 0; i < 8; i++) header[12 + i] = config->seed >> (i * 8);
+}
+
+int EncodeReplayRecord(uint64_t tick_delta, int input, uint8_t *buffer) {
+  uint64_t value = (tick_delta << INPUT_BITS) | input;
+  int length = 0;
+  do {
+    buffer[length] = value & 0x7f;
+    value >>= 7;
+    if (value) buffer[length] |= 0x80;
+    length++;
+  } while (value);
+  return length;
+}
+
+int OpenReplayWriter(ReplayWriter *w, const char *path,
+  TetrisGameConfig *config) {
+  uint8_t header[REPLAY_HEADER_SIZE];
+  EncodeReplayHeader(config, header);
+  w->last_tick = 0;
+  w->file = fopen(path, "wb");
+  if (!w->file) return 0;
+  if (fwrite(header, sizeof(header), 1, w->file) < 1) {
+    fclose(w->file);
+    w->file = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Writes a single record.
+static int WriteRecord(ReplayWriter *w, uint64_t tick, int input) {
+  uint8_t buffer[REPLAY_MAX_RECORD_SIZE];
+  int length = EncodeReplayRecord(tick - w->last_tick, input, buffer);
+  w->last_tick = tick;
+  return fwrite(buffer, length, 1, w->file) == 1;
+}
+
+int RecordInput(ReplayWriter *w, uint64_t tick, int input) {
+  if (input == TETRIS_INPUT_NONE) return 1;
+  return WriteRecord(w, tick, input);
+}
+
+int CloseReplayWriter(ReplayWriter *w, uint64_t final_tick) {
+  int ok = WriteRecord(w, final_tick, TETRIS_INPUT_NONE);
+  int saved_errno = errno;
+  if (fclose(w->file) != 0) {
+    ok = 0;
+  } else {
+    errno = saved_errno;
+  }
+  w->file = NULL;
+  return ok;
+}
+
+int DecodeReplayRecord(const uint8_t *data, size_t size,
+  uint64_t *tick_delta, int *input) {
+  uint64_t value = 0;
+  int shift = 0, length = 0;
+  uint8_t b;
+  do {
+    if (length >= size) return 0;
+    if (shift > 63) return -1;
+    b = data[length];
+    length++;
+    value |= ((uint64_t) (b & 0x7f)) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  *tick_delta = value >> INPUT_BITS;
+  *input = value & ((1 << INPUT_BITS) - 1);
+  return length;
+}
+
+// Reads the next record into r's pending record. Clears has_pending at the
+// end of the log.
+static void ReadNextRecord(ReplayReader *r) {
+  uint64_t tick_delta;
+  int length = DecodeReplayRecord(r->data + r->offset, r->size - r->offset,
+    &tick_delta, &r->pending_input);
+  if (length <= 0) {
+    r->has_pending = 0;
+    r->truncated = 1;
+    return;
+  }
+  r->offset += length;
+  r->has_pending = 1;
+  r->pending_tick += tick_delta;
+}
+
+int InitializeReplayReader(ReplayReader *r, const uint8_t *data, size_t size) {
+  int i, version;
+  memset(r, 0, sizeof(*r));
+  if (size < REPLAY_HEADER_SIZE) return 0;
+  if (memcmp(data, REPLAY_MAGIC, 4) != 0) return 0;
+  version = data[4] | (data[5] << 8);
+  if ((version < REPLAY_OLDEST_VERSION) || (version > REPLAY_VERSION)) {
+    return 0;
+  }
+  r->data = data;
+  r->size = size;
+  r->offset = REPLAY_HEADER_SIZE;
+  r->config.randomizer = data[6];
+  for (i = 0; i < 4; i++) {
+    r->config.tick_rate |= ((uint32_t) data[8 + i]) << (i * 8);
+  }
+  for (i = 0; i < 8; i++) {
+    r->config.seed |= ((uint64_t) data[12 + i]) << (i * 8);
+  }
+  if ((r->config.tick_rate == 0) || (r->config.randomizer < 0) ||
+    (r->config.randomizer > TETRIS_RANDOMIZER_BAG)) {
+    return 0;
+  }
+  ReadNextRecord(r);
+  return 1;
+}
+
+void InitializeReplayRecords(ReplayReader *r, TetrisGameConfig *config,
+  const uint8_t *records, size_t size) {
+  memset(r, 0, sizeof(*r));
+  r->data = records;
+  r->size = size;
+  r->config = *config;
+  ReadNextRecord(r);
+}
+
+uint8_t* LoadReplayFile(const char *path, size_t *size) {
+  uint8_t *data = NULL;
+  long length;
+  int saved_errno;
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  if ((fseek(f, 0, SEEK_END) != 0) || ((length = ftell(f)) < 0) ||
+    (fseek(f, 0, SEEK_SET) != 0)) {
+    goto error;
+  }
+  // Allocate at least a byte, so an empty file doesn't look like an error.
+  data = (uint8_t *) malloc(length + 1);
+  if (!data) goto error;
+  if (fread(data, 1, length, f) != (size_t) length) {
+    if (!ferror(f)) errno = EIO;
+    goto error;
+  }
+  fclose(f);
+  *size = length;
+  return data;
+error:
+  saved_errno = errno;
+  free(data);
+  fclose(f);
+  errno = saved_errno;
+  return NULL;
+}
+
+void StartReplay(ReplayReader *r, TetrisGameState *s) {
+  InitializeNewGame(s, &r->config);
+}
+
+int StepReplay(ReplayReader *r, TetrisGameState *s) {
+  while (r->has_pending && (r->pending_tick <= s->ticks)) {
+    if (r->pending_input == TETRIS_INPUT_NONE) {
+      // This was the end of the game.
+      r->has_pending = 0;
+      return 0;
+    }
+    if (!UpdateGameState(s, r->pending_input)) return 0;
+    ReadNextRecord(r);
+  }
+  if (!r->has_pending) return 0;
+  return TickGameState(s);
+}
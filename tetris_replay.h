@@ -0,0 +1,113 @@
+#ifndef TETRIS_REPLAY_H
+#define TETRIS_REPLAY_H
+// This file defines replay logs. Since games are deterministic, a game is
+// fully described by its TetrisGameConfig and the inputs passed to
+// UpdateGameState, along with the tick at which each input happened. A log
+// consists of a header followed by records:
+//
+//   Header (REPLAY_HEADER_SIZE bytes, little-endian):
+//     4 bytes: REPLAY_MAGIC
+//     2 bytes: format version (REPLAY_VERSION)
+//     1 byte: randomizer
+//     1 byte: reserved, must be 0
+//     4 bytes: tick_rate
+//     8 bytes: seed
+//
+//   Each record is a single unsigned LEB128 varint holding
+//   (tick_delta << 3) | input, where input is a TETRIS_INPUT_* value and
+//   tick_delta is the number of ticks since the previous record (or since the
+//   start of the game). A record with TETRIS_INPUT_NONE marks the tick at which
+//   the game ended, and must be the last record.
+//
+// An input usually takes a single byte, since most inputs happen less than 16
+// ticks apart.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "tetris_engine.h"
+
+#define REPLAY_MAGIC "TTRP"
+#define REPLAY_VERSION (2)
+// Logs from before TETRIS_INPUT_HOLD, which are read the same way.
+#define REPLAY_OLDEST_VERSION (1)
+#define REPLAY_HEADER_SIZE (20)
+
+// The most bytes a single record can take: a 64-bit value never needs more
+// than 10 bytes as a varint.
+#define REPLAY_MAX_RECORD_SIZE (10)
+
+// Records a game as it's played.
+typedef struct {
+  FILE *file;
+  // The value of TetrisGameState.ticks when the last record was written.
+  uint64_t last_tick;
+} ReplayWriter;
+
+// Plays back a replay log held in memory. The reader doesn't own the data.
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  // The offset of the next unread record in data.
+  size_t offset;
+  // The config the recorded game was started with.
+  TetrisGameConfig config;
+  // The next record to apply: the absolute tick it happens at, and its input.
+  // has_pending is 0 once every record has been applied.
+  int has_pending;
+  uint64_t pending_tick;
+  int pending_input;
+  // Set if the log ended without an end-of-game record, or was corrupt.
+  int truncated;
+} ReplayReader;
+
+// Fills in the REPLAY_HEADER_SIZE-byte header of a log for a game started with
+// the given config.
+void EncodeReplayHeader(TetrisGameConfig *config, uint8_t *header);
+
+// Writes a single record, for an input (or the end of the game, if input is
+// TETRIS_INPUT_NONE) tick_delta ticks after the previous one, to buffer, which
+// must hold REPLAY_MAX_RECORD_SIZE bytes. Returns the number of bytes used.
+int EncodeReplayRecord(uint64_t tick_delta, int input, uint8_t *buffer);
+
+// Reads a single record from the size bytes at data. Returns the number of
+// bytes it took, 0 if data ends partway through it, or -1 if it's invalid.
+int DecodeReplayRecord(const uint8_t *data, size_t size,
+  uint64_t *tick_delta, int *input);
+
+// Creates (or replaces) the log at path and writes the header for a game
+// started with the given config. Returns 0 and sets errno on error.
+int OpenReplayWriter(ReplayWriter *w, const char *path,
+  TetrisGameConfig *config);
+
+// Appends a record for an input passed to UpdateGameState when s->ticks was
+// equal to tick. Returns 0 and sets errno on error.
+int RecordInput(ReplayWriter *w, uint64_t tick, int input);
+
+// Appends the end-of-game record for a game that ended at the given tick, and
+// closes the file. Returns 0 and sets errno on error; the file is closed
+// either way.
+int CloseReplayWriter(ReplayWriter *w, uint64_t final_tick);
+
+// Sets up a reader for the log in data, which must remain valid while the
+// reader is used. Returns 0 if the header is invalid.
+int InitializeReplayReader(ReplayReader *r, const uint8_t *data, size_t size);
+
+// Sets up a reader for the records of a log stored without its header, such
+// as one in a game database, for a game started with the given config. The
+// records must remain valid while the reader is used.
+void InitializeReplayRecords(ReplayReader *r, TetrisGameConfig *config,
+  const uint8_t *records, size_t size);
+
+// Reads the whole file at path into a newly allocated buffer, which the caller
+// must free. Returns NULL and sets errno on error.
+uint8_t* LoadReplayFile(const char *path, size_t *size);
+
+// Starts the recorded game in s, using the config from the log.
+void StartReplay(ReplayReader *r, TetrisGameState *s);
+
+// Advances the game in s by one tick: applies every input recorded for the
+// current tick, then calls TickGameState. Returns 0 once the game is over or
+// the log has been fully played.
+int StepReplay(ReplayReader *r, TetrisGameState *s);
+
+#endif  // TETRIS_REPLAY_H
@@ -0,0 +1,255 @@
+// Implements the quicksave format described in tetris_save.h.
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "tetris_save.h"
+
+// Every character that can appear on the board, in the order their indices
+// are saved. Empty cells aren't saved, so ' ' isn't needed.
+static const char save_glyphs[] = "=HNZ#@O";
+#define SAVE_GLYPH_COUNT (sizeof(save_glyphs) - 1)
+
+const char* SaveErrorString(int error) {
+  switch (error) {
+  case SAVE_OK:
+    return "OK";
+  case SAVE_ERROR_IO:
+    return strerror(errno);
+  case SAVE_ERROR_FORMAT:
+    return "not a save file";
+  case SAVE_ERROR_VERSION:
+    return "unsupported version";
+  case SAVE_ERROR_CHECKSUM:
+    return "bad checksum";
+  case SAVE_ERROR_INVALID:
+    return "invalid game state";
+  default:
+    break;
+  }
+  return "unknown error";
+}
+
+uint32_t SaveCRC32(const uint8_t *data, size_t size) {
+  uint32_t crc = 0xffffffff;
+  size_t i;
+  int bit;
+  for (i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static void PutU16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void PutU32(uint8_t *p, uint32_t v) {
+  PutU16(p, v);
+  PutU16(p + 2, v >> 16);
+}
+
+static void PutU64(uint8_t *p, uint64_t v) {
+  PutU32(p, v);
+  PutU32(p + 4, v >> 32);
+}
+
+static uint16_t GetU16(const uint8_t *p) {
+  return p[0] | (((uint16_t) p[1]) << 8);
+}
+
+static uint32_t GetU32(const uint8_t *p) {
+  return GetU16(p) | (((uint32_t) GetU16(p + 2)) << 16);
+}
+
+static uint64_t GetU64(const uint8_t *p) {
+  return GetU32(p) | (((uint64_t) GetU32(p + 4)) << 32);
+}
+
+// Returns the index of c in save_glyphs. Characters that aren't in the table
+// are saved as the first glyph, rather than producing an unreadable save.
+static int GlyphIndex(char c) {
+  const char *found = strchr(save_glyphs, c);
+  if (!found || (c == 0)) return 0;
+  return found - save_glyphs;
+}
+
+size_t EncodeGameState(TetrisGameState *s, uint8_t *buffer) {
+  uint8_t *payload = buffer + SAVE_HEADER_SIZE;
+  uint8_t *p = payload;
+  int row, col, i, cell_count = 0;
+  uint32_t payload_size;
+  memset(buffer, 0, SAVE_MAX_SIZE);
+  *(p++) = BLOCKS_WIDE;
+  *(p++) = BLOCKS_TALL;
+  *(p++) = s->current_piece;
+  *(p++) = (uint8_t) s->location_x;
+  *(p++) = (uint8_t) s->location_y;
+  PutU32(p, s->score);
+  PutU32(p + 4, s->lines);
+  PutU32(p + 8, s->gravity_ticks);
+  PutU64(p + 12, s->ticks);
+  PutU64(p + 20, s->seed);
+  PutU64(p + 28, s->rng.state);
+  PutU64(p + 36, s->rng.increment);
+  p[44] = s->randomizer;
+  p[45] = (uint8_t) s->hold_piece;
+  p[46] = s->hold_used;
+  p[47] = s->queue_count;
+  for (i = 0; i < s->queue_count; i++) p[48 + i] = QueuedPiece(s, i);
+  p += 48 + TETRIS_QUEUE_CAPACITY;
+  for (row = 0; row < BLOCKS_TALL; row++) {
+    PutU16(p, s->rows[row]);
+    p += 2;
+  }
+  // Pack the glyphs of the occupied cells, two per byte.
+  for (row = 0; row < BLOCKS_TALL; row++) {
+    for (col = 0; col < BLOCKS_WIDE; col++) {
+      if (!(s->rows[row] & (1 << col))) continue;
+      p[cell_count >> 1] |= GlyphIndex(s->board[row * BLOCKS_WIDE + col]) <<
+        ((cell_count & 1) * 4);
+      cell_count++;
+    }
+  }
+  p += (cell_count + 1) / 2;
+  payload_size = p - payload;
+
+  memcpy(buffer, SAVE_MAGIC, 4);
+  PutU16(buffer + 4, SAVE_VERSION);
+  PutU32(buffer + 8, payload_size);
+  PutU32(buffer + 12, SaveCRC32(payload, payload_size));
+  return SAVE_HEADER_SIZE + payload_size;
+}
+
+int DecodeGameState(const uint8_t *data, size_t size, TetrisGameState *s) {
+  TetrisGameState tmp;
+  const uint8_t *p, *glyphs;
+  uint32_t payload_size;
+  int row, col, i, cell_count = 0, glyph;
+  if (size < SAVE_HEADER_SIZE) return SAVE_ERROR_FORMAT;
+  if (memcmp(data, SAVE_MAGIC, 4) != 0) return SAVE_ERROR_FORMAT;
+  if (GetU16(data + 4) != SAVE_VERSION) return SAVE_ERROR_VERSION;
+  payload_size = GetU32(data + 8);
+  if (payload_size > (size - SAVE_HEADER_SIZE)) return SAVE_ERROR_FORMAT;
+  p = data + SAVE_HEADER_SIZE;
+  // The checksum is what protects everything below from corrupted data, so
+  // we only need to check the values that a valid save could still get wrong.
+  if (SaveCRC32(p, payload_size) != GetU32(data + 12)) {
+    return SAVE_ERROR_CHECKSUM;
+  }
+  if (payload_size < (SAVE_FIXED_SIZE + BLOCKS_TALL * 2)) {
+    return SAVE_ERROR_FORMAT;
+  }
+  if ((p[0] != BLOCKS_WIDE) || (p[1] != BLOCKS_TALL)) {
+    return SAVE_ERROR_INVALID;
+  }
+
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.current_piece = p[2];
+  tmp.location_x = (int8_t) p[3];
+  tmp.location_y = (int8_t) p[4];
+  tmp.score = GetU32(p + 5);
+  tmp.lines = GetU32(p + 9);
+  tmp.gravity_ticks = GetU32(p + 13);
+  tmp.ticks = GetU64(p + 17);
+  tmp.seed = GetU64(p + 25);
+  tmp.rng.state = GetU64(p + 33);
+  tmp.rng.increment = GetU64(p + 41);
+  tmp.randomizer = p[49];
+  tmp.hold_piece = (p[50] == 0xff) ? -1 : p[50];
+  tmp.hold_used = p[51];
+  tmp.queue_count = p[52];
+  if ((tmp.hold_used > 1) || (tmp.queue_count > TETRIS_QUEUE_CAPACITY)) {
+    return SAVE_ERROR_INVALID;
+  }
+  for (i = 0; i < tmp.queue_count; i++) tmp.queue[i] = p[53 + i];
+  p += SAVE_FIXED_SIZE;
+  for (row = 0; row < BLOCKS_TALL; row++) {
+    tmp.rows[row] = GetU16(p);
+    p += 2;
+  }
+  if (!SanityCheckState(&tmp)) return SAVE_ERROR_INVALID;
+
+  // Rebuild the board's characters from the glyphs. Every cell gets either a
+  // space or a character from the table, so there's nothing left to check.
+  glyphs = p;
+  memset(tmp.board, ' ', sizeof(tmp.board));
+  for (row = 0; row < BLOCKS_TALL; row++) {
+    if (!tmp.rows[row]) continue;
+    for (col = 0; col < BLOCKS_WIDE; col++) {
+      if (!(tmp.rows[row] & (1 << col))) continue;
+      if ((glyphs + (cell_count >> 1)) >= (data + SAVE_HEADER_SIZE +
+        payload_size)) {
+        return SAVE_ERROR_FORMAT;
+      }
+      glyph = (glyphs[cell_count >> 1] >> ((cell_count & 1) * 4)) & 0xf;
+      if (glyph >= SAVE_GLYPH_COUNT) return SAVE_ERROR_INVALID;
+      tmp.board[row * BLOCKS_WIDE + col] = save_glyphs[glyph];
+      cell_count++;
+    }
+  }
+  RecomputeColumnTops(&tmp);
+  tmp.board_hash = BoardHash(tmp.rows);
+  tmp.dirty_rows = ALL_ROWS_DIRTY;
+  *s = tmp;
+  return SAVE_OK;
+}
+
+int WriteSaveFile(const char *path, TetrisGameState *s) {
+  uint8_t buffer[SAVE_MAX_SIZE];
+  char tmp_path[256];
+  size_t size = EncodeGameState(s, buffer);
+  int saved_errno;
+  FILE *f;
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+    sizeof(tmp_path)) {
+    errno = ENAMETOOLONG;
+    return SAVE_ERROR_IO;
+  }
+  f = fopen(tmp_path, "wb");
+  if (!f) return SAVE_ERROR_IO;
+  // Make sure the data is really on disk before it replaces the old save.
+  if ((fwrite(buffer, size, 1, f) < 1) || (fflush(f) != 0) ||
+    (fsync(fileno(f)) != 0)) {
+    saved_errno = errno;
+    fclose(f);
+    remove(tmp_path);
+    errno = saved_errno;
+    return SAVE_ERROR_IO;
+  }
+  if (fclose(f) != 0) {
+    saved_errno = errno;
+    remove(tmp_path);
+    errno = saved_errno;
+    return SAVE_ERROR_IO;
+  }
+  if (rename(tmp_path, path) != 0) {
+    saved_errno = errno;
+    remove(tmp_path);
+    errno = saved_errno;
+    return SAVE_ERROR_IO;
+  }
+  return SAVE_OK;
+}
+
+int ReadSaveFile(const char *path, TetrisGameState *s) {
+  // Read one byte more than the largest valid save, so we can tell if the file
+  // is too big.
+  uint8_t buffer[SAVE_MAX_SIZE + 1];
+  size_t size;
+  FILE *f = fopen(path, "rb");
+  if (!f) return SAVE_ERROR_IO;
+  size = fread(buffer, 1, sizeof(buffer), f);
+  if (ferror(f)) {
+    fclose(f);
+    errno = EIO;
+    return SAVE_ERROR_IO;
+  }
+  fclose(f);
+  if (size > SAVE_MAX_SIZE) return SAVE_ERROR_FORMAT;
+  return DecodeGameState(buffer, size, s);
+}
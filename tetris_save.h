@@ -0,0 +1,84 @@
+#ifndef TETRIS_SAVE_H
+#define TETRIS_SAVE_H
+// This file defines the quicksave file format. Saves are written byte by byte
+// in little-endian order, so they don't depend on the compiler's struct layout
+// or the machine's byte order. A save consists of a 16-byte header followed by
+// a payload:
+//
+//   Header:
+//     4 bytes: SAVE_MAGIC
+//     2 bytes: format version (SAVE_VERSION)
+//     2 bytes: reserved, must be 0
+//     4 bytes: payload length, in bytes
+//     4 bytes: CRC-32 of the payload
+//
+//   Payload (version 3):
+//     1 byte each: board width, board height, current piece
+//     1 byte each: location_x, location_y (signed)
+//     4 bytes each: score, lines, gravity_ticks
+//     8 bytes each: ticks, seed, rng.state, rng.increment
+//     1 byte each: randomizer, hold piece (0xff if none), hold_used,
+//       queue_count
+//     TETRIS_QUEUE_CAPACITY bytes: the queued pieces, starting with the next
+//       one, followed by zeros
+//     2 bytes per row: the board's row bitmasks, starting from the top row
+//     4 bits per occupied cell, in the same order as the board array: the
+//       index of the cell's character in the glyph table, two cells per byte
+//       with the first in the low bits.
+//
+// Only the first occupied cells get glyphs, so the payload size depends on how
+// full the board is.
+#include <stddef.h>
+#include <stdint.h>
+#include "tetris_engine.h"
+
+#define SAVE_MAGIC "TTRS"
+#define SAVE_VERSION (3)
+#define SAVE_HEADER_SIZE (16)
+
+// The size of the part of the payload before the row bitmasks.
+#define SAVE_FIXED_SIZE (53 + TETRIS_QUEUE_CAPACITY)
+
+// The largest possible save: the header, the fixed part of the payload, the
+// rows, and a glyph for every cell.
+#define SAVE_MAX_SIZE (SAVE_HEADER_SIZE + SAVE_FIXED_SIZE + \
+  (BLOCKS_TALL * 2) + ((BLOCKS_WIDE * BLOCKS_TALL + 1) / 2))
+
+// Return values from the functions in this file.
+#define SAVE_OK (0)
+// A system call failed; errno holds the reason.
+#define SAVE_ERROR_IO (1)
+// The data doesn't start with a valid header, or was truncated.
+#define SAVE_ERROR_FORMAT (2)
+// The save was written by an unsupported version of the format.
+#define SAVE_ERROR_VERSION (3)
+// The payload doesn't match its checksum.
+#define SAVE_ERROR_CHECKSUM (4)
+// The payload was intact, but doesn't describe a valid game.
+#define SAVE_ERROR_INVALID (5)
+
+// Returns a short description of one of the SAVE_* values above. For
+// SAVE_ERROR_IO, this is the description of the current errno.
+const char* SaveErrorString(int error);
+
+// Returns the CRC-32 (the same one used by zlib and PNG) of the given data.
+uint32_t SaveCRC32(const uint8_t *data, size_t size);
+
+// Encodes the game state into buffer, which must hold at least SAVE_MAX_SIZE
+// bytes. Returns the number of bytes used.
+size_t EncodeGameState(TetrisGameState *s, uint8_t *buffer);
+
+// Decodes a game state from the given data. Returns SAVE_OK on success. On
+// error, s is not modified. The decoded state has no events, all rows dirty,
+// and a tick_rate of 0, which the caller must fill in.
+int DecodeGameState(const uint8_t *data, size_t size, TetrisGameState *s);
+
+// Writes the game state to the file at path. The save is written to a
+// temporary file next to path and then renamed over it, so an interrupted save
+// never damages an existing one. Returns SAVE_OK or an error.
+int WriteSaveFile(const char *path, TetrisGameState *s);
+
+// Reads a game state from the file at path, as in DecodeGameState.
+int ReadSaveFile(const char *path, TetrisGameState *s);
+
+#endif  // TETRIS_SAVE_H
@@ -0,0 +1,59 @@
+// Implements the fixed-rate tick scheduler from tetris_sched.h.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tetris_sched.h"
+
+#define NS_PER_SECOND (1000000000ull)
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds.
+uint64_t MonotonicNanoseconds(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    fprintf(stderr, "Error getting time: %s\n", strerror(errno));
+    exit(1);
+  }
+  return ((uint64_t) ts.tv_sec) * NS_PER_SECOND + ts.tv_nsec;
+}
+
+// Sets up a scheduler to produce ticks_per_second ticks.
+void InitializeScheduler(TetrisScheduler *sched, uint32_t ticks_per_second) {
+  memset(sched, 0, sizeof(*sched));
+  sched->tick_ns = NS_PER_SECOND / ticks_per_second;
+  ResetScheduler(sched);
+}
+
+// Restarts the schedule from the current time.
+void ResetScheduler(TetrisScheduler *sched) {
+  sched->next_deadline = MonotonicNanoseconds() + sched->tick_ns;
+  sched->wake_deadline = sched->next_deadline;
+}
+
+// Records when the caller plans to check for due ticks next.
+uint64_t PlanWakeup(TetrisScheduler *sched, uint32_t ticks_ahead) {
+  if (ticks_ahead < 1) ticks_ahead = 1;
+  sched->wake_deadline = sched->next_deadline +
+    (ticks_ahead - 1) * sched->tick_ns;
+  return sched->wake_deadline;
+}
+
+// Returns the number of ticks that are due, and advances the deadline.
+uint32_t TicksDue(TetrisScheduler *sched) {
+  uint64_t now = MonotonicNanoseconds();
+  uint64_t due, late = 0;
+  if (now < sched->next_deadline) return 0;
+  due = ((now - sched->next_deadline) / sched->tick_ns) + 1;
+  sched->ticks += due;
+  sched->next_deadline += due * sched->tick_ns;
+  // Waking up less than a tick after the planned time is normal; anything
+  // more means we missed deadlines entirely.
+  if (now >= sched->wake_deadline) {
+    late = (now - sched->wake_deadline) / sched->tick_ns;
+  }
+  sched->missed += late;
+  if (late > MAX_CATCH_UP_TICKS) due -= late - MAX_CATCH_UP_TICKS;
+  sched->wake_deadline = sched->next_deadline;
+  return due;
+}
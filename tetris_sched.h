@@ -0,0 +1,52 @@
+#ifndef TETRIS_SCHED_H
+#define TETRIS_SCHED_H
+// This file defines a fixed-rate tick scheduler, used to advance games at a
+// constant rate independent of how often input arrives. Like the rest of the
+// engine, this doesn't depend on curses.
+#include <stdint.h>
+
+// If the scheduler wakes up more than this many ticks later than planned (for
+// example, if the process was stopped), the remaining overdue ticks are
+// dropped rather than run back-to-back.
+#define MAX_CATCH_UP_TICKS (30)
+
+typedef struct {
+  // The length of a single tick, in nanoseconds.
+  uint64_t tick_ns;
+  // The CLOCK_MONOTONIC time, in nanoseconds, at which the next tick is due.
+  uint64_t next_deadline;
+  // The CLOCK_MONOTONIC time, in nanoseconds, at which the caller planned to
+  // next check for due ticks. Ticks aren't missed until a full tick after
+  // this, so callers may sleep through ticks that they know won't do anything.
+  uint64_t wake_deadline;
+  // The total number of ticks that have become due.
+  uint64_t ticks;
+  // The number of whole ticks by which TicksDue was called later than the
+  // planned wakeup time, including any dropped ticks.
+  uint64_t missed;
+} TetrisScheduler;
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds. Exits if the clock
+// can't be read.
+uint64_t MonotonicNanoseconds(void);
+
+// Sets up a scheduler to produce ticks_per_second ticks, with the first tick
+// due one tick from now.
+void InitializeScheduler(TetrisScheduler *sched, uint32_t ticks_per_second);
+
+// Restarts the schedule as if it was initialized now, without counting the
+// time since the last tick as missed. Used after pausing. Doesn't reset the
+// tick or missed counters.
+void ResetScheduler(TetrisScheduler *sched);
+
+// Plans to check for due ticks again once ticks_ahead more ticks are due,
+// where ticks_ahead is at least 1. Returns the CLOCK_MONOTONIC time, in
+// nanoseconds, at which that will happen. Unless this is called, the
+// scheduler expects to be checked at every tick.
+uint64_t PlanWakeup(TetrisScheduler *sched, uint32_t ticks_ahead);
+
+// Returns the number of ticks that have become due since the last call, and
+// moves the deadline past them. The caller must run this many ticks.
+uint32_t TicksDue(TetrisScheduler *sched);
+
+#endif  // TETRIS_SCHED_H
@@ -0,0 +1,975 @@
+// A server that hosts many games in a single process, for players connecting
+// with telnet (or anything forwarded to its port, such as an SSH tunnel).
+// Each connection gets its own curses SCREEN from newterm(), and its own game
+// and scheduler. curses writes each SCREEN's output into a pipe instead of the
+// socket, so a frame can be read back and sent in one non-blocking send(),
+// and a slow client never stalls the other sessions.
+//
+// Sessions are driven by an epoll event loop. curses keeps the current SCREEN
+// in global state, and the curses library linked here isn't thread-safe, so
+// extra worker loops are processes sharing the listening socket rather than
+// threads.
+#include <curses.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "tetris_draw.h"
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_sched.h"
+#include "tetris_sim.h"
+
+// The port listened on unless --port is given.
+#define DEFAULT_PORT (2323)
+
+// The number of sessions each worker hosts unless --max-sessions is given.
+#define DEFAULT_MAX_SESSIONS (1024)
+
+// Sessions are laid out like the standalone game: the board, with the next
+// piece, score, and line count beside it and the held piece beside them,
+// inside a box with a status line.
+#define BOARD_CHARS_WIDE ((BLOCKS_WIDE * 2) + 2)
+#define BOARD_CHARS_TALL (BLOCKS_TALL + 2)
+#define STATUS_WINDOW_WIDTH (15)
+#define HOLD_WINDOW_WIDTH (12)
+#define HOLD_WINDOW_X (BOARD_CHARS_WIDE + STATUS_WINDOW_WIDTH + 7)
+#define SESSION_COLUMNS (HOLD_WINDOW_X + HOLD_WINDOW_WIDTH + 3)
+#define SESSION_LINES (BOARD_CHARS_TALL + 4)
+
+// The character drawn for the cells of the ghost piece.
+#define GHOST_CHARACTER ('.')
+
+// If a client falls this far behind on reading its output, it's
+// disconnected.
+#define MAX_PENDING_OUTPUT (64 * 1024)
+
+// The most epoll events handled per wakeup.
+#define MAX_EVENTS (64)
+
+// Telnet command bytes (RFC 854) and options.
+#define TELNET_IAC (255)
+#define TELNET_DONT (254)
+#define TELNET_DO (253)
+#define TELNET_WONT (252)
+#define TELNET_WILL (251)
+#define TELNET_SB (250)
+#define TELNET_SE (240)
+#define TELNET_ECHO (1)
+#define TELNET_SUPPRESS_GO_AHEAD (3)
+#define TELNET_LINEMODE (34)
+
+// Where a session's input parser is within a telnet command or an escape
+// sequence.
+#define INPUT_TEXT (0)
+// After IAC.
+#define INPUT_COMMAND (1)
+// After IAC WILL, WONT, DO, or DONT, which are followed by an option.
+#define INPUT_OPTION (2)
+// Inside a subnegotiation (IAC SB ... IAC SE), and after an IAC inside one.
+#define INPUT_SUBNEGOTIATION (3)
+#define INPUT_SUBNEGOTIATION_IAC (4)
+// After ESC, and after ESC [ or ESC O.
+#define INPUT_ESCAPE (5)
+#define INPUT_CSI (6)
+// After ESC [ 6, which is followed by ~ for page down.
+#define INPUT_CSI_6 (7)
+
+// What a session's player is doing.
+#define SESSION_WAITING (0)
+#define SESSION_PLAYING (1)
+#define SESSION_PAUSED (2)
+
+typedef struct ServerSession {
+  int socket_fd;
+  // curses writes to output_file, the write end of a pipe, and the output is
+  // read from output_fd, its non-blocking read end.
+  FILE *output_file;
+  int output_fd;
+  SCREEN *screen;
+  // The windows, as in the standalone game's TetrisDisplay.
+  WINDOW *top_window;
+  WINDOW *game;
+  WINDOW *score;
+  WINDOW *line_count;
+  WINDOW *next_piece;
+  WINDOW *hold;
+  // One of the SESSION_* values.
+  int mode;
+  TetrisGameState state;
+  TetrisScheduler sched;
+  // The time, in CLOCK_MONOTONIC nanoseconds, at which the game next needs
+  // to run ticks, or 0 if it isn't running.
+  uint64_t wake_time;
+  // Output read from curses but not yet accepted by the socket.
+  uint8_t *pending;
+  size_t pending_size;
+  size_t pending_capacity;
+  // Nonzero if the socket is being polled for writability, which is only
+  // needed while output is pending.
+  int polling_output;
+  // The INPUT_* state the last read left the parser in.
+  int input_state;
+  // What's been drawn, so only changes are redrawn; see DisplayGameState in
+  // tetris.c.
+  int redraw_all;
+  short drawn_next_piece;
+  short drawn_hold_piece;
+  unsigned drawn_score;
+  unsigned drawn_lines;
+  short drawn_ghost_piece;
+  int drawn_ghost_x;
+  int drawn_ghost_y;
+  // Nonzero once the session has been closed. It's moved to idle_sessions
+  // once the events that may still refer to it have been handled.
+  int closed;
+  // The session's index in the sessions array.
+  int index;
+  // The next session in idle_sessions.
+  struct ServerSession *next_idle;
+} ServerSession;
+
+// Holds the settings chosen on the command line.
+typedef struct {
+  int port;
+  int workers;
+  int max_sessions;
+  const char *term;
+  uint32_t tick_rate;
+  int randomizer;
+} ServerOptions;
+
+static ServerOptions options;
+
+// This worker's sessions, and its epoll instance.
+static ServerSession **sessions = NULL;
+static int session_count = 0;
+// Closed sessions, kept with their SCREENs and windows for reuse by later
+// connections. See CloseSession.
+static ServerSession *idle_sessions = NULL;
+static int epoll_fd = -1;
+
+// The input curses is given for every SCREEN. Keys are read from the socket
+// and decoded here instead, so curses never reads it.
+static FILE *null_input = NULL;
+
+// Sets O_NONBLOCK on a file descriptor. Returns 0 on error.
+static int SetNonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) return 0;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Draws the same borders as the standalone game's WinBox.
+static void WinBox(WINDOW *window) {
+  wborder(window, '|', '|', '-', '-', '+', '+', '+', '+');
+}
+
+// Prints the title at the top of a window, centered.
+static void PrintWindowTitle(WINDOW *window, const char *s) {
+  mvwaddstr(window, 0, (getmaxx(window) - strlen(s)) >> 1, s);
+}
+
+// Draws the borders, titles and controls in a session's windows, over
+// anything already in them.
+static void DrawSessionLayout(ServerSession *s) {
+  werase(s->top_window);
+  WinBox(s->top_window);
+  PrintWindowTitle(s->top_window, " Tetris ");
+  mvwaddstr(s->top_window, BOARD_CHARS_TALL - 4, BOARD_CHARS_WIDE + 5,
+    "Controls:");
+  mvwaddstr(s->top_window, BOARD_CHARS_TALL - 3, BOARD_CHARS_WIDE + 5,
+    "q: quit");
+  mvwaddstr(s->top_window, BOARD_CHARS_TALL - 2, BOARD_CHARS_WIDE + 5,
+    "space: pause");
+  mvwaddstr(s->top_window, BOARD_CHARS_TALL - 1, BOARD_CHARS_WIDE + 5,
+    "arrow keys:");
+  mvwaddstr(s->top_window, BOARD_CHARS_TALL, BOARD_CHARS_WIDE + 5,
+    "  move/rotate");
+  mvwaddstr(s->top_window, 8, HOLD_WINDOW_X + 1, "h: hold");
+  WinBox(s->game);
+  WinBox(s->next_piece);
+  PrintWindowTitle(s->next_piece, " Next ");
+  WinBox(s->hold);
+  PrintWindowTitle(s->hold, " Hold ");
+  WinBox(s->score);
+  PrintWindowTitle(s->score, " Score ");
+  WinBox(s->line_count);
+  PrintWindowTitle(s->line_count, " Lines ");
+}
+
+// Creates a session's windows in its SCREEN, which must be current. Returns 0
+// on error.
+static int CreateSessionWindows(ServerSession *s) {
+  s->top_window = newwin(SESSION_LINES, SESSION_COLUMNS, 0, 0);
+  if (!s->top_window) return 0;
+  s->game = subwin(s->top_window, BOARD_CHARS_TALL, BOARD_CHARS_WIDE, 2, 2);
+  s->next_piece = subwin(s->top_window, 8, STATUS_WINDOW_WIDTH, 2,
+    BOARD_CHARS_WIDE + 5);
+  s->score = subwin(s->top_window, 3, STATUS_WINDOW_WIDTH, 11,
+    BOARD_CHARS_WIDE + 5);
+  s->line_count = subwin(s->top_window, 3, STATUS_WINDOW_WIDTH, 15,
+    BOARD_CHARS_WIDE + 5);
+  s->hold = subwin(s->top_window, 6, HOLD_WINDOW_WIDTH, 2, HOLD_WINDOW_X);
+  if (!s->game || !s->next_piece || !s->score || !s->line_count ||
+    !s->hold) {
+    return 0;
+  }
+  DrawSessionLayout(s);
+  return 1;
+}
+
+// Writes a status message at the top of a session's main window, replacing
+// any previous one.
+static void SetStatus(ServerSession *s, const char *text) {
+  mvwprintw(s->top_window, 1, 2, "%-39s", text);
+}
+
+// Clears the board area of a session's game window, and shows two lines of
+// text in it.
+static void ShowBoardMessage(ServerSession *s, const char *first,
+  const char *second) {
+  werase(s->game);
+  WinBox(s->game);
+  mvwaddstr(s->game, 9, (BOARD_CHARS_WIDE - strlen(first)) >> 1, first);
+  mvwaddstr(s->game, 10, (BOARD_CHARS_WIDE - strlen(second)) >> 1, second);
+  s->redraw_all = 1;
+}
+
+// Draws whatever changed in a session's game since the last call, like
+// DisplayGameState in tetris.c.
+static void DisplaySessionGame(ServerSession *s) {
+  TetrisGameState *g = &s->state;
+  TetrisRowSet rows = g->dirty_rows, ghost_rows = 0;
+  int ghost_y = LandingY(g);
+  if (s->drawn_ghost_piece >= 0) {
+    ghost_rows = PieceRows(s->drawn_ghost_piece, s->drawn_ghost_y);
+  }
+  if (s->redraw_all) {
+    rows = ALL_ROWS_DIRTY;
+    s->drawn_score = ~g->score;
+    s->drawn_lines = ~g->lines;
+    s->redraw_all = 0;
+  }
+  if ((g->current_piece != s->drawn_ghost_piece) ||
+    (g->location_x != s->drawn_ghost_x) || (ghost_y != s->drawn_ghost_y)) {
+    rows |= ghost_rows | PieceRows(g->current_piece, ghost_y);
+    s->drawn_ghost_piece = g->current_piece;
+    s->drawn_ghost_x = g->location_x;
+    s->drawn_ghost_y = ghost_y;
+  }
+  if (rows) {
+    DrawBoard(s->game, g->board, rows);
+    DrawBoardPiece(s->game, g->current_piece, g->location_x, ghost_y,
+      GHOST_CHARACTER, rows);
+    DrawBoardPiece(s->game, g->current_piece, g->location_x, g->location_y,
+      piece_info[g->current_piece].glyph, rows);
+    g->dirty_rows = 0;
+  }
+  if (QueuedPiece(g, 0) != s->drawn_next_piece) {
+    if (s->drawn_next_piece >= 0) {
+      DrawPieceCells(s->next_piece, s->drawn_next_piece, 3, 5, 1);
+    }
+    DrawPieceCells(s->next_piece, QueuedPiece(g, 0), 3, 5, 0);
+    s->drawn_next_piece = QueuedPiece(g, 0);
+  }
+  if (g->hold_piece != s->drawn_hold_piece) {
+    if (s->drawn_hold_piece >= 0) {
+      DrawPieceCells(s->hold, s->drawn_hold_piece, 2, 4, 1);
+    }
+    if (g->hold_piece >= 0) DrawPieceCells(s->hold, g->hold_piece, 2, 4, 0);
+    s->drawn_hold_piece = g->hold_piece;
+  }
+  if (g->score != s->drawn_score) {
+    mvwprintw(s->score, 1, 2, "%11u", g->score);
+    s->drawn_score = g->score;
+  }
+  if (g->lines != s->drawn_lines) {
+    mvwprintw(s->line_count, 1, 2, "%11u", g->lines);
+    s->drawn_lines = g->lines;
+  }
+  g->events = 0;
+}
+
+// Discards whatever curses has written to a session's pipe.
+static void DiscardCursesOutput(ServerSession *s) {
+  uint8_t buffer[4096];
+  fflush(s->output_file);
+  while (read(s->output_fd, buffer, sizeof(buffer)) > 0) continue;
+}
+
+// Marks a session closed and closes its connection. The SCREEN, windows and
+// pipe are kept for the next connection, rather than deleted: delscreen() in
+// ncurses can leave other SCREENs' windows pointing at freed memory.
+static void CloseSession(ServerSession *s) {
+  if (s->closed) return;
+  s->closed = 1;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->socket_fd, NULL);
+  close(s->socket_fd);
+  s->socket_fd = -1;
+  s->pending_size = 0;
+  if (!s->screen) return;
+  set_term(s->screen);
+  if (!isendwin()) endwin();
+  DiscardCursesOutput(s);
+}
+
+// Removes the closed sessions from the sessions array. Those that got as far
+// as having windows are kept in idle_sessions, and the rest are freed.
+static void RemoveClosedSessions(void) {
+  ServerSession *s;
+  int i = 0;
+  while (i < session_count) {
+    s = sessions[i];
+    if (!s->closed) {
+      i++;
+      continue;
+    }
+    session_count--;
+    sessions[i] = sessions[session_count];
+    sessions[i]->index = i;
+    if (s->top_window) {
+      s->next_idle = idle_sessions;
+      idle_sessions = s;
+      continue;
+    }
+    if (s->output_file) fclose(s->output_file);
+    if (s->output_fd >= 0) close(s->output_fd);
+    free(s->pending);
+    free(s);
+  }
+}
+
+// Appends bytes to a session's pending output. Closes the session and
+// returns 0 if the client has fallen too far behind.
+static int QueueOutput(ServerSession *s, const uint8_t *data, size_t size) {
+  size_t needed = s->pending_size + size, capacity;
+  uint8_t *grown;
+  if (needed > MAX_PENDING_OUTPUT) {
+    CloseSession(s);
+    return 0;
+  }
+  if (needed > s->pending_capacity) {
+    capacity = s->pending_capacity ? (s->pending_capacity * 2) : 4096;
+    while (capacity < needed) capacity *= 2;
+    grown = (uint8_t *) realloc(s->pending, capacity);
+    if (!grown) {
+      CloseSession(s);
+      return 0;
+    }
+    s->pending = grown;
+    s->pending_capacity = capacity;
+  }
+  memcpy(s->pending + s->pending_size, data, size);
+  s->pending_size = needed;
+  return 1;
+}
+
+// Sends as much of a session's pending output as the socket will take, and
+// polls for writability if any is left. Closes the session on error.
+static void SendPendingOutput(ServerSession *s) {
+  struct epoll_event event;
+  ssize_t sent;
+  int want_output;
+  while (s->pending_size > 0) {
+    sent = send(s->socket_fd, s->pending, s->pending_size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      CloseSession(s);
+      return;
+    }
+    memmove(s->pending, s->pending + sent, s->pending_size - sent);
+    s->pending_size -= sent;
+  }
+  want_output = s->pending_size > 0;
+  if (want_output == s->polling_output) return;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | (want_output ? EPOLLOUT : 0);
+  event.data.ptr = s;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->socket_fd, &event) != 0) {
+    CloseSession(s);
+    return;
+  }
+  s->polling_output = want_output;
+}
+
+// Reads everything curses has written for a session from its pipe, and sends
+// it to the client.
+static void SendCursesOutput(ServerSession *s) {
+  uint8_t buffer[4096];
+  ssize_t length;
+  while (1) {
+    length = read(s->output_fd, buffer, sizeof(buffer));
+    if (length > 0) {
+      if (!QueueOutput(s, buffer, length)) return;
+      continue;
+    }
+    if ((length < 0) && (errno == EINTR)) continue;
+    break;
+  }
+  SendPendingOutput(s);
+}
+
+// Sends everything drawn in a session since the last call to the client. The
+// whole update is read back from the pipe and sent at once.
+static void RefreshSession(ServerSession *s) {
+  if (s->closed) return;
+  set_term(s->screen);
+  wnoutrefresh(s->top_window);
+  wnoutrefresh(s->game);
+  wnoutrefresh(s->next_piece);
+  wnoutrefresh(s->hold);
+  wnoutrefresh(s->score);
+  wnoutrefresh(s->line_count);
+  doupdate();
+  SendCursesOutput(s);
+}
+
+// Starts a new game in a session.
+static void StartSessionGame(ServerSession *s) {
+  TetrisGameConfig config;
+  char status[40];
+  config.tick_rate = options.tick_rate;
+  // Like the standalone game's seeds, these only need to differ between
+  // games.
+  config.seed = MonotonicNanoseconds() ^ (((uint64_t) time(NULL)) << 32) ^
+    (((uint64_t) getpid()) << 16) ^ s->socket_fd;
+  config.randomizer = options.randomizer;
+  InitializeNewGame(&s->state, &config);
+  InitializeScheduler(&s->sched, options.tick_rate);
+  s->mode = SESSION_PLAYING;
+  s->redraw_all = 1;
+  s->drawn_ghost_piece = -1;
+  werase(s->game);
+  WinBox(s->game);
+  snprintf(status, sizeof(status), "Seed: %llu",
+    (unsigned long long) config.seed);
+  SetStatus(s, status);
+}
+
+// Ends a session's game, leaving the final board up.
+static void EndSessionGame(ServerSession *s) {
+  s->mode = SESSION_WAITING;
+  s->wake_time = 0;
+  DisplaySessionGame(s);
+  SetStatus(s, "Game over! Press space to play again.");
+}
+
+// Handles a key decoded from a session's input. The keys are the curses key
+// codes the standalone game uses.
+static void HandleSessionKey(ServerSession *s, int key) {
+  int input = TETRIS_INPUT_NONE;
+  if (key == 'q') {
+    // Put the client's terminal back the way it was before leaving.
+    set_term(s->screen);
+    endwin();
+    SendCursesOutput(s);
+    CloseSession(s);
+    return;
+  }
+  if (key == ' ') {
+    switch (s->mode) {
+    case SESSION_WAITING:
+      StartSessionGame(s);
+      break;
+    case SESSION_PLAYING:
+      // As in the standalone game, only the partial tick in progress is lost.
+      s->mode = SESSION_PAUSED;
+      s->wake_time = 0;
+      ShowBoardMessage(s, "Paused!", "Press space");
+      break;
+    case SESSION_PAUSED:
+      s->mode = SESSION_PLAYING;
+      ResetScheduler(&s->sched);
+      werase(s->game);
+      WinBox(s->game);
+      break;
+    }
+    return;
+  }
+  if (s->mode != SESSION_PLAYING) return;
+  switch (key) {
+  case KEY_LEFT:
+    input = TETRIS_INPUT_LEFT;
+    break;
+  case KEY_RIGHT:
+    input = TETRIS_INPUT_RIGHT;
+    break;
+  case KEY_UP:
+    input = TETRIS_INPUT_ROTATE;
+    break;
+  case KEY_DOWN:
+    input = TETRIS_INPUT_DOWN;
+    break;
+  case KEY_NPAGE:
+    input = TETRIS_INPUT_DROP;
+    break;
+  case 'h':
+    input = TETRIS_INPUT_HOLD;
+    break;
+  default:
+    return;
+  }
+  if (!UpdateGameState(&s->state, input)) EndSessionGame(s);
+}
+
+// Decodes the keys in bytes read from a session's client, skipping telnet
+// commands, and handles them. The parser's state carries over between
+// reads, since a sequence may be split between them.
+static void HandleSessionInput(ServerSession *s, const uint8_t *data,
+  size_t size) {
+  size_t i;
+  uint8_t c;
+  for (i = 0; (i < size) && !s->closed; i++) {
+    c = data[i];
+    switch (s->input_state) {
+    case INPUT_TEXT:
+      if (c == TELNET_IAC) {
+        s->input_state = INPUT_COMMAND;
+      } else if (c == 27) {
+        s->input_state = INPUT_ESCAPE;
+      } else {
+        HandleSessionKey(s, c);
+      }
+      break;
+    case INPUT_COMMAND:
+      if ((c >= TELNET_WILL) && (c <= TELNET_DONT)) {
+        s->input_state = INPUT_OPTION;
+      } else if (c == TELNET_SB) {
+        s->input_state = INPUT_SUBNEGOTIATION;
+      } else {
+        // IAC IAC is a literal 255, which isn't a key we use. Everything
+        // else is a command with no arguments.
+        s->input_state = INPUT_TEXT;
+      }
+      break;
+    case INPUT_OPTION:
+      // The options we asked for are all we need, so replies and requests
+      // are ignored.
+      s->input_state = INPUT_TEXT;
+      break;
+    case INPUT_SUBNEGOTIATION:
+      if (c == TELNET_IAC) s->input_state = INPUT_SUBNEGOTIATION_IAC;
+      break;
+    case INPUT_SUBNEGOTIATION_IAC:
+      s->input_state = (c == TELNET_SE) ? INPUT_TEXT : INPUT_SUBNEGOTIATION;
+      break;
+    case INPUT_ESCAPE:
+      s->input_state = ((c == '[') || (c == 'O')) ? INPUT_CSI : INPUT_TEXT;
+      break;
+    case INPUT_CSI:
+      s->input_state = INPUT_TEXT;
+      if (c == 'A') HandleSessionKey(s, KEY_UP);
+      if (c == 'B') HandleSessionKey(s, KEY_DOWN);
+      if (c == 'C') HandleSessionKey(s, KEY_RIGHT);
+      if (c == 'D') HandleSessionKey(s, KEY_LEFT);
+      if (c == '6') s->input_state = INPUT_CSI_6;
+      break;
+    case INPUT_CSI_6:
+      s->input_state = INPUT_TEXT;
+      if (c == '~') HandleSessionKey(s, KEY_NPAGE);
+      break;
+    }
+  }
+}
+
+// Runs the ticks that came due in a session's game, and plans when it next
+// needs to wake up. The ticks in between don't change anything visible, just
+// as in the standalone game.
+static void RunSessionTicks(ServerSession *s) {
+  uint32_t ticks_due;
+  if (s->closed || (s->mode != SESSION_PLAYING)) return;
+  ticks_due = TicksDue(&s->sched);
+  while (ticks_due > 0) {
+    if (!TickGameState(&s->state)) {
+      EndSessionGame(s);
+      return;
+    }
+    ticks_due--;
+  }
+  s->wake_time = PlanWakeup(&s->sched, TicksUntilGravity(&s->state));
+}
+
+// Brings a session's game up to date, and sends the client whatever changed.
+static void UpdateSession(ServerSession *s) {
+  RunSessionTicks(s);
+  if (s->closed) return;
+  if (s->mode == SESSION_PLAYING) DisplaySessionGame(s);
+  RefreshSession(s);
+}
+
+// Gives a new session its pipe, SCREEN and windows. Returns 0 on error.
+static int CreateSessionScreen(ServerSession *s) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) return 0;
+  s->output_fd = pipe_fds[0];
+  s->output_file = fdopen(pipe_fds[1], "w");
+  if (!s->output_file) {
+    close(pipe_fds[1]);
+    return 0;
+  }
+  if (!SetNonblocking(s->output_fd)) return 0;
+  s->screen = newterm(options.term, s->output_file, null_input);
+  if (!s->screen) return 0;
+  set_term(s->screen);
+  // Telnet's newlines don't return the cursor to the left.
+  nonl();
+  curs_set(0);
+  if (CreateSessionWindows(s)) return 1;
+  // Any windows that were created are left alone, along with the SCREEN, so
+  // the session isn't reused (see CloseSession).
+  s->top_window = NULL;
+  return 0;
+}
+
+// Takes a closed session from idle_sessions and readies its SCREEN for a new
+// connection. Returns NULL if there aren't any.
+static ServerSession* ReuseIdleSession(void) {
+  ServerSession *s = idle_sessions;
+  if (!s) return NULL;
+  idle_sessions = s->next_idle;
+  s->next_idle = NULL;
+  s->mode = SESSION_WAITING;
+  s->wake_time = 0;
+  s->polling_output = 0;
+  s->input_state = INPUT_TEXT;
+  s->redraw_all = 0;
+  s->drawn_score = 0;
+  s->drawn_lines = 0;
+  s->closed = 0;
+  set_term(s->screen);
+  DrawSessionLayout(s);
+  // The SCREEN was left by endwin(), and the new client's terminal starts
+  // out blank, so the next refresh must repaint everything.
+  clearok(curscr, TRUE);
+  curs_set(0);
+  return s;
+}
+
+// Sets up a session for a newly accepted connection. Closes the connection
+// on error.
+static void OpenSession(int socket_fd) {
+  // Ask the client to stop echoing and buffering lines, so every key is sent
+  // as it's pressed.
+  static const uint8_t negotiation[] = {TELNET_IAC, TELNET_WILL, TELNET_ECHO,
+    TELNET_IAC, TELNET_WILL, TELNET_SUPPRESS_GO_AHEAD, TELNET_IAC, TELNET_DO,
+    TELNET_SUPPRESS_GO_AHEAD, TELNET_IAC, TELNET_DONT, TELNET_LINEMODE};
+  static const char full_message[] = "Sorry, the server is full.\r\n";
+  struct epoll_event event;
+  ServerSession *s;
+  int one = 1, reused = 1;
+  if (session_count >= options.max_sessions) {
+    send(socket_fd, full_message, strlen(full_message), MSG_NOSIGNAL);
+    close(socket_fd);
+    return;
+  }
+  s = ReuseIdleSession();
+  if (!s) {
+    reused = 0;
+    s = (ServerSession *) calloc(1, sizeof(*s));
+    if (!s) {
+      close(socket_fd);
+      return;
+    }
+    s->output_fd = -1;
+  }
+  s->socket_fd = socket_fd;
+  s->index = session_count;
+  sessions[session_count] = s;
+  session_count++;
+  // Frames are sent whole, so there's no reason to delay any of them.
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = s;
+  if (!SetNonblocking(socket_fd) ||
+    (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) != 0)) {
+    CloseSession(s);
+    return;
+  }
+  if (!reused && !CreateSessionScreen(s)) {
+    CloseSession(s);
+    return;
+  }
+  s->mode = SESSION_WAITING;
+  s->drawn_next_piece = -1;
+  s->drawn_hold_piece = -1;
+  s->drawn_ghost_piece = -1;
+  ShowBoardMessage(s, "Press space", "to start!");
+  if (!QueueOutput(s, negotiation, sizeof(negotiation))) return;
+  RefreshSession(s);
+}
+
+// Accepts every waiting connection.
+static void AcceptConnections(int listen_fd) {
+  int socket_fd;
+  while (1) {
+    socket_fd = accept(listen_fd, NULL, NULL);
+    if (socket_fd >= 0) {
+      OpenSession(socket_fd);
+      continue;
+    }
+    if (errno == EINTR) continue;
+    // With several workers, another one may have taken the connection.
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+    if (errno == ECONNABORTED) continue;
+    printf("accept failed: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+// Handles readiness on a session's socket.
+static void HandleSessionEvent(ServerSession *s, uint32_t events) {
+  uint8_t buffer[512];
+  ssize_t length;
+  if (s->closed) return;
+  if (events & EPOLLOUT) SendPendingOutput(s);
+  if (s->closed || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+  while (1) {
+    length = read(s->socket_fd, buffer, sizeof(buffer));
+    if (length > 0) {
+      // Keys take effect after the ticks that were already due.
+      RunSessionTicks(s);
+      HandleSessionInput(s, buffer, length);
+      if (s->closed) return;
+      continue;
+    }
+    if ((length < 0) && (errno == EINTR)) continue;
+    if ((length < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) break;
+    // The client disconnected, or the connection failed.
+    CloseSession(s);
+    return;
+  }
+  UpdateSession(s);
+}
+
+// Runs one worker's event loop, hosting sessions for connections accepted on
+// listen_fd. Only returns on error.
+static int RunWorker(int listen_fd) {
+  struct epoll_event events[MAX_EVENTS], event;
+  uint64_t now, next_wake;
+  int count, timeout, i;
+  char size[16];
+  // The terminal's size can't be read from a pipe, so curses falls back on
+  // these, and every screen is exactly as big as the layout. (resize_term()
+  // would do the same, but it takes time proportional to the number of
+  // windows in every SCREEN.) Clients' terminals need to be at least as big.
+  snprintf(size, sizeof(size), "%d", SESSION_LINES);
+  setenv("LINES", size, 1);
+  snprintf(size, sizeof(size), "%d", SESSION_COLUMNS);
+  setenv("COLUMNS", size, 1);
+  sessions = (ServerSession **) calloc(options.max_sessions,
+    sizeof(ServerSession *));
+  null_input = fopen("/dev/null", "r");
+  epoll_fd = epoll_create1(0);
+  if (!sessions || !null_input || (epoll_fd < 0)) {
+    printf("Failed setting up a worker: %s\n", strerror(errno));
+    return 1;
+  }
+  memset(&event, 0, sizeof(event));
+  // Only wake one worker per new connection.
+  event.events = EPOLLIN | ((options.workers > 1) ? EPOLLEXCLUSIVE : 0);
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+    printf("Failed polling the listening socket: %s\n", strerror(errno));
+    return 1;
+  }
+  while (1) {
+    // Sleep until the earliest time a game needs to run its ticks. Scanning
+    // every session is cheap next to drawing any of them.
+    next_wake = 0;
+    for (i = 0; i < session_count; i++) {
+      if (!sessions[i]->wake_time) continue;
+      if (!next_wake || (sessions[i]->wake_time < next_wake)) {
+        next_wake = sessions[i]->wake_time;
+      }
+    }
+    timeout = -1;
+    if (next_wake) {
+      now = MonotonicNanoseconds();
+      // Round up, so the wakeup is never early.
+      timeout = (next_wake > now) ? ((next_wake - now + 999999) / 1000000) : 0;
+    }
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      printf("epoll_wait failed: %s\n", strerror(errno));
+      return 1;
+    }
+    for (i = 0; i < count; i++) {
+      if (!events[i].data.ptr) {
+        AcceptConnections(listen_fd);
+      } else {
+        HandleSessionEvent((ServerSession *) events[i].data.ptr,
+          events[i].events);
+      }
+    }
+    now = MonotonicNanoseconds();
+    for (i = 0; i < session_count; i++) {
+      if (sessions[i]->closed || !sessions[i]->wake_time) continue;
+      if (sessions[i]->wake_time <= now) UpdateSession(sessions[i]);
+    }
+    RemoveClosedSessions();
+  }
+  return 0;
+}
+
+// Creates the non-blocking listening socket. Returns -1 and prints an error
+// on failure.
+static int Listen(int port) {
+  struct sockaddr_in address;
+  int fd, one = 1;
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    printf("Failed creating a socket: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if ((bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) ||
+    (listen(fd, SOMAXCONN) != 0) || !SetNonblocking(fd)) {
+    printf("Failed listening on port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s [options]\n"
+    "Options:\n"
+    "  --port <port>: The TCP port to accept telnet connections on.\n"
+    "    Defaults to %d.\n"
+    "  --workers <count>: The number of worker processes, each running its\n"
+    "    own event loop. Defaults to 1.\n"
+    "  --max-sessions <count>: The most sessions each worker hosts at once.\n"
+    "    Defaults to %d.\n"
+    "  --term <name>: The terminal type to send output for. Defaults to\n"
+    "    xterm.\n"
+    "  --tick-rate <rate>: The number of game ticks per second. Defaults\n"
+    "    to %d.\n"
+    "  --randomizer <weighted|bag>: The piece randomizer to use.\n",
+    program_name, DEFAULT_PORT, DEFAULT_MAX_SESSIONS, DEFAULT_TICK_RATE);
+}
+
+// Parses the command-line arguments into options. Returns 0 and prints a
+// usage message if they're invalid.
+static int ParseArguments(int argc, char **argv) {
+  uint64_t value;
+  int i;
+  memset(&options, 0, sizeof(options));
+  options.port = DEFAULT_PORT;
+  options.workers = 1;
+  options.max_sessions = DEFAULT_MAX_SESSIONS;
+  options.term = "xterm";
+  options.tick_rate = DEFAULT_TICK_RATE;
+  options.randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--port") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "port", 65535, &value)) break;
+      options.port = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--workers") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "worker count", 1024, &value)) break;
+      options.workers = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--max-sessions") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "session count", 1000000, &value)) break;
+      options.max_sessions = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--term") == 0) && ((i + 1) < argc)) {
+      i++;
+      options.term = argv[i];
+      continue;
+    }
+    if ((strcmp(argv[i], "--tick-rate") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "tick rate", 1000, &value)) break;
+      options.tick_rate = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--randomizer") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseRandomizer(argv[i], &options.randomizer)) break;
+      continue;
+    }
+    if (strcmp(argv[i], "--help") != 0) {
+      printf("Invalid argument: %s\n", argv[i]);
+    }
+    break;
+  }
+  if (i < argc) {
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  return 1;
+}
+
+// Raises the limit on open files, if needed, so every worker can host as
+// many sessions as it's allowed. Each session uses a socket and a pipe.
+// Returns 0 and prints an error if the limit can't be raised far enough.
+static int RaiseFileLimit(void) {
+  struct rlimit limit;
+  // Leave room for the listening socket, epoll, and so on.
+  rlim_t needed = ((rlim_t) options.max_sessions) * 3 + 16;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return 1;
+  if (limit.rlim_cur >= needed) return 1;
+  if ((limit.rlim_max != RLIM_INFINITY) && (limit.rlim_max < needed)) {
+    printf("%d sessions per worker need %llu open files, but the limit is "
+      "%llu.\n", options.max_sessions, (unsigned long long) needed,
+      (unsigned long long) limit.rlim_max);
+    return 0;
+  }
+  limit.rlim_cur = needed;
+  if (setrlimit(RLIMIT_NOFILE, &limit) == 0) return 1;
+  printf("Failed raising the open file limit: %s\n", strerror(errno));
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int listen_fd, i, status, result = 0;
+  pid_t pid;
+  if (!ParseArguments(argc, argv)) return 1;
+  if (!RaiseFileLimit()) return 1;
+  listen_fd = Listen(options.port);
+  if (listen_fd < 0) return 1;
+  printf("Listening on port %d, with %d worker%s.\n", options.port,
+    options.workers, (options.workers == 1) ? "" : "s");
+  fflush(stdout);
+  if (options.workers == 1) return RunWorker(listen_fd);
+  for (i = 0; i < options.workers; i++) {
+    pid = fork();
+    if (pid < 0) {
+      printf("fork failed: %s\n", strerror(errno));
+      // The workers already started keep running.
+      break;
+    }
+    if (pid == 0) exit(RunWorker(listen_fd));
+  }
+  close(listen_fd);
+  // Workers only exit on errors; the server runs until it's killed.
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) result = 1;
+  }
+  return result;
+}
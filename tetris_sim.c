@@ -0,0 +1,349 @@
+// A program that plays many games without a display, split across threads,
+// and prints statistics about how they went. Each game is identified by its
+// index; game i is played with seed first_seed + i, so results don't depend on
+// how games were divided between threads. The games themselves are played by
+// tetris_sim_board.c, compiled for each board size.
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_ai.h"
+#include "tetris_db.h"
+#include "tetris_engine.h"
+#include "tetris_sched.h"
+#include "tetris_sim.h"
+
+// The size of a cache line. Each worker's data is aligned to this, so workers
+// never write to the same line.
+#define CACHE_LINE_SIZE (64)
+
+// The default limit on the number of pieces in a single game.
+#define DEFAULT_MAX_PIECES (100000)
+
+// Holds everything owned by a single worker thread. Other workers only ever
+// touch the range, when stealing from it.
+typedef struct {
+  // The games this worker has yet to play, packed as (end << 32) | next, so
+  // both ends can be updated with a single compare-and-swap. The worker takes
+  // games from next, while thieves take the upper half of the range by
+  // lowering end.
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t range;
+  // Everything from here on is only used by the worker itself.
+  _Alignas(CACHE_LINE_SIZE) pthread_t thread;
+  int index;
+  SimStats stats;
+  // The worker's arena, from the board's create_arena.
+  void *arena;
+} SimWorker;
+
+static SimOptions options;
+// The board size chosen with --board.
+static const SimBoard *board;
+static TetrisAICache cache;
+static SimWorker *workers;
+
+// The database chosen with --record-db, which workers add games to while
+// holding db_lock. db_errno is set to the first error adding a game, after
+// which no more are added.
+static const char *db_path;
+static GameDBWriter db;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+static int db_errno;
+
+// Set by --version, which prints the version instead of playing any games.
+static int print_version;
+
+// Takes the next game from the worker's own range. Returns 0 if the range is
+// empty.
+static int TakeGame(SimWorker *w, uint32_t *game) {
+  uint64_t range = atomic_load(&w->range);
+  uint32_t next, end;
+  do {
+    next = range & 0xffffffff;
+    end = range >> 32;
+    if (next >= end) return 0;
+  } while (!atomic_compare_exchange_weak(&w->range, &range, range + 1));
+  *game = next;
+  return 1;
+}
+
+// Moves the upper half of victim's remaining games into thief's range, which
+// must be empty. Returns 0 if the victim had no games left.
+static int StealGames(SimWorker *thief, SimWorker *victim) {
+  uint64_t range = atomic_load(&victim->range), new_range;
+  uint32_t next, end, middle;
+  do {
+    next = range & 0xffffffff;
+    end = range >> 32;
+    if (next >= end) return 0;
+    middle = next + (end - next) / 2;
+    new_range = (((uint64_t) middle) << 32) | next;
+  } while (!atomic_compare_exchange_weak(&victim->range, &range, new_range));
+  // Nobody steals from an empty range, so this can't race with other thieves.
+  atomic_store(&thief->range, (((uint64_t) end) << 32) | middle);
+  return 1;
+}
+
+// Steals work from any other worker that has some. Returns 0 if every worker
+// has run out of games.
+static int FindWork(SimWorker *w) {
+  int i, victim;
+  for (i = 1; i < options.threads; i++) {
+    victim = (w->index + i) % options.threads;
+    if (StealGames(w, workers + victim)) return 1;
+  }
+  return 0;
+}
+
+static void* WorkerThread(void *arg) {
+  SimWorker *w = (SimWorker *) arg;
+  uint32_t game;
+  while (1) {
+    while (TakeGame(w, &game)) {
+      board->play_game(w->arena, &options, game, &w->stats);
+    }
+    if (!FindWork(w)) break;
+  }
+  board->destroy_arena(w->arena, &w->stats);
+  w->arena = NULL;
+  return NULL;
+}
+
+// Adds a finished game to the database; this is options.save_game.
+static void SaveGameToDB(GameSummary *summary, const uint8_t *log,
+  size_t log_size) {
+  pthread_mutex_lock(&db_lock);
+  if (!db_errno && !AppendGame(&db, summary, log, log_size)) {
+    db_errno = errno;
+  }
+  pthread_mutex_unlock(&db_lock);
+}
+
+// Adds the statistics in b to a.
+static void MergeStats(SimStats *a, SimStats *b) {
+  a->games += b->games;
+  a->score_sum += b->score_sum;
+  a->lines_sum += b->lines_sum;
+  a->pieces_sum += b->pieces_sum;
+  a->pieces_square_sum += b->pieces_square_sum;
+  if (b->score_max > a->score_max) a->score_max = b->score_max;
+  if (b->lines_max > a->lines_max) a->lines_max = b->lines_max;
+  if (b->pieces_min < a->pieces_min) a->pieces_min = b->pieces_min;
+  if (b->pieces_max > a->pieces_max) a->pieces_max = b->pieces_max;
+  a->games_capped += b->games_capped;
+  a->placements_evaluated += b->placements_evaluated;
+  a->search_ns += b->search_ns;
+  a->cache_hits += b->cache_hits;
+  a->cache_misses += b->cache_misses;
+}
+
+static void PrintStats(SimStats *stats, double seconds) {
+  double games = (double) stats->games;
+  double mean_pieces = ((double) stats->pieces_sum) / games;
+  double variance = stats->pieces_square_sum / games -
+    mean_pieces * mean_pieces;
+  if (variance < 0) variance = 0;
+  printf("Games: %llu (%llu stopped at %llu pieces)\n",
+    (unsigned long long) stats->games,
+    (unsigned long long) stats->games_capped,
+    (unsigned long long) options.max_pieces);
+  printf("Score: mean %.2f, max %u\n", ((double) stats->score_sum) / games,
+    stats->score_max);
+  printf("Lines: mean %.2f, max %u\n", ((double) stats->lines_sum) / games,
+    stats->lines_max);
+  printf("Pieces survived: mean %.2f, stddev %.2f, min %llu, max %llu\n",
+    mean_pieces, sqrt(variance), (unsigned long long) stats->pieces_min,
+    (unsigned long long) stats->pieces_max);
+  printf("Took %.3f seconds with %d threads on a %dx%d board: %.1f games/s, "
+    "%.1f pieces/s\n", seconds, options.threads, board->width, board->height,
+    games / seconds, ((double) stats->pieces_sum) / seconds);
+  if (options.policy != POLICY_AI) return;
+  // The search time is summed across threads, so this is the rate of a
+  // single thread.
+  printf("AI: %llu placements evaluated, %.1f per second per thread (%s)\n",
+    (unsigned long long) stats->placements_evaluated,
+    ((double) stats->placements_evaluated) /
+    (((double) stats->search_ns) / 1e9),
+    AIEvaluatorName(GetAIEvaluator(options.evaluator)));
+  if (!options.cache_bits) return;
+  printf("Cache: %llu hits, %llu misses, %.1f%% hit rate\n",
+    (unsigned long long) stats->cache_hits,
+    (unsigned long long) stats->cache_misses,
+    100.0 * ((double) stats->cache_hits) /
+    ((double) (stats->cache_hits + stats->cache_misses)));
+}
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s [options]\n"
+    "Options:\n"
+    "  --games <count>: The number of games to play. Defaults to 1000.\n",
+    program_name);
+  PrintSimOptionUsage(DEFAULT_MAX_PIECES);
+  printf("  --policy <ai|random>: Place pieces using the AI (the default), or\n"
+    "    at random.\n"
+    "  --ai-weights <height,holes,bumpiness,lines>: The weights the AI\n"
+    "    gives each feature of a board.\n"
+    "  --cache-bits <bits>: Cache the AI's lookahead scores for 2^<bits>\n"
+    "    boards, shared by every thread. Defaults to 0, for no cache.\n"
+    "  --record-db <path>: Add every game, with its replay log, to the\n"
+    "    game database at <path>, creating it if needed. See tetris-db.\n"
+    "  --version: Print the version and exit.\n");
+}
+
+static int ParseArguments(int argc, char **argv) {
+  uint64_t value;
+  int i, parsed;
+  DefaultSimOptions(&options, &board);
+  options.games = 1000;
+  options.max_pieces = DEFAULT_MAX_PIECES;
+  for (i = 1; i < argc; i++) {
+    parsed = ParseSimOption(argc, argv, &i, &options, &board);
+    if (parsed < 0) break;
+    if (parsed) continue;
+    if ((strcmp(argv[i], "--games") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "game count", UINT32_MAX, &value)) break;
+      options.games = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--policy") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (strcmp(argv[i], "ai") == 0) {
+        options.policy = POLICY_AI;
+      } else if (strcmp(argv[i], "random") == 0) {
+        options.policy = POLICY_RANDOM;
+      } else {
+        printf("Invalid policy: %s\n", argv[i]);
+        break;
+      }
+      continue;
+    }
+    if ((strcmp(argv[i], "--ai-weights") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseAIWeights(argv[i], &options.weights)) {
+        printf("Invalid AI weights: %s\n", argv[i]);
+        break;
+      }
+      continue;
+    }
+    if ((strcmp(argv[i], "--cache-bits") == 0) && ((i + 1) < argc)) {
+      i++;
+      // 0 disables the cache, so don't use ParseCount here.
+      if (strcmp(argv[i], "0") == 0) {
+        options.cache_bits = 0;
+        continue;
+      }
+      if (!ParseCount(argv[i], "cache size", 30, &value)) break;
+      options.cache_bits = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--record-db") == 0) && ((i + 1) < argc)) {
+      i++;
+      db_path = argv[i];
+      options.save_game = SaveGameToDB;
+      continue;
+    }
+    if (strcmp(argv[i], "--version") == 0) {
+      print_version = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--help") != 0) {
+      printf("Invalid argument: %s\n", argv[i]);
+    }
+    break;
+  }
+  if (i < argc) {
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  SimStats total;
+  uint64_t start_time, elapsed, db_games;
+  uint32_t begin, end;
+  int i, result;
+  if (!ParseArguments(argc, argv)) return 1;
+  if (print_version) {
+    printf("ncurses_tetris %s (tetris-sim, boards: ", TETRIS_VERSION);
+    PrintSimBoards();
+    printf(")\n");
+    return 0;
+  }
+  if (options.threads > options.games) options.threads = options.games;
+  workers = (SimWorker *) aligned_alloc(CACHE_LINE_SIZE,
+    options.threads * sizeof(SimWorker));
+  if (!workers) {
+    printf("Failed allocating workers: %s\n", strerror(errno));
+    return 1;
+  }
+  memset(workers, 0, options.threads * sizeof(SimWorker));
+  if (db_path && !OpenGameDBWriter(&db, db_path)) {
+    if (errno == EINVAL) {
+      printf("%s is not a game database.\n", db_path);
+    } else {
+      printf("Failed opening %s: %s\n", db_path, strerror(errno));
+    }
+    return 1;
+  }
+  if ((options.policy == POLICY_AI) && options.cache_bits &&
+    !CreateAICache(&cache, options.cache_bits)) {
+    printf("Failed allocating the AI cache: %s\n", strerror(errno));
+    return 1;
+  }
+  for (i = 0; i < options.threads; i++) {
+    workers[i].arena = board->create_arena(&options,
+      cache.entries ? &cache : NULL);
+    if (!workers[i].arena) {
+      printf("Failed allocating workers: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+  // Start each worker with an equal share of the games. Stealing evens things
+  // out if some games take longer than others.
+  for (i = 0; i < options.threads; i++) {
+    begin = ((uint64_t) options.games) * i / options.threads;
+    end = ((uint64_t) options.games) * (i + 1) / options.threads;
+    workers[i].index = i;
+    workers[i].stats.pieces_min = UINT64_MAX;
+    atomic_store(&workers[i].range, (((uint64_t) end) << 32) | begin);
+  }
+  start_time = MonotonicNanoseconds();
+  for (i = 0; i < options.threads; i++) {
+    result = pthread_create(&workers[i].thread, NULL, WorkerThread,
+      workers + i);
+    if (result != 0) {
+      printf("Failed creating thread: %s\n", strerror(result));
+      return 1;
+    }
+  }
+  memset(&total, 0, sizeof(total));
+  total.pieces_min = UINT64_MAX;
+  for (i = 0; i < options.threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    MergeStats(&total, &workers[i].stats);
+  }
+  elapsed = MonotonicNanoseconds() - start_time;
+  PrintStats(&total, ((double) elapsed) / 1e9);
+  if (db_path) {
+    db_games = db.count;
+    if (db_errno) {
+      printf("Failed adding games to %s: %s\n", db_path, strerror(db_errno));
+    }
+    if (!CloseGameDBWriter(&db) && !db_errno) {
+      printf("Failed writing %s: %s\n", db_path, strerror(errno));
+      db_errno = errno;
+    }
+    if (db_errno) return 1;
+    printf("Database: %s now holds %llu games\n", db_path,
+      (unsigned long long) db_games);
+  }
+  if (cache.entries) DestroyAICache(&cache);
+  free(workers);
+  return 0;
+}
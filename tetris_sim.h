@@ -0,0 +1,125 @@
+#ifndef TETRIS_SIM_H
+#define TETRIS_SIM_H
+// This file defines the interface between tetris-sim's driver (tetris_sim.c),
+// which parses options, hands out games to threads and prints statistics, and
+// the code that plays the games (tetris_sim_board.c). The latter is compiled
+// once for each board size, along with the engine and AI, so every size keeps
+// its own constant-bounded loops; the driver picks one with --board.
+// tetris_sim_board.c also holds the option parsing that tetris-sim shares
+// with tetris-tune (and, for ParseCount and ParseRandomizer, tetris-server).
+#include <stddef.h>
+#include <stdint.h>
+#include "tetris_ai.h"
+#include "tetris_db.h"
+
+// The ways pieces can be placed.
+#define POLICY_RANDOM (0)
+#define POLICY_AI (1)
+
+// Statistics about some number of finished games. Sums are kept as integers
+// so results are identical no matter how the games were split up.
+typedef struct {
+  uint64_t games;
+  uint64_t score_sum;
+  uint64_t lines_sum;
+  uint64_t pieces_sum;
+  // Used to compute the standard deviation of the number of pieces.
+  double pieces_square_sum;
+  unsigned score_max;
+  unsigned lines_max;
+  uint64_t pieces_min;
+  uint64_t pieces_max;
+  // The number of games stopped by --max-pieces rather than a game over.
+  uint64_t games_capped;
+  // The number of placements the AI scored, and the time it took.
+  uint64_t placements_evaluated;
+  uint64_t search_ns;
+  // The number of boards the AI found in the cache or not.
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+} SimStats;
+
+// Settings chosen on the command line, shared (read-only) by all workers.
+typedef struct {
+  uint32_t games;
+  uint64_t first_seed;
+  int threads;
+  int randomizer;
+  uint64_t max_pieces;
+  // The POLICY_* value choosing how pieces are placed.
+  int policy;
+  TetrisAIWeights weights;
+  // The name of the evaluator to pass to GetAIEvaluator, or NULL for the
+  // fastest one.
+  const char *evaluator;
+  // The cache shared by every worker's AI has 2^cache_bits entries, or there
+  // is no cache if this is 0.
+  int cache_bits;
+  // If not NULL, called with every finished game and its replay log records.
+  // This may be called from any worker at once.
+  void (*save_game)(GameSummary *summary, const uint8_t *log,
+    size_t log_size);
+} SimOptions;
+
+// The code for playing games on one size of board. A worker's arena holds the
+// game state and AI it reuses for every game, so playing games never
+// allocates memory.
+typedef struct {
+  int width;
+  int height;
+  // Allocates and sets up an arena for a worker. The AI uses cache, unless
+  // it's NULL. Returns NULL on error.
+  void* (*create_arena)(const SimOptions *options, TetrisAICache *cache);
+  // Plays the given game, and adds its result to stats.
+  void (*play_game)(void *arena, const SimOptions *options, uint32_t game,
+    SimStats *stats);
+  // Adds the AI's counters to stats, and frees the arena.
+  void (*destroy_arena)(void *arena, SimStats *stats);
+} SimBoard;
+
+// The board sizes tetris-sim is built for: the engine's default size, and one
+// for each size in the Makefile's BOARD_SIZES.
+extern const SimBoard sim_board;
+extern const SimBoard sim_board_10x40;
+extern const SimBoard sim_board_12x20;
+extern const SimBoard sim_board_16x20;
+
+// Every board size above, with the default first, for --board to choose from.
+#define SIM_BOARD_COUNT (4)
+extern const SimBoard *const sim_boards[SIM_BOARD_COUNT];
+
+// Returns the board size written as <width>x<height>, or NULL if it isn't one
+// of sim_boards.
+const SimBoard* FindSimBoard(const char *text);
+
+// Prints the sizes in sim_boards, as a list for a usage message.
+void PrintSimBoards(void);
+
+// Parses an unsigned number argument between 1 and max. Returns 0 and prints
+// an error if it's invalid.
+int ParseCount(const char *arg, const char *name, uint64_t max,
+  uint64_t *value);
+
+// Parses the name of a piece randomizer, "weighted" or "bag", into one of the
+// TETRIS_RANDOMIZER_* values. Returns 0 and prints an error if it's invalid.
+int ParseRandomizer(const char *arg, int *randomizer);
+
+// Fills in the defaults of the options ParseSimOption parses (apart from
+// max_pieces, which the caller chooses), and of the AI: one thread per online
+// CPU, the weighted randomizer, the AI policy with the default weights, and
+// the default board size in *board.
+void DefaultSimOptions(SimOptions *options, const SimBoard **board);
+
+// Parses argv[*i] if it's one of the options for playing games that tetris-sim
+// and tetris-tune share: --seed, --threads, --randomizer, --max-pieces,
+// --evaluator and --board. If it is, advances *i to its argument and returns
+// 1, or returns -1 after printing an error if the argument is invalid.
+// Returns 0 if argv[*i] isn't one of these options.
+int ParseSimOption(int argc, char **argv, int *i, SimOptions *options,
+  const SimBoard **board);
+
+// Prints the usage message lines for the options ParseSimOption parses, with
+// default_max_pieces as the default of --max-pieces.
+void PrintSimOptionUsage(uint64_t default_max_pieces);
+
+#endif  // TETRIS_SIM_H
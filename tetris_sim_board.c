@@ -0,0 +1,285 @@
+// Plays tetris-sim's games on a board of BLOCKS_WIDE by BLOCKS_TALL cells. This
+// is compiled once for each board size; see tetris_sim.h.
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tetris_ai.h"
+#include "tetris_db.h"
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_sim.h"
+
+#ifdef TETRIS_BOARD_SUFFIX
+#define SIM_BOARD TETRIS_SIZED(sim_board)
+#else
+#define SIM_BOARD sim_board
+#endif
+
+// The arena is aligned for the AI's batch of boards, which is loaded with
+// aligned SIMD instructions, and so workers' arenas never share a cache line.
+#define ARENA_ALIGNMENT (64)
+
+typedef struct {
+  TetrisGameState state;
+  TetrisAI ai;
+  // The replay log of the game being played, if games are being recorded.
+  // log_failed is set if the log couldn't be grown, so the game isn't saved.
+  ReplayBuffer log;
+  int log_failed;
+} SimArena;
+
+static void* CreateArena(const SimOptions *options, TetrisAICache *cache) {
+  size_t size = (sizeof(SimArena) + ARENA_ALIGNMENT - 1) &
+    ~((size_t) (ARENA_ALIGNMENT - 1));
+  SimArena *arena = (SimArena *) aligned_alloc(ARENA_ALIGNMENT, size);
+  if (!arena) return NULL;
+  memset(arena, 0, sizeof(*arena));
+  InitializeAI(&arena->ai, &options->weights);
+  arena->ai.evaluator = GetAIEvaluator(options->evaluator);
+  arena->ai.cache = cache;
+  return arena;
+}
+
+// Passed to PlayMove to add the AI's inputs to the arena's replay log.
+static void RecordSimInput(uint64_t tick, int input, void *arg) {
+  SimArena *arena = (SimArena *) arg;
+  if (!BufferInput(&arena->log, tick, input)) arena->log_failed = 1;
+}
+
+// Passes an input to UpdateGameState, recording it first if games are being
+// recorded.
+static int ApplySimInput(SimArena *arena, const SimOptions *options,
+  int input) {
+  if (options->save_game) {
+    RecordSimInput(arena->state.ticks, input, arena);
+  }
+  return UpdateGameState(&arena->state, input);
+}
+
+// Moves the falling piece to the given column after rotating it the given
+// number of times, and drops it. Any part of the move that's blocked is
+// skipped. Returns 0 on game over.
+static int PlacePiece(SimArena *arena, const SimOptions *options,
+  int rotations, int column) {
+  TetrisGameState *s = &arena->state;
+  int i, old_x;
+  for (i = 0; i < rotations; i++) {
+    ApplySimInput(arena, options, TETRIS_INPUT_ROTATE);
+  }
+  while (s->location_x != column) {
+    old_x = s->location_x;
+    ApplySimInput(arena, options, (column < old_x) ? TETRIS_INPUT_LEFT :
+      TETRIS_INPUT_RIGHT);
+    if (s->location_x == old_x) break;
+  }
+  return ApplySimInput(arena, options, TETRIS_INPUT_DROP);
+}
+
+// Passes the game that just finished to options->save_game.
+static void SaveGame(SimArena *arena, const SimOptions *options,
+  TetrisGameConfig *config) {
+  TetrisGameState *s = &arena->state;
+  GameSummary summary;
+  if (!BufferGameEnd(&arena->log, s->ticks)) arena->log_failed = 1;
+  if (arena->log_failed) return;
+  memset(&summary, 0, sizeof(summary));
+  summary.config = *config;
+  summary.board_width = BLOCKS_WIDE;
+  summary.board_height = BLOCKS_TALL;
+  summary.score = s->score;
+  summary.lines = s->lines;
+  summary.pieces = s->pieces;
+  options->save_game(&summary, arena->log.data, arena->log.size);
+}
+
+// Plays a single game, placing pieces using the chosen policy, and adds its
+// result to stats.
+static void PlayGame(void *arena_pointer, const SimOptions *options,
+  uint32_t game, SimStats *stats) {
+  SimArena *arena = (SimArena *) arena_pointer;
+  TetrisGameState *s = &arena->state;
+  TetrisGameConfig config;
+  TetrisRNG policy_rng;
+  TetrisAIMove move;
+  uint64_t pieces = 0;
+  int alive = 1;
+  config.tick_rate = DEFAULT_TICK_RATE;
+  config.seed = options->first_seed + game;
+  config.randomizer = options->randomizer;
+  // Every game may use different weights, e.g. in tetris-tune.
+  arena->ai.weights = options->weights;
+  InitializeNewGame(s, &config);
+  ResetReplayBuffer(&arena->log);
+  arena->log_failed = 0;
+  // The policy gets its own generator, so it can't change the pieces.
+  SeedRandom(&policy_rng, ~config.seed);
+  while (alive && (pieces < options->max_pieces)) {
+    if (options->policy == POLICY_RANDOM) {
+      alive = PlacePiece(arena, options, RandomBelow(&policy_rng, 4),
+        RandomBelow(&policy_rng, BLOCKS_WIDE));
+    } else if (ChooseMove(&arena->ai, s, &move)) {
+      alive = PlayMove(s, &move, options->save_game ? RecordSimInput :
+        NULL, arena);
+    } else {
+      // The piece can't be placed anywhere, so just let it land.
+      alive = ApplySimInput(arena, options, TETRIS_INPUT_DROP);
+    }
+    if (s->events & TETRIS_EVENT_PIECE_LOCKED) pieces++;
+    s->events = 0;
+  }
+  if (options->save_game) SaveGame(arena, options, &config);
+  stats->games++;
+  stats->score_sum += s->score;
+  stats->lines_sum += s->lines;
+  stats->pieces_sum += pieces;
+  stats->pieces_square_sum += ((double) pieces) * ((double) pieces);
+  if (s->score > stats->score_max) stats->score_max = s->score;
+  if (s->lines > stats->lines_max) stats->lines_max = s->lines;
+  if (pieces < stats->pieces_min) stats->pieces_min = pieces;
+  if (pieces > stats->pieces_max) stats->pieces_max = pieces;
+  if (alive) stats->games_capped++;
+}
+
+static void DestroyArena(void *arena_pointer, SimStats *stats) {
+  SimArena *arena = (SimArena *) arena_pointer;
+  stats->placements_evaluated += arena->ai.placements_evaluated;
+  stats->search_ns += arena->ai.search_ns;
+  stats->cache_hits += arena->ai.cache_hits;
+  stats->cache_misses += arena->ai.cache_misses;
+  DestroyReplayBuffer(&arena->log);
+  free(arena);
+}
+
+const SimBoard SIM_BOARD = {
+  BLOCKS_WIDE,
+  BLOCKS_TALL,
+  CreateArena,
+  PlayGame,
+  DestroyArena,
+};
+
+#ifndef TETRIS_BOARD_SUFFIX
+// The list of sizes only needs to exist once, so it goes with the default
+// size.
+const SimBoard *const sim_boards[SIM_BOARD_COUNT] = {&sim_board,
+  &sim_board_10x40, &sim_board_12x20, &sim_board_16x20};
+
+const SimBoard* FindSimBoard(const char *text) {
+  int width, height, length = 0, i;
+  if (sscanf(text, "%dx%d%n", &width, &height, &length) != 2) return NULL;
+  if (text[length] != 0) return NULL;
+  for (i = 0; i < SIM_BOARD_COUNT; i++) {
+    if ((sim_boards[i]->width == width) &&
+      (sim_boards[i]->height == height)) {
+      return sim_boards[i];
+    }
+  }
+  return NULL;
+}
+
+void PrintSimBoards(void) {
+  int i;
+  for (i = 0; i < SIM_BOARD_COUNT; i++) {
+    printf("%s%dx%d", i ? ", " : "", sim_boards[i]->width,
+      sim_boards[i]->height);
+  }
+}
+
+int ParseCount(const char *arg, const char *name, uint64_t max,
+  uint64_t *value) {
+  char *end = NULL;
+  errno = 0;
+  *value = strtoull(arg, &end, 0);
+  if ((*end != 0) || (end == arg) || (errno != 0) || (*value < 1) ||
+    (*value > max)) {
+    printf("Invalid %s: %s\n", name, arg);
+    return 0;
+  }
+  return 1;
+}
+
+int ParseRandomizer(const char *arg, int *randomizer) {
+  if (strcmp(arg, "weighted") == 0) {
+    *randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+  } else if (strcmp(arg, "bag") == 0) {
+    *randomizer = TETRIS_RANDOMIZER_BAG;
+  } else {
+    printf("Invalid randomizer: %s\n", arg);
+    return 0;
+  }
+  return 1;
+}
+
+void DefaultSimOptions(SimOptions *options, const SimBoard **board) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  memset(options, 0, sizeof(*options));
+  options->threads = (cpus > 0) ? cpus : 1;
+  options->randomizer = TETRIS_RANDOMIZER_WEIGHTED;
+  options->policy = POLICY_AI;
+  DefaultAIWeights(&options->weights);
+  *board = sim_boards[0];
+}
+
+int ParseSimOption(int argc, char **argv, int *i, SimOptions *options,
+  const SimBoard **board) {
+  const char *name = argv[*i], *arg;
+  char *end = NULL;
+  uint64_t value;
+  if ((*i + 1) >= argc) return 0;
+  arg = argv[*i + 1];
+  if (strcmp(name, "--seed") == 0) {
+    // 0 is a fine seed, so don't use ParseCount here.
+    errno = 0;
+    options->first_seed = strtoull(arg, &end, 0);
+    if ((*end != 0) || (end == arg) || (errno != 0)) {
+      printf("Invalid seed: %s\n", arg);
+      return -1;
+    }
+  } else if (strcmp(name, "--threads") == 0) {
+    if (!ParseCount(arg, "thread count", 4096, &value)) return -1;
+    options->threads = value;
+  } else if (strcmp(name, "--randomizer") == 0) {
+    if (!ParseRandomizer(arg, &options->randomizer)) return -1;
+  } else if (strcmp(name, "--max-pieces") == 0) {
+    if (!ParseCount(arg, "piece limit", UINT64_MAX, &value)) return -1;
+    options->max_pieces = value;
+  } else if (strcmp(name, "--evaluator") == 0) {
+    // CPU support doesn't depend on the board size, so checking the default
+    // size's evaluators is enough.
+    options->evaluator = arg;
+    if (!GetAIEvaluator(arg)) {
+      printf("Unknown or unsupported evaluator: %s\n", arg);
+      return -1;
+    }
+  } else if (strcmp(name, "--board") == 0) {
+    *board = FindSimBoard(arg);
+    if (!*board) {
+      printf("Unsupported board size: %s\n", arg);
+      return -1;
+    }
+  } else {
+    return 0;
+  }
+  (*i)++;
+  return 1;
+}
+
+void PrintSimOptionUsage(uint64_t default_max_pieces) {
+  printf("  --seed <seed>: The seed of the first game. Defaults to 0.\n"
+    "  --threads <count>: The number of threads to use. Defaults to the\n"
+    "    number of online CPUs.\n"
+    "  --randomizer <weighted|bag>: The piece randomizer to use.\n"
+    "  --max-pieces <count>: Stop any game after <count> pieces. Defaults\n"
+    "    to %llu.\n"
+    "  --evaluator <auto|avx2|ssse3|scalar>: The code used to compute board\n"
+    "    features. Defaults to the fastest one this CPU supports.\n"
+    "  --board <width>x<height>: The size of the board, in cells. One of:\n"
+    "    ", (unsigned long long) default_max_pieces);
+  PrintSimBoards();
+  printf(". Defaults to %dx%d.\n", sim_boards[0]->width,
+    sim_boards[0]->height);
+}
+#endif  // TETRIS_BOARD_SUFFIX
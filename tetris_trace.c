@@ -0,0 +1,208 @@
+// Implements the instrumentation described in tetris_trace.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tetris_trace.h"
+
+// The number of events copied out of a ring at a time.
+#define SNAPSHOT_CHUNK (256)
+
+// The names of the TRACE_STAGE_* values, as they appear in trace files.
+static const char *stage_names[] = {"wait", "update", "display", "refresh",
+  "frame", "key_latency"};
+
+void InitializeTrace(TetrisTrace *t) {
+  memset(t, 0, sizeof(*t));
+  atomic_init(&t->stages.head, 0);
+  atomic_init(&t->latencies.head, 0);
+  t->io_fd = -1;
+}
+
+// Adds an event to a ring, as TraceRecord and TraceRecordRefresh do.
+static void AddEvent(TraceRing *r, int stage, double start, double end,
+  uint32_t bytes, uint32_t writes) {
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  TraceEvent *e = r->events + (head % TRACE_RING_SIZE);
+  e->start = start;
+  e->end = end;
+  e->stage = stage;
+  e->bytes = bytes;
+  e->writes = writes;
+  // Publish the event only once it's complete.
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void TraceRecord(TraceRing *r, int stage, double start, double end) {
+  AddEvent(r, stage, start, end, 0, 0);
+}
+
+void TraceRecordRefresh(TraceRing *r, double start, double end,
+  uint32_t bytes, uint32_t writes) {
+  AddEvent(r, TRACE_STAGE_REFRESH, start, end, bytes, writes);
+}
+
+int OpenWriteCounters(TetrisTrace *t) {
+  uint64_t bytes, writes;
+  t->io_fd = open("/proc/self/io", O_RDONLY);
+  if (t->io_fd < 0) return 0;
+  if (ReadWriteCounters(t, &bytes, &writes)) return 1;
+  close(t->io_fd);
+  t->io_fd = -1;
+  return 0;
+}
+
+int ReadWriteCounters(TetrisTrace *t, uint64_t *bytes, uint64_t *writes) {
+  char text[512];
+  char *bytes_line, *writes_line;
+  ssize_t length;
+  unsigned long long value;
+  if (t->io_fd < 0) return 0;
+  // The file's contents are regenerated every time it's read from the start.
+  length = pread(t->io_fd, text, sizeof(text) - 1, 0);
+  if (length <= 0) return 0;
+  text[length] = 0;
+  bytes_line = strstr(text, "wchar: ");
+  writes_line = strstr(text, "syscw: ");
+  if (!bytes_line || !writes_line) return 0;
+  if (sscanf(bytes_line, "wchar: %llu", &value) != 1) return 0;
+  *bytes = value;
+  if (sscanf(writes_line, "syscw: %llu", &value) != 1) return 0;
+  *writes = value;
+  return 1;
+}
+
+int TraceSnapshot(TraceRing *r, uint64_t *first, TraceEvent *out, int max) {
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  uint64_t start = *first, oldest, i;
+  int count = 0, skip;
+  if ((head > TRACE_RING_SIZE) && (start < (head - TRACE_RING_SIZE))) {
+    start = head - TRACE_RING_SIZE;
+  }
+  for (i = start; (i < head) && (count < max); i++) {
+    out[count] = r->events[i % TRACE_RING_SIZE];
+    count++;
+  }
+  // The writer may have replaced some of the copied events in the meantime,
+  // and may be partway through replacing the one after its newest event.
+  // Drop any that could have been touched.
+  atomic_thread_fence(memory_order_acquire);
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  oldest = (head >= TRACE_RING_SIZE) ? (head - TRACE_RING_SIZE + 1) : 0;
+  if (oldest > start) {
+    skip = ((oldest - start) > count) ? count : (oldest - start);
+    memmove(out, out + skip, (count - skip) * sizeof(TraceEvent));
+    count -= skip;
+    start += skip;
+  }
+  *first = start;
+  return count;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *((const double *) a), y = *((const double *) b);
+  if (x < y) return -1;
+  return x > y;
+}
+
+int TracePercentiles(TraceRing *r, int stage, double *p50, double *p99) {
+  TraceEvent events[SNAPSHOT_CHUNK];
+  double durations[TRACE_RING_SIZE];
+  uint64_t next = 0;
+  int count = 0, copied, i;
+  while ((copied = TraceSnapshot(r, &next, events, SNAPSHOT_CHUNK)) > 0) {
+    for (i = 0; (i < copied) && (count < TRACE_RING_SIZE); i++) {
+      if (events[i].stage != stage) continue;
+      durations[count] = events[i].end - events[i].start;
+      count++;
+    }
+    next += copied;
+  }
+  if (!count) return 0;
+  qsort(durations, count, sizeof(double), CompareDoubles);
+  *p50 = durations[(count - 1) / 2];
+  *p99 = durations[((count - 1) * 99) / 100];
+  return 1;
+}
+
+int OpenTraceFile(TetrisTrace *t, const char *path, double start_time) {
+  t->file = fopen(path, "wb");
+  if (!t->file) return 0;
+  t->start_time = start_time;
+  t->stages_written = atomic_load(&t->stages.head);
+  t->latencies_written = atomic_load(&t->latencies.head);
+  t->any_written = 0;
+  fprintf(t->file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  return 1;
+}
+
+// Writes the events in a ring that haven't been written yet, as complete
+// ("X") events on the given thread ID. Overwritten events are skipped.
+static void WriteEvents(TetrisTrace *t, TraceRing *r, uint64_t *written,
+  int tid) {
+  TraceEvent events[SNAPSHOT_CHUNK];
+  uint64_t first;
+  int count, i;
+  while (1) {
+    first = *written;
+    count = TraceSnapshot(r, &first, events, SNAPSHOT_CHUNK);
+    if (!count) return;
+    for (i = 0; i < count; i++) {
+      fprintf(t->file, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+        "\"dur\": %.3f, \"pid\": 1, \"tid\": %d", t->any_written ? "," : "",
+        stage_names[events[i].stage],
+        (events[i].start - t->start_time) * 1e6,
+        (events[i].end - events[i].start) * 1e6, tid);
+      if (events[i].writes) {
+        fprintf(t->file, ", \"args\": {\"bytes\": %u, \"writes\": %u}",
+          (unsigned) events[i].bytes, (unsigned) events[i].writes);
+      }
+      fprintf(t->file, "}");
+      t->any_written = 1;
+    }
+    *written = first + count;
+  }
+}
+
+int FlushTrace(TetrisTrace *t, int force) {
+  uint64_t stages_backlog, latencies_backlog;
+  int saved_errno;
+  if (!t->file) return 1;
+  if (!force) {
+    stages_backlog = atomic_load(&t->stages.head) - t->stages_written;
+    latencies_backlog = atomic_load(&t->latencies.head) -
+      t->latencies_written;
+    if ((stages_backlog < (TRACE_RING_SIZE / 2)) &&
+      (latencies_backlog < (TRACE_RING_SIZE / 2))) {
+      return 1;
+    }
+  }
+  WriteEvents(t, &t->stages, &t->stages_written, 1);
+  WriteEvents(t, &t->latencies, &t->latencies_written, 2);
+  if (!ferror(t->file)) return 1;
+  saved_errno = errno;
+  fclose(t->file);
+  t->file = NULL;
+  errno = saved_errno;
+  return 0;
+}
+
+int CloseTraceFile(TetrisTrace *t) {
+  int ok, saved_errno;
+  if (!t->file) return 1;
+  if (!FlushTrace(t, 1)) return 0;
+  fprintf(t->file, "\n]}\n");
+  ok = !ferror(t->file);
+  saved_errno = errno;
+  if (fclose(t->file) != 0) {
+    ok = 0;
+  } else {
+    errno = saved_errno;
+  }
+  t->file = NULL;
+  return ok;
+}
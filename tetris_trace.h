@@ -0,0 +1,110 @@
+#ifndef TETRIS_TRACE_H
+#define TETRIS_TRACE_H
+// This file defines the frontend's optional instrumentation. The start and end
+// of each stage of the main loop are kept in ring buffers, so recent frame
+// times and key-to-screen latencies can be summarized, and can be written to
+// a Chrome trace-event JSON file (which chrome://tracing and Perfetto can
+// open). Nothing here depends on curses; times are passed in, in seconds, by
+// the caller.
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The parts of the main loop that are timed.
+// Sleeping in WaitForKey until a key arrives or a deadline passes.
+#define TRACE_STAGE_WAIT (0)
+// Running UpdateGameState, the ticks that came due, and the AI.
+#define TRACE_STAGE_UPDATE (1)
+// Drawing whatever changed in DisplayGameState, including its refresh.
+#define TRACE_STAGE_DISPLAY (2)
+// Writing to the terminal in RefreshAllWindows.
+#define TRACE_STAGE_REFRESH (3)
+// From waking up to the end of drawing the result: everything but the wait.
+#define TRACE_STAGE_FRAME (4)
+// From reading a key to the end of the refresh that shows its effect.
+#define TRACE_STAGE_KEY_LATENCY (5)
+
+// The number of events each ring holds. Must be a power of 2.
+#define TRACE_RING_SIZE (4096)
+
+typedef struct {
+  double start;
+  double end;
+  // One of the TRACE_STAGE_* values.
+  int stage;
+  // For TRACE_STAGE_REFRESH, the number of bytes written to the terminal and
+  // the number of write() calls it took, if they were counted.
+  uint32_t bytes;
+  uint32_t writes;
+} TraceEvent;
+
+// A ring of the most recent events. It has a single writer, which never
+// waits: once the ring is full, each new event replaces the oldest one.
+// Readers may run at any time, even in another thread, and simply skip any
+// events overwritten while they were being copied.
+typedef struct {
+  TraceEvent events[TRACE_RING_SIZE];
+  // The number of events ever written. Event i is in events[i %
+  // TRACE_RING_SIZE] until event i + TRACE_RING_SIZE replaces it.
+  _Atomic uint64_t head;
+} TraceRing;
+
+typedef struct {
+  // Key latencies get their own ring, since keys are far less common than
+  // frames and would soon be pushed out of the ring holding every stage.
+  TraceRing stages;
+  TraceRing latencies;
+  // The file trace events are written to, or NULL if there isn't one, along
+  // with the number of events already written from each ring.
+  FILE *file;
+  uint64_t stages_written;
+  uint64_t latencies_written;
+  int any_written;
+  // The time that's written as 0 in the trace file.
+  double start_time;
+  // An open /proc/self/io, for counting what the process writes, or -1.
+  int io_fd;
+} TetrisTrace;
+
+// Sets up empty rings, without a trace file.
+void InitializeTrace(TetrisTrace *t);
+
+// Adds an event to a ring. Must only be called by the ring's one writer.
+void TraceRecord(TraceRing *r, int stage, double start, double end);
+
+// Adds a TRACE_STAGE_REFRESH event, with the output it wrote, to a ring.
+void TraceRecordRefresh(TraceRing *r, double start, double end,
+  uint32_t bytes, uint32_t writes);
+
+// Starts counting the bytes and write() calls the process makes, using the
+// totals Linux keeps in /proc/self/io. Returns 0 if they can't be counted.
+int OpenWriteCounters(TetrisTrace *t);
+
+// Reads the total bytes written and write() calls made by the process so far.
+// Returns 0 if they aren't being counted.
+int ReadWriteCounters(TetrisTrace *t, uint64_t *bytes, uint64_t *writes);
+
+// Copies up to max of the events numbered first and up, oldest first, that
+// are still in the ring. Returns the number copied, and sets *first to the
+// number of the first one copied.
+int TraceSnapshot(TraceRing *r, uint64_t *first, TraceEvent *out, int max);
+
+// Finds the median and 99th percentile duration, in seconds, of the events
+// for the given stage still in a ring. Returns 0 if there are none.
+int TracePercentiles(TraceRing *r, int stage, double *p50, double *p99);
+
+// Creates a trace file at path, and starts writing events to it. Times are
+// written relative to start_time. Returns 0 and sets errno on error.
+int OpenTraceFile(TetrisTrace *t, const char *path, double start_time);
+
+// Writes the events recorded since the last call to the trace file, if there
+// is one. Unless force is nonzero, this does nothing until the rings are half
+// full, so writes are batched. Returns 0 and sets errno on error, in which
+// case the trace file is closed.
+int FlushTrace(TetrisTrace *t, int force);
+
+// Writes any remaining events and finishes the trace file. Returns 0 and sets
+// errno on error.
+int CloseTraceFile(TetrisTrace *t);
+
+#endif  // TETRIS_TRACE_H
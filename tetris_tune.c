@@ -0,0 +1,536 @@
+// A program that tunes the AI's weights with a genetic algorithm. Each
+// generation, every candidate set of weights plays the same games (the same
+// seeds, so the comparison between candidates is paired), split across all of
+// the CPUs. The candidates that cleared the most lines are kept, and the rest
+// of the next generation is bred from them. Weights are kept at unit length,
+// since scaling every weight by the same amount doesn't change any move the
+// AI chooses.
+//
+// The games are played by tetris_sim_board.c, like tetris-sim's. After every
+// generation, the population is written to the checkpoint file, if there is
+// one, so an interrupted run can pick up where it left off.
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tetris_ai.h"
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_sched.h"
+#include "tetris_sim.h"
+
+// The first line of a checkpoint file.
+#define CHECKPOINT_MAGIC "tetris-tune checkpoint 1"
+
+// The default limit on the number of pieces in a single game. It's lower than
+// tetris-sim's, since every candidate plays many games per generation.
+#define DEFAULT_MAX_PIECES (1000)
+
+// The number of candidates that each parent is the best of.
+#define TOURNAMENT_SIZE (3)
+
+// Settings chosen on the command line.
+typedef struct {
+  int population;
+  // The number of candidates copied unchanged into the next generation.
+  int elites;
+  int generations;
+  // Each candidate plays games_per_candidate games per generation. In
+  // generation g, game i has seed game_options.first_seed +
+  // g * games_per_candidate + i, so each generation plays new games, but every
+  // candidate in it plays the same ones.
+  uint32_t games_per_candidate;
+  // The standard deviation of the noise added to each weight of a child.
+  double mutation;
+  // If not NULL, the path the population is saved to after each generation,
+  // and loaded from at startup if it exists.
+  const char *checkpoint_path;
+  // Passed to the board's play_game, with the weights of each candidate. Its
+  // threads are the number of workers.
+  SimOptions game_options;
+} TuneOptions;
+
+// A set of weights, and how they did in the current generation.
+typedef struct {
+  TetrisAIWeights weights;
+  SimStats stats;
+} Candidate;
+
+// Each worker's data is aligned to a cache line, so workers never write to
+// the same line.
+typedef struct {
+  _Alignas(64) pthread_t thread;
+  void *arena;
+  // The statistics of the games this worker played for each candidate in the
+  // current generation.
+  SimStats *stats;
+} TuneWorker;
+
+static TuneOptions options;
+static const SimBoard *board;
+static TuneWorker *workers;
+static Candidate *candidates;
+// The per-candidate options passed to play_game in the current generation.
+static SimOptions *candidate_options;
+// The generation being played, and the next game (numbered across every
+// candidate) for a worker to take.
+static int generation;
+static _Atomic uint64_t next_game;
+// The state of the genetic algorithm's random choices. It's saved in the
+// checkpoint, so a resumed run makes the same choices.
+static TetrisRNG rng;
+
+// Returns a random number in (0, 1).
+static double RandomUnit(void) {
+  return (((double) RandomU32(&rng)) + 0.5) / 4294967296.0;
+}
+
+// Returns a normally distributed random number with mean 0 and standard
+// deviation 1, using the Box-Muller transform.
+static double RandomNormal(void) {
+  double u = RandomUnit(), v = RandomUnit();
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+// Scales weights to unit length. Leaves them unchanged if they're all 0.
+static void NormalizeWeights(TetrisAIWeights *w) {
+  double length = sqrt(w->aggregate_height * w->aggregate_height +
+    w->holes * w->holes + w->bumpiness * w->bumpiness + w->lines * w->lines);
+  if (length == 0) return;
+  w->aggregate_height /= length;
+  w->holes /= length;
+  w->bumpiness /= length;
+  w->lines /= length;
+}
+
+// Fills in weights pointing in a random direction.
+static void RandomWeights(TetrisAIWeights *w) {
+  w->aggregate_height = RandomNormal();
+  w->holes = RandomNormal();
+  w->bumpiness = RandomNormal();
+  w->lines = RandomNormal();
+  NormalizeWeights(w);
+}
+
+// Returns nonzero if candidate a did better than candidate b in the current
+// generation. Lines are summed as integers, so results don't depend on how the
+// games were split between threads. Ties go to the earlier candidate.
+static int Better(int a, int b) {
+  if (candidates[a].stats.lines_sum != candidates[b].stats.lines_sum) {
+    return candidates[a].stats.lines_sum > candidates[b].stats.lines_sum;
+  }
+  return a < b;
+}
+
+// Sorts the candidates best first. The population is small, so this uses an
+// insertion sort.
+static void SortCandidates(void) {
+  Candidate tmp;
+  int i, j;
+  for (i = 1; i < options.population; i++) {
+    for (j = i; (j > 0) && Better(j, j - 1); j--) {
+      tmp = candidates[j];
+      candidates[j] = candidates[j - 1];
+      candidates[j - 1] = tmp;
+    }
+  }
+}
+
+// Returns the best of TOURNAMENT_SIZE randomly chosen candidates, which must
+// already be sorted.
+static int ChooseParent(void) {
+  int i, choice, best = options.population;
+  for (i = 0; i < TOURNAMENT_SIZE; i++) {
+    choice = RandomBelow(&rng, options.population);
+    if (choice < best) best = choice;
+  }
+  return best;
+}
+
+// Replaces every candidate except the elites with a child of two parents: a
+// random blend of the parents' weights, plus some noise. The candidates must
+// already be sorted, and the children are bred from the whole population
+// before any of it is replaced.
+static void BreedNextGeneration(void) {
+  TetrisAIWeights *children;
+  TetrisAIWeights *a, *b;
+  double mix;
+  int i, count = options.population - options.elites;
+  children = (TetrisAIWeights *) malloc(count * sizeof(TetrisAIWeights));
+  if (!children) {
+    printf("Failed allocating memory: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 0; i < count; i++) {
+    a = &(candidates[ChooseParent()].weights);
+    b = &(candidates[ChooseParent()].weights);
+    mix = RandomUnit();
+    children[i].aggregate_height = mix * a->aggregate_height +
+      (1 - mix) * b->aggregate_height + options.mutation * RandomNormal();
+    children[i].holes = mix * a->holes + (1 - mix) * b->holes +
+      options.mutation * RandomNormal();
+    children[i].bumpiness = mix * a->bumpiness + (1 - mix) * b->bumpiness +
+      options.mutation * RandomNormal();
+    children[i].lines = mix * a->lines + (1 - mix) * b->lines +
+      options.mutation * RandomNormal();
+    NormalizeWeights(children + i);
+  }
+  for (i = 0; i < count; i++) {
+    candidates[options.elites + i].weights = children[i];
+  }
+  free(children);
+}
+
+static void* WorkerThread(void *arg) {
+  TuneWorker *w = (TuneWorker *) arg;
+  uint64_t total = ((uint64_t) options.population) *
+    options.games_per_candidate;
+  uint64_t game, candidate;
+  while (1) {
+    game = atomic_fetch_add(&next_game, 1);
+    if (game >= total) break;
+    candidate = game / options.games_per_candidate;
+    board->play_game(w->arena, candidate_options + candidate,
+      game % options.games_per_candidate, w->stats + candidate);
+  }
+  return NULL;
+}
+
+// Plays the current generation's games, filling in each candidate's stats.
+static void EvaluateGeneration(void) {
+  int i, j, result;
+  for (i = 0; i < options.population; i++) {
+    candidate_options[i] = options.game_options;
+    candidate_options[i].first_seed = options.game_options.first_seed +
+      ((uint64_t) generation) * options.games_per_candidate;
+    candidate_options[i].weights = candidates[i].weights;
+    memset(&(candidates[i].stats), 0, sizeof(SimStats));
+    candidates[i].stats.pieces_min = UINT64_MAX;
+  }
+  for (i = 0; i < options.game_options.threads; i++) {
+    for (j = 0; j < options.population; j++) {
+      memset(workers[i].stats + j, 0, sizeof(SimStats));
+      workers[i].stats[j].pieces_min = UINT64_MAX;
+    }
+  }
+  atomic_store(&next_game, 0);
+  for (i = 0; i < options.game_options.threads; i++) {
+    result = pthread_create(&workers[i].thread, NULL, WorkerThread,
+      workers + i);
+    if (result != 0) {
+      printf("Failed creating thread: %s\n", strerror(result));
+      exit(1);
+    }
+  }
+  for (i = 0; i < options.game_options.threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (j = 0; j < options.population; j++) {
+      candidates[j].stats.games += workers[i].stats[j].games;
+      candidates[j].stats.lines_sum += workers[i].stats[j].lines_sum;
+      candidates[j].stats.score_sum += workers[i].stats[j].score_sum;
+      candidates[j].stats.pieces_sum += workers[i].stats[j].pieces_sum;
+    }
+  }
+}
+
+// Prints weights in the format --ai-weights takes.
+static void PrintWeights(TetrisAIWeights *w) {
+  printf("%.6f,%.6f,%.6f,%.6f", w->aggregate_height, w->holes, w->bumpiness,
+    w->lines);
+}
+
+// Prints how the generation that was just evaluated (and sorted) went.
+static void PrintProgress(double seconds) {
+  uint64_t games = 0, pieces = 0, lines = 0;
+  int i;
+  for (i = 0; i < options.population; i++) {
+    games += candidates[i].stats.games;
+    pieces += candidates[i].stats.pieces_sum;
+    lines += candidates[i].stats.lines_sum;
+  }
+  printf("Generation %d: best %.2f lines/game (", generation + 1,
+    ((double) candidates[0].stats.lines_sum) /
+    ((double) options.games_per_candidate));
+  PrintWeights(&(candidates[0].weights));
+  printf("), population mean %.2f; %.1f games/s, %.1f pieces/s\n",
+    ((double) lines) / ((double) games), ((double) games) / seconds,
+    ((double) pieces) / seconds);
+  fflush(stdout);
+}
+
+// Writes the population about to be evaluated, along with its generation
+// number and the random state, to the checkpoint file. The file is written
+// under a temporary name, synced to disk, and then renamed, so a crash never
+// leaves a partial checkpoint behind. Returns 0 and sets errno on error.
+static int SaveCheckpoint(int next_generation) {
+  size_t length = strlen(options.checkpoint_path);
+  char *tmp_path = (char *) malloc(length + 5);
+  TetrisAIWeights *w;
+  int i, ok, saved_errno;
+  FILE *f;
+  if (!tmp_path) return 0;
+  memcpy(tmp_path, options.checkpoint_path, length);
+  memcpy(tmp_path + length, ".tmp", 5);
+  f = fopen(tmp_path, "w");
+  if (!f) {
+    saved_errno = errno;
+    free(tmp_path);
+    errno = saved_errno;
+    return 0;
+  }
+  fprintf(f, "%s\ngeneration %d\nrng %llu %llu\npopulation %d\n",
+    CHECKPOINT_MAGIC, next_generation, (unsigned long long) rng.state,
+    (unsigned long long) rng.increment, options.population);
+  // %.17g always reads back as the same double.
+  for (i = 0; i < options.population; i++) {
+    w = &(candidates[i].weights);
+    fprintf(f, "%.17g,%.17g,%.17g,%.17g\n", w->aggregate_height, w->holes,
+      w->bumpiness, w->lines);
+  }
+  // Make sure the data is really on disk before it replaces the old
+  // checkpoint, or a power loss could leave the rename without the data.
+  ok = !ferror(f) && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+  saved_errno = errno;
+  if ((fclose(f) != 0) && ok) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (ok && (rename(tmp_path, options.checkpoint_path) != 0)) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (!ok) remove(tmp_path);
+  free(tmp_path);
+  errno = saved_errno;
+  return ok;
+}
+
+// Loads the population, generation number and random state from the
+// checkpoint file. Returns 0 if there's no checkpoint, 1 if it was loaded, or
+// -1 (after printing an error) if it's invalid. The checkpoint's population
+// size replaces --population.
+static int LoadCheckpoint(void) {
+  unsigned long long state, increment;
+  char magic[64];
+  TetrisAIWeights *w;
+  int i, population;
+  FILE *f = fopen(options.checkpoint_path, "r");
+  if (!f) {
+    if (errno == ENOENT) return 0;
+    printf("Failed opening %s: %s\n", options.checkpoint_path,
+      strerror(errno));
+    return -1;
+  }
+  if (!fgets(magic, sizeof(magic), f) ||
+    (strcmp(magic, CHECKPOINT_MAGIC "\n") != 0) ||
+    (fscanf(f, "generation %d rng %llu %llu population %d", &generation,
+      &state, &increment, &population) != 4) || (generation < 0) ||
+    (population < 2)) {
+    goto invalid;
+  }
+  free(candidates);
+  candidates = (Candidate *) calloc(population, sizeof(Candidate));
+  if (!candidates) {
+    printf("Failed allocating memory: %s\n", strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  options.population = population;
+  for (i = 0; i < population; i++) {
+    w = &(candidates[i].weights);
+    if (fscanf(f, "%lf,%lf,%lf,%lf", &w->aggregate_height, &w->holes,
+      &w->bumpiness, &w->lines) != 4) {
+      goto invalid;
+    }
+  }
+  rng.state = state;
+  rng.increment = increment;
+  fclose(f);
+  return 1;
+invalid:
+  printf("%s is not a valid checkpoint.\n", options.checkpoint_path);
+  fclose(f);
+  return -1;
+}
+
+static void PrintUsage(const char *program_name) {
+  printf("Usage: %s [options]\n"
+    "Options:\n"
+    "  --population <count>: The number of candidate weights in each\n"
+    "    generation. Defaults to 24.\n"
+    "  --elites <count>: The number of best candidates kept unchanged in the\n"
+    "    next generation. Defaults to a quarter of the population, and at\n"
+    "    least 1.\n"
+    "  --generations <count>: The number of generations to run, counting\n"
+    "    those already in the checkpoint. Defaults to 20.\n"
+    "  --games <count>: The number of games each candidate plays per\n"
+    "    generation. Defaults to 100.\n"
+    "  --mutation <stddev>: The noise added to each weight of a child.\n"
+    "    Defaults to 0.1.\n"
+    "  --checkpoint <path>: Save the population to <path> after every\n"
+    "    generation, and resume from it if it exists.\n", program_name);
+  PrintSimOptionUsage(DEFAULT_MAX_PIECES);
+}
+
+static int ParseArguments(int argc, char **argv) {
+  uint64_t value;
+  char *end = NULL;
+  int i, parsed;
+  memset(&options, 0, sizeof(options));
+  options.population = 24;
+  options.elites = -1;
+  options.generations = 20;
+  options.games_per_candidate = 100;
+  options.mutation = 0.1;
+  DefaultSimOptions(&options.game_options, &board);
+  options.game_options.max_pieces = DEFAULT_MAX_PIECES;
+  for (i = 1; i < argc; i++) {
+    parsed = ParseSimOption(argc, argv, &i, &options.game_options, &board);
+    if (parsed < 0) break;
+    if (parsed) continue;
+    if ((strcmp(argv[i], "--population") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "population", 100000, &value)) break;
+      options.population = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--elites") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "elite count", 100000, &value)) break;
+      options.elites = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--generations") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "generation count", 1000000, &value)) break;
+      options.generations = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--games") == 0) && ((i + 1) < argc)) {
+      i++;
+      if (!ParseCount(argv[i], "game count", 1000000, &value)) break;
+      options.games_per_candidate = value;
+      continue;
+    }
+    if ((strcmp(argv[i], "--mutation") == 0) && ((i + 1) < argc)) {
+      i++;
+      options.mutation = strtod(argv[i], &end);
+      if ((*end != 0) || (end == argv[i]) || !(options.mutation >= 0)) {
+        printf("Invalid mutation: %s\n", argv[i]);
+        break;
+      }
+      continue;
+    }
+    if ((strcmp(argv[i], "--checkpoint") == 0) && ((i + 1) < argc)) {
+      i++;
+      options.checkpoint_path = argv[i];
+      continue;
+    }
+    if (strcmp(argv[i], "--help") != 0) {
+      printf("Invalid argument: %s\n", argv[i]);
+    }
+    break;
+  }
+  if (i < argc) {
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  if (options.population < 2) {
+    printf("The population must be at least 2.\n");
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  SimStats unused;
+  uint64_t start_time;
+  int i, loaded = 0;
+  if (!ParseArguments(argc, argv)) return 1;
+  // A fixed seed makes every run with the same options the same.
+  SeedRandom(&rng, options.game_options.first_seed ^ 0x74756e65);
+  candidates = (Candidate *) calloc(options.population, sizeof(Candidate));
+  if (!candidates) {
+    printf("Failed allocating memory: %s\n", strerror(errno));
+    return 1;
+  }
+  if (options.checkpoint_path) {
+    loaded = LoadCheckpoint();
+    if (loaded < 0) return 1;
+  }
+  // This waits for the checkpoint, which may change the population. At least
+  // one elite is always kept, so the best weights printed at the end are ones
+  // that were actually evaluated.
+  if (options.elites < 0) options.elites = options.population / 4;
+  if (options.elites < 1) options.elites = 1;
+  if (options.elites >= options.population) {
+    printf("The number of elites must be less than the population.\n");
+    return 1;
+  }
+  if (loaded) {
+    printf("Resuming from %s at generation %d.\n", options.checkpoint_path,
+      generation + 1);
+  } else {
+    // Start from the default weights, and random ones around them. Like
+    // every other candidate, the default weights are kept at unit length.
+    DefaultAIWeights(&(candidates[0].weights));
+    NormalizeWeights(&(candidates[0].weights));
+    for (i = 1; i < options.population; i++) {
+      RandomWeights(&(candidates[i].weights));
+    }
+  }
+  candidate_options = (SimOptions *) malloc(options.population *
+    sizeof(SimOptions));
+  workers = (TuneWorker *) aligned_alloc(64, options.game_options.threads *
+    sizeof(TuneWorker));
+  if (!candidate_options || !workers) {
+    printf("Failed allocating memory: %s\n", strerror(errno));
+    return 1;
+  }
+  memset(workers, 0, options.game_options.threads * sizeof(TuneWorker));
+  for (i = 0; i < options.game_options.threads; i++) {
+    workers[i].stats = (SimStats *) malloc(options.population *
+      sizeof(SimStats));
+    // The weights change every game, so a cache of lookahead scores would
+    // be wrong.
+    workers[i].arena = board->create_arena(&options.game_options, NULL);
+    if (!workers[i].stats || !workers[i].arena) {
+      printf("Failed allocating workers: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+  printf("Tuning with %d candidates, %u games each per generation, on a "
+    "%dx%d board with %d threads.\n", options.population,
+    options.games_per_candidate, board->width, board->height,
+    options.game_options.threads);
+  for (; generation < options.generations; generation++) {
+    start_time = MonotonicNanoseconds();
+    EvaluateGeneration();
+    SortCandidates();
+    PrintProgress(((double) (MonotonicNanoseconds() - start_time)) / 1e9);
+    BreedNextGeneration();
+    if (options.checkpoint_path && !SaveCheckpoint(generation + 1)) {
+      printf("Failed writing %s: %s\n", options.checkpoint_path,
+        strerror(errno));
+      return 1;
+    }
+  }
+  // Breeding leaves the elites, sorted best first, at the start.
+  printf("Best weights: --ai-weights ");
+  PrintWeights(&(candidates[0].weights));
+  printf("\n");
+  memset(&unused, 0, sizeof(unused));
+  for (i = 0; i < options.game_options.threads; i++) {
+    board->destroy_arena(workers[i].arena, &unused);
+    free(workers[i].stats);
+  }
+  free(workers);
+  free(candidate_options);
+  free(candidates);
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Implements the undo history described in tetris_undo.h.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetris_engine.h"
+#include "tetris_undo.h"
+
+int CreateUndoRing(TetrisUndoRing *ring, int depth) {
+  memset(ring, 0, sizeof(*ring));
+  ring->snapshots = (TetrisSnapshot *) malloc(depth * sizeof(TetrisSnapshot));
+  if (!ring->snapshots) return 0;
+  ring->capacity = depth;
+  return 1;
+}
+
+void DestroyUndoRing(TetrisUndoRing *ring) {
+  free(ring->snapshots);
+  memset(ring, 0, sizeof(*ring));
+}
+
+void ResetUndoRing(TetrisUndoRing *ring) {
+  ring->first = 0;
+  ring->count = 0;
+}
+
+void TakeSnapshot(TetrisUndoRing *ring, TetrisGameState *s) {
+  TetrisSnapshot *p;
+  if (ring->count > ring->first) {
+    p = ring->snapshots + ((ring->count - 1) % ring->capacity);
+    if (p->pieces == s->pieces) return;
+  }
+  p = ring->snapshots + (ring->count % ring->capacity);
+  ring->count++;
+  if ((ring->count - ring->first) > ring->capacity) ring->first++;
+  p->pieces = s->pieces;
+  memcpy(p->board, s->board, sizeof(p->board));
+  memcpy(p->rows, s->rows, sizeof(p->rows));
+  memcpy(p->column_tops, s->column_tops, sizeof(p->column_tops));
+  p->board_hash = s->board_hash;
+  memcpy(p->queue, s->queue, sizeof(p->queue));
+  p->queue_start = s->queue_start;
+  p->queue_count = s->queue_count;
+  p->hold_piece = s->hold_piece;
+  p->hold_used = s->hold_used;
+  p->current_piece = s->current_piece;
+  p->location_x = s->location_x;
+  p->location_y = s->location_y;
+  p->score = s->score;
+  p->lines = s->lines;
+  p->ticks = s->ticks;
+  p->gravity_ticks = s->gravity_ticks;
+  p->rng = s->rng;
+}
+
+uint32_t UndoablePieces(TetrisUndoRing *ring, TetrisGameState *s) {
+  TetrisSnapshot *oldest;
+  if (ring->count == ring->first) return 0;
+  oldest = ring->snapshots + (ring->first % ring->capacity);
+  if (oldest->pieces >= s->pieces) return 0;
+  return s->pieces - oldest->pieces;
+}
+
+uint32_t RestoreSnapshot(TetrisUndoRing *ring, TetrisGameState *s,
+  uint32_t pieces_back) {
+  TetrisSnapshot *p = NULL;
+  uint32_t target;
+  uint64_t i;
+  if (pieces_back > s->pieces) pieces_back = s->pieces;
+  target = s->pieces - pieces_back;
+  // Normally there's a snapshot for every piece, but a piece that landed
+  // straight after another, within a single update, won't have one. Use the
+  // newest snapshot that goes back far enough, or the oldest one there is.
+  for (i = ring->count; i > ring->first; i--) {
+    p = ring->snapshots + ((i - 1) % ring->capacity);
+    if (p->pieces <= target) break;
+  }
+  if (!p || (p->pieces >= s->pieces)) return 0;
+  // Later snapshots describe a future that's no longer going to happen.
+  ring->count = (i > ring->first) ? i : (ring->first + 1);
+  pieces_back = s->pieces - p->pieces;
+  s->pieces = p->pieces;
+  memcpy(s->board, p->board, sizeof(s->board));
+  memcpy(s->rows, p->rows, sizeof(s->rows));
+  memcpy(s->column_tops, p->column_tops, sizeof(s->column_tops));
+  s->board_hash = p->board_hash;
+  memcpy(s->queue, p->queue, sizeof(s->queue));
+  s->queue_start = p->queue_start;
+  s->queue_count = p->queue_count;
+  s->hold_piece = p->hold_piece;
+  s->hold_used = p->hold_used;
+  s->current_piece = p->current_piece;
+  s->location_x = p->location_x;
+  s->location_y = p->location_y;
+  s->score = p->score;
+  s->lines = p->lines;
+  s->ticks = p->ticks;
+  s->gravity_ticks = p->gravity_ticks;
+  s->rng = p->rng;
+  s->events = 0;
+  s->dirty_rows = ALL_ROWS_DIRTY;
+  return pieces_back;
+}
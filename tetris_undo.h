@@ -0,0 +1,79 @@
+#ifndef TETRIS_UNDO_H
+#define TETRIS_UNDO_H
+// This file defines an in-memory undo history: a ring of snapshots of a game,
+// one for each piece, taken as the piece appears. Taking back pieces restores
+// an older snapshot. The ring is allocated once, when it's created, so taking
+// and restoring snapshots never allocates memory or touches the disk. Like the
+// rest of the engine, this doesn't depend on curses.
+#include <stdint.h>
+#include "tetris_engine.h"
+#include "tetris_random.h"
+
+// The default number of snapshots kept.
+#define DEFAULT_UNDO_DEPTH (100)
+
+// The parts of a TetrisGameState that change during a game. The renderer's
+// flags (events and the dirty rows) aren't kept, and neither are the
+// settings, which never change during a game.
+typedef struct {
+  // The value of TetrisGameState.pieces when the snapshot was taken; that
+  // is, the number of pieces that had landed.
+  uint32_t pieces;
+  char board[BLOCKS_WIDE * BLOCKS_TALL];
+  uint16_t rows[BLOCKS_TALL];
+  uint8_t column_tops[BLOCKS_WIDE];
+  uint64_t board_hash;
+  uint8_t queue[TETRIS_QUEUE_CAPACITY];
+  uint8_t queue_start;
+  uint8_t queue_count;
+  short hold_piece;
+  uint8_t hold_used;
+  short current_piece;
+  int location_x;
+  int location_y;
+  unsigned score;
+  unsigned lines;
+  uint64_t ticks;
+  uint32_t gravity_ticks;
+  TetrisRNG rng;
+} TetrisSnapshot;
+
+typedef struct {
+  // The ring's storage, with room for capacity snapshots.
+  TetrisSnapshot *snapshots;
+  int capacity;
+  // Snapshot i, counting from 0 since the ring was last reset, is in
+  // snapshots[i % capacity]. Snapshots first through count - 1 are still in
+  // the ring.
+  uint64_t first;
+  uint64_t count;
+} TetrisUndoRing;
+
+// Allocates a ring holding up to depth snapshots, which must be at least 1.
+// Returns 0 and sets errno on error.
+int CreateUndoRing(TetrisUndoRing *ring, int depth);
+
+// Frees a ring's storage.
+void DestroyUndoRing(TetrisUndoRing *ring);
+
+// Removes every snapshot from the ring, e.g. when a new game starts.
+void ResetUndoRing(TetrisUndoRing *ring);
+
+// Takes a snapshot of s, replacing the oldest one if the ring is full. Does
+// nothing if the newest snapshot was taken after the same number of pieces
+// landed, so this may be called after every update.
+void TakeSnapshot(TetrisUndoRing *ring, TetrisGameState *s);
+
+// Returns the number of pieces that can be taken back from s: the number that
+// have landed since the oldest snapshot in the ring was taken.
+uint32_t UndoablePieces(TetrisUndoRing *ring, TetrisGameState *s);
+
+// Puts s back the way it was when the piece that landed pieces_back pieces
+// ago appeared, and discards the snapshots taken after that. If fewer pieces
+// than that can be taken back, this goes back as far as it can. Returns the
+// number of pieces taken back, which is 0 (leaving s unchanged) if the ring
+// is empty. The restored state has every row dirty.
+uint32_t RestoreSnapshot(TetrisUndoRing *ring, TetrisGameState *s,
+  uint32_t pieces_back);
+
+#endif  // TETRIS_UNDO_H
@@ -0,0 +1,704 @@
+// Implements the versus matches described in tetris_versus.h.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_replay.h"
+#include "tetris_versus.h"
+
+// The size of an 'S' message before its rows, and after them, including the
+// type byte.
+#define SYNC_HEADER_SIZE (13)
+#define SYNC_FOOTER_SIZE (8)
+
+static void PutU32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void PutU64(uint8_t *p, uint64_t v) {
+  PutU32(p, v);
+  PutU32(p + 4, v >> 32);
+}
+
+static uint32_t GetU32(const uint8_t *p) {
+  return ((uint32_t) p[0]) | (((uint32_t) p[1]) << 8) |
+    (((uint32_t) p[2]) << 16) | (((uint32_t) p[3]) << 24);
+}
+
+static uint64_t GetU64(const uint8_t *p) {
+  return ((uint64_t) GetU32(p)) | (((uint64_t) GetU32(p + 4)) << 32);
+}
+
+// Returns the number of bits set in v.
+static int CountBits(uint32_t v) {
+  int count = 0;
+  while (v) {
+    v &= v - 1;
+    count++;
+  }
+  return count;
+}
+
+// Fills in a match for the given config, with the connection in fd.
+static void InitializeMatch(VersusMatch *m, int fd, int local_player,
+  TetrisGameConfig *config) {
+  int p;
+  memset(m, 0, sizeof(*m));
+  m->fd = fd;
+  m->local_player = local_player;
+  m->config = *config;
+  for (p = 0; p < 2; p++) {
+    // Both players get the same pieces, so neither has an easier game.
+    InitializeNewGame(m->current.games + p, config);
+    m->current.alive[p] = 1;
+    SeedRandom(m->current.garbage_rng + p, config->seed ^
+      (0x67617262616765ull + p));
+  }
+  m->confirmed = m->current;
+  m->max_prediction_ticks = (config->tick_rate * VERSUS_MAX_PREDICTION_MS) /
+    1000;
+  if (m->max_prediction_ticks < 1) m->max_prediction_ticks = 1;
+}
+
+// Fills in the 'H' message for a config.
+static void EncodeHello(TetrisGameConfig *config, uint8_t *message) {
+  memset(message, 0, VERSUS_HELLO_SIZE + 1);
+  message[0] = 'H';
+  memcpy(message + 1, VERSUS_MAGIC, 4);
+  message[5] = VERSUS_VERSION & 0xff;
+  message[6] = VERSUS_VERSION >> 8;
+  message[7] = config->randomizer;
+  message[8] = BLOCKS_WIDE;
+  message[9] = BLOCKS_TALL;
+  PutU32(message + 11, config->tick_rate);
+  PutU64(message + 15, config->seed);
+}
+
+// Reads an 'H' message into config. Returns 0 and prints an error if it's
+// invalid or for a different version or board size.
+static int DecodeHello(const uint8_t *message, TetrisGameConfig *config) {
+  if ((message[0] != 'H') || (memcmp(message + 1, VERSUS_MAGIC, 4) != 0)) {
+    printf("The other side isn't a tetris versus match.\n");
+    return 0;
+  }
+  if (((message[5] | (message[6] << 8)) != VERSUS_VERSION) ||
+    (message[8] != BLOCKS_WIDE) || (message[9] != BLOCKS_TALL)) {
+    printf("The other side is running an incompatible version.\n");
+    return 0;
+  }
+  config->randomizer = message[7];
+  config->tick_rate = GetU32(message + 11);
+  config->seed = GetU64(message + 15);
+  if ((config->tick_rate < 1) || (config->tick_rate > 1000) ||
+    ((config->randomizer != TETRIS_RANDOMIZER_WEIGHTED) &&
+    (config->randomizer != TETRIS_RANDOMIZER_BAG))) {
+    printf("The other side sent invalid settings.\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Writes or reads exactly size bytes on a blocking socket. Return 0 and print
+// an error on failure.
+static int SendAll(int fd, const uint8_t *data, size_t size) {
+  ssize_t result;
+  while (size > 0) {
+    result = send(fd, data, size, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      printf("Failed sending to the opponent: %s\n", strerror(errno));
+      return 0;
+    }
+    data += result;
+    size -= result;
+  }
+  return 1;
+}
+
+static int ReceiveAll(int fd, uint8_t *data, size_t size) {
+  ssize_t result;
+  while (size > 0) {
+    result = recv(fd, data, size, 0);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      printf("Failed receiving from the opponent: %s\n", strerror(errno));
+      return 0;
+    }
+    if (result == 0) {
+      printf("The opponent disconnected.\n");
+      return 0;
+    }
+    data += result;
+    size -= result;
+  }
+  return 1;
+}
+
+// Sets up a connected socket for the match: non-blocking, with every message
+// sent as soon as it's written. Returns 0 and prints an error on failure.
+static int PrepareSocket(int fd) {
+  int one = 1, flags = fcntl(fd, F_GETFL);
+  // Inputs are sent as they happen, so there's no reason to delay any of
+  // them.
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+    printf("Failed setting up the connection: %s\n", strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+int StartVersusMatch(VersusMatch *m, int fd, int local_player,
+  TetrisGameConfig *config) {
+  if (!PrepareSocket(fd)) return 0;
+  InitializeMatch(m, fd, local_player, config);
+  return 1;
+}
+
+int HostVersusMatch(VersusMatch *m, uint16_t port, TetrisGameConfig *config) {
+  uint8_t hello[VERSUS_HELLO_SIZE + 1], reply[VERSUS_HELLO_SIZE + 1];
+  struct sockaddr_in address;
+  TetrisGameConfig accepted;
+  int listen_fd, fd, one = 1;
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    printf("Failed creating a socket: %s\n", strerror(errno));
+    return 0;
+  }
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if ((bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0) ||
+    (listen(listen_fd, 1) != 0)) {
+    printf("Failed listening on port %d: %s\n", port, strerror(errno));
+    close(listen_fd);
+    return 0;
+  }
+  printf("Waiting for an opponent on port %d...\n", port);
+  fflush(stdout);
+  do {
+    fd = accept(listen_fd, NULL, NULL);
+  } while ((fd < 0) && ((errno == EINTR) || (errno == ECONNABORTED)));
+  close(listen_fd);
+  if (fd < 0) {
+    printf("accept failed: %s\n", strerror(errno));
+    return 0;
+  }
+  EncodeHello(config, hello);
+  if (!SendAll(fd, hello, sizeof(hello)) ||
+    !ReceiveAll(fd, reply, sizeof(reply)) ||
+    !DecodeHello(reply, &accepted)) {
+    close(fd);
+    return 0;
+  }
+  if (memcmp(hello, reply, sizeof(hello)) != 0) {
+    printf("The opponent didn't accept the match's settings.\n");
+    close(fd);
+    return 0;
+  }
+  if (!StartVersusMatch(m, fd, 0, config)) {
+    close(fd);
+    return 0;
+  }
+  return 1;
+}
+
+int JoinVersusMatch(VersusMatch *m, const char *host) {
+  uint8_t hello[VERSUS_HELLO_SIZE + 1];
+  struct addrinfo hints, *addresses, *a;
+  TetrisGameConfig config;
+  char name[256], port[16];
+  const char *colon = strrchr(host, ':');
+  int fd = -1, result;
+  size_t length = colon ? (size_t) (colon - host) : strlen(host);
+  if (length >= sizeof(name)) {
+    printf("Invalid host: %s\n", host);
+    return 0;
+  }
+  memcpy(name, host, length);
+  name[length] = 0;
+  snprintf(port, sizeof(port), "%s", colon ? (colon + 1) : "");
+  if (!colon) snprintf(port, sizeof(port), "%d", DEFAULT_VERSUS_PORT);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  result = getaddrinfo(name, port, &hints, &addresses);
+  if (result != 0) {
+    printf("Failed looking up %s: %s\n", host, gai_strerror(result));
+    return 0;
+  }
+  for (a = addresses; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    printf("Failed connecting to %s: %s\n", host, strerror(errno));
+    return 0;
+  }
+  // Accept the host's settings by sending them back.
+  if (!ReceiveAll(fd, hello, sizeof(hello)) ||
+    !DecodeHello(hello, &config) || !SendAll(fd, hello, sizeof(hello)) ||
+    !StartVersusMatch(m, fd, 1, &config)) {
+    close(fd);
+    return 0;
+  }
+  return 1;
+}
+
+void CloseVersusMatch(VersusMatch *m) {
+  if (m->fd >= 0) close(m->fd);
+  m->fd = -1;
+}
+
+TetrisGameState* LocalVersusGame(VersusMatch *m) {
+  return m->current.games + m->local_player;
+}
+
+TetrisGameState* OpponentVersusGame(VersusMatch *m) {
+  return m->current.games + (1 - m->local_player);
+}
+
+// Adds the garbage waiting for player p, if the move that was just made in
+// their game landed a piece without clearing any lines. pieces and lines are
+// the game's counts from before the move.
+static void AddPendingGarbage(VersusState *v, int p, uint32_t pieces,
+  unsigned lines) {
+  TetrisGameState *s = v->games + p;
+  int hole_x;
+  if ((s->pieces == pieces) || (s->lines != lines)) return;
+  if (!v->pending_garbage[p]) return;
+  hole_x = RandomBelow(v->garbage_rng + p, BLOCKS_WIDE);
+  if (!AddGarbageRows(s, v->pending_garbage[p], hole_x)) v->alive[p] = 0;
+  v->pending_garbage[p] = 0;
+}
+
+// Applies an input to player p's game in v.
+static void ApplyInput(VersusState *v, int p, int input) {
+  TetrisGameState *s = v->games + p;
+  uint32_t pieces = s->pieces;
+  unsigned lines = s->lines;
+  if (!v->alive[p]) return;
+  if (!UpdateGameState(s, input)) {
+    v->alive[p] = 0;
+    return;
+  }
+  AddPendingGarbage(v, p, pieces, lines);
+}
+
+// Applies every input player p made at v's current tick.
+static void ApplyInputsAtTick(VersusMatch *m, VersusState *v, int p) {
+  int i;
+  for (i = 0; i < m->event_count[p]; i++) {
+    if (m->events[p][i].tick > v->tick) break;
+    if (m->events[p][i].tick == v->tick) {
+      ApplyInput(v, p, m->events[p][i].input);
+    }
+  }
+}
+
+// Ends v's current tick: advances both games, then sends each player's new
+// garbage to the other.
+static void FinishTick(VersusState *v) {
+  TetrisGameState *s;
+  uint32_t pieces, attack, cancelled, sent[2];
+  unsigned lines;
+  int p;
+  for (p = 0; p < 2; p++) {
+    if (!v->alive[p]) continue;
+    s = v->games + p;
+    pieces = s->pieces;
+    lines = s->lines;
+    if (!TickGameState(s)) {
+      v->alive[p] = 0;
+      continue;
+    }
+    AddPendingGarbage(v, p, pieces, lines);
+  }
+  for (p = 0; p < 2; p++) {
+    attack = v->games[p].garbage_sent - v->garbage_delivered[p];
+    v->garbage_delivered[p] = v->games[p].garbage_sent;
+    cancelled = (attack < v->pending_garbage[p]) ? attack :
+      v->pending_garbage[p];
+    v->pending_garbage[p] -= cancelled;
+    sent[p] = attack - cancelled;
+  }
+  for (p = 0; p < 2; p++) {
+    if (v->alive[1 - p]) v->pending_garbage[1 - p] += sent[p];
+  }
+  v->tick++;
+}
+
+// Marks a failure, keeping the first one.
+static void Fail(VersusMatch *m, int failure) {
+  if (!m->failure) m->failure = failure;
+}
+
+// Queues a message to be sent. The buffer only fills up if the opponent stops
+// reading for a long time, which is treated as the connection failing.
+static void QueueMessage(VersusMatch *m, const uint8_t *data, size_t size) {
+  if ((m->out_size + size) > sizeof(m->out)) {
+    Fail(m, VERSUS_CONNECTION_ERROR);
+    return;
+  }
+  memcpy(m->out + m->out_size, data, size);
+  m->out_size += size;
+}
+
+// Queues an 'I' message for an input at the given tick, or a progress marker
+// if input is TETRIS_INPUT_NONE.
+static void QueueInput(VersusMatch *m, uint64_t tick, int input) {
+  uint8_t message[REPLAY_MAX_RECORD_SIZE + 1];
+  message[0] = 'I';
+  QueueMessage(m, message, 1 + EncodeReplayRecord(tick - m->last_sent_tick,
+    input, message + 1));
+  m->last_sent_tick = tick;
+}
+
+// Checks the opponent's board as this machine computed it against the
+// opponent's own copy. On a mismatch, the opponent is told too, so both sides
+// report the desync.
+static void CompareSync(VersusMatch *m, VersusSyncRecord *mine,
+  VersusSyncRecord *theirs) {
+  uint8_t message = 'D';
+  if ((memcmp(mine->rows, theirs->rows, sizeof(mine->rows)) == 0) &&
+    (mine->score == theirs->score) && (mine->lines == theirs->lines)) {
+    return;
+  }
+  if (m->failure) return;
+  QueueMessage(m, &message, 1);
+  Fail(m, VERSUS_DESYNCED);
+}
+
+// Sends the local player's confirmed board as of this sync tick, and keeps the
+// opponent's to check against theirs when it arrives.
+static void RecordSync(VersusMatch *m) {
+  uint8_t message[SYNC_HEADER_SIZE + 2 * BLOCKS_TALL + SYNC_FOOTER_SIZE];
+  TetrisGameState *local = m->confirmed.games + m->local_player;
+  TetrisGameState *remote = m->confirmed.games + (1 - m->local_player);
+  VersusSyncRecord *r;
+  uint32_t changed = 0;
+  size_t size = SYNC_HEADER_SIZE;
+  int y;
+  r = m->sync_history + ((m->confirmed.tick / VERSUS_SYNC_TICKS) %
+    VERSUS_SYNC_HISTORY);
+  r->tick = m->confirmed.tick;
+  memcpy(r->rows, remote->rows, sizeof(r->rows));
+  r->score = remote->score;
+  r->lines = remote->lines;
+  message[0] = 'S';
+  PutU64(message + 1, m->confirmed.tick);
+  for (y = 0; y < BLOCKS_TALL; y++) {
+    if (local->rows[y] == m->sent_rows[y]) continue;
+    changed |= ((uint32_t) 1) << y;
+    message[size] = local->rows[y] & 0xff;
+    message[size + 1] = local->rows[y] >> 8;
+    size += 2;
+  }
+  PutU32(message + 9, changed);
+  PutU32(message + size, local->score);
+  PutU32(message + size + 4, local->lines);
+  size += SYNC_FOOTER_SIZE;
+  memcpy(m->sent_rows, local->rows, sizeof(m->sent_rows));
+  QueueMessage(m, message, size);
+  // The opponent's copy may have arrived before this machine got this far.
+  if (m->early_sync.tick == r->tick) CompareSync(m, r, &m->early_sync);
+}
+
+// Forgets every input made before the given tick.
+static void DropInputsBefore(VersusMatch *m, uint64_t tick) {
+  int p, i;
+  for (p = 0; p < 2; p++) {
+    for (i = 0; i < m->event_count[p]; i++) {
+      if (m->events[p][i].tick >= tick) break;
+    }
+    if (i == 0) continue;
+    memmove(m->events[p], m->events[p] + i,
+      (m->event_count[p] - i) * sizeof(VersusEvent));
+    m->event_count[p] -= i;
+  }
+}
+
+// Moves the confirmed state up to the last tick both players have finished.
+static void AdvanceConfirmed(VersusMatch *m) {
+  uint64_t limit = m->current.tick;
+  int p, advanced = 0;
+  if (m->remote_tick < limit) limit = m->remote_tick;
+  // The match is decided at the first tick a player's game ends, which must
+  // be the same on both machines however far each one advances at a time.
+  while ((m->confirmed.tick < limit) && m->confirmed.alive[0] &&
+    m->confirmed.alive[1]) {
+    for (p = 0; p < 2; p++) ApplyInputsAtTick(m, &m->confirmed, p);
+    FinishTick(&m->confirmed);
+    advanced = 1;
+    if ((m->confirmed.tick % VERSUS_SYNC_TICKS) == 0) RecordSync(m);
+  }
+  if (advanced) DropInputsBefore(m, m->confirmed.tick);
+}
+
+// Rebuilds the current state from the confirmed one, with every input known
+// so far, after an opponent's input arrived for a tick already shown.
+static void RollBack(VersusMatch *m) {
+  uint64_t target = m->current.tick;
+  TetrisGameState *old, *s;
+  VersusState v;
+  int p;
+  AdvanceConfirmed(m);
+  v = m->confirmed;
+  m->rollbacks++;
+  m->rollback_ticks += target - v.tick;
+  while (1) {
+    for (p = 0; p < 2; p++) ApplyInputsAtTick(m, &v, p);
+    if (v.tick >= target) break;
+    FinishTick(&v);
+  }
+  // A game that ended up where it was only needs what it already had to
+  // redraw. Otherwise, nothing tracked what the old state showed, so all of
+  // it is redrawn.
+  for (p = 0; p < 2; p++) {
+    old = m->current.games + p;
+    s = v.games + p;
+    s->events = old->events;
+    if ((memcmp(s->board, old->board, sizeof(s->board)) == 0) &&
+      (s->current_piece == old->current_piece) &&
+      (s->location_x == old->location_x) &&
+      (s->location_y == old->location_y)) {
+      s->dirty_rows = old->dirty_rows;
+    } else {
+      s->dirty_rows = ALL_ROWS_DIRTY;
+    }
+  }
+  m->current = v;
+}
+
+// Adds an input to player p's list. Returns 0 if the list is full.
+static int AddEvent(VersusMatch *m, int p, uint64_t tick, int input) {
+  VersusEvent *e;
+  if (m->event_count[p] >= VERSUS_MAX_EVENTS) return 0;
+  e = m->events[p] + m->event_count[p];
+  e->tick = tick;
+  e->input = input;
+  m->event_count[p]++;
+  return 1;
+}
+
+void VersusLocalInput(VersusMatch *m, int input) {
+  if (m->failure || (input == TETRIS_INPUT_NONE)) return;
+  if (!m->current.alive[m->local_player]) return;
+  // This only happens if the opponent stopped sending anything; VersusTick
+  // will be stalled by then, so dropping the input is fine.
+  if (!AddEvent(m, m->local_player, m->current.tick, input)) return;
+  ApplyInput(&m->current, m->local_player, input);
+  QueueInput(m, m->current.tick, input);
+}
+
+int VersusTick(VersusMatch *m) {
+  if (m->failure) return 0;
+  // The opponent may be ahead, too.
+  if (m->current.tick >= (m->remote_tick + m->max_prediction_ticks)) {
+    m->stalls++;
+    return 0;
+  }
+  FinishTick(&m->current);
+  // The opponent may already have sent inputs for the new tick.
+  ApplyInputsAtTick(m, &m->current, 1 - m->local_player);
+  AdvanceConfirmed(m);
+  return 1;
+}
+
+// Checks an 'S' message's board against this machine's copy of the
+// opponent's board at the same tick, or keeps it until this machine gets
+// there.
+static void CheckSync(VersusMatch *m, const uint8_t *message, size_t size) {
+  uint64_t tick = GetU64(message + 1);
+  uint32_t changed = GetU32(message + 9);
+  VersusSyncRecord *r, received;
+  size_t offset = SYNC_HEADER_SIZE;
+  int y;
+  for (y = 0; y < BLOCKS_TALL; y++) {
+    if (!(changed & (((uint32_t) 1) << y))) continue;
+    m->received_rows[y] = message[offset] | (message[offset + 1] << 8);
+    offset += 2;
+  }
+  received.tick = tick;
+  memcpy(received.rows, m->received_rows, sizeof(received.rows));
+  received.score = GetU32(message + offset);
+  received.lines = GetU32(message + offset + 4);
+  // The opponent confirmed this tick, so every input they made before it
+  // has arrived, and the confirmed state can get at least this far. Their
+  // progress marker for it is only queued after this message.
+  if (tick > m->remote_tick) m->remote_tick = tick;
+  AdvanceConfirmed(m);
+  if (tick > m->confirmed.tick) {
+    // This machine's game hasn't reached the tick yet, so RecordSync checks
+    // it instead. Only the newest is kept if the opponent is far ahead.
+    m->early_sync = received;
+    return;
+  }
+  r = m->sync_history + ((tick / VERSUS_SYNC_TICKS) % VERSUS_SYNC_HISTORY);
+  // The record was overwritten if the opponent fell very far behind.
+  if (r->tick != tick) return;
+  CompareSync(m, r, &received);
+}
+
+// Handles one 'I' message's record.
+static void HandleInput(VersusMatch *m, uint64_t tick_delta, int input) {
+  int remote = 1 - m->local_player;
+  uint64_t tick = m->last_received_tick + tick_delta;
+  m->last_received_tick = tick;
+  if (input == TETRIS_INPUT_NONE) {
+    if (tick > m->remote_tick) m->remote_tick = tick;
+    return;
+  }
+  // The opponent said they'd finished this tick already.
+  if ((tick < m->remote_tick) || (input > TETRIS_INPUT_HOLD) ||
+    !AddEvent(m, remote, tick, input)) {
+    Fail(m, VERSUS_CONNECTION_ERROR);
+    return;
+  }
+  // Inputs for the tick being shown can be applied directly, since the games
+  // don't affect each other until the tick ends.
+  if (tick == m->current.tick) ApplyInput(&m->current, remote, input);
+}
+
+// Handles every complete message in the receive buffer. Sets *roll_back if an
+// input arrived for a tick that has already been shown.
+static void HandleMessages(VersusMatch *m, int *roll_back) {
+  uint64_t tick_delta;
+  uint32_t changed;
+  size_t offset = 0, size;
+  int length, input;
+  while ((offset < m->in_size) && !m->failure) {
+    size = m->in_size - offset;
+    switch (m->in[offset]) {
+    case 'I':
+      length = DecodeReplayRecord(m->in + offset + 1, size - 1, &tick_delta,
+        &input);
+      if (length < 0) {
+        Fail(m, VERSUS_CONNECTION_ERROR);
+        break;
+      }
+      if (length == 0) goto incomplete;
+      HandleInput(m, tick_delta, input);
+      if ((input != TETRIS_INPUT_NONE) &&
+        (m->last_received_tick < m->current.tick)) {
+        *roll_back = 1;
+      }
+      offset += 1 + length;
+      break;
+    case 'S':
+      if (size < SYNC_HEADER_SIZE) goto incomplete;
+      changed = GetU32(m->in + offset + 9);
+      if (changed & ~((uint32_t) ALL_ROWS_DIRTY)) {
+        Fail(m, VERSUS_CONNECTION_ERROR);
+        break;
+      }
+      length = SYNC_HEADER_SIZE + 2 * CountBits(changed) + SYNC_FOOTER_SIZE;
+      if (size < length) goto incomplete;
+      // Roll back first, so the confirmed state is up to date.
+      if (*roll_back) RollBack(m);
+      *roll_back = 0;
+      CheckSync(m, m->in + offset, length);
+      offset += length;
+      break;
+    case 'Q':
+      Fail(m, VERSUS_OPPONENT_LEFT);
+      offset++;
+      break;
+    case 'D':
+      Fail(m, VERSUS_DESYNCED);
+      offset++;
+      break;
+    default:
+      Fail(m, VERSUS_CONNECTION_ERROR);
+      break;
+    }
+  }
+incomplete:
+  memmove(m->in, m->in + offset, m->in_size - offset);
+  m->in_size -= offset;
+}
+
+// Sends as much queued data as the socket accepts.
+static void Flush(VersusMatch *m) {
+  ssize_t result;
+  while ((m->out_size > 0) && (m->fd >= 0)) {
+    result = send(m->fd, m->out, m->out_size, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+      Fail(m, VERSUS_OPPONENT_LEFT);
+      m->out_size = 0;
+      return;
+    }
+    memmove(m->out, m->out + result, m->out_size - result);
+    m->out_size -= result;
+  }
+}
+
+void VersusExchange(VersusMatch *m) {
+  ssize_t result;
+  int roll_back = 0;
+  while (!m->failure && (m->in_size < sizeof(m->in))) {
+    result = recv(m->fd, m->in + m->in_size, sizeof(m->in) - m->in_size, 0);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        Fail(m, VERSUS_OPPONENT_LEFT);
+      }
+      break;
+    }
+    if (result == 0) {
+      Fail(m, VERSUS_OPPONENT_LEFT);
+      break;
+    }
+    m->in_size += result;
+    HandleMessages(m, &roll_back);
+  }
+  // Whatever arrived before the opponent left still counts, since it may
+  // decide the match.
+  if (roll_back) RollBack(m);
+  AdvanceConfirmed(m);
+  // Tell the opponent how far this game has got, so they can confirm it.
+  if (m->current.tick > m->last_sent_tick) {
+    QueueInput(m, m->current.tick, TETRIS_INPUT_NONE);
+  }
+  Flush(m);
+}
+
+int VersusWantsToSend(VersusMatch *m) {
+  return m->out_size > 0;
+}
+
+void VersusQuit(VersusMatch *m) {
+  uint8_t message = 'Q';
+  m->out_size = 0;
+  QueueMessage(m, &message, 1);
+  Flush(m);
+}
+
+int VersusResult(VersusMatch *m) {
+  int local = m->confirmed.alive[m->local_player];
+  int remote = m->confirmed.alive[1 - m->local_player];
+  if (!local && !remote) return VERSUS_DRAW;
+  if (!remote) return VERSUS_WON;
+  if (!local) return VERSUS_LOST;
+  return m->failure;
+}
@@ -0,0 +1,222 @@
+#ifndef TETRIS_VERSUS_H
+#define TETRIS_VERSUS_H
+// This file defines two-player versus matches played over a TCP connection.
+// Both players' games run in lockstep on both machines: each machine applies
+// its own player's inputs as soon as they happen, and sends them to the other
+// machine, tagged with the tick they happened at. Games are deterministic, so
+// both machines compute identical results from the same inputs.
+//
+// The two games only interact at the end of each tick, when the garbage rows
+// earned by each player's line clears (see GarbageForLines) are sent to the
+// other player. Garbage first cancels any garbage waiting to be added to the
+// sender's own board, and what's left waits to be added to the receiver's
+// board the next time a piece lands there without clearing a line.
+//
+// An opponent's inputs arrive late, so their game is predicted: it's assumed
+// that they pressed nothing until their inputs say otherwise. The state at the
+// last tick for which both players' inputs are known (the "confirmed" state)
+// is kept, and when an opponent's input arrives for a tick that has already
+// been shown, the match rolls back to the confirmed state and runs forward
+// again to the current tick with the input included. Rolling back only takes
+// replaying a few ticks without drawing, so it's invisible to the local
+// player, who never waits for the network unless the opponent falls more than
+// VERSUS_MAX_PREDICTION_MS behind.
+//
+// Every VERSUS_SYNC_TICKS ticks of the confirmed state, each machine also
+// sends its own player's board as a delta against the last one it sent: a
+// mask of the rows that changed, followed by those rows' bitmasks. The
+// receiver checks the result against its own copy of that board, so a
+// desync is reported rather than silently producing different winners. The
+// machine that finds the mismatch tells the other one, so both report it.
+//
+// Messages are a type byte followed by their contents:
+//   'H' (hello): VERSUS_MAGIC, version (2 bytes), randomizer (1 byte), board
+//     width and height (1 byte each), reserved (1 byte), tick_rate (4 bytes),
+//     seed (8 bytes), all little-endian like replay logs. The host sends this
+//     first, and the guest sends the same thing back to accept it.
+//   'I' (input): a replay log record (see tetris_replay.h), with its tick
+//     relative to the previous 'I' message. A TETRIS_INPUT_NONE record means
+//     the sender has reached that tick, and sent every input before it.
+//   'S' (sync): tick (8 bytes), changed row mask (4 bytes), then 2 bytes for
+//     each changed row, then score and lines (4 bytes each).
+//   'Q' (quit): the sender is leaving the match.
+//   'D' (desynced): the sender's copy of the receiver's board didn't match
+//     the receiver's sync.
+//
+// Like the rest of the engine, this doesn't depend on curses. It only
+// supports the default board size.
+#include <stddef.h>
+#include <stdint.h>
+#include "tetris_engine.h"
+#include "tetris_random.h"
+
+#if BLOCKS_TALL > 32
+#error "Versus matches only support boards up to 32 rows tall."
+#endif
+
+#define VERSUS_MAGIC "TTVS"
+#define VERSUS_VERSION (3)
+#define VERSUS_HELLO_SIZE (22)
+
+// The port hosts listen on unless another one is given.
+#define DEFAULT_VERSUS_PORT (2424)
+
+// The furthest the local game runs ahead of the last tick the opponent is
+// known to have reached. Past this, the local game waits for the opponent.
+#define VERSUS_MAX_PREDICTION_MS (500)
+
+// The number of ticks between board syncs.
+#define VERSUS_SYNC_TICKS (30)
+
+// The number of syncs remembered while waiting for the opponent's copy.
+#define VERSUS_SYNC_HISTORY (64)
+
+// The most inputs remembered for a player between the confirmed state and the
+// newest input. The local game waits for the opponent long before this fills
+// up.
+#define VERSUS_MAX_EVENTS (4096)
+
+// The size of the buffers for data sent and received.
+#define VERSUS_BUFFER_SIZE (65536)
+
+// Results of a match, from VersusResult.
+#define VERSUS_PLAYING (0)
+#define VERSUS_WON (1)
+#define VERSUS_LOST (2)
+#define VERSUS_DRAW (3)
+// The opponent quit or disconnected before the match was decided.
+#define VERSUS_OPPONENT_LEFT (4)
+// The opponent's machine computed a different board than this one.
+#define VERSUS_DESYNCED (5)
+// The connection failed, or the opponent sent something invalid.
+#define VERSUS_CONNECTION_ERROR (6)
+
+// Everything about both games that changes as they're played. Copying this
+// is how the match is rolled back.
+typedef struct {
+  TetrisGameState games[2];
+  // Cleared once a player's game is over; their game stops changing.
+  int alive[2];
+  // The garbage rows waiting to be added to each player's board.
+  uint32_t pending_garbage[2];
+  // The value of each game's garbage_sent already sent to the other player.
+  uint32_t garbage_delivered[2];
+  // Chooses the column of the hole in each player's garbage rows. Each
+  // player has their own, so the games never depend on each other within a
+  // tick.
+  TetrisRNG garbage_rng[2];
+  // The tick both games are at.
+  uint64_t tick;
+} VersusState;
+
+// An input a player made, and the tick it was made at.
+typedef struct {
+  uint64_t tick;
+  int input;
+} VersusEvent;
+
+// The local player's board at a sync tick, kept until the opponent's copy of
+// it arrives, and the opponent's board at the same tick, to check against
+// theirs.
+typedef struct {
+  uint64_t tick;
+  uint16_t rows[BLOCKS_TALL];
+  unsigned score;
+  unsigned lines;
+} VersusSyncRecord;
+
+typedef struct {
+  // The connected socket, which is non-blocking.
+  int fd;
+  // Player 0 is the host, and player 1 is the guest.
+  int local_player;
+  TetrisGameConfig config;
+  // The state shown to the player, at the local player's current tick, and
+  // the state at the last tick for which both players' inputs are known.
+  VersusState current;
+  VersusState confirmed;
+  // Each player's inputs at or after confirmed.tick, oldest first.
+  VersusEvent events[2][VERSUS_MAX_EVENTS];
+  int event_count[2];
+  // The tick the opponent has reached: every input they made before it has
+  // arrived.
+  uint64_t remote_tick;
+  // The tick of the last 'I' message sent and received.
+  uint64_t last_sent_tick;
+  uint64_t last_received_tick;
+  // The largest number of ticks current may run ahead of remote_tick.
+  uint32_t max_prediction_ticks;
+  // The local board as of the last sync sent, and the opponent's board as of
+  // the last sync received.
+  uint16_t sent_rows[BLOCKS_TALL];
+  uint16_t received_rows[BLOCKS_TALL];
+  // The opponent's confirmed board at each of the last VERSUS_SYNC_HISTORY
+  // sync ticks, indexed by sync number modulo VERSUS_SYNC_HISTORY.
+  VersusSyncRecord sync_history[VERSUS_SYNC_HISTORY];
+  // The newest sync received for a tick the confirmed state hadn't reached
+  // yet, checked once it does. Its tick is 0 if there's none.
+  VersusSyncRecord early_sync;
+  // The number of rollbacks, and the number of ticks they replayed.
+  uint64_t rollbacks;
+  uint64_t rollback_ticks;
+  // The number of ticks the local game skipped waiting for the opponent.
+  uint64_t stalls;
+  // Set once the match can't continue: one of the VERSUS_* results.
+  int failure;
+  // Data waiting to be sent, and data received but not yet handled.
+  uint8_t out[VERSUS_BUFFER_SIZE];
+  size_t out_size;
+  uint8_t in[VERSUS_BUFFER_SIZE];
+  size_t in_size;
+} VersusMatch;
+
+// Listens on the given port, waits for an opponent to connect, and starts a
+// match with the given config as player 0. Blocks until the opponent accepts
+// or the connection fails. Returns 0 and prints an error on failure.
+int HostVersusMatch(VersusMatch *m, uint16_t port, TetrisGameConfig *config);
+
+// Starts a match over fd, a socket already connected to the opponent, as the
+// given player, skipping the 'H' exchange; both sides must use the same
+// config. Returns 0 and prints an error on failure. HostVersusMatch and
+// JoinVersusMatch call this once they've agreed on a config.
+int StartVersusMatch(VersusMatch *m, int fd, int local_player,
+  TetrisGameConfig *config);
+
+// Connects to a host, given as "<address>:<port>" or just "<address>", and
+// joins its match as player 1, using the host's config. Blocks until the
+// match starts or the connection fails. Returns 0 and prints an error on
+// failure.
+int JoinVersusMatch(VersusMatch *m, const char *host);
+
+// Closes the match's connection.
+void CloseVersusMatch(VersusMatch *m);
+
+// Returns the local player's game, and the opponent's, as currently shown.
+TetrisGameState* LocalVersusGame(VersusMatch *m);
+TetrisGameState* OpponentVersusGame(VersusMatch *m);
+
+// Applies one of the local player's inputs at the current tick, and queues it
+// to be sent. Does nothing once the local player's game is over.
+void VersusLocalInput(VersusMatch *m, int input);
+
+// Advances both games by one tick. Returns 0, without advancing, if the
+// opponent is too far behind; the tick is skipped rather than made up later.
+int VersusTick(VersusMatch *m);
+
+// Reads whatever the opponent has sent, rolling back if needed, and sends
+// whatever is queued, along with how far the local game has got. Never
+// blocks.
+void VersusExchange(VersusMatch *m);
+
+// Returns nonzero if there's data waiting to be sent, so the caller should
+// also wait for the socket to become writable.
+int VersusWantsToSend(VersusMatch *m);
+
+// Sends a 'Q' message, as far as it can without blocking.
+void VersusQuit(VersusMatch *m);
+
+// Returns one of the VERSUS_* results. Wins and losses are only decided from
+// the confirmed state, so both players always see the same result.
+int VersusResult(VersusMatch *m);
+
+#endif  // TETRIS_VERSUS_H
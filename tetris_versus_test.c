@@ -0,0 +1,113 @@
+// Tests versus matches' desync detection. Two matches, one for each player,
+// play each other in this process over a socketpair. After a while, one
+// side's copy of its own board is corrupted, and both sides must then report
+// VERSUS_DESYNCED. Exits with a nonzero status if any check fails.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "tetris_engine.h"
+#include "tetris_random.h"
+#include "tetris_versus.h"
+
+// The ticks played before the corruption, and the most played after it
+// while waiting for both sides to notice.
+#define CLEAN_TICKS (300)
+#define DESYNC_TICKS (10 * VERSUS_SYNC_TICKS)
+
+static VersusMatch matches[2];
+
+// Starts a match between matches[0] (the host) and matches[1].
+static void StartMatches(void) {
+  TetrisGameConfig config;
+  int fds[2], p;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  memset(&config, 0, sizeof(config));
+  config.seed = 1234;
+  config.tick_rate = DEFAULT_TICK_RATE;
+  config.randomizer = TETRIS_RANDOMIZER_BAG;
+  for (p = 0; p < 2; p++) {
+    if (!StartVersusMatch(matches + p, fds[p], p, &config)) exit(1);
+  }
+}
+
+// Plays the given number of ticks on both sides, with each player making a
+// random input now and then, and exchanging messages every tick. Stops early
+// once both sides' matches are over.
+static void PlayTicks(TetrisRNG *rng, int ticks) {
+  int i, p, input;
+  for (i = 0; i < ticks; i++) {
+    for (p = 0; p < 2; p++) {
+      // Drops would end the games too quickly.
+      input = RandomBelow(rng, 16);
+      if (input < TETRIS_INPUT_DROP) VersusLocalInput(matches + p, input);
+      VersusTick(matches + p);
+      VersusExchange(matches + p);
+    }
+    if ((VersusResult(matches) != VERSUS_PLAYING) &&
+      (VersusResult(matches + 1) != VERSUS_PLAYING)) {
+      return;
+    }
+  }
+}
+
+// Fills in the bottom left cell of player p's board, as they see it, where
+// nothing else changes it. Returns 0 if it was already filled.
+static int CorruptBoard(int p) {
+  VersusMatch *m = matches + p;
+  TetrisGameState *games[2] = {m->current.games + p, m->confirmed.games + p};
+  int i, y = BLOCKS_TALL - 1;
+  for (i = 0; i < 2; i++) {
+    if (games[i]->rows[y] & 1) return 0;
+    games[i]->rows[y] |= 1;
+    games[i]->board[y * BLOCKS_WIDE] = 'X';
+    games[i]->board_hash = BoardHash(games[i]->rows);
+    RecomputeColumnTops(games[i]);
+  }
+  return 1;
+}
+
+// Plays a match, corrupting player p's board partway through. Returns 0 and
+// prints what went wrong on failure.
+static int TestDesync(int p) {
+  TetrisRNG rng;
+  int results[2], i, ok = 1;
+  SeedRandom(&rng, p);
+  StartMatches();
+  PlayTicks(&rng, CLEAN_TICKS);
+  for (i = 0; i < 2; i++) {
+    if (VersusResult(matches + i) != VERSUS_PLAYING) {
+      printf("Player %d's match ended with result %d before the board was "
+        "corrupted.\n", i, VersusResult(matches + i));
+      ok = 0;
+    }
+  }
+  if (!ok) return 0;
+  if (!CorruptBoard(p)) {
+    printf("Player %d's bottom left cell was already filled.\n", p);
+    return 0;
+  }
+  PlayTicks(&rng, DESYNC_TICKS);
+  for (i = 0; i < 2; i++) {
+    results[i] = VersusResult(matches + i);
+    CloseVersusMatch(matches + i);
+    if (results[i] == VERSUS_DESYNCED) continue;
+    printf("With player %d's board corrupted, player %d's match ended with "
+      "result %d rather than VERSUS_DESYNCED.\n", p, i, results[i]);
+    ok = 0;
+  }
+  return ok;
+}
+
+int main(void) {
+  int p, failures = 0;
+  for (p = 0; p < 2; p++) {
+    if (!TestDesync(p)) failures++;
+  }
+  if (failures) return 1;
+  printf("Versus desync tests passed.\n");
+  return 0;
+}